@@ -0,0 +1,727 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "bot.h"
+#include "config.h"
+#include "constants.h"
+#include "log.h"
+#include "porting.h"
+#include "serialization.h"
+#include "version.h"
+#include "network/connection.h"
+#include "network/networkpacket.h"
+#include "network/networkprotocol.h"
+#include "util/auth.h"
+#include "util/numeric.h"
+#include "util/pointedthing.h"
+#include "util/srp.h"
+#include "util/string.h"
+#include <sstream>
+
+// Nodes per second, the default walking speed of players
+#define BOT_WALK_SPEED 4.0f
+// Seconds between the TOSERVER_INIT packets until the server answers
+#define BOT_INIT_INTERVAL 2.0f
+// Field of view sent to the server, in radians
+#define BOT_FOV (72.0f * core::DEGTORAD)
+
+/*
+	BotScript
+*/
+
+BotScript::BotScript()
+{
+	// Walk around a square, dig a node and place it back
+	std::istringstream is(
+		"walk 8 0 0\n"
+		"dig 8 -1 1 2\n"
+		"place 8 -1 1\n"
+		"walk 8 0 8\n"
+		"say Hello\n"
+		"walk 0 0 8\n"
+		"walk 0 0 0\n"
+		"wait 1\n");
+	parse(is, nullptr);
+}
+
+bool BotScript::parse(std::istream &is, std::string *error)
+{
+	std::vector<BotAction> actions;
+	std::string line;
+	u32 line_num = 0;
+
+	while (std::getline(is, line)) {
+		line_num++;
+		line = trim(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ls(line);
+		std::string command;
+		ls >> command;
+
+		BotAction action;
+		bool ok = true;
+		if (command == "walk" || command == "dig" || command == "place") {
+			s32 x, y, z;
+			ok = !!(ls >> x >> y >> z);
+			action.pos = v3s16(x, y, z);
+			if (command == "walk") {
+				action.type = BotAction::WALK;
+			} else if (command == "place") {
+				action.type = BotAction::PLACE;
+			} else {
+				action.type = BotAction::DIG;
+				action.duration = 1.0f;
+				ls >> action.duration;
+			}
+		} else if (command == "say") {
+			action.type = BotAction::SAY;
+			std::getline(ls, action.text);
+			action.text = trim(action.text);
+			ok = !action.text.empty();
+		} else if (command == "wait") {
+			action.type = BotAction::WAIT;
+			ok = !!(ls >> action.duration);
+		} else {
+			ok = false;
+		}
+
+		if (!ok) {
+			if (error)
+				*error = "Invalid action on line " + std::to_string(line_num)
+						+ ": " + line;
+			return false;
+		}
+		actions.push_back(action);
+	}
+
+	if (actions.empty()) {
+		if (error)
+			*error = "No actions";
+		return false;
+	}
+
+	m_actions = std::move(actions);
+	return true;
+}
+
+/*
+	BotStat
+*/
+
+void BotStat::add(float value)
+{
+	count++;
+	sum += value;
+	max = MYMAX(max, value);
+}
+
+void BotStat::merge(const BotStat &other)
+{
+	count += other.count;
+	sum += other.sum;
+	max = MYMAX(max, other.max);
+}
+
+void BotStats::merge(const BotStats &other)
+{
+	login_time.merge(other.login_time);
+	block_latency.merge(other.block_latency);
+	chat_latency.merge(other.chat_latency);
+	rtt.merge(other.rtt);
+	packets_received += other.packets_received;
+	bytes_received += other.bytes_received;
+	packets_sent += other.packets_sent;
+	bytes_sent += other.bytes_sent;
+	blocks_received += other.blocks_received;
+	block_bytes_received += other.block_bytes_received;
+	actions_done += other.actions_done;
+}
+
+/*
+	Bot
+*/
+
+Bot::Bot(const std::string &name, const std::string &password,
+		const BotScript &script, v3s16 origin, u8 wanted_range):
+	m_name(name),
+	m_password(password),
+	m_script(script),
+	m_origin(origin),
+	m_wanted_range(wanted_range)
+{
+}
+
+Bot::~Bot()
+{
+	if (m_auth_data)
+		srp_user_delete((SRPUser *) m_auth_data);
+}
+
+void Bot::connect(const Address &address)
+{
+	m_con.reset(new con::Connection(PROTOCOL_ID, 512, CONNECTION_TIMEOUT,
+			address.isIPv6(), this));
+	m_con->SetTimeoutMs(0);
+	m_con->Connect(address);
+
+	m_state = BOT_CONNECTING;
+	m_connect_time = porting::getTimeMs();
+	m_init_timer = 0.0f;
+}
+
+void Bot::disconnect()
+{
+	if (m_con)
+		m_con->Disconnect();
+}
+
+void Bot::deletingPeer(con::Peer *peer, bool timeout)
+{
+	fail(timeout ? "Connection timed out" : "Disconnected by the server");
+}
+
+void Bot::fail(const std::string &error)
+{
+	if (m_state == BOT_FAILED)
+		return;
+
+	m_state = BOT_FAILED;
+	m_error = error;
+	errorstream << "Bot " << m_name << ": " << error << std::endl;
+}
+
+BotStats Bot::takeStats()
+{
+	if (m_state == BOT_READY)
+		m_stats.rtt.add(m_con->getPeerStat(PEER_ID_SERVER, con::AVG_RTT));
+
+	BotStats stats = m_stats;
+	m_stats = BotStats();
+	return stats;
+}
+
+void Bot::step(float dtime)
+{
+	if (m_state == BOT_CREATED || m_state == BOT_FAILED)
+		return;
+
+	receive();
+
+	if (m_state == BOT_CONNECTING && m_auth_mech == AUTH_MECHANISM_NONE) {
+		m_init_timer -= dtime;
+		if (m_init_timer <= 0.0f) {
+			m_init_timer = BOT_INIT_INTERVAL;
+			sendInit();
+		}
+		return;
+	}
+
+	if (m_state != BOT_READY)
+		return;
+
+	stepScript(dtime);
+
+	m_playerpos_timer += dtime;
+	if (m_playerpos_timer >= m_send_interval) {
+		m_playerpos_timer = 0.0f;
+		sendPlayerPos();
+	}
+}
+
+/*
+	Networking
+*/
+
+void Bot::receive()
+{
+	// Don't let a flood of packets starve the other bots
+	u64 start_ms = porting::getTimeMs();
+	while (m_state != BOT_FAILED && porting::getTimeMs() < start_ms + 100) {
+		NetworkPacket pkt;
+		try {
+			m_con->Receive(&pkt);
+		} catch (con::NoIncomingDataException &e) {
+			break;
+		}
+
+		if (pkt.getPeerId() != PEER_ID_SERVER)
+			continue;
+
+		m_stats.packets_received++;
+		m_stats.bytes_received += 2 + pkt.getSize();
+
+		try {
+			handlePacket(&pkt);
+		} catch (SerializationError &e) {
+			errorstream << "Bot " << m_name << ": Invalid packet "
+					<< pkt.getCommand() << ": " << e.what() << std::endl;
+		}
+	}
+}
+
+void Bot::send(NetworkPacket *pkt)
+{
+	m_stats.packets_sent++;
+	m_stats.bytes_sent += 2 + pkt->getSize();
+
+	// The channels of the client, see serverCommandFactoryTable
+	u8 channel = 0;
+	bool reliable = true;
+	switch (pkt->getCommand()) {
+	case TOSERVER_INIT:
+		channel = 1;
+		reliable = false;
+		break;
+	case TOSERVER_INIT2:
+	case TOSERVER_FIRST_SRP:
+	case TOSERVER_SRP_BYTES_A:
+	case TOSERVER_SRP_BYTES_M:
+		channel = 1;
+		break;
+	case TOSERVER_GOTBLOCKS:
+		channel = 2;
+		break;
+	case TOSERVER_PLAYERPOS:
+		reliable = false;
+		break;
+	default:
+		break;
+	}
+
+	m_con->Send(PEER_ID_SERVER, channel, pkt, reliable);
+}
+
+void Bot::handlePacket(NetworkPacket *pkt)
+{
+	switch (pkt->getCommand()) {
+	case TOCLIENT_HELLO:
+		handleHello(pkt);
+		break;
+	case TOCLIENT_SRP_BYTES_S_B:
+		handleSrpBytesSandB(pkt);
+		break;
+	case TOCLIENT_AUTH_ACCEPT:
+		handleAuthAccept(pkt);
+		break;
+	case TOCLIENT_ACCESS_DENIED:
+	case TOCLIENT_ACCESS_DENIED_LEGACY:
+		handleAccessDenied(pkt);
+		break;
+	case TOCLIENT_ANNOUNCE_MEDIA: {
+		// The definitions came before, the media isn't needed
+		if (m_state != BOT_INIT)
+			break;
+
+		NetworkPacket resp_pkt(TOSERVER_CLIENT_READY,
+				1 + 1 + 1 + 1 + 2 + strlen(g_version_hash));
+		resp_pkt << (u8) VERSION_MAJOR << (u8) VERSION_MINOR
+			<< (u8) VERSION_PATCH << (u8) 0 << std::string(g_version_hash);
+		send(&resp_pkt);
+
+		m_state = BOT_READY;
+		m_stats.login_time.add(
+				(porting::getTimeMs() - m_connect_time) / 1000.0f);
+		break;
+	}
+	case TOCLIENT_BLOCKDATA:
+	case TOCLIENT_BLOCK_NODES: {
+		v3s16 p;
+		*pkt >> p;
+		handleBlock(p, pkt->getSize());
+		break;
+	}
+	case TOCLIENT_MOVE_PLAYER: {
+		// The server didn't accept a position
+		f32 pitch, yaw;
+		*pkt >> m_position >> pitch >> yaw;
+		m_position_changed = true;
+		break;
+	}
+	case TOCLIENT_DEATHSCREEN: {
+		NetworkPacket resp_pkt(TOSERVER_RESPAWN, 0);
+		send(&resp_pkt);
+		break;
+	}
+	case TOCLIENT_CHAT_MESSAGE:
+		handleChatMessage(pkt);
+		break;
+	default:
+		break;
+	}
+}
+
+void Bot::handleHello(NetworkPacket *pkt)
+{
+	if (m_state != BOT_CONNECTING || m_auth_mech != AUTH_MECHANISM_NONE)
+		return;
+
+	u8 serialization_ver;
+	u16 compression_mode;
+	u32 auth_mechs;
+	std::string username_legacy;
+	*pkt >> serialization_ver >> compression_mode >> m_proto_ver
+		>> auth_mechs >> username_legacy;
+
+	if (m_proto_ver >= 37)
+		m_con->EnablePeerBundling(PEER_ID_SERVER);
+
+	if (auth_mechs & AUTH_MECHANISM_SRP) {
+		m_auth_mech = AUTH_MECHANISM_SRP;
+
+		std::string playername_u = lowercase(m_name);
+		m_auth_data = srp_user_new(SRP_SHA256, SRP_NG_2048,
+			m_name.c_str(), playername_u.c_str(),
+			(const unsigned char *) m_password.c_str(),
+			m_password.length(), NULL, NULL);
+		char *bytes_A = 0;
+		size_t len_A = 0;
+		SRP_Result res = srp_user_start_authentication(
+			(struct SRPUser *) m_auth_data, NULL, NULL, 0,
+			(unsigned char **) &bytes_A, &len_A);
+		if (res != SRP_OK) {
+			fail("Creating local SRP user failed");
+			return;
+		}
+
+		NetworkPacket resp_pkt(TOSERVER_SRP_BYTES_A, 0);
+		resp_pkt << std::string(bytes_A, len_A) << (u8) 1;
+		send(&resp_pkt);
+	} else if (auth_mechs & AUTH_MECHANISM_FIRST_SRP) {
+		// New player, registered without asking
+		m_auth_mech = AUTH_MECHANISM_FIRST_SRP;
+
+		std::string verifier;
+		std::string salt;
+		generate_srp_verifier_and_salt(m_name, m_password, &verifier, &salt);
+
+		NetworkPacket resp_pkt(TOSERVER_FIRST_SRP, 0);
+		resp_pkt << salt << verifier << (u8)(m_password.empty() ? 1 : 0);
+		send(&resp_pkt);
+	} else {
+		fail("No supported authentication mechanism");
+		m_con->Disconnect();
+	}
+}
+
+void Bot::handleSrpBytesSandB(NetworkPacket *pkt)
+{
+	if (m_auth_mech != AUTH_MECHANISM_SRP || !m_auth_data)
+		return;
+
+	std::string s;
+	std::string B;
+	*pkt >> s >> B;
+
+	char *bytes_M = 0;
+	size_t len_M = 0;
+	srp_user_process_challenge((SRPUser *) m_auth_data,
+		(const unsigned char *) s.c_str(), s.size(),
+		(const unsigned char *) B.c_str(), B.size(),
+		(unsigned char **) &bytes_M, &len_M);
+
+	if (!bytes_M) {
+		fail("SRP-6a S_B safety check violation");
+		return;
+	}
+
+	NetworkPacket resp_pkt(TOSERVER_SRP_BYTES_M, 0);
+	resp_pkt << std::string(bytes_M, len_M);
+	send(&resp_pkt);
+}
+
+void Bot::handleAuthAccept(NetworkPacket *pkt)
+{
+	if (m_state != BOT_CONNECTING)
+		return;
+
+	if (m_auth_data) {
+		srp_user_delete((SRPUser *) m_auth_data);
+		m_auth_data = nullptr;
+	}
+
+	v3f playerpos;
+	u64 map_seed;
+	*pkt >> playerpos >> map_seed >> m_send_interval;
+
+	m_position = playerpos - v3f(0, BS / 2, 0);
+	m_origin += floatToInt(m_position, BS);
+	m_position_changed = true;
+
+	NetworkPacket resp_pkt(TOSERVER_INIT2, sizeof(u16));
+	resp_pkt << std::string();
+	send(&resp_pkt);
+
+	m_state = BOT_INIT;
+}
+
+void Bot::handleAccessDenied(NetworkPacket *pkt)
+{
+	std::string reason = "Unknown";
+
+	if (pkt->getCommand() == TOCLIENT_ACCESS_DENIED_LEGACY) {
+		if (pkt->getSize() >= 2) {
+			std::wstring wide_reason;
+			*pkt >> wide_reason;
+			reason = wide_to_utf8(wide_reason);
+		}
+	} else if (pkt->getSize() >= 1) {
+		u8 deny_code;
+		*pkt >> deny_code;
+		if (deny_code < SERVER_ACCESSDENIED_MAX)
+			reason = accessDeniedStrings[deny_code];
+		if (deny_code == SERVER_ACCESSDENIED_CUSTOM_STRING ||
+				deny_code == SERVER_ACCESSDENIED_SHUTDOWN ||
+				deny_code == SERVER_ACCESSDENIED_CRASH) {
+			std::string custom_reason;
+			*pkt >> custom_reason;
+			if (!custom_reason.empty())
+				reason = custom_reason;
+		}
+	}
+
+	fail("Access denied: " + reason);
+}
+
+void Bot::handleBlock(v3s16 p, u32 size)
+{
+	m_stats.blocks_received++;
+	m_stats.block_bytes_received += size;
+
+	NetworkPacket pkt(TOSERVER_GOTBLOCKS, 1 + 6);
+	pkt << (u8) 1 << p;
+	send(&pkt);
+
+	m_blocks.insert(p);
+
+	auto it = m_blocks_awaited.find(p);
+	if (it == m_blocks_awaited.end())
+		return;
+
+	m_stats.block_latency.add((porting::getTimeMs() - it->second) / 1000.0f);
+	m_blocks_awaited.erase(it);
+}
+
+void Bot::handleChatMessage(NetworkPacket *pkt)
+{
+	u8 version, message_type;
+	std::wstring sender, message;
+	*pkt >> version >> message_type >> sender >> message;
+
+	// The message is formatted by the server, it ends with the text
+	for (auto it = m_chat_awaited.begin(); it != m_chat_awaited.end(); ++it) {
+		const std::wstring &text = it->first;
+		if (message.size() < text.size() ||
+				message.compare(message.size() - text.size(),
+					text.size(), text) != 0)
+			continue;
+
+		m_stats.chat_latency.add(
+				(porting::getTimeMs() - it->second) / 1000.0f);
+		// Earlier messages are lost or refused
+		m_chat_awaited.erase(m_chat_awaited.begin(), it + 1);
+		break;
+	}
+}
+
+void Bot::sendInit()
+{
+	NetworkPacket pkt(TOSERVER_INIT, 1 + 2 + 2 + (1 + m_name.size()));
+
+	u16 supp_comp_modes = NETPROTO_COMPRESSION_NONE;
+	if (isBlockCompressionSupported(BLOCK_COMPRESSION_ZSTD))
+		supp_comp_modes |= NETPROTO_COMPRESSION_ZSTD;
+	if (isBlockCompressionSupported(BLOCK_COMPRESSION_LZ4))
+		supp_comp_modes |= NETPROTO_COMPRESSION_LZ4;
+
+	pkt << (u8) SER_FMT_VER_HIGHEST_READ << (u16) supp_comp_modes;
+	pkt << (u16) CLIENT_PROTOCOL_VERSION_MIN << (u16) CLIENT_PROTOCOL_VERSION_MAX;
+	pkt << m_name;
+
+	send(&pkt);
+}
+
+void Bot::writePlayerPos(NetworkPacket *pkt)
+{
+	v3f pf = m_position * 100;
+	v3f sf = m_speed * 100;
+	s32 pitch = 0;
+	s32 yaw = m_yaw * 100;
+	// Forward is pressed while walking
+	u32 keyPressed = m_speed == v3f() ? 0 : 1;
+	u8 fov = BOT_FOV * 80;
+
+	*pkt << v3s32(pf.X, pf.Y, pf.Z) << v3s32(sf.X, sf.Y, sf.Z)
+		<< pitch << yaw << keyPressed;
+	*pkt << fov << m_wanted_range;
+}
+
+void Bot::sendPlayerPos()
+{
+	if (!m_position_changed)
+		return;
+	m_position_changed = false;
+
+	NetworkPacket pkt(TOSERVER_PLAYERPOS, 12 + 12 + 4 + 4 + 4 + 1 + 1);
+	writePlayerPos(&pkt);
+	send(&pkt);
+
+	v3s16 blockpos = getContainerPos(floatToInt(m_position, BS),
+			MAP_BLOCKSIZE);
+	if (blockpos != m_blockpos) {
+		m_blockpos = blockpos;
+		requestBlocksAround(blockpos);
+	}
+}
+
+void Bot::requestBlocksAround(v3s16 blockpos)
+{
+	// Forget the blocks the bot walked away from before they came
+	for (auto it = m_blocks_awaited.begin(); it != m_blocks_awaited.end();) {
+		v3s16 d = it->first - blockpos;
+		if (MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z)) > 1)
+			it = m_blocks_awaited.erase(it);
+		else
+			++it;
+	}
+
+	// Time the blocks around the bot from now on, which are needed first
+	u64 now = porting::getTimeMs();
+	v3s16 d;
+	for (d.Z = -1; d.Z <= 1; d.Z++)
+	for (d.Y = -1; d.Y <= 1; d.Y++)
+	for (d.X = -1; d.X <= 1; d.X++) {
+		v3s16 p = blockpos + d;
+		if (m_blocks.find(p) == m_blocks.end())
+			m_blocks_awaited.emplace(p, now);
+	}
+}
+
+void Bot::sendInteract(u8 action, v3s16 under, v3s16 above)
+{
+	v3s16 normal = above - under;
+	PointedThing pointed(under, above, under,
+			intToFloat(under, BS) + intToFloat(normal, BS / 2),
+			normal, 0, 0.0f);
+
+	/*
+		[0] u16 command
+		[2] u8 action
+		[3] u16 item
+		[5] u32 length of the next item (plen)
+		[9] serialized PointedThing
+		[9 + plen] player position information
+	*/
+	NetworkPacket pkt(TOSERVER_INTERACT, 1 + 2 + 0);
+	pkt << action << (u16) 0;
+
+	std::ostringstream tmp_os(std::ios::binary);
+	pointed.serialize(tmp_os);
+	pkt.putLongString(tmp_os.str());
+
+	writePlayerPos(&pkt);
+	send(&pkt);
+}
+
+void Bot::sendChatMessage(const std::string &text)
+{
+	// Numbered to recognize it when it comes back
+	std::wstring message = utf8_to_wide(text) + L" #"
+			+ std::to_wstring(++m_chat_counter);
+
+	NetworkPacket pkt(TOSERVER_CHAT_MESSAGE, 2 + message.size() * sizeof(u16));
+	pkt << message;
+	send(&pkt);
+
+	m_chat_awaited.emplace_back(message, porting::getTimeMs());
+}
+
+/*
+	Script
+*/
+
+v3f Bot::getActionTarget(const BotAction &action) const
+{
+	return intToFloat(m_origin + action.pos, BS);
+}
+
+void Bot::nextAction()
+{
+	m_stats.actions_done++;
+	m_action = (m_action + 1) % m_script.getActions().size();
+	m_action_timer = 0.0f;
+	m_digging = false;
+}
+
+void Bot::stepScript(float dtime)
+{
+	const BotAction &action = m_script.getActions()[m_action];
+
+	switch (action.type) {
+	case BotAction::WALK: {
+		v3f target = getActionTarget(action);
+		v3f d = target - m_position;
+		float distance = d.getLength();
+		float step = BOT_WALK_SPEED * BS * dtime;
+
+		m_position_changed = true;
+		if (distance <= step) {
+			m_position = target;
+			m_speed = v3f();
+			nextAction();
+			break;
+		}
+
+		d /= distance;
+		m_position += d * step;
+		m_speed = d * BOT_WALK_SPEED * BS;
+		m_yaw = wrapDegrees_0_360(atan2(-d.X, d.Z) * core::RADTODEG);
+		break;
+	}
+	case BotAction::DIG: {
+		v3s16 p = m_origin + action.pos;
+		if (!m_digging) {
+			sendInteract(0, p, p + v3s16(0, 1, 0));
+			m_digging = true;
+		}
+		m_action_timer += dtime;
+		if (m_action_timer >= action.duration) {
+			sendInteract(2, p, p + v3s16(0, 1, 0));
+			nextAction();
+		}
+		break;
+	}
+	case BotAction::PLACE: {
+		v3s16 p = m_origin + action.pos;
+		sendInteract(3, p - v3s16(0, 1, 0), p);
+		nextAction();
+		break;
+	}
+	case BotAction::SAY:
+		sendChatMessage(action.text);
+		nextAction();
+		break;
+	case BotAction::WAIT:
+		m_action_timer += dtime;
+		if (m_action_timer >= action.duration)
+			nextAction();
+		break;
+	}
+}
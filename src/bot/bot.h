@@ -0,0 +1,221 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "network/address.h"
+#include "network/peerhandler.h"
+#include <deque>
+#include <istream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+class NetworkPacket;
+
+namespace con
+{
+class Connection;
+}
+
+struct BotAction
+{
+	enum Type
+	{
+		WALK,
+		DIG,
+		PLACE,
+		SAY,
+		WAIT,
+	};
+
+	Type type;
+	// Node position relative to the origin of the bot
+	v3s16 pos;
+	std::string text;
+	// Seconds to wait, or to dig before the node is reported as dug
+	float duration = 0.0f;
+};
+
+/*
+	The actions a bot repeats, read from a text file with one per line:
+		walk <x> <y> <z>
+		dig <x> <y> <z> [<seconds>]
+		place <x> <y> <z>
+		say <text>
+		wait <seconds>
+	Positions are in nodes and relative to the origin of the bot. A node
+	is placed against the one below it. Empty lines and lines starting
+	with # are ignored.
+*/
+class BotScript
+{
+public:
+	BotScript();
+
+	bool parse(std::istream &is, std::string *error);
+	const std::vector<BotAction> &getActions() const { return m_actions; }
+
+private:
+	std::vector<BotAction> m_actions;
+};
+
+// Number, average and maximum of samples
+struct BotStat
+{
+	void add(float value);
+	void merge(const BotStat &other);
+	float avg() const { return count ? sum / count : 0.0f; }
+
+	u32 count = 0;
+	float sum = 0.0f;
+	float max = 0.0f;
+};
+
+struct BotStats
+{
+	void merge(const BotStats &other);
+
+	// Seconds from connecting until the server accepted the bot
+	BotStat login_time;
+	// Seconds from entering a block until it and its neighbours arrived
+	BotStat block_latency;
+	// Seconds until a chat message came back from the server. Unlike the
+	// round trip time this includes the wait for the next server step.
+	BotStat chat_latency;
+	// Round trip time of the connection
+	BotStat rtt;
+
+	u32 packets_received = 0;
+	u64 bytes_received = 0;
+	u32 packets_sent = 0;
+	u64 bytes_sent = 0;
+	// Full blocks and blocks sent as changed nodes
+	u32 blocks_received = 0;
+	u64 block_bytes_received = 0;
+	u32 actions_done = 0;
+};
+
+/*
+	A client without graphics, map or environment for load tests. It logs
+	in like a player, acknowledges the blocks it gets, walks through the
+	actions of a script and measures how quickly the server answers.
+*/
+class Bot : public con::PeerHandler
+{
+public:
+	enum State
+	{
+		BOT_CREATED,
+		// Waiting for the server to accept the login
+		BOT_CONNECTING,
+		// Waiting for the definitions
+		BOT_INIT,
+		BOT_READY,
+		// Denied or disconnected, see getError()
+		BOT_FAILED,
+	};
+
+	Bot(const std::string &name, const std::string &password,
+			const BotScript &script, v3s16 origin, u8 wanted_range);
+	~Bot();
+
+	void connect(const Address &address);
+	void disconnect();
+	void step(float dtime);
+
+	const std::string &getName() const { return m_name; }
+	State getState() const { return m_state; }
+	const std::string &getError() const { return m_error; }
+
+	// Returns the statistics gathered since the last call
+	BotStats takeStats();
+
+	// PeerHandler
+	void peerAdded(con::Peer *peer) {}
+	void deletingPeer(con::Peer *peer, bool timeout);
+
+private:
+	void receive();
+	void handlePacket(NetworkPacket *pkt);
+	void handleHello(NetworkPacket *pkt);
+	void handleSrpBytesSandB(NetworkPacket *pkt);
+	void handleAuthAccept(NetworkPacket *pkt);
+	void handleAccessDenied(NetworkPacket *pkt);
+	void handleBlock(v3s16 p, u32 size);
+	void handleChatMessage(NetworkPacket *pkt);
+	void fail(const std::string &error);
+
+	void send(NetworkPacket *pkt);
+	void sendInit();
+	void sendPlayerPos();
+	void writePlayerPos(NetworkPacket *pkt);
+	void sendInteract(u8 action, v3s16 under, v3s16 above);
+	void sendChatMessage(const std::string &text);
+
+	void stepScript(float dtime);
+	void nextAction();
+	v3f getActionTarget(const BotAction &action) const;
+	void requestBlocksAround(v3s16 blockpos);
+
+	std::unique_ptr<con::Connection> m_con;
+	std::string m_name;
+	std::string m_password;
+	const BotScript &m_script;
+	// Node the positions of the script are relative to. Given relative to
+	// the spawn position, which is added at login.
+	v3s16 m_origin;
+	u8 m_wanted_range;
+
+	State m_state = BOT_CREATED;
+	std::string m_error;
+	u64 m_connect_time = 0;
+	float m_init_timer = 0.0f;
+
+	u16 m_proto_ver = 0;
+	u32 m_auth_mech = 0;
+	void *m_auth_data = nullptr;
+
+	v3f m_position;
+	v3f m_speed;
+	float m_yaw = 0.0f;
+	bool m_position_changed = true;
+	float m_send_interval = 0.1f;
+	float m_playerpos_timer = 0.0f;
+
+	u32 m_action = 0;
+	float m_action_timer = 0.0f;
+	bool m_digging = false;
+
+	// Blocks the server sent
+	std::set<v3s16> m_blocks;
+	// Blocks around the bot which are awaited, with the time they are
+	// awaited since
+	std::map<v3s16, u64> m_blocks_awaited;
+	v3s16 m_blockpos = v3s16(S16_MIN, S16_MIN, S16_MIN);
+
+	// Sent chat messages which didn't come back yet, with their send time
+	std::deque<std::pair<std::wstring, u64>> m_chat_awaited;
+	u32 m_chat_counter = 0;
+
+	BotStats m_stats;
+};
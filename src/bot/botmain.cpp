@@ -0,0 +1,296 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	minetestbot: connects a number of bots to a server and reports how
+	the server copes with them
+*/
+
+#include "bot.h"
+#include "debug.h"
+#include "defaultsettings.h"
+#include "log.h"
+#include "porting.h"
+#include "settings.h"
+#include "network/socket.h"
+#include "util/numeric.h"
+#include "util/string.h"
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+typedef std::map<std::string, ValueSpec> OptionList;
+
+static void set_allowed_options(OptionList *allowed_options)
+{
+	allowed_options->clear();
+
+	allowed_options->insert(std::make_pair("help", ValueSpec(VALUETYPE_FLAG,
+			"Show allowed options")));
+	allowed_options->insert(std::make_pair("address", ValueSpec(VALUETYPE_STRING,
+			"Address of the server, defaults to 127.0.0.1")));
+	allowed_options->insert(std::make_pair("port", ValueSpec(VALUETYPE_STRING,
+			"Port of the server, defaults to 30000")));
+	allowed_options->insert(std::make_pair("bots", ValueSpec(VALUETYPE_STRING,
+			"Number of bots, defaults to 10")));
+	allowed_options->insert(std::make_pair("name", ValueSpec(VALUETYPE_STRING,
+			"Name the bot number is appended to, defaults to 'bot'")));
+	allowed_options->insert(std::make_pair("password", ValueSpec(VALUETYPE_STRING,
+			"Password of the bots")));
+	allowed_options->insert(std::make_pair("script", ValueSpec(VALUETYPE_STRING,
+			"File with the actions the bots repeat")));
+	allowed_options->insert(std::make_pair("duration", ValueSpec(VALUETYPE_STRING,
+			"Seconds to run, 0 until interrupted, defaults to 60")));
+	allowed_options->insert(std::make_pair("report-interval", ValueSpec(VALUETYPE_STRING,
+			"Seconds between the reports, defaults to 10")));
+	allowed_options->insert(std::make_pair("join-interval", ValueSpec(VALUETYPE_STRING,
+			"Seconds between the logins of the bots, defaults to 0.1")));
+	allowed_options->insert(std::make_pair("spread", ValueSpec(VALUETYPE_STRING,
+			"Distance of the bots to each other in nodes, defaults to 32")));
+	allowed_options->insert(std::make_pair("wanted-range", ValueSpec(VALUETYPE_STRING,
+			"View range of the bots in mapblocks, defaults to 8")));
+	allowed_options->insert(std::make_pair("quiet", ValueSpec(VALUETYPE_FLAG,
+			"Print to console errors only")));
+	allowed_options->insert(std::make_pair("info", ValueSpec(VALUETYPE_FLAG,
+			"Print more information to console")));
+	allowed_options->insert(std::make_pair("verbose", ValueSpec(VALUETYPE_FLAG,
+			"Print even more information to console")));
+}
+
+static void print_help(const OptionList &allowed_options)
+{
+	std::cout << "Allowed options:" << std::endl;
+	for (const auto &allowed_option : allowed_options) {
+		std::ostringstream os1(std::ios::binary);
+		os1 << "  --" << allowed_option.first;
+		if (allowed_option.second.type != VALUETYPE_FLAG)
+			os1 << " <value>";
+
+		std::cout << padStringRight(os1.str(), 30);
+
+		if (allowed_option.second.help)
+			std::cout << allowed_option.second.help;
+
+		std::cout << std::endl;
+	}
+}
+
+static std::string get_option(const Settings &cmd_args, const std::string &name,
+		const std::string &def)
+{
+	return cmd_args.exists(name) ? cmd_args.get(name) : def;
+}
+
+static void print_stat(std::ostream &os, const char *name, const BotStat &stat)
+{
+	os << "  " << padStringRight(name, 16);
+	if (stat.count == 0) {
+		os << "-" << std::endl;
+		return;
+	}
+	os << "avg " << std::fixed << std::setprecision(3) << stat.avg()
+		<< "s, max " << stat.max << "s (" << stat.count << " samples)"
+		<< std::endl;
+}
+
+static void print_report(std::ostream &os, const BotStats &stats, float seconds,
+		u32 ready, u32 failed, u32 total)
+{
+	seconds = MYMAX(seconds, 0.001f);
+
+	os << std::fixed << std::setprecision(1);
+	os << "Bots: " << ready << " ready, " << failed << " failed, "
+		<< total << " total" << std::endl;
+	os << "  " << padStringRight("received", 16)
+		<< stats.bytes_received / seconds / 1024.0f << " KiB/s, "
+		<< stats.packets_received / seconds << " packets/s" << std::endl;
+	os << "  " << padStringRight("sent", 16)
+		<< stats.bytes_sent / seconds / 1024.0f << " KiB/s, "
+		<< stats.packets_sent / seconds << " packets/s" << std::endl;
+	os << "  " << padStringRight("blocks", 16)
+		<< stats.blocks_received / seconds << " blocks/s, "
+		<< stats.block_bytes_received / seconds / 1024.0f << " KiB/s"
+		<< std::endl;
+	os << "  " << padStringRight("actions", 16)
+		<< stats.actions_done / seconds << " actions/s" << std::endl;
+	print_stat(os, "login", stats.login_time);
+	print_stat(os, "block latency", stats.block_latency);
+	print_stat(os, "chat latency", stats.chat_latency);
+	print_stat(os, "round trip", stats.rtt);
+}
+
+int main(int argc, char *argv[])
+{
+	debug_set_exception_handler();
+
+	g_logger.registerThread("Main");
+	g_logger.addOutputMaxLevel(&stderr_output, LL_ACTION);
+
+	OptionList allowed_options;
+	set_allowed_options(&allowed_options);
+
+	Settings cmd_args;
+	bool cmd_args_ok = cmd_args.parseCommandLine(argc, argv, allowed_options);
+	if (!cmd_args_ok || cmd_args.getFlag("help")
+			|| cmd_args.exists("nonopt1")) {
+		print_help(allowed_options);
+		return cmd_args_ok ? 0 : 1;
+	}
+
+	if (cmd_args.getFlag("quiet")) {
+		g_logger.removeOutput(&stderr_output);
+		g_logger.addOutputMaxLevel(&stderr_output, LL_ERROR);
+	}
+	if (cmd_args.getFlag("info") || cmd_args.getFlag("verbose"))
+		g_logger.addOutput(&stderr_output, LL_INFO);
+	if (cmd_args.getFlag("verbose"))
+		g_logger.addOutput(&stderr_output, LL_VERBOSE);
+
+	porting::signal_handler_init();
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	set_default_settings(g_settings);
+	// The bots are many connections in one process
+	g_settings->set("connection_send_threads", "1");
+
+	sockets_init();
+	atexit(sockets_cleanup);
+
+	BotScript script;
+	if (cmd_args.exists("script")) {
+		std::ifstream is(cmd_args.get("script"));
+		std::string error;
+		if (!is.good()) {
+			errorstream << "Cannot open " << cmd_args.get("script")
+					<< std::endl;
+			return 1;
+		}
+		if (!script.parse(is, &error)) {
+			errorstream << cmd_args.get("script") << ": " << error
+					<< std::endl;
+			return 1;
+		}
+	}
+
+	Address address;
+	try {
+		address.Resolve(get_option(cmd_args, "address", "127.0.0.1").c_str());
+	} catch (ResolveError &e) {
+		errorstream << "Cannot resolve address: " << e.what() << std::endl;
+		return 1;
+	}
+	address.setPort(stoi(get_option(cmd_args, "port", "30000")));
+
+	u32 bot_count = stoi(get_option(cmd_args, "bots", "10"));
+	std::string name = get_option(cmd_args, "name", "bot");
+	std::string password = get_option(cmd_args, "password", "");
+	float duration = stof(get_option(cmd_args, "duration", "60"));
+	float report_interval = stof(get_option(cmd_args, "report-interval", "10"));
+	float join_interval = stof(get_option(cmd_args, "join-interval", "0.1"));
+	s16 spread = stoi(get_option(cmd_args, "spread", "32"));
+	u8 wanted_range = rangelim(stoi(get_option(cmd_args, "wanted-range", "8")),
+			1, 255);
+
+	// Put the bots on a square grid around the spawn position
+	std::vector<std::unique_ptr<Bot>> bots;
+	s32 side = std::ceil(std::sqrt((float)bot_count));
+	for (u32 i = 0; i < bot_count; i++) {
+		s32 x = (s32)i % side - side / 2;
+		s32 z = (s32)i / side - side / 2;
+		v3s16 origin(x * spread, 0, z * spread);
+		bots.emplace_back(new Bot(name + std::to_string(i + 1), password,
+				script, origin, wanted_range));
+	}
+
+	BotStats interval_stats;
+	BotStats total_stats;
+	u64 start_time = porting::getTimeMs();
+	u64 last_time = start_time;
+	float report_timer = 0.0f;
+	float join_timer = 0.0f;
+	u32 joined = 0;
+	bool *kill = porting::signal_handler_killstatus();
+
+	while (!*kill) {
+		u64 time = porting::getTimeMs();
+		float dtime = (time - last_time) / 1000.0f;
+		float run_time = (time - start_time) / 1000.0f;
+		last_time = time;
+		if (duration > 0.0f && run_time >= duration)
+			break;
+
+		// Don't log them all in at once
+		join_timer -= dtime;
+		while (joined < bots.size() && join_timer <= 0.0f) {
+			bots[joined++]->connect(address);
+			join_timer += join_interval;
+		}
+
+		for (auto &bot : bots)
+			bot->step(dtime);
+
+		report_timer += dtime;
+		if (report_timer >= report_interval) {
+			u32 ready = 0;
+			u32 failed = 0;
+			for (auto &bot : bots) {
+				interval_stats.merge(bot->takeStats());
+				ready += bot->getState() == Bot::BOT_READY;
+				failed += bot->getState() == Bot::BOT_FAILED;
+			}
+
+			std::cout << "[" << std::fixed << std::setprecision(0)
+				<< run_time << "s] ";
+			print_report(std::cout, interval_stats, report_timer,
+					ready, failed, bots.size());
+
+			total_stats.merge(interval_stats);
+			interval_stats = BotStats();
+			report_timer = 0.0f;
+		}
+
+		sleep_ms(10);
+	}
+
+	u32 ready = 0;
+	u32 failed = 0;
+	for (auto &bot : bots) {
+		total_stats.merge(bot->takeStats());
+		ready += bot->getState() == Bot::BOT_READY;
+		failed += bot->getState() == Bot::BOT_FAILED;
+		bot->disconnect();
+	}
+	total_stats.merge(interval_stats);
+
+	std::cout << "Summary of " << std::fixed << std::setprecision(0)
+		<< (porting::getTimeMs() - start_time) / 1000.0f << "s: ";
+	print_report(std::cout, total_stats,
+			(porting::getTimeMs() - start_time) / 1000.0f,
+			ready, failed, bots.size());
+
+	// Give the disconnect packets time to go out
+	sleep_ms(500);
+	bots.clear();
+
+	END_DEBUG_EXCEPTION_HANDLER
+
+	return 0;
+}
@@ -972,8 +972,11 @@ void Client::sendInit(const std::string &playerName)
 {
 	NetworkPacket pkt(TOSERVER_INIT, 1 + 2 + 2 + (1 + playerName.size()));
 
-	// we don't support network compression yet
 	u16 supp_comp_modes = NETPROTO_COMPRESSION_NONE;
+	if (isBlockCompressionSupported(BLOCK_COMPRESSION_ZSTD))
+		supp_comp_modes |= NETPROTO_COMPRESSION_ZSTD;
+	if (isBlockCompressionSupported(BLOCK_COMPRESSION_LZ4))
+		supp_comp_modes |= NETPROTO_COMPRESSION_LZ4;
 
 	pkt << (u8) SER_FMT_VER_HIGHEST_READ << (u16) supp_comp_modes;
 	pkt << (u16) CLIENT_PROTOCOL_VERSION_MIN << (u16) CLIENT_PROTOCOL_VERSION_MAX;
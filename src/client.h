@@ -187,6 +187,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void handleCommand_RemoveNode(NetworkPacket* pkt);
 	void handleCommand_AddNode(NetworkPacket* pkt);
 	void handleCommand_BlockData(NetworkPacket* pkt);
+	void handleCommand_BlockNodes(NetworkPacket* pkt);
 	void handleCommand_Inventory(NetworkPacket* pkt);
 	void handleCommand_TimeOfDay(NetworkPacket* pkt);
 	void handleCommand_ChatMessage(NetworkPacket *pkt);
@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 #include "content_sao.h"              // TODO this is used for cleanup of only
 #include "log.h"
+#include "util/serialize.h"
 #include "util/srp.h"
 #include "face_position_cache.h"
 
@@ -144,7 +145,8 @@ void RemoteClient::GetNextBlocks (
 		Get the starting value of the block finder radius.
 	*/
 
-	if (m_last_center != center) {
+	bool center_changed = m_last_center != center;
+	if (center_changed) {
 		m_nearest_unsent_d = 0;
 		m_last_center = center;
 	}
@@ -210,6 +212,10 @@ void RemoteClient::GetNextBlocks (
 		wanted_range);
 	const s16 d_blocks_in_sight = full_d_max * BS * MAP_BLOCKSIZE;
 
+	// Don't make the emerge threads work on blocks left behind
+	if (center_changed)
+		emerge->cancelBlockEmerges(peer_id, center, full_d_max);
+
 	s16 d_max = full_d_max;
 	s16 d_max_gen = std::min(adjustDist(m_max_gen_distance, prop_zoom_fov),
 		wanted_range);
@@ -417,8 +423,10 @@ void RemoteClient::GotBlock(v3s16 p)
 	}
 }
 
-void RemoteClient::SentBlock(v3s16 p)
+void RemoteClient::SentBlock(v3s16 p, u64 version)
 {
+	m_blocks_sent_version[p] = version;
+
 	if (m_blocks_modified.find(p) != m_blocks_modified.end())
 		m_blocks_modified.erase(p);
 
@@ -430,6 +438,12 @@ void RemoteClient::SentBlock(v3s16 p)
 }
 
 void RemoteClient::SetBlockNotSent(v3s16 p)
+{
+	m_blocks_sent_version.erase(p);
+	SetBlockModified(p);
+}
+
+void RemoteClient::SetBlockModified(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
 	m_nothing_to_send_pause_timer = 0;
@@ -622,6 +636,39 @@ u64 RemoteClient::uptime() const
 	return porting::getTimeS() - m_connection_time;
 }
 
+u8 RemoteClient::getBlockCompression() const
+{
+	if (m_deployed_compression & NETPROTO_COMPRESSION_ZSTD)
+		return BLOCK_COMPRESSION_ZSTD;
+	if (m_deployed_compression & NETPROTO_COMPRESSION_LZ4)
+		return BLOCK_COMPRESSION_LZ4;
+	return BLOCK_COMPRESSION_ZLIB;
+}
+
+std::string RemoteClient::compactPositionUpdate(u16 id, const std::string &data,
+		bool *reliable)
+{
+	std::istringstream is(data, std::ios::binary);
+	// command
+	readU8(is);
+	GenericPosition pos = gob_read_update_position(is);
+
+	auto it = m_position_refs.find(id);
+	if (it != m_position_refs.end()) {
+		std::string delta = gob_cmd_update_position_delta(it->second, pos);
+		if (!delta.empty())
+			return delta;
+		it->second.number++;
+	} else {
+		it = m_position_refs.emplace(id, GenericPositionReference()).first;
+	}
+
+	// The first update or too far off the last reference
+	it->second.pos = pos;
+	*reliable = true;
+	return gob_cmd_update_position_reference(it->second);
+}
+
 ClientInterface::ClientInterface(const std::shared_ptr<con::Connection> & con)
 :
 	m_con(con),
@@ -663,7 +710,7 @@ void ClientInterface::markBlockposAsNotSent(const v3s16 &pos)
 	MutexAutoLock clientslock(m_clients_mutex);
 	for (const auto &client : m_clients) {
 		if (client.second->getState() >= CS_Active)
-			client.second->SetBlockNotSent(pos);
+			client.second->SetBlockModified(pos);
 	}
 }
 
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irr_v3d.h"                   // for irrlicht datatypes
 
 #include "constants.h"
+#include "genericobject.h"
 #include "serialization.h"             // for SER_FMT_VER_INVALID
 #include "network/networkpacket.h"
 #include "network/networkprotocol.h"
@@ -30,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <list>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include <mutex>
 
 class MapBlock;
@@ -259,11 +261,29 @@ class RemoteClient
 
 	void GotBlock(v3s16 p);
 
-	void SentBlock(v3s16 p);
+	// version is the MapBlock::getNodeVersion() of the sent data
+	void SentBlock(v3s16 p, u64 version);
 
+	/*
+		SetBlockNotSent() is for when the copy of the client is unknown
+		or wrong, it gets the whole block again. The others are for
+		blocks modified on the server, clients which have the version
+		sent last get only the changed nodes if possible.
+	*/
 	void SetBlockNotSent(v3s16 p);
+	void SetBlockModified(v3s16 p);
 	void SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks);
 
+	// Returns false if the client has no known version of the block
+	bool getSentBlockVersion(v3s16 p, u64 *version) const
+	{
+		auto it = m_blocks_sent_version.find(p);
+		if (it == m_blocks_sent_version.end())
+			return false;
+		*version = it->second;
+		return true;
+	}
+
 	/**
 	 * tell client about this block being modified right now.
 	 * this information is required to requeue the block in case it's "on wire"
@@ -303,6 +323,16 @@ class RemoteClient
 	*/
 	std::set<u16> m_known_objects;
 
+	/*
+		Turns a GENERIC_CMD_UPDATE_POSITION message of the object into a
+		compact update relative to the last position reference sent to the
+		client. If a new reference is needed it is returned instead, and
+		reliable is set.
+	*/
+	std::string compactPositionUpdate(u16 id, const std::string &data,
+			bool *reliable);
+	void forgetPositionReference(u16 id) { m_position_refs.erase(id); }
+
 	ClientState getState() const { return m_state; }
 
 	std::string getName() const { return m_name; }
@@ -319,6 +349,9 @@ class RemoteClient
 	void setDeployedCompressionMode(u16 byteFlag)
 		{ m_deployed_compression = byteFlag; }
 
+	// BlockCompression codec of the blocks sent to this client
+	u8 getBlockCompression() const;
+
 	void confirmSerializationVersion()
 		{ serialization_version = m_pending_serialization_version; }
 
@@ -386,6 +419,12 @@ class RemoteClient
 	*/
 	std::set<v3s16> m_blocks_modified;
 
+	/*
+		Versions of the blocks as last sent to the client, see SentBlock().
+		A block is removed when the copy of the client becomes unknown.
+	*/
+	std::map<v3s16, u64> m_blocks_sent_version;
+
 	/*
 		Count of excess GotBlocks().
 		There is an excess amount because the client sometimes
@@ -398,6 +437,12 @@ class RemoteClient
 	// CPU usage optimization
 	float m_nothing_to_send_pause_timer = 0.0f;
 
+	/*
+		Last position reference sent for each known object,
+		see compactPositionUpdate()
+	*/
+	std::unordered_map<u16, GenericPositionReference> m_position_refs;
+
 	/*
 		name of player using this client
 	*/
@@ -436,7 +481,7 @@ class ClientInterface {
 	/* get list of active client id's */
 	std::vector<session_t> getClientIDs(ClientState min_state=CS_Active);
 
-	/* mark block as not sent to active client sessions */
+	/* mark block as modified for active client sessions */
 	void markBlockposAsNotSent(const v3s16 &pos);
 
 	/* verify is server user limit was reached */
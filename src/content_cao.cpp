@@ -1273,6 +1273,37 @@ void GenericCAO::updateAttachments()
 	}
 }
 
+void GenericCAO::updatePosition(const GenericPosition &pos)
+{
+	// Not sent by the server if this object is an attachment.
+	// We might however get here if the server notices the object being detached before the client.
+	m_position = pos.position;
+	m_velocity = pos.velocity;
+	m_acceleration = pos.acceleration;
+	if (std::fabs(m_prop.automatic_rotate) < 0.001f)
+		m_yaw = pos.yaw;
+	m_yaw = wrapDegrees_0_360(m_yaw);
+
+	// Place us a bit higher if we're physical, to not sink into
+	// the ground due to sucky collision detection...
+	if(m_prop.physical)
+		m_position += v3f(0,0.002,0);
+
+	if(getParent() != NULL) // Just in case
+		return;
+
+	if(pos.do_interpolate)
+	{
+		if(!m_prop.physical)
+			pos_translator.update(m_position, pos.is_movement_end,
+				pos.update_interval);
+	} else {
+		pos_translator.init(m_position);
+	}
+	yaw_translator.update(m_yaw, false, pos.update_interval);
+	updateNodePos();
+}
+
 void GenericCAO::processMessage(const std::string &data)
 {
 	//infostream<<"GenericCAO: Got message"<<std::endl;
@@ -1309,37 +1340,18 @@ void GenericCAO::processMessage(const std::string &data)
 
 		expireVisuals();
 	} else if (cmd == GENERIC_CMD_UPDATE_POSITION) {
-		// Not sent by the server if this object is an attachment.
-		// We might however get here if the server notices the object being detached before the client.
-		m_position = readV3F1000(is);
-		m_velocity = readV3F1000(is);
-		m_acceleration = readV3F1000(is);
-		if (std::fabs(m_prop.automatic_rotate) < 0.001f)
-			m_yaw = readF1000(is);
-		else
-			readF1000(is);
-		m_yaw = wrapDegrees_0_360(m_yaw);
-		bool do_interpolate = readU8(is);
-		bool is_end_position = readU8(is);
-		float update_interval = readF1000(is);
-
-		// Place us a bit higher if we're physical, to not sink into
-		// the ground due to sucky collision detection...
-		if(m_prop.physical)
-			m_position += v3f(0,0.002,0);
-
-		if(getParent() != NULL) // Just in case
-			return;
-
-		if(do_interpolate)
-		{
-			if(!m_prop.physical)
-				pos_translator.update(m_position, is_end_position, update_interval);
-		} else {
-			pos_translator.init(m_position);
-		}
-		yaw_translator.update(m_yaw, false, update_interval);
-		updateNodePos();
+		updatePosition(gob_read_update_position(is));
+	} else if (cmd == GENERIC_CMD_UPDATE_POSITION_REFERENCE) {
+		m_position_ref = gob_read_update_position_reference(is);
+		m_has_position_ref = true;
+		updatePosition(m_position_ref.pos);
+	} else if (cmd == GENERIC_CMD_UPDATE_POSITION_DELTA) {
+		// Updates sent before the last reference or arriving before it
+		// are dropped, like lost ones
+		GenericPosition pos;
+		if (m_has_position_ref &&
+				gob_read_update_position_delta(is, m_position_ref, pos))
+			updatePosition(pos);
 	} else if (cmd == GENERIC_CMD_SET_TEXTURE_MOD) {
 		std::string mod = deSerializeString(is);
 
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "object_properties.h"
 #include "itemgroup.h"
 #include "constants.h"
+#include "genericobject.h"
 
 class Camera;
 class Client;
@@ -84,6 +85,9 @@ class GenericCAO : public ClientActiveObject
 	s16 m_hp = 1;
 	SmoothTranslator<v3f> pos_translator;
 	SmoothTranslatorWrapped yaw_translator;
+	// Base of the compact position updates
+	GenericPositionReference m_position_ref;
+	bool m_has_position_ref = false;
 	// Spritesheet/animation stuff
 	v2f m_tx_size = v2f(1,1);
 	v2s16 m_tx_basepos;
@@ -216,6 +220,8 @@ class GenericCAO : public ClientActiveObject
 
 	void updateAttachments();
 
+	void updatePosition(const GenericPosition &pos);
+
 	void processMessage(const std::string &data);
 
 	bool directReportPunch(v3f dir, const ItemStack *punchitem=NULL,
@@ -66,9 +66,11 @@ class TestSAO : public ServerActiveObject
 			return;
 		}
 
-		m_base_position.Y += dtime * BS * 2;
-		if(m_base_position.Y > 8*BS)
-			m_base_position.Y = 2*BS;
+		v3f pos = m_base_position;
+		pos.Y += dtime * BS * 2;
+		if(pos.Y > 8*BS)
+			pos.Y = 2*BS;
+		setBasePosition(pos);
 
 		if (!send_recommended)
 			return;
@@ -405,7 +407,7 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 	if(isAttached())
 	{
 		v3f pos = m_env->getActiveObject(m_attachment_parent_id)->getBasePosition();
-		m_base_position = pos;
+		setBasePosition(pos);
 		m_velocity = v3f(0,0,0);
 		m_acceleration = v3f(0,0,0);
 	}
@@ -426,12 +428,12 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 					this, m_prop.collideWithObjects);
 
 			// Apply results
-			m_base_position = p_pos;
+			setBasePosition(p_pos);
 			m_velocity = p_velocity;
 			m_acceleration = p_acceleration;
 		} else {
-			m_base_position += dtime * m_velocity + 0.5 * dtime
-					* dtime * m_acceleration;
+			setBasePosition(m_base_position + dtime * m_velocity +
+					0.5 * dtime * dtime * m_acceleration);
 			m_velocity += dtime * m_acceleration;
 		}
 
@@ -659,7 +661,7 @@ void LuaEntitySAO::setPos(const v3f &pos)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	sendPosition(false, true);
 }
 
@@ -667,7 +669,7 @@ void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	if(!continuous)
 		sendPosition(true, true);
 }
@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/string.h"
 
 #include "leveldb/db.h"
+#include <algorithm>
 
 
 #define ENSURE_STATUS_OK(s) \
@@ -74,6 +75,35 @@ void Database_LevelDB::loadBlock(const v3s16 &pos, std::string *block)
 	*block = (status.ok()) ? datastr : "";
 }
 
+void Database_LevelDB::loadBlocks(const std::vector<v3s16> &positions,
+	const LoadBlockCallback &callback)
+{
+	// Seeking forward through sorted keys keeps the iterator on the same
+	// or the next data blocks instead of starting from the index every time
+	std::vector<std::pair<std::string, v3s16>> keys;
+	keys.reserve(positions.size());
+	for (const v3s16 &pos : positions)
+		keys.emplace_back(i64tos(getBlockAsInteger(pos)), pos);
+	std::sort(keys.begin(), keys.end(),
+		[] (const std::pair<std::string, v3s16> &a,
+				const std::pair<std::string, v3s16> &b) {
+			return a.first < b.first;
+		});
+
+	std::string block;
+	leveldb::Iterator *it = m_database->NewIterator(leveldb::ReadOptions());
+	for (const auto &key : keys) {
+		it->Seek(key.first);
+		if (it->Valid() && it->key() == key.first)
+			block = it->value().ToString();
+		else
+			block.clear();
+		callback(key.second, &block);
+	}
+	ENSURE_STATUS_OK(it->status());
+	delete it;
+}
+
 bool Database_LevelDB::deleteBlock(const v3s16 &pos)
 {
 	leveldb::Status status = m_database->Delete(leveldb::WriteOptions(),
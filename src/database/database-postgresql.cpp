@@ -38,6 +38,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "content_sao.h"
 #include "remoteplayer.h"
+#include "util/string.h"
+#include <cstring>
+#include <map>
 
 Database_PostgreSQL::Database_PostgreSQL(const std::string &connect_string) :
 	m_connect_string(connect_string)
@@ -210,6 +213,11 @@ void MapDatabasePostgreSQL::initStatements()
 				"UPDATE SET data = $4::bytea");
 	}
 
+	prepareStatement("read_blocks",
+		"SELECT posX, posY, posZ, data FROM blocks "
+			"WHERE (posX, posY, posZ) IN (SELECT * FROM "
+			"unnest($1::int4[], $2::int4[], $3::int4[]))");
+
 	prepareStatement("delete_block", "DELETE FROM blocks WHERE "
 		"posX = $1::int4 AND posY = $2::int4 AND posZ = $3::int4");
 
@@ -273,6 +281,60 @@ void MapDatabasePostgreSQL::loadBlock(const v3s16 &pos, std::string *block)
 	PQclear(results);
 }
 
+void MapDatabasePostgreSQL::loadBlocks(const std::vector<v3s16> &positions,
+	const LoadBlockCallback &callback)
+{
+	if (positions.empty())
+		return;
+
+	verifyDatabase();
+
+	// Send the coordinates as three int4[] literals, one round trip in total
+	std::string xs = "{", ys = "{", zs = "{";
+	for (size_t i = 0; i < positions.size(); i++) {
+		const char *sep = i == 0 ? "" : ",";
+		xs.append(sep).append(itos(positions[i].X));
+		ys.append(sep).append(itos(positions[i].Y));
+		zs.append(sep).append(itos(positions[i].Z));
+	}
+	xs += "}";
+	ys += "}";
+	zs += "}";
+
+	const void *args[] = { xs.c_str(), ys.c_str(), zs.c_str() };
+	const int argLen[] = { (int)xs.size(), (int)ys.size(), (int)zs.size() };
+	const int argFmt[] = { 0, 0, 0 };
+
+	PGresult *results = execPrepared("read_blocks", ARRLEN(args), args,
+		argLen, argFmt, false);
+
+	// The result is in binary format
+	auto get_int4 = [results] (int row, int col) -> s16 {
+		u32 v;
+		memcpy(&v, PQgetvalue(results, row, col), sizeof(v));
+		return (s16)(s32)ntohl(v);
+	};
+
+	std::map<v3s16, std::string> found;
+	int numrows = PQntuples(results);
+	for (int row = 0; row < numrows; row++) {
+		v3s16 pos(get_int4(row, 0), get_int4(row, 1), get_int4(row, 2));
+		found[pos] = std::string(PQgetvalue(results, row, 3),
+			PQgetlength(results, row, 3));
+	}
+	PQclear(results);
+
+	std::string block;
+	for (const v3s16 &pos : positions) {
+		auto it = found.find(pos);
+		if (it != found.end())
+			block = it->second;
+		else
+			block.clear();
+		callback(pos, &block);
+	}
+}
+
 bool MapDatabasePostgreSQL::deleteBlock(const v3s16 &pos)
 {
 	verifyDatabase();
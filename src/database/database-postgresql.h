@@ -115,6 +115,8 @@ class MapDatabasePostgreSQL : private Database_PostgreSQL, public MapDatabase
 
 	bool saveBlock(const v3s16 &pos, const std::string &data);
 	void loadBlock(const v3s16 &pos, std::string *block);
+	void loadBlocks(const std::vector<v3s16> &positions,
+		const LoadBlockCallback &callback);
 	bool deleteBlock(const v3s16 &pos);
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
@@ -156,6 +156,60 @@ void Database_Redis::loadBlock(const v3s16 &pos, std::string *block)
 		"Redis command 'HGET %s %s' gave invalid reply."));
 }
 
+void Database_Redis::loadBlocks(const std::vector<v3s16> &positions,
+	const LoadBlockCallback &callback)
+{
+	if (positions.empty())
+		return;
+
+	// One HMGET for all blocks
+	std::vector<std::string> keys;
+	keys.reserve(positions.size());
+	for (const v3s16 &pos : positions)
+		keys.push_back(i64tos(getBlockAsInteger(pos)));
+
+	std::vector<const char *> argv;
+	std::vector<size_t> argvlen;
+	argv.reserve(keys.size() + 2);
+	argvlen.reserve(keys.size() + 2);
+	argv.push_back("HMGET");
+	argvlen.push_back(5);
+	argv.push_back(hash.c_str());
+	argvlen.push_back(hash.size());
+	for (const std::string &key : keys) {
+		argv.push_back(key.c_str());
+		argvlen.push_back(key.size());
+	}
+
+	redisReply *reply = static_cast<redisReply *>(redisCommandArgv(ctx,
+		argv.size(), argv.data(), argvlen.data()));
+	if (!reply) {
+		throw DatabaseException(std::string(
+			"Redis command 'HMGET %s ...' failed: ") + ctx->errstr);
+	}
+
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != keys.size()) {
+		std::string errstr = reply->type == REDIS_REPLY_ERROR ?
+			std::string(reply->str, reply->len) : "invalid reply";
+		freeReplyObject(reply);
+		errorstream << "loadBlocks: loading " << positions.size()
+			<< " blocks failed: " << errstr << std::endl;
+		throw DatabaseException(std::string(
+			"Redis command 'HMGET %s ...' errored: ") + errstr);
+	}
+
+	std::string block;
+	for (size_t i = 0; i < reply->elements; i++) {
+		redisReply *r = reply->element[i];
+		if (r->type == REDIS_REPLY_STRING)
+			block.assign(r->str, r->len);
+		else
+			block.clear();
+		callback(positions[i], &block);
+	}
+	freeReplyObject(reply);
+}
+
 bool Database_Redis::deleteBlock(const v3s16 &pos)
 {
 	std::string tmp = i64tos(getBlockAsInteger(pos));
@@ -36,6 +36,7 @@ SQLite format specification:
 #include "content_sao.h"
 #include "remoteplayer.h"
 
+#include <algorithm>
 #include <cassert>
 
 // When to print messages when the database is being held locked by another process
@@ -206,6 +207,7 @@ MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir):
 MapDatabaseSQLite3::~MapDatabaseSQLite3()
 {
 	FINALIZE_STATEMENT(m_stmt_read)
+	FINALIZE_STATEMENT(m_stmt_read_range)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
 	FINALIZE_STATEMENT(m_stmt_delete)
@@ -228,6 +230,8 @@ void MapDatabaseSQLite3::createDatabase()
 void MapDatabaseSQLite3::initStatements()
 {
 	PREPARE_STATEMENT(read, "SELECT `data` FROM `blocks` WHERE `pos` = ? LIMIT 1");
+	PREPARE_STATEMENT(read_range, "SELECT `pos`, `data` FROM `blocks` "
+		"WHERE `pos` BETWEEN ? AND ? ORDER BY `pos`");
 #ifdef __ANDROID__
 	PREPARE_STATEMENT(write,  "INSERT INTO `blocks` (`pos`, `data`) VALUES (?, ?)");
 #else
@@ -309,6 +313,59 @@ void MapDatabaseSQLite3::loadBlock(const v3s16 &pos, std::string *block)
 	sqlite3_reset(m_stmt_read);
 }
 
+void MapDatabaseSQLite3::loadBlocks(const std::vector<v3s16> &positions,
+	const LoadBlockCallback &callback)
+{
+	verifyDatabase();
+
+	// Sort by key and sweep over runs of nearby keys with one range query
+	// each. The blocks of a mapchunk row are consecutive keys.
+	std::vector<std::pair<s64, v3s16>> keys;
+	keys.reserve(positions.size());
+	for (const v3s16 &pos : positions)
+		keys.emplace_back(getBlockAsInteger(pos), pos);
+	std::sort(keys.begin(), keys.end(),
+		[] (const std::pair<s64, v3s16> &a, const std::pair<s64, v3s16> &b) {
+			return a.first < b.first;
+		});
+
+	std::string block;
+	size_t i = 0;
+	while (i < keys.size()) {
+		// Extend the run while the gaps are small
+		size_t end = i + 1;
+		while (end < keys.size() && keys[end].first - keys[end - 1].first <= 16)
+			end++;
+
+		int64_to_sqlite(m_stmt_read_range, 1, keys[i].first);
+		int64_to_sqlite(m_stmt_read_range, 2, keys[end - 1].first);
+
+		size_t k = i;
+		while (sqlite3_step(m_stmt_read_range) == SQLITE_ROW) {
+			s64 key = sqlite3_column_int64(m_stmt_read_range, 0);
+			// Report requested blocks that have no row
+			for (; k < end && keys[k].first < key; k++) {
+				block.clear();
+				callback(keys[k].second, &block);
+			}
+			for (; k < end && keys[k].first == key; k++) {
+				const char *data = (const char *)
+					sqlite3_column_blob(m_stmt_read_range, 1);
+				size_t len = sqlite3_column_bytes(m_stmt_read_range, 1);
+				block = data ? std::string(data, len) : "";
+				callback(keys[k].second, &block);
+			}
+		}
+		sqlite3_reset(m_stmt_read_range);
+
+		for (; k < end; k++) {
+			block.clear();
+			callback(keys[k].second, &block);
+		}
+		i = end;
+	}
+}
+
 void MapDatabaseSQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	verifyDatabase();
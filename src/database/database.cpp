@@ -56,6 +56,17 @@ s64 MapDatabase::getBlockAsInteger(const v3s16 &pos)
 }
 
 
+void MapDatabase::loadBlocks(const std::vector<v3s16> &positions,
+	const LoadBlockCallback &callback)
+{
+	for (const v3s16 &pos : positions) {
+		std::string block;
+		loadBlock(pos, &block);
+		callback(pos, &block);
+	}
+}
+
+
 v3s16 MapDatabase::getIntegerAsBlock(s64 i)
 {
 	v3s16 pos;
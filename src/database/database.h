@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
+#include <functional>
 #include <set>
 #include <string>
 #include <vector>
@@ -43,6 +44,15 @@ class MapDatabase : public Database
 	virtual void loadBlock(const v3s16 &pos, std::string *block) = 0;
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
+	typedef std::function<void(const v3s16 &pos, std::string *block)>
+		LoadBlockCallback;
+	// Loads many blocks at once, calling callback for every position with
+	// the block data (empty if not stored). The order is unspecified.
+	// Backends should override this if they can do better than one
+	// loadBlock() per position.
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+		const LoadBlockCallback &callback);
+
 	static s64 getBlockAsInteger(const v3s16 &pos);
 	static v3s16 getIntegerAsBlock(s64 i);
 
@@ -21,12 +21,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "emerge.h"
 
+#include <algorithm>
 #include <iostream>
-#include <queue>
 
 #include "util/container.h"
 #include "util/thread.h"
-#include "threading/event.h"
+#include "threading/workerpool.h"
 
 #include "config.h"
 #include "constants.h"
@@ -34,6 +34,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include "map.h"
 #include "mapblock.h"
+#include "nameidmapping.h"
 #include "mapgen/mg_biome.h"
 #include "mapgen/mg_ore.h"
 #include "mapgen/mg_decoration.h"
@@ -55,12 +56,6 @@ class EmergeThread : public Thread {
 	~EmergeThread() = default;
 
 	void *run();
-	void signal();
-
-	// Requires queue mutex held
-	bool pushBlock(const v3s16 &pos);
-
-	void cancelPendingItems();
 
 	static void runCompletionCallbacks(
 		const v3s16 &pos, EmergeAction action,
@@ -72,13 +67,17 @@ class EmergeThread : public Thread {
 	EmergeManager *m_emerge;
 	Mapgen *m_mapgen;
 
-	Event m_queue_event;
-	std::queue<v3s16> m_block_queue;
+	// Stored data of the blocks of the mapchunk last loaded from
+	std::map<v3s16, std::string> m_prefetched;
+	// For ServerMap::isPrefetchValid(), 0 if there is no prefetch
+	u32 m_prefetch_id = 0;
 
 	bool popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata);
 
 	EmergeAction getBlockOrStartGen(
 		const v3s16 &pos, bool allow_gen, MapBlock **block, BlockMakeData *data);
+	MapBlock *loadBlockUnlocked(v3s16 pos, MutexAutoLock &envlock);
+	std::string *getPrefetchedBlob(v3s16 pos);
 	MapBlock *finishGen(v3s16 pos, BlockMakeData *bmdata,
 		std::map<v3s16, MapBlock *> *modified_blocks);
 
@@ -154,21 +153,27 @@ EmergeManager::EmergeManager(Server *server)
 		m_threads.push_back(new EmergeThread(server, i));
 
 	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
+
+	// If unspecified, use the processors the other emerge threads leave
+	// over. Only one emerge thread at a time gets help from the pool; the
+	// others generate their chunks alone meanwhile.
+	s16 chunk_threads = 0;
+	if (!g_settings->getS16NoEx("mapgen_chunk_threads", chunk_threads) ||
+			chunk_threads < 1)
+		chunk_threads = rangelim(
+			(s16)Thread::getNumberOfProcessors() - nthreads, 1, 8);
+	mapgen_pool = new WorkerPool(chunk_threads, "MapgenWorker");
+	infostream << "EmergeManager: using " << chunk_threads
+		<< " threads per mapchunk" << std::endl;
 }
 
 
 EmergeManager::~EmergeManager()
 {
-	for (u32 i = 0; i != m_threads.size(); i++) {
-		EmergeThread *thread = m_threads[i];
-
-		if (m_threads_active) {
-			thread->stop();
-			thread->signal();
-			thread->wait();
-		}
+	stopThreads();
 
-		delete thread;
+	for (u32 i = 0; i != m_threads.size(); i++) {
+		delete m_threads[i];
 
 		// Mapgen init might not be finished if there is an error during startup.
 		if (m_mapgens.size() > i)
@@ -179,6 +184,7 @@ EmergeManager::~EmergeManager()
 	delete oremgr;
 	delete decomgr;
 	delete schemmgr;
+	delete mapgen_pool;
 }
 
 
@@ -217,6 +223,12 @@ void EmergeManager::startThreads()
 	if (m_threads_active)
 		return;
 
+	// Threads that were stopped may have taken the posts of queued items
+	{
+		MutexAutoLock queuelock(m_queue_mutex);
+		m_queue_semaphore.post(m_queue.size());
+	}
+
 	for (u32 i = 0; i != m_threads.size(); i++)
 		m_threads[i]->start();
 
@@ -229,11 +241,11 @@ void EmergeManager::stopThreads()
 	if (!m_threads_active)
 		return;
 
-	// Request thread stop in parallel
-	for (u32 i = 0; i != m_threads.size(); i++) {
+	// Request thread stop in parallel, then wake all of them up. Items
+	// left in the queue stay there until the threads are started again.
+	for (u32 i = 0; i != m_threads.size(); i++)
 		m_threads[i]->stop();
-		m_threads[i]->signal();
-	}
+	m_queue_semaphore.post(m_threads.size());
 
 	// Then do the waiting for each
 	for (u32 i = 0; i != m_threads.size(); i++)
@@ -272,7 +284,6 @@ bool EmergeManager::enqueueBlockEmergeEx(
 	EmergeCompletionCallback callback,
 	void *callback_param)
 {
-	EmergeThread *thread = NULL;
 	bool entry_already_exists = false;
 
 	{
@@ -284,17 +295,70 @@ bool EmergeManager::enqueueBlockEmergeEx(
 
 		if (entry_already_exists)
 			return true;
-
-		thread = getOptimalThread();
-		thread->pushBlock(blockpos);
 	}
 
-	thread->signal();
+	m_queue_semaphore.post();
 
 	return true;
 }
 
 
+void EmergeManager::cancelBlockEmerges(session_t peer_id, v3s16 center,
+	s16 range)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	auto it = m_blocks_enqueued.begin();
+	while (it != m_blocks_enqueued.end()) {
+		BlockEmergeData &bedata = it->second;
+		v3s16 d = it->first - center;
+		if (range >= 0 && std::abs(d.X) <= range && std::abs(d.Y) <= range &&
+				std::abs(d.Z) <= range) {
+			++it;
+			continue;
+		}
+
+		auto peer = std::find(bedata.peers.begin(), bedata.peers.end(), peer_id);
+		if (peer == bedata.peers.end()) {
+			++it;
+			continue;
+		}
+		bedata.peers.erase(peer);
+
+		// Callbacks are never left without an answer
+		if (!bedata.peers.empty() || !bedata.callbacks.empty()) {
+			++it;
+			continue;
+		}
+
+		// Its item in m_queue is skipped
+		u16 &count_peer = m_peer_queue_count[bedata.peer_requested];
+		assert(count_peer != 0);
+		count_peer--;
+
+		it = m_blocks_enqueued.erase(it);
+	}
+}
+
+
+void EmergeManager::updatePriorities(
+	const std::unordered_map<session_t, v3s16> &positions)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	m_peer_positions = positions;
+
+	// Rebuilding drops the items of cancelled blocks as well
+	m_queue.clear();
+	for (auto &it : m_blocks_enqueued) {
+		BlockEmergeData &bedata = it.second;
+		bedata.priority = getPriority(it.first, bedata.peers);
+		m_queue.push_back({bedata.priority, bedata.seq, it.first});
+	}
+	std::make_heap(m_queue.begin(), m_queue.end());
+}
+
+
 //
 // Mapgen-related helper functions
 //
@@ -385,11 +449,20 @@ bool EmergeManager::pushBlockEmergeData(
 	if (callback)
 		bedata.callbacks.emplace_back(callback, callback_param);
 
+	if (std::find(bedata.peers.begin(), bedata.peers.end(), peer_requested) ==
+			bedata.peers.end())
+		bedata.peers.push_back(peer_requested);
+
 	if (*entry_already_exists) {
 		bedata.flags |= flags;
 	} else {
 		bedata.flags = flags;
 		bedata.peer_requested = peer_requested;
+		bedata.priority = getPriority(pos, bedata.peers);
+		bedata.seq = m_queue_seq++;
+
+		m_queue.push_back({bedata.priority, bedata.seq, pos});
+		std::push_heap(m_queue.begin(), m_queue.end());
 
 		count_peer++;
 	}
@@ -398,15 +471,27 @@ bool EmergeManager::pushBlockEmergeData(
 }
 
 
-bool EmergeManager::popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata)
+bool EmergeManager::popBlockEmergeData(v3s16 *pos, BlockEmergeData *bedata)
 {
 	std::map<v3s16, BlockEmergeData>::iterator it;
 	std::unordered_map<u16, u16>::iterator it2;
 
-	it = m_blocks_enqueued.find(pos);
-	if (it == m_blocks_enqueued.end())
-		return false;
+	for (;;) {
+		if (m_queue.empty())
+			return false;
 
+		std::pop_heap(m_queue.begin(), m_queue.end());
+		EmergeQueueItem item = m_queue.back();
+		m_queue.pop_back();
+
+		// Skip the items of cancelled blocks, and old items of blocks
+		// which were enqueued again
+		it = m_blocks_enqueued.find(item.pos);
+		if (it != m_blocks_enqueued.end() && it->second.seq == item.seq)
+			break;
+	}
+
+	*pos = it->first;
 	*bedata = it->second;
 
 	it2 = m_peer_queue_count.find(bedata->peer_requested);
@@ -423,24 +508,30 @@ bool EmergeManager::popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata)
 }
 
 
-EmergeThread *EmergeManager::getOptimalThread()
+u32 EmergeManager::getPriority(v3s16 pos, const std::vector<session_t> &peers)
 {
-	size_t nthreads = m_threads.size();
-
-	FATAL_ERROR_IF(nthreads == 0, "No emerge threads!");
-
-	size_t index = 0;
-	size_t nitems_lowest = m_threads[0]->m_block_queue.size();
-
-	for (size_t i = 1; i < nthreads; i++) {
-		size_t nitems = m_threads[i]->m_block_queue.size();
-		if (nitems < nitems_lowest) {
-			index = i;
-			nitems_lowest = nitems;
+	// Without known players the blocks are emerged in the requested order
+	u32 priority = U32_MAX;
+
+	auto update = [&] (v3s16 player_pos) {
+		v3s32 d = v3s32(pos.X, pos.Y, pos.Z) -
+			v3s32(player_pos.X, player_pos.Y, player_pos.Z);
+		priority = std::min(priority, (u32)(d.X * d.X + d.Y * d.Y + d.Z * d.Z));
+	};
+
+	for (session_t peer_id : peers) {
+		if (peer_id == PEER_ID_INEXISTENT) {
+			// The server's own requests go by the nearest of all players
+			for (const auto &it : m_peer_positions)
+				update(it.second);
+		} else {
+			auto it = m_peer_positions.find(peer_id);
+			if (it != m_peer_positions.end())
+				update(it->second);
 		}
 	}
 
-	return m_threads[index];
+	return priority;
 }
 
 
@@ -460,37 +551,6 @@ EmergeThread::EmergeThread(Server *server, int ethreadid) :
 }
 
 
-void EmergeThread::signal()
-{
-	m_queue_event.signal();
-}
-
-
-bool EmergeThread::pushBlock(const v3s16 &pos)
-{
-	m_block_queue.push(pos);
-	return true;
-}
-
-
-void EmergeThread::cancelPendingItems()
-{
-	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
-
-	while (!m_block_queue.empty()) {
-		BlockEmergeData bedata;
-		v3s16 pos;
-
-		pos = m_block_queue.front();
-		m_block_queue.pop();
-
-		m_emerge->popBlockEmergeData(pos, &bedata);
-
-		runCompletionCallbacks(pos, EMERGE_CANCELLED, bedata.callbacks);
-	}
-}
-
-
 void EmergeThread::runCompletionCallbacks(const v3s16 &pos, EmergeAction action,
 	const EmergeCallbackList &callbacks)
 {
@@ -510,15 +570,7 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 {
 	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
 
-	if (m_block_queue.empty())
-		return false;
-
-	*pos = m_block_queue.front();
-	m_block_queue.pop();
-
-	m_emerge->popBlockEmergeData(*pos, bedata);
-
-	return true;
+	return m_emerge->popBlockEmergeData(pos, bedata);
 }
 
 
@@ -534,7 +586,10 @@ EmergeAction EmergeThread::getBlockOrStartGen(
 			return EMERGE_FROM_MEMORY;
 	} else {
 		// 2). Attempt to load block from disk if it was not in the memory
-		*block = m_map->loadBlock(pos);
+		if (*block) // Dummy block, load into it
+			*block = m_map->loadBlock(pos);
+		else
+			*block = loadBlockUnlocked(pos, envlock);
 		if (*block && (*block)->isGenerated())
 			return EMERGE_FROM_DISK;
 	}
@@ -548,6 +603,67 @@ EmergeAction EmergeThread::getBlockOrStartGen(
 }
 
 
+MapBlock *EmergeThread::loadBlockUnlocked(v3s16 pos, MutexAutoLock &envlock)
+{
+	MapBlock *block = NULL;
+	NameIdMapping nimap;
+
+	// Read and deserialize the block while the server thread keeps running
+	m_map->startDetachedLoad(pos);
+	envlock.unlock();
+	bool loaded;
+	{
+		ScopeProfiler sp(g_profiler,
+			"EmergeThread: load block without envlock", SPT_AVG);
+		loaded = m_map->loadBlockDetached(pos, &block, &nimap,
+			getPrefetchedBlob(pos));
+		m_prefetched.erase(pos);
+	}
+	envlock.lock();
+
+	if (m_map->finishDetachedLoad(pos, &block, nimap) && (loaded || block))
+		return block;
+
+	// Legacy storage, invalid data or the block was saved in the meantime
+	return m_map->loadBlock(pos);
+}
+
+
+std::string *EmergeThread::getPrefetchedBlob(v3s16 pos)
+{
+	auto it = m_prefetched.find(pos);
+	if (it != m_prefetched.end()) {
+		// A block written since is read from the database again
+		if (m_map->isPrefetchValid(m_prefetch_id, pos))
+			return &it->second;
+		m_prefetched.erase(it);
+		return nullptr;
+	}
+
+	// Fetch the whole mapchunk at once; when one of its blocks is needed
+	// the others usually follow, and networked databases are slow per
+	// request
+	ScopeProfiler sp(g_profiler, "EmergeThread: prefetch mapchunk", SPT_AVG);
+	s16 chunksize = m_emerge->mgparams->chunksize;
+	v3s16 chunkpos = m_emerge->getContainingChunk(pos);
+	std::vector<v3s16> positions;
+	positions.reserve(chunksize * chunksize * chunksize);
+	v3s16 p;
+	for (p.Z = chunkpos.Z; p.Z < chunkpos.Z + chunksize; p.Z++)
+	for (p.Y = chunkpos.Y; p.Y < chunkpos.Y + chunksize; p.Y++)
+	for (p.X = chunkpos.X; p.X < chunkpos.X + chunksize; p.X++)
+		positions.push_back(p);
+
+	if (m_prefetch_id != 0)
+		m_map->endPrefetch(m_prefetch_id);
+	m_prefetched.clear();
+	m_prefetch_id = m_map->prefetchBlocks(positions, m_prefetched);
+
+	it = m_prefetched.find(pos);
+	return it != m_prefetched.end() ? &it->second : nullptr;
+}
+
+
 MapBlock *EmergeThread::finishGen(v3s16 pos, BlockMakeData *bmdata,
 	std::map<v3s16, MapBlock *> *modified_blocks)
 {
@@ -624,10 +740,11 @@ void *EmergeThread::run()
 		EmergeAction action;
 		MapBlock *block;
 
-		if (!popBlockEmerge(&pos, &bedata)) {
-			m_queue_event.wait();
+		// One post per pushed item, so that no item is left waiting while
+		// a thread is idle
+		m_emerge->m_queue_semaphore.wait();
+		if (stopRequested() || !popBlockEmerge(&pos, &bedata))
 			continue;
-		}
 
 		if (blockpos_over_max_limit(pos))
 			continue;
@@ -648,6 +765,13 @@ void *EmergeThread::run()
 					t.stop(true); // Hide output
 			}
 
+			// Every phase is recorded, so that the averages are per chunk
+			for (int i = 0; i != MGPHASE_COUNT; i++) {
+				g_profiler->avg(std::string("Mapgen: ") + mapgen_phase_names[i],
+					m_mapgen->phase_times[i] / 1000.0f);
+				m_mapgen->phase_times[i] = 0;
+			}
+
 			block = finishGen(pos, &bmdata, &modified_blocks);
 		}
 
@@ -679,6 +803,9 @@ void *EmergeThread::run()
 		m_server->setAsyncFatalError(err.str());
 	}
 
+	if (m_prefetch_id != 0)
+		m_map->endPrefetch(m_prefetch_id);
+
 	END_DEBUG_EXCEPTION_HANDLER
 	return NULL;
 }
@@ -21,11 +21,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <map>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 #include "network/networkprotocol.h"
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "mapgen/mapgen.h" // for MapgenParams
 #include "map.h"
+#include "threading/semaphore.h"
 
 #define BLOCK_EMERGE_ALLOW_GEN   (1 << 0)
 #define BLOCK_EMERGE_FORCE_QUEUE (1 << 1)
@@ -44,6 +47,7 @@ class OreManager;
 class DecorationManager;
 class SchematicManager;
 class Server;
+class WorkerPool;
 
 // Structure containing inputs/outputs for chunk generation
 struct BlockMakeData {
@@ -84,6 +88,26 @@ struct BlockEmergeData {
 	u16 peer_requested;
 	u16 flags;
 	EmergeCallbackList callbacks;
+	// Peers waiting for the block, PEER_ID_INEXISTENT for the server itself
+	std::vector<session_t> peers;
+	// Squared distance in blocks to the nearest player of the peers
+	u32 priority;
+	// Order of the requests, among blocks of the same priority
+	u64 seq;
+};
+
+struct EmergeQueueItem {
+	u32 priority;
+	u64 seq;
+	v3s16 pos;
+
+	// The heap puts the greatest item on top, which is the one to emerge next
+	bool operator<(const EmergeQueueItem &other) const
+	{
+		if (priority != other.priority)
+			return priority > other.priority;
+		return seq > other.seq;
+	}
 };
 
 class EmergeManager {
@@ -112,6 +136,9 @@ class EmergeManager {
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	// Threads shared by the mapgens to split up the generation of a chunk
+	WorkerPool *mapgen_pool;
+
 	// Methods
 	EmergeManager(Server *server);
 	~EmergeManager();
@@ -136,6 +163,19 @@ class EmergeManager {
 		EmergeCompletionCallback callback,
 		void *callback_param);
 
+	/*
+		Takes the interest of the peer from the blocks it requested which are
+		more than range blocks away from center on any axis, or from all of
+		them if range is negative. Blocks nobody waits for any longer are
+		removed from the queue.
+	*/
+	void cancelBlockEmerges(session_t peer_id, v3s16 center = v3s16(0, 0, 0),
+		s16 range = -1);
+
+	// Sets the block positions of the players by peer and reorders the
+	// queue so that the blocks nearest to them are emerged first
+	void updatePriorities(const std::unordered_map<session_t, v3s16> &positions);
+
 	v3s16 getContainingChunk(v3s16 blockpos);
 
 	Mapgen *getCurrentMapgen();
@@ -155,13 +195,20 @@ class EmergeManager {
 	std::mutex m_queue_mutex;
 	std::map<v3s16, BlockEmergeData> m_blocks_enqueued;
 	std::unordered_map<u16, u16> m_peer_queue_count;
+	// Heap shared by the threads, each takes the next block when it is
+	// idle. Still holds the items of cancelled blocks, they are skipped.
+	std::vector<EmergeQueueItem> m_queue;
+	u64 m_queue_seq = 0;
+	// Posted once per item pushed to m_queue
+	Semaphore m_queue_semaphore;
+	std::unordered_map<session_t, v3s16> m_peer_positions;
 
 	u16 m_qlimit_total;
 	u16 m_qlimit_diskonly;
 	u16 m_qlimit_generate;
 
 	// Requires m_queue_mutex held
-	EmergeThread *getOptimalThread();
+	u32 getPriority(v3s16 pos, const std::vector<session_t> &peers);
 
 	bool pushBlockEmergeData(
 		v3s16 pos,
@@ -171,7 +218,8 @@ class EmergeManager {
 		void *callback_param,
 		bool *entry_already_exists);
 
-	bool popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata);
+	bool popBlockEmergeData(v3s16 *pos, BlockEmergeData *bedata);
 
 	friend class EmergeThread;
+	friend class TestEmerge;
 };
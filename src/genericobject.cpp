@@ -18,7 +18,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 */
 
 #include "genericobject.h"
+#include <cmath>
 #include <sstream>
+#include "util/numeric.h"
 #include "util/serialize.h"
 
 std::string gob_cmd_set_properties(const ObjectProperties &prop)
@@ -65,6 +67,140 @@ std::string gob_cmd_update_position(
 	return os.str();
 }
 
+static void write_update_position(std::ostream &os, const GenericPosition &pos)
+{
+	writeV3F1000(os, pos.position);
+	writeV3F1000(os, pos.velocity);
+	writeV3F1000(os, pos.acceleration);
+	writeF1000(os, pos.yaw);
+	writeU8(os, pos.do_interpolate);
+	writeU8(os, pos.is_movement_end);
+	writeF1000(os, pos.update_interval);
+}
+
+GenericPosition gob_read_update_position(std::istream &is)
+{
+	GenericPosition pos;
+	pos.position = readV3F1000(is);
+	pos.velocity = readV3F1000(is);
+	pos.acceleration = readV3F1000(is);
+	pos.yaw = readF1000(is);
+	pos.do_interpolate = readU8(is);
+	pos.is_movement_end = readU8(is);
+	pos.update_interval = readF1000(is);
+	return pos;
+}
+
+std::string gob_cmd_update_position_reference(
+		const GenericPositionReference &ref)
+{
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_REFERENCE);
+	// parameters
+	writeU8(os, ref.number);
+	write_update_position(os, ref.pos);
+	return os.str();
+}
+
+GenericPositionReference gob_read_update_position_reference(std::istream &is)
+{
+	GenericPositionReference ref;
+	ref.number = readU8(is);
+	ref.pos = gob_read_update_position(is);
+	return ref;
+}
+
+// Steps per unit of the quantized parts of the delta updates
+#define POSITION_DELTA_STEPS 32.0f
+#define VELOCITY_STEPS 16.0f
+#define YAW_STEPS (65536.0f / 360.0f)
+
+enum PositionDeltaFlags {
+	POSITION_DELTA_INTERPOLATE = 0x01,
+	POSITION_DELTA_MOVEMENT_END = 0x02,
+	POSITION_DELTA_VELOCITY = 0x04,
+	POSITION_DELTA_ACCELERATION = 0x08,
+	POSITION_DELTA_YAW = 0x10,
+};
+
+static bool quantize(v3f v, float steps, v3s16 *result)
+{
+	v *= steps;
+	if (std::fabs(v.X) > S16_MAX || std::fabs(v.Y) > S16_MAX ||
+			std::fabs(v.Z) > S16_MAX)
+		return false;
+	*result = v3s16(myround(v.X), myround(v.Y), myround(v.Z));
+	return true;
+}
+
+std::string gob_cmd_update_position_delta(const GenericPositionReference &ref,
+		const GenericPosition &pos)
+{
+	u8 flags = 0;
+	if (pos.do_interpolate)
+		flags |= POSITION_DELTA_INTERPOLATE;
+	if (pos.is_movement_end)
+		flags |= POSITION_DELTA_MOVEMENT_END;
+
+	v3s16 position, velocity, acceleration;
+	if (!quantize(pos.position - ref.pos.position, POSITION_DELTA_STEPS,
+			&position))
+		return "";
+	if (pos.velocity != ref.pos.velocity) {
+		if (!quantize(pos.velocity, VELOCITY_STEPS, &velocity))
+			return "";
+		flags |= POSITION_DELTA_VELOCITY;
+	}
+	if (pos.acceleration != ref.pos.acceleration) {
+		if (!quantize(pos.acceleration, VELOCITY_STEPS, &acceleration))
+			return "";
+		flags |= POSITION_DELTA_ACCELERATION;
+	}
+	if (pos.yaw != ref.pos.yaw)
+		flags |= POSITION_DELTA_YAW;
+	if (pos.update_interval < 0.0f || pos.update_interval * 1000.0f > U16_MAX)
+		return "";
+
+	std::ostringstream os(std::ios::binary);
+	// command
+	writeU8(os, GENERIC_CMD_UPDATE_POSITION_DELTA);
+	// parameters
+	writeU8(os, ref.number);
+	writeU8(os, flags);
+	writeV3S16(os, position);
+	if (flags & POSITION_DELTA_VELOCITY)
+		writeV3S16(os, velocity);
+	if (flags & POSITION_DELTA_ACCELERATION)
+		writeV3S16(os, acceleration);
+	if (flags & POSITION_DELTA_YAW)
+		writeU16(os, myround(wrapDegrees_0_360(pos.yaw) * YAW_STEPS) & 0xFFFF);
+	// update_interval in milliseconds
+	writeU16(os, myround(pos.update_interval * 1000.0f));
+	return os.str();
+}
+
+bool gob_read_update_position_delta(std::istream &is,
+		const GenericPositionReference &ref, GenericPosition &pos)
+{
+	if (readU8(is) != ref.number)
+		return false;
+
+	u8 flags = readU8(is);
+	pos.do_interpolate = flags & POSITION_DELTA_INTERPOLATE;
+	pos.is_movement_end = flags & POSITION_DELTA_MOVEMENT_END;
+	pos.position = ref.pos.position +
+		intToFloat(readV3S16(is), 1.0f / POSITION_DELTA_STEPS);
+	pos.velocity = (flags & POSITION_DELTA_VELOCITY) ?
+		intToFloat(readV3S16(is), 1.0f / VELOCITY_STEPS) : ref.pos.velocity;
+	pos.acceleration = (flags & POSITION_DELTA_ACCELERATION) ?
+		intToFloat(readV3S16(is), 1.0f / VELOCITY_STEPS) : ref.pos.acceleration;
+	pos.yaw = (flags & POSITION_DELTA_YAW) ?
+		readU16(is) / YAW_STEPS : ref.pos.yaw;
+	pos.update_interval = readU16(is) / 1000.0f;
+	return true;
+}
+
 std::string gob_cmd_set_texture_mod(const std::string &mod)
 {
 	std::ostringstream os(std::ios::binary);
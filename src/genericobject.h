@@ -37,7 +37,9 @@ enum GenericCMD {
 	GENERIC_CMD_SET_PHYSICS_OVERRIDE,
 	GENERIC_CMD_UPDATE_NAMETAG_ATTRIBUTES,
 	GENERIC_CMD_SPAWN_INFANT,
-	GENERIC_CMD_SET_ANIMATION_SPEED
+	GENERIC_CMD_SET_ANIMATION_SPEED,
+	GENERIC_CMD_UPDATE_POSITION_REFERENCE,
+	GENERIC_CMD_UPDATE_POSITION_DELTA
 };
 
 #include "object_properties.h"
@@ -54,6 +56,45 @@ std::string gob_cmd_update_position(
 	f32 update_interval
 );
 
+// Parameters of GENERIC_CMD_UPDATE_POSITION
+struct GenericPosition
+{
+	v3f position;
+	v3f velocity;
+	v3f acceleration;
+	f32 yaw = 0.0f;
+	bool do_interpolate = false;
+	bool is_movement_end = false;
+	f32 update_interval = 0.0f;
+};
+
+// Reads the parameters after the command byte
+GenericPosition gob_read_update_position(std::istream &is);
+
+/*
+	Compact position updates, since protocol version 38.
+	A full update is sent reliably as the reference of the object; the
+	following updates are sent unreliably, as quantized differences to
+	it and without the parts that didn't change. The references are
+	numbered, updates that belong to another one are dropped.
+*/
+struct GenericPositionReference
+{
+	u8 number = 0;
+	GenericPosition pos;
+};
+
+std::string gob_cmd_update_position_reference(
+		const GenericPositionReference &ref);
+GenericPositionReference gob_read_update_position_reference(std::istream &is);
+
+// Returns an empty string if pos is too far off the reference
+std::string gob_cmd_update_position_delta(const GenericPositionReference &ref,
+		const GenericPosition &pos);
+// Returns false if the update was made for another reference
+bool gob_read_update_position_delta(std::istream &is,
+		const GenericPositionReference &ref, GenericPosition &pos);
+
 std::string gob_cmd_set_texture_mod(const std::string &mod);
 
 std::string gob_cmd_set_sprite(
@@ -33,10 +33,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "httpfetch.h"
 #include "gameparams.h"
 #include "database/database.h"
+#include "mapblock.h"
+#include "map.h"
+#include "emerge.h"
+#include "mapgen/mapgen.h"
+#include "convert_json.h"
+#include "profiler.h"
 #include "config.h"
 #include "player.h"
 #include "porting.h"
 #include "network/socket.h"
+#include "util/numeric.h"
+#include <algorithm>
+#include <atomic>
 #if USE_CURSES
 	#include "terminal_chat_console.h"
 #endif
@@ -101,6 +110,10 @@ static bool determine_subgame(GameParams *game_params);
 
 static bool run_dedicated_server(const GameParams &game_params, const Settings &cmd_args);
 static bool migrate_map_database(const GameParams &game_params, const Settings &cmd_args);
+static bool migrate_map_compression(const GameParams &game_params, const Settings &cmd_args);
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args,
+		const Address &bind_addr);
+static bool run_mapgen_benchmark(const Settings &cmd_args);
 
 /**********************************************************************/
 
@@ -185,6 +198,9 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	if (cmd_args.exists("mapgen-benchmark"))
+		return run_mapgen_benchmark(cmd_args) ? 0 : 1;
+
 	GameParams game_params;
 #ifdef SERVER
 	porting::attachOrCreateConsole();
@@ -291,6 +307,12 @@ static void set_allowed_options(OptionList *allowed_options)
 		_("Migrate from current players backend to another (Only works when using minetestserver or with --server)"))));
 	allowed_options->insert(std::make_pair("migrate-auth", ValueSpec(VALUETYPE_STRING,
 		_("Migrate from current auth backend to another (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("migrate-compression", ValueSpec(VALUETYPE_STRING,
+		_("Recompress the map with zlib, zstd, lz4 or zstd_dict (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("pregenerate", ValueSpec(VALUETYPE_STRING,
+		_("Generate the map in the area x1,y1,z1:x2,y2,z2 and exit (Only works when using minetestserver or with --server)"))));
+	allowed_options->insert(std::make_pair("mapgen-benchmark", ValueSpec(VALUETYPE_STRING,
+		_("Generate the given number of chunks with every mapgen, print the time of each phase as JSON and exit"))));
 	allowed_options->insert(std::make_pair("terminal", ValueSpec(VALUETYPE_FLAG,
 			_("Feature an interactive terminal (Only works when using minetestserver or with --server)"))));
 #ifndef SERVER
@@ -842,6 +864,12 @@ static bool run_dedicated_server(const GameParams &game_params, const Settings &
 	if (cmd_args.exists("migrate-auth"))
 		return ServerEnvironment::migrateAuthDatabase(game_params, cmd_args);
 
+	if (cmd_args.exists("migrate-compression"))
+		return migrate_map_compression(game_params, cmd_args);
+
+	if (cmd_args.exists("pregenerate"))
+		return pregenerate_map(game_params, cmd_args, bind_addr);
+
 	if (cmd_args.exists("terminal")) {
 #if USE_CURSES
 		bool name_ok = true;
@@ -993,3 +1021,507 @@ static bool migrate_map_database(const GameParams &game_params, const Settings &
 
 	return true;
 }
+
+static bool train_map_compression_dictionary(MapDatabase *db,
+	const std::vector<v3s16> &blocks, const std::string &path)
+{
+	// Node data of a few thousand blocks spread over the whole map
+	const size_t max_samples = 4000;
+	size_t step = MYMAX(blocks.size() / max_samples, 1);
+
+	std::vector<std::string> samples;
+	for (size_t i = 0; i < blocks.size(); i += step) {
+		std::string data, recompressed, bulk_data;
+		db->loadBlock(blocks[i], &data);
+		try {
+			if (!data.empty() && MapBlock::recompressBlob(data,
+					BLOCK_COMPRESSION_ZLIB, &recompressed, &bulk_data))
+				samples.push_back(bulk_data);
+		} catch (SerializationError &e) {
+			continue;
+		}
+	}
+
+	actionstream << "Training the map compression dictionary with "
+		<< samples.size() << " blocks" << std::endl;
+	std::string dict = trainBlockCompressionDictionary(samples, 112 * 1024);
+	if (dict.empty()) {
+		errorstream << "Failed to train the map compression dictionary"
+			<< std::endl;
+		return false;
+	}
+	if (!fs::safeWriteToFile(path, dict)) {
+		errorstream << "Failed to write " << path << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static bool migrate_map_compression(const GameParams &game_params, const Settings &cmd_args)
+{
+	std::string migrate_to = cmd_args.get("migrate-compression");
+	Settings world_mt;
+	std::string world_mt_path = game_params.world_path + DIR_DELIM + "world.mt";
+	if (!world_mt.readConfigFile(world_mt_path.c_str())) {
+		errorstream << "Cannot read world.mt!" << std::endl;
+		return false;
+	}
+
+	if (!world_mt.exists("backend")) {
+		errorstream << "Please specify your current backend in world.mt:"
+			<< std::endl
+			<< "	backend = {sqlite3|leveldb|redis|dummy|postgresql}"
+			<< std::endl;
+		return false;
+	}
+
+	u8 compression;
+	if (!parseBlockCompressionName(migrate_to, &compression)) {
+		errorstream << "Unknown map compression \"" << migrate_to << "\""
+			<< std::endl;
+		return false;
+	}
+
+	MapDatabase *db = ServerMap::createDatabase(world_mt.get("backend"),
+		game_params.world_path, world_mt);
+	std::vector<v3s16> blocks;
+	db->listAllLoadableBlocks(blocks);
+
+	// An existing dictionary is kept, blocks may still depend on it
+	std::string dict_path =
+		ServerMap::getCompressionDictionaryPath(game_params.world_path);
+	if (compression == BLOCK_COMPRESSION_ZSTD_DICT &&
+			!fs::PathExists(dict_path) &&
+			!train_map_compression_dictionary(db, blocks, dict_path)) {
+		delete db;
+		return false;
+	}
+
+	ServerMap::loadCompressionSettings(game_params.world_path, world_mt, db);
+	if (!isBlockCompressionSupported(compression)) {
+		errorstream << "Map compression \"" << migrate_to
+			<< "\" is not supported by this build" << std::endl;
+		delete db;
+		return false;
+	}
+
+	u32 count = 0, skipped = 0;
+	time_t last_update_time = 0;
+	bool &kill = *porting::signal_handler_killstatus();
+
+	db->beginSave();
+	for (const v3s16 &pos : blocks) {
+		if (kill) {
+			db->endSave();
+			delete db;
+			return false;
+		}
+
+		std::string data, recompressed;
+		db->loadBlock(pos, &data);
+		try {
+			if (!data.empty() &&
+					MapBlock::recompressBlob(data, compression, &recompressed))
+				db->saveBlock(pos, recompressed);
+			else
+				skipped++;
+		} catch (SerializationError &e) {
+			errorstream << "Failed to recompress block " << PP(pos)
+				<< ", skipping it: " << e.what() << std::endl;
+			skipped++;
+		}
+		if (++count % 0xFF == 0 && time(NULL) - last_update_time >= 1) {
+			std::cerr << " Recompressed " << count << " blocks, "
+				<< (100.0 * count / blocks.size()) << "% completed.\r";
+			db->endSave();
+			db->beginSave();
+			last_update_time = time(NULL);
+		}
+	}
+	std::cerr << std::endl;
+	db->endSave();
+	delete db;
+
+	actionstream << "Successfully recompressed " << (count - skipped)
+		<< " blocks, " << skipped << " were left as they are" << std::endl;
+	world_mt.set("map_compression", migrate_to);
+	if (!world_mt.updateConfigFile(world_mt_path.c_str()))
+		errorstream << "Failed to update world.mt!" << std::endl;
+	else
+		actionstream << "world.mt updated" << std::endl;
+
+	return true;
+}
+
+// Chunks emerged at once, the map is saved and unloaded after each batch
+#define PREGENERATE_BATCH_SIZE 256
+
+struct PregenerateState
+{
+	std::atomic<u32> finished;
+	std::atomic<u32> errors;
+	std::atomic<u32> skipped;
+};
+
+static void pregenerate_callback(v3s16 blockpos, EmergeAction action, void *param)
+{
+	PregenerateState *state = (PregenerateState *)param;
+	if (action == EMERGE_CANCELLED) {
+		// Requests cancelled at shutdown are left for the next run
+		if (*porting::signal_handler_killstatus())
+			return;
+		// The map refuses chunks whose borders cross the mapgen limit
+		state->skipped++;
+	} else if (action == EMERGE_ERRORED) {
+		state->errors++;
+	}
+	state->finished++;
+}
+
+static bool pregenerate_map(const GameParams &game_params, const Settings &cmd_args,
+		const Address &bind_addr)
+{
+	v3s16 minp, maxp;
+	if (sscanf(cmd_args.get("pregenerate").c_str(), "%hd,%hd,%hd:%hd,%hd,%hd",
+			&minp.X, &minp.Y, &minp.Z, &maxp.X, &maxp.Y, &maxp.Z) != 6) {
+		errorstream << "Invalid area \"" << cmd_args.get("pregenerate")
+			<< "\", expected x1,y1,z1:x2,y2,z2" << std::endl;
+		return false;
+	}
+	sortBoxVerticies(minp, maxp);
+
+	std::ostringstream area;
+	area << minp.X << "," << minp.Y << "," << minp.Z << ":"
+		<< maxp.X << "," << maxp.Y << "," << maxp.Z;
+
+	// Outlives the server and with it the emerge threads
+	PregenerateState state;
+	state.finished = 0;
+	state.errors = 0;
+	state.skipped = 0;
+
+	try {
+		// The network is never started
+		Server server(game_params.world_path, game_params.game_spec, false,
+			bind_addr, true);
+		server.init();
+
+		EmergeManager *emerge = server.getEmergeManager();
+		Map &map = server.getMap();
+
+		// Only whole chunks within mapgen_limit can be generated
+		s16 edge_min, edge_max;
+		emerge->mgparams->getMapgenEdges(&edge_min, &edge_max);
+		minp = componentwise_max(minp, v3s16(1, 1, 1) * edge_min);
+		maxp = componentwise_min(maxp, v3s16(1, 1, 1) * edge_max);
+		if (minp.X > maxp.X || minp.Y > maxp.Y || minp.Z > maxp.Z) {
+			errorstream << "The area " << area.str() << " lies outside of "
+				"the mapgen limit" << std::endl;
+			return false;
+		}
+
+		// Visit the chunks along a Hilbert curve, so that the chunks
+		// generated at the same time share their borders and are close
+		// to each other in the database
+		s16 chunksize = emerge->mgparams->chunksize;
+		v3s16 chunk_min = EmergeManager::getContainingChunk(
+			getNodeBlockPos(minp), chunksize);
+		v3s16 chunk_max = EmergeManager::getContainingChunk(
+			getNodeBlockPos(maxp), chunksize);
+		v3s16 extent = (chunk_max - chunk_min) / chunksize + v3s16(1, 1, 1);
+
+		u32 bits = 1;
+		while ((1 << bits) < MYMAX(extent.X, MYMAX(extent.Y, extent.Z)))
+			bits++;
+
+		std::vector<std::pair<u64, v3s16>> chunks;
+		chunks.reserve((size_t)extent.X * extent.Y * extent.Z);
+		for (s16 z = 0; z < extent.Z; z++)
+		for (s16 y = 0; y < extent.Y; y++)
+		for (s16 x = 0; x < extent.X; x++) {
+			chunks.emplace_back(hilbert_index_3d(x, y, z, bits),
+				chunk_min + v3s16(x, y, z) * chunksize);
+		}
+		std::sort(chunks.begin(), chunks.end(),
+			[](const std::pair<u64, v3s16> &a, const std::pair<u64, v3s16> &b) {
+				return a.first < b.first;
+			});
+
+		// Chunks before the checkpoint are in the database
+		std::string checkpoint_path = game_params.world_path + DIR_DELIM
+			+ "pregenerate.txt";
+		Settings checkpoint;
+		size_t next = 0;
+		if (checkpoint.readConfigFile(checkpoint_path.c_str()) &&
+				checkpoint.exists("area") && checkpoint.get("area") == area.str() &&
+				checkpoint.exists("next")) {
+			next = MYMIN(checkpoint.getU64("next"), chunks.size());
+			actionstream << "Resuming the pregeneration at chunk " << next
+				<< " of " << chunks.size() << std::endl;
+		}
+		checkpoint.set("area", area.str());
+
+		actionstream << "Pregenerating " << chunks.size() - next
+			<< " chunks in " << area.str() << std::endl;
+
+		emerge->startThreads();
+
+		bool &kill = *porting::signal_handler_killstatus();
+		size_t first = next;
+		u64 start_time = porting::getTimeMs();
+
+		while (next < chunks.size() && !kill) {
+			size_t batch_end = MYMIN(next + PREGENERATE_BATCH_SIZE, chunks.size());
+			u32 batch_size = batch_end - next;
+			state.finished = 0;
+
+			for (size_t i = next; i < batch_end; i++) {
+				if (!emerge->enqueueBlockEmergeEx(chunks[i].second,
+						PEER_ID_INEXISTENT,
+						BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+						pregenerate_callback, &state)) {
+					state.errors++;
+					state.finished++;
+				}
+			}
+
+			while (state.finished < batch_size && !kill) {
+				// Throws on fatal errors of the emerge threads
+				server.step(0.0f);
+				sleep_ms(10);
+			}
+			if (kill)
+				break;
+
+			// Nothing is being generated now, so no block is unloaded
+			// which a mapgen still writes to. The blocks of the batch are
+			// saved in one transaction.
+			{
+				MutexAutoLock envlock(server.m_env_mutex);
+				map.unloadUnreferencedBlocks();
+			}
+
+			next = batch_end;
+			checkpoint.setU64("next", next);
+			if (!checkpoint.updateConfigFile(checkpoint_path.c_str()))
+				errorstream << "Failed to write " << checkpoint_path << std::endl;
+
+			float seconds = (porting::getTimeMs() - start_time) / 1000.0f;
+			std::cerr << " Generated " << next << " of " << chunks.size()
+				<< " chunks, " << (next - first) / MYMAX(seconds, 0.001f)
+				<< " chunks/s, " << (100.0 * next / chunks.size())
+				<< "% completed.\r";
+		}
+		std::cerr << std::endl;
+
+		// Chunks finished before an interruption are saved as well, they
+		// are loaded from the database when the run is resumed
+		emerge->stopThreads();
+		{
+			MutexAutoLock envlock(server.m_env_mutex);
+			map.unloadUnreferencedBlocks();
+		}
+
+		if (state.errors > 0)
+			errorstream << state.errors << " chunks could not be generated"
+				<< std::endl;
+		if (state.skipped > 0)
+			warningstream << state.skipped << " chunks were skipped because "
+				"they cross the mapgen limit" << std::endl;
+
+		if (next < chunks.size()) {
+			actionstream << "Pregeneration interrupted at chunk " << next
+				<< " of " << chunks.size() << ", run again to resume"
+				<< std::endl;
+			return false;
+		}
+
+		fs::DeleteSingleFileOrEmptyDirectory(checkpoint_path);
+		float seconds = (porting::getTimeMs() - start_time) / 1000.0f;
+		actionstream << "Pregenerated " << chunks.size() - first
+			<< " chunks in " << seconds << "s ("
+			<< (chunks.size() - first) / MYMAX(seconds, 0.001f)
+			<< " chunks/s)" << std::endl;
+	} catch (const ModError &e) {
+		errorstream << "ModError: " << e.what() << std::endl;
+		return false;
+	} catch (const ServerError &e) {
+		errorstream << "ServerError: " << e.what() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// Same for every run, so that the results of different builds can be compared
+#define MAPGEN_BENCHMARK_SEED "7423151925839051489"
+// Chunks of one mapgen, already far more than needed for stable averages
+#define MAPGEN_BENCHMARK_MAX_CHUNKS 10000
+
+static const char *mapgen_benchmark_names[] = {
+	"v5", "v6", "v7", "flat", "fractal", "valleys", "carpathian",
+};
+
+struct MapgenBenchmarkState
+{
+	std::atomic<u32> finished;
+	std::atomic<u32> errors;
+};
+
+static void mapgen_benchmark_callback(v3s16 blockpos, EmergeAction action,
+		void *param)
+{
+	MapgenBenchmarkState *state = (MapgenBenchmarkState *)param;
+	if (action != EMERGE_GENERATED)
+		state->errors++;
+	state->finished++;
+}
+
+// Generates the chunks in a temporary world with the minimal game and
+// returns the timings, or Json::nullValue when the run failed
+static Json::Value benchmark_mapgen(const std::string &mg_name, u32 chunk_count,
+		const SubgameSpec &gamespec)
+{
+	char buf[32];
+	porting::mt_snprintf(buf, sizeof(buf), "%08X", myrand());
+	std::string world_path = fs::TempPath() + DIR_DELIM "mtbench_" + buf;
+
+	// Nothing is read from or written to disk while generating
+	Settings world_mt;
+	world_mt.set("gameid", gamespec.id);
+	world_mt.set("backend", "dummy");
+	world_mt.set("player_backend", "dummy");
+	if (!fs::CreateAllDirs(world_path) || !world_mt.updateConfigFile(
+			(world_path + DIR_DELIM "world.mt").c_str())) {
+		errorstream << "Cannot create the world " << world_path << std::endl;
+		return Json::nullValue;
+	}
+
+	// The map settings of a new world are taken from these
+	g_settings->set("mg_name", mg_name);
+	g_settings->set("fixed_map_seed", MAPGEN_BENCHMARK_SEED);
+
+	Json::Value result;
+	MapgenBenchmarkState state;
+	state.finished = 0;
+	state.errors = 0;
+
+	try {
+		Server server(world_path, gamespec, false, Address(), true);
+		server.init();
+
+		EmergeManager *emerge = server.getEmergeManager();
+		s16 chunksize = emerge->mgparams->chunksize;
+
+		// A square spiral around the origin at the height of the ground,
+		// where all the phases have something to do
+		std::vector<v3s16> chunks;
+		for (s16 r = 0; chunks.size() < chunk_count; r++) {
+			for (s16 z = -r; z <= r; z++)
+			for (s16 x = -r; x <= r; x++) {
+				if (MYMAX(abs(x), abs(z)) == r)
+					chunks.emplace_back(x * chunksize, 0, z * chunksize);
+			}
+		}
+		chunks.resize(chunk_count);
+
+		g_profiler->clear();
+		emerge->startThreads();
+
+		bool &kill = *porting::signal_handler_killstatus();
+		u64 start_time = porting::getTimeUs();
+
+		for (const v3s16 &blockpos : chunks) {
+			if (!emerge->enqueueBlockEmergeEx(blockpos, PEER_ID_INEXISTENT,
+					BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+					mapgen_benchmark_callback, &state)) {
+				state.errors++;
+				state.finished++;
+			}
+		}
+
+		while (state.finished < chunk_count && !kill) {
+			// Throws on fatal errors of the emerge threads
+			server.step(0.0f);
+			sleep_ms(1);
+		}
+
+		float total_ms = (porting::getTimeUs() - start_time) / 1000.0f;
+		emerge->stopThreads();
+
+		if (kill) {
+			result = Json::nullValue;
+		} else {
+			result["chunks"] = chunk_count;
+			result["errors"] = (u32)state.errors;
+			result["total_ms"] = total_ms;
+			result["chunks_per_second"] =
+				chunk_count / MYMAX(total_ms / 1000.0f, 0.001f);
+			result["makechunk_ms"] =
+				g_profiler->getValue("EmergeThread: Mapgen::makeChunk");
+
+			// Averages per chunk, the time of a nested phase isn't
+			// counted in the one it was started from
+			Json::Value phases(Json::objectValue);
+			for (int i = 0; i != MGPHASE_COUNT; i++) {
+				phases[mapgen_phase_names[i]] = g_profiler->getValue(
+					std::string("Mapgen: ") + mapgen_phase_names[i]);
+			}
+			result["phases_ms"] = phases;
+		}
+	} catch (const ModError &e) {
+		errorstream << "ModError: " << e.what() << std::endl;
+		result = Json::nullValue;
+	} catch (const ServerError &e) {
+		errorstream << "ServerError: " << e.what() << std::endl;
+		result = Json::nullValue;
+	}
+
+	fs::RecursiveDelete(world_path);
+	return result;
+}
+
+static bool run_mapgen_benchmark(const Settings &cmd_args)
+{
+	// mystoi() clamps, so the digits are checked first. Longer strings
+	// could overflow.
+	const std::string &arg = cmd_args.get("mapgen-benchmark");
+	s32 chunk_count = 0;
+	if (is_number(arg) && arg.size() <= 9)
+		chunk_count = mystoi(arg, 0, MAPGEN_BENCHMARK_MAX_CHUNKS + 1);
+	if (chunk_count < 1 || chunk_count > MAPGEN_BENCHMARK_MAX_CHUNKS) {
+		errorstream << "Invalid number of chunks \"" << arg
+			<< "\", expected 1 to " << MAPGEN_BENCHMARK_MAX_CHUNKS
+			<< std::endl;
+		return false;
+	}
+
+	SubgameSpec gamespec = findSubgame("minimal");
+	if (!gamespec.isValid()) {
+		errorstream << "The minimal game is required for the benchmark"
+			<< std::endl;
+		return false;
+	}
+
+	// One chunk at a time, the phases are timed on the emerge thread
+	g_settings->set("num_emerge_threads", "1");
+
+	Json::Value root;
+	root["seed"] = MAPGEN_BENCHMARK_SEED;
+	root["chunksize"] = g_settings->getS16("chunksize");
+	root["mapgen_chunk_threads"] = g_settings->getU16("mapgen_chunk_threads");
+
+	bool success = true;
+	for (const char *mg_name : mapgen_benchmark_names) {
+		actionstream << "Benchmarking mapgen " << mg_name << std::endl;
+		Json::Value result = benchmark_mapgen(mg_name, chunk_count, gamespec);
+		if (result.isNull())
+			success = false;
+		root["mapgens"][mg_name] = result;
+		if (*porting::signal_handler_killstatus())
+			break;
+	}
+
+	std::cout << fastWriteJson(root) << std::endl;
+	return success;
+}
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "mapsector.h"
 #include "mapblock.h"
+#include "map_save_thread.h"
 #include "filesys.h"
 #include "voxel.h"
 #include "voxelalgorithms.h"
@@ -46,6 +47,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "database/database-sqlite3.h"
 #include "script/scripting_server.h"
 #include <deque>
+#include <fstream>
 #include <queue>
 #if USE_LEVELDB
 #include "database/database-leveldb.h"
@@ -133,12 +135,7 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	return m_block_index.get(p3d);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -995,6 +992,7 @@ bool Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return false;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->invalidateNetworkData();
 	return true;
 }
 
@@ -1009,7 +1007,10 @@ void Map::removeNodeMetadata(v3s16 p)
 				<<std::endl;
 		return;
 	}
+	if (!block->m_node_metadata.get(p_rel))
+		return;
 	block->m_node_metadata.remove(p_rel);
+	block->invalidateNetworkData();
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -1159,6 +1160,11 @@ ServerMap::ServerMap(const std::string &savedir, IGameDef *gamedef,
 	}
 	std::string backend = conf.get("backend");
 	dbase = createDatabase(backend, savedir, conf);
+	// The emerge threads read through their own connection, which the
+	// writes of the server and save threads don't hold up
+	if (backend == "sqlite3" || backend == "postgresql" || backend == "redis")
+		dbase_prefetch = createDatabase(backend, savedir, conf);
+	m_compression = loadCompressionSettings(savedir, conf, dbase);
 	if (conf.exists("readonly_backend")) {
 		std::string readonly_dir = savedir + DIR_DELIM + "readonly";
 		dbase_ro = createDatabase(conf.get("readonly_backend"), readonly_dir, conf);
@@ -1168,6 +1174,8 @@ ServerMap::ServerMap(const std::string &savedir, IGameDef *gamedef,
 
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
+	m_has_legacy_sectors = fs::PathExists(m_savedir + DIR_DELIM + "sectors") ||
+		fs::PathExists(m_savedir + DIR_DELIM + "sectors2");
 
 	try {
 		// If directory exists, check contents and load if possible
@@ -1215,6 +1223,9 @@ ServerMap::~ServerMap()
 
 	try
 	{
+		// Let the background saves finish first
+		stopSaveThread();
+
 		if (m_map_saving_enabled) {
 			// Save only changed parts
 			save(MOD_STATE_WRITE_AT_UNLOAD);
@@ -1233,6 +1244,7 @@ ServerMap::~ServerMap()
 		Close database if it was opened
 	*/
 	delete dbase;
+	delete dbase_prefetch;
 	if (dbase_ro)
 		delete dbase_ro;
 
@@ -1867,12 +1879,106 @@ void ServerMap::save(ModifiedState save_level)
 	}
 }
 
+void ServerMap::saveInBackground(ModifiedState save_level)
+{
+	if (!m_map_saving_enabled) {
+		warningstream<<"Not saving map, saving disabled."<<std::endl;
+		return;
+	}
+
+	if (m_map_metadata_changed || save_level == MOD_STATE_CLEAN) {
+		if (settings_mgr.saveMapMeta())
+			m_map_metadata_changed = false;
+	}
+
+	if (!m_save_thread) {
+		m_save_thread = new MapSaveThread(dbase, &m_db_mutex,
+			[this] (v3s16 pos) { onBlockWritten(pos); }, m_compression);
+		m_save_thread->start();
+	}
+
+	applyBackgroundSaves();
+
+	std::vector<std::pair<v3s16, MapBlockSaveItem>> items;
+	{
+		ScopeProfiler sp(g_profiler, "ServerMap: take block snapshots", SPT_AVG);
+
+		for (auto &sector_it : m_sectors) {
+			MapBlockVect blocks;
+			sector_it.second->getBlocks(blocks);
+
+			for (MapBlock *block : blocks) {
+				if (block->getModified() < (u32)save_level || block->isDummy())
+					continue;
+
+				// Skip blocks whose current state is already being written
+				v3s16 p = block->getPos();
+				u32 counter = block->getModifiedCounter();
+				auto it = m_blocks_saving.find(p);
+				if (it != m_blocks_saving.end() && it->second == counter)
+					continue;
+
+				MapBlockSaveItem item;
+				item.snapshot = block->createSnapshot();
+				item.modified_counter = counter;
+				items.emplace_back(p, item);
+				m_blocks_saving[p] = counter;
+			}
+		}
+	}
+
+	if (!items.empty()) {
+		infostream << "ServerMap: Saving " << items.size()
+				<< " blocks in the background" << std::endl;
+	}
+	m_save_thread->enqueue(items);
+}
+
+void ServerMap::applyBackgroundSaves()
+{
+	if (!m_save_thread)
+		return;
+
+	std::vector<std::pair<v3s16, u32>> written;
+	m_save_thread->popWritten(written);
+
+	for (const auto &it : written) {
+		auto saving = m_blocks_saving.find(it.first);
+		// Replaced by a newer snapshot or written synchronously
+		if (saving == m_blocks_saving.end() || saving->second != it.second)
+			continue;
+		m_blocks_saving.erase(saving);
+
+		// Only mark as clean if it was not modified since the snapshot
+		MapBlock *block = getBlockNoCreateNoEx(it.first);
+		if (block && block->getModifiedCounter() == it.second)
+			block->resetModified();
+	}
+}
+
+void ServerMap::stopSaveThread()
+{
+	if (!m_save_thread)
+		return;
+
+	// The thread writes everything that is queued before it exits
+	m_save_thread->stop();
+	m_save_thread->signal();
+	m_save_thread->wait();
+
+	applyBackgroundSaves();
+	delete m_save_thread;
+	m_save_thread = nullptr;
+	m_blocks_saving.clear();
+}
+
 void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	if (loadFromFolders()) {
 		errorstream << "Map::listAllLoadableBlocks(): Result will be missing "
 				<< "all blocks that are stored in flat files." << std::endl;
 	}
+	RecursiveMutexAutoLock dblock(m_db_mutex);
 	dbase->listAllLoadableBlocks(dst);
 	if (dbase_ro)
 		dbase_ro->listAllLoadableBlocks(dst);
@@ -1921,22 +2027,92 @@ MapDatabase *ServerMap::createDatabase(
 	throw BaseException(std::string("Database backend ") + name + " not supported.");
 }
 
+u8 ServerMap::loadCompressionSettings(const std::string &savedir,
+	Settings &conf, MapDatabase *db)
+{
+	if (!conf.exists("map_compression")) {
+		// Worlds of older versions don't have the setting. Switching them
+		// would make them unreadable for these versions, that is left to
+		// --migrate-compression. A world that has run before has map
+		// metadata, so the blocks are only listed for the others.
+		bool is_new = !fs::PathExists(savedir + DIR_DELIM + "map_meta.txt");
+		if (is_new) {
+			std::vector<v3s16> blocks;
+			db->listAllLoadableBlocks(blocks);
+			is_new = blocks.empty();
+		}
+		conf.set("map_compression", is_new ?
+			getBlockCompressionName(getDefaultBlockCompression()) : "zlib");
+	}
+
+	// Also needed to read old blocks if another codec is used now
+	std::ifstream dict_file(getCompressionDictionaryPath(savedir).c_str(),
+		std::ios_base::binary);
+	if (dict_file.good()) {
+		std::string dict((std::istreambuf_iterator<char>(dict_file)),
+			std::istreambuf_iterator<char>());
+		if (!setBlockCompressionDictionary(dict))
+			errorstream << "ServerMap: Failed to load the map compression "
+				"dictionary" << std::endl;
+	}
+
+	std::string name = conf.get("map_compression");
+	u8 compression;
+	if (!parseBlockCompressionName(name, &compression) ||
+			!isBlockCompressionSupported(compression)) {
+		errorstream << "ServerMap: Map compression \"" << name
+			<< "\" is not supported, using zlib" << std::endl;
+		return BLOCK_COMPRESSION_ZLIB;
+	}
+	return compression;
+}
+
+std::string ServerMap::getCompressionDictionaryPath(const std::string &savedir)
+{
+	return savedir + DIR_DELIM + "map_compression.dict";
+}
+
 void ServerMap::beginSave()
 {
+	m_db_mutex.lock();
 	dbase->beginSave();
+	m_in_save = true;
 }
 
 void ServerMap::endSave()
 {
 	dbase->endSave();
+	m_in_save = false;
+	for (v3s16 pos : m_uncommitted_writes)
+		onBlockWritten(pos);
+	m_uncommitted_writes.clear();
+	m_db_mutex.unlock();
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	v3s16 p = block->getPos();
+
+	// A detached load of this block would now return outdated data
+	auto it = m_detached_loads.find(p);
+	if (it != m_detached_loads.end())
+		it->second = true;
+
+	RecursiveMutexAutoLock dblock(m_db_mutex);
+
+	// A snapshot that is still being written would be older than this
+	if (m_blocks_saving.erase(p) != 0)
+		m_save_thread->cancel(p);
+
+	bool success = saveBlock(block, dbase, m_compression);
+	if (m_in_save)
+		m_uncommitted_writes.push_back(p);
+	else
+		onBlockWritten(p);
+	return success;
 }
 
-bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db)
+bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db, u8 compression)
 {
 	v3s16 p3d = block->getPos();
 
@@ -1956,7 +2132,7 @@ bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db)
 	*/
 	std::ostringstream o(std::ios_base::binary);
 	o.write((char*) &version, 1);
-	block->serialize(o, version, true);
+	block->serialize(o, version, true, compression);
 
 	bool ret = db->saveBlock(p3d, o.str());
 	if (ret) {
@@ -2111,15 +2287,15 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	std::string ret;
-	dbase->loadBlock(blockpos, &ret);
+	{
+		RecursiveMutexAutoLock dblock(m_db_mutex);
+		dbase->loadBlock(blockpos, &ret);
+		if (ret.empty() && dbase_ro)
+			dbase_ro->loadBlock(blockpos, &ret);
+	}
 	if (!ret.empty()) {
 		loadBlock(&ret, blockpos, createSector(p2d), false);
-	} else if (dbase_ro) {
-		dbase_ro->loadBlock(blockpos, &ret);
-		if (!ret.empty()) {
-			loadBlock(&ret, blockpos, createSector(p2d), false);
-		}
-	} else {
+	} else if (!dbase_ro) {
 		// Not found in database, try the files
 
 		// The directory layout we're going to load from.
@@ -2174,10 +2350,198 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return block;
 }
 
-bool ServerMap::deleteBlock(v3s16 blockpos)
+void ServerMap::startDetachedLoad(v3s16 blockpos)
+{
+	m_detached_loads[blockpos] = false;
+}
+
+bool ServerMap::loadBlockDetached(v3s16 blockpos, MapBlock **block,
+		NameIdMapping *nimap, std::string *prefetched)
+{
+	*block = NULL;
+
+	std::string blob;
+	if (prefetched) {
+		blob.swap(*prefetched);
+	} else {
+		RecursiveMutexAutoLock dblock(m_db_mutex);
+		dbase->loadBlock(blockpos, &blob);
+		if (blob.empty() && dbase_ro)
+			dbase_ro->loadBlock(blockpos, &blob);
+	}
+
+	if (blob.empty()) {
+		// The block might still be stored in the old flat file format
+		return dbase_ro || !m_has_legacy_sectors;
+	}
+
+	MapBlock *newblock = new MapBlock(this, blockpos, m_gamedef);
+	try {
+		std::istringstream is(blob, std::ios_base::binary);
+
+		u8 version = SER_FMT_VER_INVALID;
+		is.read((char *)&version, 1);
+		if (is.fail())
+			throw SerializationError("ServerMap::loadBlockDetached(): Failed"
+					" to read MapBlock version");
+
+		// Old blocks are converted using the nodedef; leave them to
+		// loadBlock() as well
+		if (version <= 21) {
+			delete newblock;
+			return false;
+		}
+
+		// Allocating ids for unknown nodes has to wait for the env lock
+		newblock->deSerialize(is, version, true, nimap);
+	} catch (BaseException &e) {
+		// Let loadBlock() do the error handling
+		delete newblock;
+		return false;
+	}
+
+	*block = newblock;
+	return true;
+}
+
+u32 ServerMap::prefetchBlocks(const std::vector<v3s16> &positions,
+		std::map<v3s16, std::string> &blobs)
+{
+	// Registered before reading, so that no write committed after the
+	// read is missed
+	u32 prefetch_id;
+	{
+		MutexAutoLock lock(m_prefetch_mutex);
+		if (m_next_prefetch_id == 0)
+			m_next_prefetch_id++;
+		prefetch_id = m_next_prefetch_id++;
+		std::map<v3s16, bool> &written = m_prefetches[prefetch_id];
+		for (const v3s16 &pos : positions)
+			written[pos] = false;
+	}
+
+	std::vector<v3s16> missing;
+	auto callback = [&] (const v3s16 &pos, std::string *data) {
+		if (data->empty())
+			missing.push_back(pos);
+		else
+			blobs[pos].swap(*data);
+	};
+	if (dbase_prefetch) {
+		MutexAutoLock dblock(m_prefetch_db_mutex);
+		dbase_prefetch->loadBlocks(positions, callback);
+	} else {
+		RecursiveMutexAutoLock dblock(m_db_mutex);
+		dbase->loadBlocks(positions, callback);
+	}
+
+	if (dbase_ro && !missing.empty()) {
+		RecursiveMutexAutoLock dblock(m_db_mutex);
+		dbase_ro->loadBlocks(missing,
+			[&] (const v3s16 &pos, std::string *data) {
+				blobs[pos].swap(*data);
+			});
+	} else {
+		for (const v3s16 &pos : missing)
+			blobs[pos].clear();
+	}
+
+	return prefetch_id;
+}
+
+bool ServerMap::isPrefetchValid(u32 prefetch_id, v3s16 blockpos)
+{
+	MutexAutoLock lock(m_prefetch_mutex);
+	auto it = m_prefetches.find(prefetch_id);
+	if (it == m_prefetches.end())
+		return false;
+	auto written = it->second.find(blockpos);
+	return written != it->second.end() && !written->second;
+}
+
+void ServerMap::endPrefetch(u32 prefetch_id)
+{
+	MutexAutoLock lock(m_prefetch_mutex);
+	m_prefetches.erase(prefetch_id);
+}
+
+void ServerMap::onBlockWritten(v3s16 blockpos)
+{
+	MutexAutoLock lock(m_prefetch_mutex);
+	for (auto &prefetch : m_prefetches) {
+		auto written = prefetch.second.find(blockpos);
+		if (written != prefetch.second.end())
+			written->second = true;
+	}
+}
+
+bool ServerMap::finishDetachedLoad(v3s16 blockpos, MapBlock **block,
+		const NameIdMapping &nimap)
 {
-	if (!dbase->deleteBlock(blockpos))
+	auto it = m_detached_loads.find(blockpos);
+	bool outdated = it != m_detached_loads.end() && it->second;
+	if (it != m_detached_loads.end())
+		m_detached_loads.erase(it);
+
+	// Somebody else loaded or generated the block in the meantime
+	MapBlock *existing = getBlockNoCreateNoEx(blockpos);
+	if (existing) {
+		delete *block;
+		*block = existing;
+		return !existing->isDummy();
+	}
+
+	if (outdated) {
+		delete *block;
+		*block = NULL;
 		return false;
+	}
+
+	if (!*block)
+		return true;
+
+	(*block)->correctNodeIds(nimap);
+
+	MapSector *sector = createSector(v2s16(blockpos.X, blockpos.Z));
+	sector->insertBlock(*block);
+	ReflowScan scanner(this, m_emerge->ndef);
+	scanner.scan(*block, &m_transforming_liquid);
+
+	// We just loaded it from the database, so it's up-to-date.
+	(*block)->resetModified();
+
+	std::map<v3s16, MapBlock *> modified_blocks;
+	// Fix lighting if necessary
+	voxalgo::update_block_border_lighting(this, *block, modified_blocks);
+	if (!modified_blocks.empty()) {
+		//Modified lighting, send event
+		MapEditEvent event;
+		event.type = MEET_OTHER;
+		for (const auto &modified_block : modified_blocks)
+			event.modified_blocks.insert(modified_block.first);
+		dispatchEvent(&event);
+	}
+	return true;
+}
+
+bool ServerMap::deleteBlock(v3s16 blockpos)
+{
+	auto it = m_detached_loads.find(blockpos);
+	if (it != m_detached_loads.end())
+		it->second = true;
+
+	{
+		RecursiveMutexAutoLock dblock(m_db_mutex);
+		if (m_blocks_saving.erase(blockpos) != 0)
+			m_save_thread->cancel(blockpos);
+		bool success = dbase->deleteBlock(blockpos);
+		if (m_in_save)
+			m_uncommitted_writes.push_back(blockpos);
+		else
+			onBlockWritten(blockpos);
+		if (!success)
+			return false;
+	}
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if (block) {
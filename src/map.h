@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/container.h"
 #include "nodetimer.h"
 #include "map_settings_manager.h"
+#include "mapblockindex.h"
 #include "debug.h"
 
 class Settings;
@@ -45,8 +46,10 @@ class NodeMetadata;
 class IGameDef;
 class IRollbackManager;
 class EmergeManager;
+class MapSaveThread;
 class ServerEnvironment;
 struct BlockMakeData;
+class NameIdMapping;
 
 /*
 	MapEditEvent
@@ -301,6 +304,10 @@ class Map /*: public NodeContainer*/
 
 	std::map<v2s16, MapSector*> m_sectors;
 
+	// All blocks of all sectors by position, kept up to date by MapSector
+	friend class MapSector;
+	MapBlockIndex m_block_index;
+
 	// Be sure to set this to NULL when the cached sector is deleted
 	MapSector *m_sector_cache = nullptr;
 	v2s16 m_sector_cache_p;
@@ -400,6 +407,15 @@ class ServerMap : public Map
 		Database functions
 	*/
 	static MapDatabase *createDatabase(const std::string &name, const std::string &savedir, Settings &conf);
+	/*
+		Reads the "map_compression" codec of world.mt and loads the world's
+		compression dictionary. If the codec is missing, new worlds get the
+		default and existing ones zlib, which they were written with.
+		Falls back to zlib if the codec is not supported by this build.
+	*/
+	static u8 loadCompressionSettings(const std::string &savedir, Settings &conf,
+		MapDatabase *db);
+	static std::string getCompressionDictionaryPath(const std::string &savedir);
 
 	// Returns true if the database file does not exist
 	bool loadFromFolders();
@@ -409,13 +425,20 @@ class ServerMap : public Map
 	void endSave();
 
 	void save(ModifiedState save_level);
+	/*
+		Like save(), but only takes snapshots of the modified blocks and
+		leaves serializing and writing them to a background thread.
+		Blocks are marked as clean once they are in the database.
+	*/
+	void saveInBackground(ModifiedState save_level);
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 	void listAllLoadedBlocks(std::vector<v3s16> &dst);
 
 	MapgenParams *getMapgenParams();
 
 	bool saveBlock(MapBlock *block);
-	static bool saveBlock(MapBlock *block, MapDatabase *db);
+	static bool saveBlock(MapBlock *block, MapDatabase *db,
+			u8 compression = BLOCK_COMPRESSION_ZLIB);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(const std::string &sectordir, const std::string &blockfile,
 			MapSector *sector, bool save_after_load=false);
@@ -423,6 +446,42 @@ class ServerMap : public Map
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Two-phase loading used by the emerge threads, so that reading and
+		decompressing the block does not block the server thread.
+		- startDetachedLoad(): needs the environment lock
+		- loadBlockDetached(): must be called without the environment lock.
+		  Returns false if the caller has to fall back to loadBlock(),
+		  otherwise *block is the new block or NULL if it is not stored.
+		  The node ids of the block are still the stored ones; their
+		  id-name mapping is put into *nimap.
+		- finishDetachedLoad(): needs the environment lock. Applies nimap,
+		  which may add unknown node names to the nodedef, and inserts the
+		  block into the map, or replaces *block with the one that was put
+		  there in the meantime. Returns false if the caller has to fall
+		  back to loadBlock() because the stored block changed during the
+		  load.
+		The nodedef is only ever modified with the environment lock held.
+	*/
+	void startDetachedLoad(v3s16 blockpos);
+	// If blob is given it is used instead of reading the database
+	bool loadBlockDetached(v3s16 blockpos, MapBlock **block,
+			NameIdMapping *nimap, std::string *blob = nullptr);
+	bool finishDetachedLoad(v3s16 blockpos, MapBlock **block,
+			const NameIdMapping &nimap);
+
+	/*
+		Reads the stored data of many blocks with a single database request,
+		to be passed to loadBlockDetached() later. Must be called without
+		the environment lock. Returns an id for isPrefetchValid(), which is
+		to be released with endPrefetch().
+	*/
+	u32 prefetchBlocks(const std::vector<v3s16> &positions,
+			std::map<v3s16, std::string> &blobs);
+	// False if the block was written to the database since the prefetch
+	bool isPrefetchValid(u32 prefetch_id, v3s16 blockpos);
+	void endPrefetch(u32 prefetch_id);
+
 	bool deleteBlock(v3s16 blockpos);
 
 	void updateVManip(v3s16 pos);
@@ -469,6 +528,40 @@ class ServerMap : public Map
 	bool m_map_metadata_changed = true;
 	MapDatabase *dbase = nullptr;
 	MapDatabase *dbase_ro = nullptr;
+	// BlockCompression codec used for writing blocks
+	u8 m_compression = BLOCK_COMPRESSION_ZLIB;
+
+	// Serializes database accesses. Held from beginSave() to endSave().
+	std::recursive_mutex m_db_mutex;
+	// Blocks written since beginSave(), they are committed by endSave()
+	// (protected by m_db_mutex)
+	std::vector<v3s16> m_uncommitted_writes;
+	bool m_in_save = false;
+
+	// Second connection to the database for prefetchBlocks(), so that its
+	// reads don't wait for m_db_mutex. Only for backends that can be
+	// opened twice, dbase is used otherwise.
+	MapDatabase *dbase_prefetch = nullptr;
+	std::mutex m_prefetch_db_mutex;
+	// The blocks of the prefetches in use, and whether they were written
+	// since (protected by m_prefetch_mutex)
+	std::mutex m_prefetch_mutex;
+	std::map<u32, std::map<v3s16, bool>> m_prefetches;
+	u32 m_next_prefetch_id = 1;
+	// Must be called after the write is committed
+	void onBlockWritten(v3s16 blockpos);
+	// True if the world still contains blocks in the old flat file format
+	bool m_has_legacy_sectors = false;
+	// Blocks being loaded by loadBlockDetached(), and whether they were
+	// written to the database since the load started (protected by envlock)
+	std::map<v3s16, bool> m_detached_loads;
+
+	MapSaveThread *m_save_thread = nullptr;
+	// Blocks handed to m_save_thread, and their modification counter then
+	std::map<v3s16, u32> m_blocks_saving;
+	// Marks the blocks written by m_save_thread as clean
+	void applyBackgroundSaves();
+	void stopSaveThread();
 };
 
 
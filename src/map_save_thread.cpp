@@ -0,0 +1,189 @@
+/*
+Minetest
+Copyright (C) 2010-2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "map_save_thread.h"
+#include <sstream>
+#include "database/database.h"
+#include "debug.h"
+#include "log.h"
+#include "mapblock.h"
+#include "profiler.h"
+#include "serialization.h"
+#include "threading/mutex_auto_lock.h"
+#include "util/basic_macros.h"
+
+// Maximum number of blocks written in one database transaction
+#define MAP_SAVE_BATCH_SIZE 256
+
+MapSaveThread::MapSaveThread(MapDatabase *db, std::recursive_mutex *db_mutex,
+		std::function<void(v3s16)> written, u8 compression) :
+	Thread("MapSave"),
+	m_db(db),
+	m_db_mutex(db_mutex),
+	m_written_callback(written),
+	m_compression(compression)
+{
+}
+
+MapSaveThread::~MapSaveThread()
+{
+	for (auto &it : m_queue)
+		delete it.second.snapshot;
+}
+
+void MapSaveThread::signal()
+{
+	m_queue_event.signal();
+}
+
+void MapSaveThread::enqueue(
+	const std::vector<std::pair<v3s16, MapBlockSaveItem>> &items)
+{
+	if (items.empty())
+		return;
+
+	{
+		MutexAutoLock lock(m_queue_mutex);
+		for (const auto &item : items) {
+			auto it = m_queue.find(item.first);
+			if (it != m_queue.end()) {
+				delete it->second.snapshot;
+				it->second = item.second;
+			} else {
+				m_queue[item.first] = item.second;
+			}
+		}
+	}
+
+	signal();
+}
+
+void MapSaveThread::cancel(v3s16 pos)
+{
+	MutexAutoLock lock(m_queue_mutex);
+
+	auto it = m_queue.find(pos);
+	if (it != m_queue.end()) {
+		delete it->second.snapshot;
+		m_queue.erase(it);
+	}
+
+	if (m_in_progress.find(pos) != m_in_progress.end())
+		m_cancelled.insert(pos);
+}
+
+void MapSaveThread::popWritten(std::vector<std::pair<v3s16, u32>> &dst)
+{
+	MutexAutoLock lock(m_queue_mutex);
+	dst.insert(dst.end(), m_written.begin(), m_written.end());
+	m_written.clear();
+}
+
+bool MapSaveThread::isIdle()
+{
+	MutexAutoLock lock(m_queue_mutex);
+	return m_queue.empty() && m_in_progress.empty();
+}
+
+void *MapSaveThread::run()
+{
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	// Format used for writing
+	const u8 version = SER_FMT_VER_HIGHEST_WRITE;
+
+	while (true) {
+		std::vector<std::pair<v3s16, MapBlockSaveItem>> batch;
+		{
+			MutexAutoLock lock(m_queue_mutex);
+			while (!m_queue.empty() && batch.size() < MAP_SAVE_BATCH_SIZE) {
+				auto it = m_queue.begin();
+				batch.emplace_back(*it);
+				m_in_progress.insert(it->first);
+				m_queue.erase(it);
+			}
+		}
+
+		if (batch.empty()) {
+			// Only quit once everything has been written
+			if (stopRequested())
+				break;
+			m_queue_event.wait();
+			continue;
+		}
+
+		/*
+			[0] u8 serialization version
+			[1] data
+		*/
+		std::vector<std::string> blobs;
+		blobs.reserve(batch.size());
+		{
+			ScopeProfiler sp(g_profiler, "MapSaveThread: serialize blocks", SPT_AVG);
+			for (const auto &item : batch) {
+				std::ostringstream o(std::ios_base::binary);
+				o.write((char *)&version, 1);
+				item.second.snapshot->serialize(o, version, true,
+					m_compression);
+				blobs.emplace_back(o.str());
+			}
+		}
+
+		std::vector<std::pair<v3s16, u32>> written;
+		{
+			ScopeProfiler sp(g_profiler, "MapSaveThread: write blocks", SPT_AVG);
+			RecursiveMutexAutoLock dblock(*m_db_mutex);
+
+			std::set<v3s16> cancelled;
+			{
+				MutexAutoLock lock(m_queue_mutex);
+				cancelled.swap(m_cancelled);
+			}
+
+			m_db->beginSave();
+			for (size_t i = 0; i < batch.size(); i++) {
+				v3s16 pos = batch[i].first;
+				if (cancelled.find(pos) != cancelled.end())
+					continue;
+				if (m_db->saveBlock(pos, blobs[i]))
+					written.emplace_back(pos, batch[i].second.modified_counter);
+				else
+					errorstream << "MapSaveThread: Failed to write block "
+						<< PP(pos) << std::endl;
+			}
+			m_db->endSave();
+			for (const auto &item : written)
+				m_written_callback(item.first);
+
+			// Anything cancelled from now on is already in the database
+			MutexAutoLock lock(m_queue_mutex);
+			m_written.insert(m_written.end(), written.begin(), written.end());
+			m_in_progress.clear();
+			m_cancelled.clear();
+		}
+
+		g_profiler->add("MapSaveThread: blocks written", written.size());
+
+		for (auto &item : batch)
+			delete item.second.snapshot;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
@@ -0,0 +1,88 @@
+/*
+Minetest
+Copyright (C) 2010-2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+#include "irr_v3d.h"
+#include "threading/event.h"
+#include "threading/thread.h"
+
+class MapBlock;
+class MapDatabase;
+
+struct MapBlockSaveItem
+{
+	// Detached copy of the block, see MapBlock::createSnapshot()
+	MapBlock *snapshot = nullptr;
+	// MapBlock::getModifiedCounter() when the snapshot was taken
+	u32 modified_counter = 0;
+};
+
+/*
+	Serializes, compresses and writes block snapshots to the map database
+	in batches, so that ServerMap::save() does not stall the server thread.
+	Database accesses are serialized with the other users of the database
+	through the mutex passed to the constructor.
+*/
+class MapSaveThread : public Thread
+{
+public:
+	// written is called for every block once the write is committed
+	MapSaveThread(MapDatabase *db, std::recursive_mutex *db_mutex,
+		std::function<void(v3s16)> written, u8 compression);
+	~MapSaveThread();
+
+	void *run();
+	void signal();
+
+	// Takes ownership of the snapshots. A queued snapshot of the same block
+	// that has not been written yet is replaced.
+	void enqueue(const std::vector<std::pair<v3s16, MapBlockSaveItem>> &items);
+
+	// Drops the queued snapshot of a block because a newer version is being
+	// written synchronously. Must be called with the database mutex held.
+	void cancel(v3s16 pos);
+
+	// Returns the blocks (with their modification counter) that have been
+	// committed to the database since the last call
+	void popWritten(std::vector<std::pair<v3s16, u32>> &dst);
+
+	bool isIdle();
+
+private:
+	MapDatabase *m_db;
+	std::recursive_mutex *m_db_mutex;
+	std::function<void(v3s16)> m_written_callback;
+	// BlockCompression codec of the written blocks
+	u8 m_compression;
+
+	Event m_queue_event;
+	std::mutex m_queue_mutex;
+	std::map<v3s16, MapBlockSaveItem> m_queue;
+	// Blocks of the batch that is currently being written
+	std::set<v3s16> m_in_progress;
+	// Blocks of the current batch that must not be written anymore
+	std::set<v3s16> m_cancelled;
+	std::vector<std::pair<v3s16, u32>> m_written;
+};
@@ -19,6 +19,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "mapblock.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <sstream>
 #include "map.h"
 #include "light.h"
@@ -34,6 +37,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock_mesh.h"
 #endif
 #include "porting.h"
+#include "profiler.h"
 #include "util/string.h"
 #include "util/serialize.h"
 #include "util/basic_macros.h"
@@ -62,6 +66,102 @@ static const char *modified_reason_strings[] = {
 };
 
 
+/*
+	MapBlockContentIndex
+*/
+
+void MapBlockContentIndex::build(const MapNode *nodes, u32 nodecount)
+{
+	invalidate();
+
+	std::unordered_map<content_t, u16> counts;
+	content_t previous_c = CONTENT_IGNORE;
+	u16 *previous_count = nullptr;
+	for (u32 i = 0; i < nodecount; i++) {
+		content_t c = nodes[i].getContent();
+		if (!previous_count || c != previous_c) {
+			previous_count = &counts[c];
+			previous_c = c;
+		}
+		(*previous_count)++;
+	}
+
+	m_counts.assign(counts.begin(), counts.end());
+	m_valid = true;
+}
+
+u16 MapBlockContentIndex::getCount(content_t c) const
+{
+	for (const auto &count : m_counts) {
+		if (count.first == c)
+			return count.second;
+	}
+	return 0;
+}
+
+const std::vector<u16> &MapBlockContentIndex::getPositions(content_t c,
+		const MapNode *nodes, u32 nodecount)
+{
+	static const std::vector<u16> empty;
+	if (!m_valid || getCount(c) == 0)
+		return empty;
+
+	auto it = m_positions.find(c);
+	if (it != m_positions.end())
+		return it->second;
+
+	std::vector<u16> &positions = m_positions[c];
+	positions.reserve(getCount(c));
+	for (u32 i = 0; i < nodecount; i++) {
+		if (nodes[i].getContent() == c)
+			positions.push_back(i);
+	}
+	return positions;
+}
+
+void MapBlockContentIndex::addNode(u16 i, content_t c)
+{
+	bool found = false;
+	for (auto &count : m_counts) {
+		if (count.first == c) {
+			count.second++;
+			found = true;
+			break;
+		}
+	}
+	if (!found)
+		m_counts.emplace_back(c, 1);
+
+	auto it = m_positions.find(c);
+	if (it != m_positions.end()) {
+		std::vector<u16> &positions = it->second;
+		positions.insert(std::lower_bound(positions.begin(),
+			positions.end(), i), i);
+	}
+}
+
+void MapBlockContentIndex::removeNode(u16 i, content_t c)
+{
+	for (auto count = m_counts.begin(); count != m_counts.end(); ++count) {
+		if (count->first != c)
+			continue;
+		if (--count->second == 0) {
+			m_counts.erase(count);
+			m_positions.erase(c);
+			return;
+		}
+		break;
+	}
+
+	auto it = m_positions.find(c);
+	if (it != m_positions.end()) {
+		std::vector<u16> &positions = it->second;
+		auto pos = std::lower_bound(positions.begin(), positions.end(), i);
+		if (pos != positions.end() && *pos == i)
+			positions.erase(pos);
+	}
+}
+
 /*
 	MapBlock
 */
@@ -146,12 +246,51 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
 {
-	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
-	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	// Copy from VoxelManipulator to data, logging the changed nodes
+	std::vector<u16> changed;
+	v3s16 relpos = getPosRelative();
+	u16 i = 0;
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++) {
+		s32 vi = dst.m_area.index(relpos.X, relpos.Y + y, relpos.Z + z);
+		for (s16 x = 0; x < MAP_BLOCKSIZE; x++, i++, vi++) {
+			MapNode &n = dst.m_data[vi];
+			if (n.getContent() == CONTENT_IGNORE || n == data[i])
+				continue;
+			m_content_index.update(i, data[i].getContent(), n.getContent());
+			data[i] = n;
+			changed.push_back(i);
+		}
+	}
 
-	// Copy from VoxelManipulator to data
-	dst.copyTo(data, data_area, v3s16(0,0,0),
-			getPosRelative(), data_size);
+	m_network_data.reset();
+	if (m_node_changes.size() + changed.size() > max_node_changes)
+		resetNodeChanges();
+	else
+		m_node_changes.insert(m_node_changes.end(),
+				changed.begin(), changed.end());
+}
+
+static std::atomic<u64> s_next_node_changes_base(0);
+
+void MapBlock::resetNodeChanges()
+{
+	// Each log gets a range of versions of its own
+	m_node_changes_base = s_next_node_changes_base.fetch_add(
+			max_node_changes + 1);
+	std::vector<u16>().swap(m_node_changes);
+}
+
+bool MapBlock::getChangedNodes(u64 version, std::vector<u16> &indices) const
+{
+	if (version < m_node_changes_base || version > getNodeVersion())
+		return false;
+
+	indices.assign(m_node_changes.begin() + (version - m_node_changes_base),
+			m_node_changes.end());
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	return true;
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -216,6 +355,8 @@ void MapBlock::expireDayNightDiff()
 	}
 
 	m_day_night_differs_expired = true;
+	// Peers recompute the flag when they get changed nodes
+	m_network_data.reset();
 }
 
 s16 MapBlock::getGroundLevel(v2s16 p2d)
@@ -252,11 +393,17 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 // sure we can handle all content ids. But it's absolutely worth it as it's
 // a speedup of 4 for one of the major time consuming functions on storing
 // mapblocks.
-static content_t getBlockNodeIdMapping_mapping[USHRT_MAX + 1];
+// thread_local: blocks are also serialized by the MapSaveThread. It's
+// allocated on first use, so that threads which never serialize a block
+// don't pay for it.
+static thread_local std::unique_ptr<content_t[]> getBlockNodeIdMapping_buf;
 static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 	const NodeDefManager *nodedef)
 {
-	memset(getBlockNodeIdMapping_mapping, 0xFF, (USHRT_MAX + 1) * sizeof(content_t));
+	if (!getBlockNodeIdMapping_buf)
+		getBlockNodeIdMapping_buf.reset(new content_t[USHRT_MAX + 1]);
+	content_t *mapping = getBlockNodeIdMapping_buf.get();
+	memset(mapping, 0xFF, (USHRT_MAX + 1) * sizeof(content_t));
 
 	std::set<content_t> unknown_contents;
 	content_t id_counter = 0;
@@ -265,14 +412,14 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 		content_t id = CONTENT_IGNORE;
 
 		// Try to find an existing mapping
-		if (getBlockNodeIdMapping_mapping[global_id] != 0xFFFF) {
-			id = getBlockNodeIdMapping_mapping[global_id];
+		if (mapping[global_id] != 0xFFFF) {
+			id = mapping[global_id];
 		}
 		else
 		{
 			// We have to assign a new mapping
 			id = id_counter++;
-			getBlockNodeIdMapping_mapping[global_id] = id;
+			mapping[global_id] = id;
 
 			const ContentFeatures &f = nodedef->get(global_id);
 			const std::string &name = f.name;
@@ -355,7 +502,8 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk,
+		u8 compression)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -377,6 +525,10 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	if (version >= 27) {
 		writeU16(os, m_lighting_complete);
 	}
+	if (version >= 29)
+		writeU8(os, compression);
+	else
+		compression = BLOCK_COMPRESSION_ZLIB;
 
 	/*
 		Bulk node data
@@ -394,7 +546,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		writeU8(os, content_width);
 		writeU8(os, params_width);
 		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
+				content_width, params_width, true, compression);
 		delete[] tmp_nodes;
 	}
 	else
@@ -404,7 +556,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		writeU8(os, content_width);
 		writeU8(os, params_width);
 		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+				content_width, params_width, true, compression);
 	}
 
 	/*
@@ -412,7 +564,7 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	*/
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss, version, disk);
-	compressZlib(oss.str(), os);
+	compressBlockData(oss.str(), os, compression);
 
 	/*
 		Data that goes to disk, but not the network
@@ -451,8 +603,72 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os)
 	writeF1000(os, 0); // deprecated humidity
 }
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+std::shared_ptr<const std::string> MapBlock::getNetworkData(u8 version,
+		u16 net_proto_version, u8 compression)
+{
+	if (version < 29)
+		compression = BLOCK_COMPRESSION_ZLIB;
+
+	if (m_network_data && m_network_data_ser_ver == version &&
+			m_network_data_proto_ver == net_proto_version &&
+			m_network_data_compression == compression) {
+		g_profiler->add("MapBlock: network data cache hits", 1);
+		return m_network_data;
+	}
+	g_profiler->add("MapBlock: network data cache misses", 1);
+
+	std::ostringstream os(std::ios_base::binary);
+	serialize(os, version, false, compression);
+	serializeNetworkSpecific(os);
+
+	m_network_data = std::make_shared<const std::string>(os.str());
+	m_network_data_ser_ver = version;
+	m_network_data_proto_ver = net_proto_version;
+	m_network_data_compression = compression;
+	return m_network_data;
+}
+
+MapBlock *MapBlock::createSnapshot()
+{
+	MapBlock *copy = new MapBlock(m_parent, m_pos, m_gamedef, true);
+	if (data) {
+		copy->data = new MapNode[nodecount];
+		memcpy(copy->data, data, nodecount * sizeof(MapNode));
+	}
+
+	copy->is_underground = is_underground;
+	copy->m_lighting_complete = m_lighting_complete;
+	copy->m_day_night_differs = m_day_night_differs;
+	copy->m_day_night_differs_expired = m_day_night_differs_expired;
+	copy->m_generated = m_generated;
+	copy->m_timestamp = m_timestamp;
+	copy->m_disk_timestamp = m_disk_timestamp;
+	copy->m_static_objects = m_static_objects;
+
+	// Metadata and timers are copied through their on-disk format because
+	// they contain pointers and iterators
+	{
+		std::ostringstream os(std::ios_base::binary);
+		m_node_metadata.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		copy->m_node_metadata.deSerialize(is, m_gamedef->idef());
+	}
+	{
+		std::ostringstream os(std::ios_base::binary);
+		m_node_timers.serialize(os, SER_FMT_VER_HIGHEST_WRITE);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		copy->m_node_timers.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE);
+	}
+
+	return copy;
+}
+
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		NameIdMapping *nimap_out)
 {
+	m_content_index.invalidate();
+	invalidateNetworkData();
+
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
@@ -462,6 +678,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 
 	if(version <= 21)
 	{
+		// The legacy conversion needs the corrected ids
+		FATAL_ERROR_IF(nimap_out, "MapBlock::deSerialize(): can't defer"
+				" the id-name mapping of old blocks");
 		deSerialize_pre22(is, version, disk);
 		return;
 	}
@@ -474,6 +693,14 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	else
 		m_lighting_complete = readU16(is);
 	m_generated = (flags & 0x08) == 0;
+	u8 compression = BLOCK_COMPRESSION_ZLIB;
+	if (version >= 29) {
+		compression = readU8(is);
+		if (!isBlockCompressionSupported(compression))
+			throw SerializationError(std::string("MapBlock::deSerialize(): "
+				"unsupported compression ") +
+				getBlockCompressionName(compression));
+	}
 
 	/*
 		Bulk node data
@@ -487,7 +714,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	if(params_width != 2)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
 	MapNode::deSerializeBulk(is, version, data, nodecount,
-			content_width, params_width, true);
+			content_width, params_width, true, compression);
 
 	/*
 		NodeMetadata
@@ -497,7 +724,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	// Ignore errors
 	try {
 		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
+		decompressBlockData(is, oss, compression);
 		std::istringstream iss(oss.str(), std::ios_base::binary);
 		if (version >= 23)
 			m_node_metadata.deSerialize(iss, m_gamedef->idef());
@@ -541,9 +768,13 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		// Dynamically re-set ids based on node names
 		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 				<<": NameIdMapping"<<std::endl);
-		NameIdMapping nimap;
-		nimap.deSerialize(is);
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if (nimap_out) {
+			nimap_out->deSerialize(is);
+		} else {
+			NameIdMapping nimap;
+			nimap.deSerialize(is);
+			correctBlockNodeIds(&nimap, data, m_gamedef);
+		}
 
 		if(version >= 25){
 			TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
@@ -556,6 +787,60 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 			<<": Done."<<std::endl);
 }
 
+void MapBlock::correctNodeIds(const NameIdMapping &nimap)
+{
+	m_content_index.invalidate();
+	invalidateNetworkData();
+	correctBlockNodeIds(&nimap, data, m_gamedef);
+}
+
+bool MapBlock::recompressBlob(const std::string &blob, u8 compression,
+		std::string *result, std::string *bulk_data)
+{
+	std::istringstream is(blob, std::ios_base::binary);
+	u8 version = readU8(is);
+	// The layout of the uncompressed parts changed before 25
+	if (version < 25 || !ser_ver_supported(version))
+		return false;
+
+	u8 flags = readU8(is);
+	u16 lighting_complete = version >= 27 ? readU16(is) : 0xFFFF;
+	u8 old_compression = version >= 29 ? readU8(is) : (u8)BLOCK_COMPRESSION_ZLIB;
+	u8 content_width = readU8(is);
+	u8 params_width = readU8(is);
+	if ((content_width != 1 && content_width != 2) || params_width != 2)
+		throw SerializationError("MapBlock::recompressBlob(): invalid width");
+
+	std::ostringstream nodes_os(std::ios_base::binary);
+	decompressBlockData(is, nodes_os, old_compression);
+	std::string nodes = nodes_os.str();
+	if (nodes.size() != nodecount * (content_width + params_width))
+		throw SerializationError("MapBlock::recompressBlob(): "
+			"invalid node data size");
+	std::ostringstream meta(std::ios_base::binary);
+	decompressBlockData(is, meta, old_compression);
+
+	// Static objects, timestamp, name-id mapping and node timers are the
+	// same in all versions >= 25
+	std::string rest(std::istreambuf_iterator<char>(is), {});
+
+	std::ostringstream os(std::ios_base::binary);
+	writeU8(os, SER_FMT_VER_HIGHEST_WRITE);
+	writeU8(os, flags);
+	writeU16(os, lighting_complete);
+	writeU8(os, compression);
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	compressBlockData(nodes, os, compression);
+	compressBlockData(meta.str(), os, compression);
+	os.write(rest.c_str(), rest.size());
+
+	*result = os.str();
+	if (bulk_data)
+		bulk_data->swap(nodes);
+	return true;
+}
+
 void MapBlock::deSerializeNetworkSpecific(std::istream &is)
 {
 	try {
@@ -19,7 +19,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #pragma once
 
+#include <memory>
 #include <set>
+#include <unordered_map>
+#include <vector>
 #include "irr_v3d.h"
 #include "mapnode.h"
 #include "exceptions.h"
@@ -30,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "modifiedstate.h"
 #include "util/numeric.h" // getContainerPos
 #include "settings.h"
+#include "serialization.h"
 #include "mapgen/mapgen.h"
 
 class Map;
@@ -37,6 +41,7 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class NameIdMapping;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -66,6 +71,79 @@ class VoxelManipulator;
 #define MOD_REASON_VMANIP                    (1 << 19)
 #define MOD_REASON_UNKNOWN                   (1 << 20)
 
+// Modifications that leave the networked block data alone or only change
+// it through the node change log, see MapBlock::getChangedNodes()
+#define MOD_REASONS_NODE_CHANGES_KEPT (MOD_REASON_SET_NODE | \
+		MOD_REASON_SET_NODE_NO_CHECK | MOD_REASON_VMANIP | \
+		MOD_REASON_SET_TIMESTAMP | MOD_REASON_CLEAR_ALL_OBJECTS | \
+		MOD_REASON_BLOCK_EXPIRED | MOD_REASON_ADD_ACTIVE_OBJECT_RAW | \
+		MOD_REASON_REMOVE_OBJECTS_REMOVE | \
+		MOD_REASON_REMOVE_OBJECTS_DEACTIVATE | \
+		MOD_REASON_TOO_MANY_OBJECTS | MOD_REASON_STATIC_DATA_ADDED | \
+		MOD_REASON_STATIC_DATA_REMOVED | MOD_REASON_STATIC_DATA_CHANGED | \
+		MOD_REASON_EXPIRE_DAYNIGHTDIFF)
+
+////
+//// Content index
+////
+
+/*
+	Index of the content types in a MapBlock, so that ABMs, LBMs and node
+	searches only need to visit the nodes that can match.
+	The node counts are kept up to date once the index has been built.
+	Position lists are only built for the content types that are asked for
+	and are then kept up to date as well.
+	Positions are node indices (z * zstride + y * ystride + x).
+*/
+class MapBlockContentIndex
+{
+public:
+	typedef std::vector<std::pair<content_t, u16>> ContentCounts;
+
+	inline bool isValid() const
+	{
+		return m_valid;
+	}
+
+	void build(const MapNode *nodes, u32 nodecount);
+
+	inline void invalidate()
+	{
+		m_valid = false;
+		m_counts.clear();
+		m_positions.clear();
+	}
+
+	// Call before the node at index i changes from old_c to new_c
+	inline void update(u16 i, content_t old_c, content_t new_c)
+	{
+		if (!m_valid || old_c == new_c)
+			return;
+		removeNode(i, old_c);
+		addNode(i, new_c);
+	}
+
+	const ContentCounts &getCounts() const
+	{
+		return m_counts;
+	}
+
+	u16 getCount(content_t c) const;
+
+	// Returns the sorted indices of all nodes with content c
+	const std::vector<u16> &getPositions(content_t c, const MapNode *nodes,
+			u32 nodecount);
+
+private:
+	void addNode(u16 i, content_t c);
+	void removeNode(u16 i, content_t c);
+
+	bool m_valid = false;
+	// Usually only a handful of content types, so a vector is fastest
+	ContentCounts m_counts;
+	std::unordered_map<content_t, std::vector<u16>> m_positions;
+};
+
 ////
 //// MapBlock itself
 ////
@@ -92,6 +170,7 @@ class MapBlock
 		data = new MapNode[nodecount];
 		for (u32 i = 0; i < nodecount; i++)
 			data[i] = MapNode(CONTENT_IGNORE);
+		m_content_index.invalidate();
 
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
@@ -106,6 +185,7 @@ class MapBlock
 	////
 	void raiseModified(u32 mod, u32 reason=MOD_REASON_UNKNOWN)
 	{
+		m_modified_counter++;
 		if (mod > m_modified) {
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -114,8 +194,9 @@ class MapBlock
 		} else if (mod == m_modified) {
 			m_modified_reason |= reason;
 		}
-		if (mod == MOD_STATE_WRITE_NEEDED)
-			contents_cached = false;
+		m_network_data.reset();
+		if (reason & ~MOD_REASONS_NODE_CHANGES_KEPT)
+			resetNodeChanges();
 	}
 
 	inline u32 getModified()
@@ -130,6 +211,13 @@ class MapBlock
 
 	std::string getModifiedReasonString();
 
+	// Incremented on every modification; used to tell whether the block
+	// changed since a snapshot of it was taken
+	inline u32 getModifiedCounter()
+	{
+		return m_modified_counter;
+	}
+
 	inline void resetModified()
 	{
 		m_modified = MOD_STATE_CLEAN;
@@ -279,7 +367,10 @@ class MapBlock
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		u32 i = z * zstride + y * ystride + x;
+		m_content_index.update(i, data[i].getContent(), n.getContent());
+		data[i] = n;
+		logNodeChange(i);
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -327,7 +418,10 @@ class MapBlock
 		if (!data)
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		u32 i = z * zstride + y * ystride + x;
+		m_content_index.update(i, data[i].getContent(), n.getContent());
+		data[i] = n;
+		logNodeChange(i);
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE_NO_CHECK);
 	}
 
@@ -356,6 +450,26 @@ class MapBlock
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
+	// Returns the content index of the block, building it if needed
+	inline MapBlockContentIndex &getContentIndex()
+	{
+		if (!m_content_index.isValid() && data)
+			m_content_index.build(data, nodecount);
+		return m_content_index;
+	}
+
+	// Returns the sorted indices of all nodes with content c
+	inline const std::vector<u16> &getContentPositions(content_t c)
+	{
+		return getContentIndex().getPositions(c, data, nodecount);
+	}
+
+	static inline v3s16 nodeIndexToPos(u16 i)
+	{
+		return v3s16(i % MAP_BLOCKSIZE, (i / ystride) % MAP_BLOCKSIZE,
+			i / zstride);
+	}
+
 	// Update day-night lighting difference flag.
 	// Sets m_day_night_differs to appropriate value.
 	// These methods don't care about neighboring blocks.
@@ -482,13 +596,73 @@ class MapBlock
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_VER_LOWEST_WRITE
-	void serialize(std::ostream &os, u8 version, bool disk);
+	// compression is a BlockCompression; versions < 29 always use zlib
+	void serialize(std::ostream &os, u8 version, bool disk,
+			u8 compression = BLOCK_COMPRESSION_ZLIB);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// If nimap is given, the stored node ids are kept and the id-name
+	// mapping is put there instead, to be applied with correctNodeIds().
+	// Then nothing is added to the nodedef. Needs version >= 22.
+	void deSerialize(std::istream &is, u8 version, bool disk,
+			NameIdMapping *nimap = nullptr);
+	// Makes the node ids match the nodedef, adding unknown names to it
+	void correctNodeIds(const NameIdMapping &nimap);
 
 	void serializeNetworkSpecific(std::ostream &os);
 	void deSerializeNetworkSpecific(std::istream &is);
+
+	// Returns a detached copy of this block that can be serialized on
+	// another thread while this one keeps being modified
+	MapBlock *createSnapshot();
+
+	// Returns the over-the-network block data (serialize() followed by
+	// serializeNetworkSpecific()). The result is cached and shared between
+	// all peers that use the same versions until the block is modified.
+	std::shared_ptr<const std::string> getNetworkData(u8 version,
+			u16 net_proto_version, u8 compression);
+
+	/*
+		Converts a block as stored in the database (with the version byte)
+		to the newest format using another compression codec, without
+		deserializing it. Returns false if the version is too old for this;
+		such blocks are converted when they are loaded.
+		If bulk_data is given, the uncompressed node data is stored there.
+	*/
+	static bool recompressBlob(const std::string &blob, u8 compression,
+			std::string *result, std::string *bulk_data = nullptr);
+
+	// Must be called by everything that changes the networked block data
+	// without going through raiseModified()
+	inline void invalidateNetworkData()
+	{
+		m_network_data.reset();
+		resetNodeChanges();
+	}
+
+	/*
+		Node change log
+
+		Changes of single nodes are logged, so that a peer which has an
+		earlier version of the block can be sent only the changed nodes.
+		Every other change of the networked data, and too many changes,
+		start a new log. Versions are unique over all blocks, a block
+		that is unloaded and loaded again doesn't reuse them.
+	*/
+
+	// Version of the networked data of the block
+	inline u64 getNodeVersion() const
+	{
+		return m_node_changes_base + m_node_changes.size();
+	}
+
+	// Gets the sorted indices of the nodes changed since version.
+	// Returns false if they aren't known, the whole block has to be sent.
+	bool getChangedNodes(u64 version, std::vector<u16> &indices) const;
+
+	// At most this many changes are logged before a new log is started
+	static const u32 max_node_changes = 256;
+
 private:
 	/*
 		Private methods
@@ -513,6 +687,16 @@ class MapBlock
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	inline void logNodeChange(u16 i)
+	{
+		if (m_node_changes.size() >= max_node_changes)
+			resetNodeChanges();
+		else
+			m_node_changes.push_back(i);
+	}
+
+	void resetNodeChanges();
+
 public:
 	/*
 		Public member variables
@@ -531,14 +715,6 @@ class MapBlock
 
 	static const u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
 
-	//// ABM optimizations ////
-	// Cache of content types
-	std::unordered_set<content_t> contents;
-	// True if content types are cached
-	bool contents_cached = false;
-	// True if we never want to cache content types for this block
-	bool do_not_cache_contents = false;
-
 private:
 	/*
 		Private member variables
@@ -565,6 +741,9 @@ class MapBlock
 	*/
 	MapNode *data = nullptr;
 
+	// Built on demand, see getContentIndex()
+	MapBlockContentIndex m_content_index;
+
 	/*
 		- On the server, this is used for telling whether the
 		  block has been modified from the one on disk.
@@ -572,6 +751,7 @@ class MapBlock
 	*/
 	u32 m_modified = MOD_STATE_WRITE_NEEDED;
 	u32 m_modified_reason = MOD_REASON_INITIAL;
+	u32 m_modified_counter = 0;
 
 	/*
 		When propagating sunlight and the above block doesn't exist,
@@ -599,6 +779,19 @@ class MapBlock
 
 	bool m_generated = false;
 
+	/*
+		Cached result of getNetworkData() and the versions it was made for.
+		NULL if there is no valid cache.
+	*/
+	std::shared_ptr<const std::string> m_network_data;
+	u8 m_network_data_ser_ver = 0;
+	u16 m_network_data_proto_ver = 0;
+	u8 m_network_data_compression = 0;
+
+	// See getNodeVersion()
+	u64 m_node_changes_base = 0;
+	std::vector<u16> m_node_changes;
+
 	/*
 		When block is removed from active blocks, this is set to gametime.
 		Value BLOCK_TIMESTAMP_UNDEFINED=0xffffffff means there is no timestamp.
@@ -0,0 +1,156 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblockindex.h"
+#include <atomic>
+
+#define MAPBLOCKINDEX_MIN_CAPACITY 1024
+#define MAPBLOCKINDEX_CACHE_SIZE 8
+
+// Generations are unique across all indices, so a cache filled from an
+// index that has since been deleted can never look valid for a new one
+static std::atomic<u64> s_next_generation(1);
+
+struct MapBlockIndexCache
+{
+	const MapBlockIndex *owner = nullptr;
+	u64 generation = 0;
+	struct {
+		v3s16 pos;
+		MapBlock *block = nullptr;
+	} entries[MAPBLOCKINDEX_CACHE_SIZE];
+};
+
+static thread_local MapBlockIndexCache s_cache;
+
+MapBlockIndex::MapBlockIndex():
+	m_slots(MAPBLOCKINDEX_MIN_CAPACITY),
+	m_mask(MAPBLOCKINDEX_MIN_CAPACITY - 1),
+	m_generation(s_next_generation++)
+{
+}
+
+MapBlock *MapBlockIndex::get(v3s16 p) const
+{
+	MapBlockIndexCache &cache = s_cache;
+	if (cache.owner != this || cache.generation != m_generation) {
+		cache = MapBlockIndexCache();
+		cache.owner = this;
+		cache.generation = m_generation;
+	}
+
+	auto &entry = cache.entries[hash(p) % MAPBLOCKINDEX_CACHE_SIZE];
+	if (entry.block && entry.pos == p)
+		return entry.block;
+
+	MapBlock *block = lookup(p);
+	if (block) {
+		entry.pos = p;
+		entry.block = block;
+	}
+	return block;
+}
+
+MapBlock *MapBlockIndex::lookup(v3s16 p) const
+{
+	for (size_t i = hash(p) & m_mask; ; i = (i + 1) & m_mask) {
+		const Slot &slot = m_slots[i];
+		if (!slot.block)
+			return nullptr;
+		if (slot.pos == p)
+			return slot.block;
+	}
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	// Keep the load factor below 1/2
+	if ((m_size + 1) * 2 > m_slots.size())
+		rehash(m_slots.size() * 2);
+
+	size_t i = hash(p) & m_mask;
+	for (; m_slots[i].block; i = (i + 1) & m_mask) {
+		if (m_slots[i].pos == p) {
+			m_slots[i].block = block;
+			invalidateCaches();
+			return;
+		}
+	}
+	m_slots[i].pos = p;
+	m_slots[i].block = block;
+	m_size++;
+}
+
+void MapBlockIndex::erase(v3s16 p)
+{
+	size_t i = hash(p) & m_mask;
+	for (; ; i = (i + 1) & m_mask) {
+		if (!m_slots[i].block)
+			return;
+		if (m_slots[i].pos == p)
+			break;
+	}
+
+	// Backward shift deletion: move following entries of the probe
+	// sequence up so that lookups never need tombstones
+	size_t j = i;
+	while (true) {
+		j = (j + 1) & m_mask;
+		if (!m_slots[j].block)
+			break;
+		size_t home = hash(m_slots[j].pos) & m_mask;
+		// Move the entry at j to the hole at i if its home slot is not
+		// cyclically in (i, j]
+		bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+		if (movable) {
+			m_slots[i] = m_slots[j];
+			i = j;
+		}
+	}
+	m_slots[i] = Slot();
+	m_size--;
+
+	invalidateCaches();
+}
+
+void MapBlockIndex::clear()
+{
+	m_slots.assign(MAPBLOCKINDEX_MIN_CAPACITY, Slot());
+	m_mask = MAPBLOCKINDEX_MIN_CAPACITY - 1;
+	m_size = 0;
+	invalidateCaches();
+}
+
+void MapBlockIndex::rehash(size_t capacity)
+{
+	std::vector<Slot> old;
+	old.swap(m_slots);
+	m_slots.resize(capacity);
+	m_mask = capacity - 1;
+	m_size = 0;
+	for (const Slot &slot : old) {
+		if (slot.block)
+			insert(slot.pos, slot.block);
+	}
+}
+
+void MapBlockIndex::invalidateCaches()
+{
+	m_generation = s_next_generation++;
+}
@@ -0,0 +1,73 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include <vector>
+
+class MapBlock;
+
+/*
+	Open addressing hash table from block position to MapBlock.
+
+	This is what Map::getBlockNoCreateNoEx() looks blocks up in; the
+	MapSectors still own the blocks and tell the index about every block
+	they gain or lose.
+
+	Lookups go through a small per-thread cache of recently found blocks.
+	Removing a block from any index invalidates the caches of that index.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+
+	MapBlock *get(v3s16 p) const;
+
+	// Replaces an existing entry for the same position
+	void insert(v3s16 p, MapBlock *block);
+	void erase(v3s16 p);
+	void clear();
+
+	size_t size() const { return m_size; }
+
+private:
+	struct Slot
+	{
+		v3s16 pos;
+		MapBlock *block = nullptr; // nullptr if the slot is free
+	};
+
+	static inline u32 hash(v3s16 p)
+	{
+		u64 key = ((u64)(u16)p.X << 32) | ((u64)(u16)p.Y << 16) | (u16)p.Z;
+		return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	MapBlock *lookup(v3s16 p) const;
+	void rehash(size_t capacity);
+	void invalidateCaches();
+
+	std::vector<Slot> m_slots;
+	size_t m_mask;
+	size_t m_size = 0;
+	// Changes whenever a block is removed, see get()
+	u64 m_generation;
+};
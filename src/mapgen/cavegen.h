@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define VMANIP_FLAG_CAVE VOXELFLAG_CHECKED1
 
 class GenerateNotifier;
+class WorkerPool;
 
 /*
 	CavesNoiseIntersection is a cave digging algorithm that carves smooth,
@@ -44,7 +45,8 @@ class CavesNoiseIntersection
 		NoiseParams *np_cave2, s32 seed, float cave_width);
 	~CavesNoiseIntersection();
 
-	void generateCaves(MMVManip *vm, v3s16 nmin, v3s16 nmax, u8 *biomemap);
+	void generateCaves(MMVManip *vm, v3s16 nmin, v3s16 nmax, u8 *biomemap,
+		WorkerPool *pool = nullptr);
 
 private:
 	const NodeDefManager *m_ndef;
@@ -73,7 +75,8 @@ class CavernsNoise
 		float cavern_taper, float cavern_threshold);
 	~CavernsNoise();
 
-	bool generateCaverns(MMVManip *vm, v3s16 nmin, v3s16 nmax);
+	bool generateCaverns(MMVManip *vm, v3s16 nmin, v3s16 nmax,
+		WorkerPool *pool = nullptr);
 
 private:
 	const NodeDefManager *m_ndef;
@@ -39,6 +39,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/serialize.h"
 #include "util/numeric.h"
 #include "filesys.h"
+#include "threading/workerpool.h"
 #include "log.h"
 #include "mapgen_carpathian.h"
 #include "mapgen_flat.h"
@@ -51,6 +52,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "cavegen.h"
 #include "dungeongen.h"
 
+// Slabs of a chunk per thread of the worker pool, so that a thread which
+// is held up delays the chunk less
+#define MAPGEN_SLABS_PER_THREAD 2
+
 FlagDesc flagdesc_mapgen[] = {
 	{"caves",       MG_CAVES},
 	{"dungeons",    MG_DUNGEONS},
@@ -71,6 +76,18 @@ FlagDesc flagdesc_gennotify[] = {
 	{NULL,               0}
 };
 
+const char *mapgen_phase_names[MGPHASE_COUNT] = {
+	"noise",
+	"terrain",
+	"caves",
+	"dungeons",
+	"biomes",
+	"ores",
+	"decorations",
+	"lighting",
+	"liquids",
+};
+
 struct MapgenDesc {
 	const char *name;
 	bool is_user_visible;
@@ -123,7 +140,8 @@ Mapgen::Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge) :
 	*/
 	seed = (s32)params->seed;
 
-	ndef      = emerge->ndef;
+	ndef       = emerge->ndef;
+	workerpool = emerge->mapgen_pool;
 }
 
 
@@ -286,6 +304,7 @@ s16 Mapgen::findLiquidSurface(v2s16 p2d, s16 ymin, s16 ymax)
 
 void Mapgen::updateHeightmap(v3s16 nmin, v3s16 nmax)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	if (!heightmap)
 		return;
 
@@ -363,6 +382,7 @@ inline bool Mapgen::isLiquidHorizontallyFlowable(u32 vi, v3s16 em)
 
 void Mapgen::updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nmax)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_LIQUIDS);
 	bool isignored, isliquid, wasignored, wasliquid, waschecked, waspushed;
 	const v3s16 &em  = vm->m_area.getExtent();
 
@@ -415,6 +435,7 @@ void Mapgen::updateLiquid(UniqueQueue<v3s16> *trans_liquid, v3s16 nmin, v3s16 nm
 
 void Mapgen::setLighting(u8 light, v3s16 nmin, v3s16 nmax)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_LIGHTING);
 	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen lighting update", SPT_AVG);
 	VoxelArea a(nmin, nmax);
 
@@ -472,6 +493,7 @@ void Mapgen::lightSpread(VoxelArea &a, v3s16 p, u8 light)
 void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax, v3s16 full_nmin, v3s16 full_nmax,
 	bool propagate_shadow)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_LIGHTING);
 	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen lighting update", SPT_AVG);
 	//TimeTaker t("updateLighting");
 
@@ -559,6 +581,56 @@ void Mapgen::spreadLight(v3s16 nmin, v3s16 nmax)
 }
 
 
+u32 Mapgen::getSlabCount(s16 zmin, s16 zmax) const
+{
+	if (!workerpool || workerpool->getThreadCount() == 1 || zmax < zmin)
+		return 1;
+
+	return MYMIN((u32)(zmax - zmin + 1),
+		workerpool->getThreadCount() * MAPGEN_SLABS_PER_THREAD);
+}
+
+
+void Mapgen::forEachSlab(s16 zmin, s16 zmax,
+	const std::function<void(u32, s16, s16)> &f)
+{
+	u32 slabs = getSlabCount(zmin, zmax);
+	if (slabs == 1) {
+		f(0, zmin, zmax);
+		return;
+	}
+
+	s32 length = zmax - zmin + 1;
+	workerpool->parallelFor(slabs, [&] (size_t slab) {
+		s32 begin = length * (s32)slab / (s32)slabs;
+		s32 end = length * (s32)(slab + 1) / (s32)slabs;
+		f(slab, zmin + begin, zmin + end - 1);
+	});
+}
+
+
+MapgenPhaseTimer::MapgenPhaseTimer(Mapgen *mapgen, MapgenPhase phase) :
+	m_mapgen(mapgen),
+	m_phase(phase),
+	m_parent(mapgen->current_phase),
+	m_start(porting::getTimeUs())
+{
+	if (m_parent)
+		m_mapgen->phase_times[m_parent->m_phase] += m_start - m_parent->m_start;
+	m_mapgen->current_phase = this;
+}
+
+
+MapgenPhaseTimer::~MapgenPhaseTimer()
+{
+	u64 time = porting::getTimeUs();
+	m_mapgen->phase_times[m_phase] += time - m_start;
+	if (m_parent)
+		m_parent->m_start = time;
+	m_mapgen->current_phase = m_parent;
+}
+
+
 ////
 //// MapgenBasic
 ////
@@ -643,143 +715,151 @@ MapgenBasic::~MapgenBasic()
 
 void MapgenBasic::generateBiomes()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_BIOMES);
 	// can't generate biomes without a biome generator!
 	assert(biomegen);
 	assert(biomemap);
 
 	const v3s16 &em = vm->m_area.getExtent();
-	u32 index = 0;
 
-	noise_filler_depth->perlinMap2D(node_min.X, node_min.Z);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_filler_depth->perlinMap2D(node_min.X, node_min.Z);
+	}
 
-	for (s16 z = node_min.Z; z <= node_max.Z; z++)
-	for (s16 x = node_min.X; x <= node_max.X; x++, index++) {
-		Biome *biome = NULL;
-		biome_t water_biome_index = 0;
-		u16 depth_top = 0;
-		u16 base_filler = 0;
-		u16 depth_water_top = 0;
-		u16 depth_riverbed = 0;
-		s16 biome_y_min = -MAX_MAP_GENERATION_LIMIT;
-		u32 vi = vm->m_area.index(x, node_max.Y, z);
-
-		// Check node at base of mapchunk above, either a node of a previously
-		// generated mapchunk or if not, a node of overgenerated base terrain.
-		content_t c_above = vm->m_data[vi + em.X].getContent();
-		bool air_above = c_above == CONTENT_AIR;
-		bool river_water_above = c_above == c_river_water_source;
-		bool water_above = c_above == c_water_source || river_water_above;
-
-		biomemap[index] = BIOME_NONE;
-
-		// If there is air or water above enable top/filler placement, otherwise force
-		// nplaced to stone level by setting a number exceeding any possible filler depth.
-		u16 nplaced = (air_above || water_above) ? 0 : U16_MAX;
-
-		for (s16 y = node_max.Y; y >= node_min.Y; y--) {
-			content_t c = vm->m_data[vi].getContent();
-			// Biome is (re)calculated:
-			// 1. At the surface of stone below air or water.
-			// 2. At the surface of water below air.
-			// 3. When stone or water is detected but biome has not yet been calculated.
-			// 4. When stone or water is detected just below a biome's lower limit.
-			bool is_stone_surface = (c == c_stone) &&
-				(air_above || water_above || !biome || y < biome_y_min); // 1, 3, 4
-
-			bool is_water_surface =
-				(c == c_water_source || c == c_river_water_source) &&
-				(air_above || !biome || y < biome_y_min); // 2, 3, 4
-
-			if (is_stone_surface || is_water_surface) {
-				// (Re)calculate biome
-				biome = biomegen->getBiomeAtIndex(index, v3s16(x, y, z));
-
-				// Add biome to biomemap at first stone surface detected
-				if (biomemap[index] == BIOME_NONE && is_stone_surface)
-					biomemap[index] = biome->index;
-
-				// Store biome of first water surface detected, as a fallback
-				// entry for the biomemap.
-				if (water_biome_index == 0 && is_water_surface)
-					water_biome_index = biome->index;
-
-				depth_top = biome->depth_top;
-				base_filler = MYMAX(depth_top +
-					biome->depth_filler +
-					noise_filler_depth->result[index], 0.0f);
-				depth_water_top = biome->depth_water_top;
-				depth_riverbed = biome->depth_riverbed;
-				biome_y_min = biome->min_pos.Y;
-			}
+	// The columns are independent of each other
+	forEachSlab(node_min.Z, node_max.Z, [&] (u32, s16 zmin, s16 zmax) {
+		u32 index = (zmin - node_min.Z) * csize.X;
+		for (s16 z = zmin; z <= zmax; z++)
+		for (s16 x = node_min.X; x <= node_max.X; x++, index++) {
+			Biome *biome = NULL;
+			biome_t water_biome_index = 0;
+			u16 depth_top = 0;
+			u16 base_filler = 0;
+			u16 depth_water_top = 0;
+			u16 depth_riverbed = 0;
+			s16 biome_y_min = -MAX_MAP_GENERATION_LIMIT;
+			u32 vi = vm->m_area.index(x, node_max.Y, z);
+
+			// Check node at base of mapchunk above, either a node of a previously
+			// generated mapchunk or if not, a node of overgenerated base terrain.
+			content_t c_above = vm->m_data[vi + em.X].getContent();
+			bool air_above = c_above == CONTENT_AIR;
+			bool river_water_above = c_above == c_river_water_source;
+			bool water_above = c_above == c_water_source || river_water_above;
+
+			biomemap[index] = BIOME_NONE;
+
+			// If there is air or water above enable top/filler placement, otherwise force
+			// nplaced to stone level by setting a number exceeding any possible filler depth.
+			u16 nplaced = (air_above || water_above) ? 0 : U16_MAX;
+
+			for (s16 y = node_max.Y; y >= node_min.Y; y--) {
+				content_t c = vm->m_data[vi].getContent();
+				// Biome is (re)calculated:
+				// 1. At the surface of stone below air or water.
+				// 2. At the surface of water below air.
+				// 3. When stone or water is detected but biome has not yet been calculated.
+				// 4. When stone or water is detected just below a biome's lower limit.
+				bool is_stone_surface = (c == c_stone) &&
+					(air_above || water_above || !biome || y < biome_y_min); // 1, 3, 4
+
+				bool is_water_surface =
+					(c == c_water_source || c == c_river_water_source) &&
+					(air_above || !biome || y < biome_y_min); // 2, 3, 4
+
+				if (is_stone_surface || is_water_surface) {
+					// (Re)calculate biome
+					biome = biomegen->getBiomeAtIndex(index, v3s16(x, y, z));
+
+					// Add biome to biomemap at first stone surface detected
+					if (biomemap[index] == BIOME_NONE && is_stone_surface)
+						biomemap[index] = biome->index;
+
+					// Store biome of first water surface detected, as a fallback
+					// entry for the biomemap.
+					if (water_biome_index == 0 && is_water_surface)
+						water_biome_index = biome->index;
+
+					depth_top = biome->depth_top;
+					base_filler = MYMAX(depth_top +
+						biome->depth_filler +
+						noise_filler_depth->result[index], 0.0f);
+					depth_water_top = biome->depth_water_top;
+					depth_riverbed = biome->depth_riverbed;
+					biome_y_min = biome->min_pos.Y;
+				}
 
-			if (c == c_stone) {
-				content_t c_below = vm->m_data[vi - em.X].getContent();
-
-				// If the node below isn't solid, make this node stone, so that
-				// any top/filler nodes above are structurally supported.
-				// This is done by aborting the cycle of top/filler placement
-				// immediately by forcing nplaced to stone level.
-				if (c_below == CONTENT_AIR
-						|| c_below == c_water_source
-						|| c_below == c_river_water_source)
-					nplaced = U16_MAX;
-
-				if (river_water_above) {
-					if (nplaced < depth_riverbed) {
-						vm->m_data[vi] = MapNode(biome->c_riverbed);
+				if (c == c_stone) {
+					content_t c_below = vm->m_data[vi - em.X].getContent();
+
+					// If the node below isn't solid, make this node stone, so that
+					// any top/filler nodes above are structurally supported.
+					// This is done by aborting the cycle of top/filler placement
+					// immediately by forcing nplaced to stone level.
+					if (c_below == CONTENT_AIR
+							|| c_below == c_water_source
+							|| c_below == c_river_water_source)
+						nplaced = U16_MAX;
+
+					if (river_water_above) {
+						if (nplaced < depth_riverbed) {
+							vm->m_data[vi] = MapNode(biome->c_riverbed);
+							nplaced++;
+						} else {
+							nplaced = U16_MAX;  // Disable top/filler placement
+							river_water_above = false;
+						}
+					} else if (nplaced < depth_top) {
+						vm->m_data[vi] = MapNode(biome->c_top);
+						nplaced++;
+					} else if (nplaced < base_filler) {
+						vm->m_data[vi] = MapNode(biome->c_filler);
 						nplaced++;
 					} else {
+						vm->m_data[vi] = MapNode(biome->c_stone);
 						nplaced = U16_MAX;  // Disable top/filler placement
-						river_water_above = false;
 					}
-				} else if (nplaced < depth_top) {
-					vm->m_data[vi] = MapNode(biome->c_top);
-					nplaced++;
-				} else if (nplaced < base_filler) {
-					vm->m_data[vi] = MapNode(biome->c_filler);
-					nplaced++;
-				} else {
-					vm->m_data[vi] = MapNode(biome->c_stone);
+
+					air_above = false;
+					water_above = false;
+				} else if (c == c_water_source) {
+					vm->m_data[vi] = MapNode((y > (s32)(water_level - depth_water_top))
+							? biome->c_water_top : biome->c_water);
+					nplaced = 0;  // Enable top/filler placement for next surface
+					air_above = false;
+					water_above = true;
+				} else if (c == c_river_water_source) {
+					vm->m_data[vi] = MapNode(biome->c_river_water);
+					nplaced = 0;  // Enable riverbed placement for next surface
+					air_above = false;
+					water_above = true;
+					river_water_above = true;
+				} else if (c == CONTENT_AIR) {
+					nplaced = 0;  // Enable top/filler placement for next surface
+					air_above = true;
+					water_above = false;
+				} else {  // Possible various nodes overgenerated from neighbouring mapchunks
 					nplaced = U16_MAX;  // Disable top/filler placement
+					air_above = false;
+					water_above = false;
 				}
 
-				air_above = false;
-				water_above = false;
-			} else if (c == c_water_source) {
-				vm->m_data[vi] = MapNode((y > (s32)(water_level - depth_water_top))
-						? biome->c_water_top : biome->c_water);
-				nplaced = 0;  // Enable top/filler placement for next surface
-				air_above = false;
-				water_above = true;
-			} else if (c == c_river_water_source) {
-				vm->m_data[vi] = MapNode(biome->c_river_water);
-				nplaced = 0;  // Enable riverbed placement for next surface
-				air_above = false;
-				water_above = true;
-				river_water_above = true;
-			} else if (c == CONTENT_AIR) {
-				nplaced = 0;  // Enable top/filler placement for next surface
-				air_above = true;
-				water_above = false;
-			} else {  // Possible various nodes overgenerated from neighbouring mapchunks
-				nplaced = U16_MAX;  // Disable top/filler placement
-				air_above = false;
-				water_above = false;
+				VoxelArea::add_y(em, vi, -1);
 			}
-
-			VoxelArea::add_y(em, vi, -1);
+			// If no stone surface detected in mapchunk column and a water surface
+			// biome fallback exists, add it to the biomemap. This avoids water
+			// surface decorations failing in deep water.
+			if (biomemap[index] == BIOME_NONE && water_biome_index != 0)
+				biomemap[index] = water_biome_index;
 		}
-		// If no stone surface detected in mapchunk column and a water surface
-		// biome fallback exists, add it to the biomemap. This avoids water
-		// surface decorations failing in deep water.
- 		if (biomemap[index] == BIOME_NONE && water_biome_index != 0)
-			biomemap[index] = water_biome_index;
-	}
+	});
 }
 
 
 void MapgenBasic::dustTopNodes()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_BIOMES);
 	if (node_max.Y < water_level)
 		return;
 
@@ -844,18 +924,20 @@ void MapgenBasic::dustTopNodes()
 
 void MapgenBasic::generateCavesNoiseIntersection(s16 max_stone_y)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_CAVES);
 	if (node_min.Y > max_stone_y)
 		return;
 
 	CavesNoiseIntersection caves_noise(ndef, m_bmgr, csize,
 		&np_cave1, &np_cave2, seed, cave_width);
 
-	caves_noise.generateCaves(vm, node_min, node_max, biomemap);
+	caves_noise.generateCaves(vm, node_min, node_max, biomemap, workerpool);
 }
 
 
 void MapgenBasic::generateCavesRandomWalk(s16 max_stone_y, s16 large_cave_depth)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_CAVES);
 	if (node_min.Y > max_stone_y || node_max.Y > large_cave_depth)
 		return;
 
@@ -874,18 +956,20 @@ void MapgenBasic::generateCavesRandomWalk(s16 max_stone_y, s16 large_cave_depth)
 
 bool MapgenBasic::generateCavernsNoise(s16 max_stone_y)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_CAVES);
 	if (node_min.Y > max_stone_y || node_min.Y > cavern_limit)
 		return false;
 
 	CavernsNoise caverns_noise(ndef, csize, &np_cavern,
 		seed, cavern_limit, cavern_taper, cavern_threshold);
 
-	return caverns_noise.generateCaverns(vm, node_min, node_max);
+	return caverns_noise.generateCaverns(vm, node_min, node_max, workerpool);
 }
 
 
 void MapgenBasic::generateDungeons(s16 max_stone_y)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_DUNGEONS);
 	if (max_stone_y < node_min.Y)
 		return;
 
@@ -1140,6 +1224,16 @@ void MapgenParams::calcMapgenEdges()
 }
 
 
+void MapgenParams::getMapgenEdges(s16 *edge_min, s16 *edge_max)
+{
+	if (!m_mapgen_edges_calculated)
+		calcMapgenEdges();
+
+	*edge_min = mapgen_edge_min;
+	*edge_max = mapgen_edge_max;
+}
+
+
 s32 MapgenParams::getSpawnRangeMax()
 {
 	if (!m_mapgen_edges_calculated)
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "util/string.h"
 #include "util/container.h"
+#include <functional>
 
 #define MAPGEN_DEFAULT MAPGEN_V7
 #define MAPGEN_DEFAULT_NAME "v7"
@@ -57,6 +58,7 @@ class VoxelManipulator;
 struct BlockMakeData;
 class VoxelArea;
 class Map;
+class WorkerPool;
 
 enum MapgenObject {
 	MGOBJ_VMANIP,
@@ -102,6 +104,24 @@ class GenerateNotifier {
 	std::list<GenNotifyEvent> m_notify_events;
 };
 
+// Parts of the generation of a chunk, which are timed separately
+enum MapgenPhase {
+	MGPHASE_NOISE,
+	MGPHASE_TERRAIN,
+	MGPHASE_CAVES,
+	MGPHASE_DUNGEONS,
+	MGPHASE_BIOMES,
+	MGPHASE_ORES,
+	MGPHASE_DECORATIONS,
+	MGPHASE_LIGHTING,
+	MGPHASE_LIQUIDS,
+	MGPHASE_COUNT,
+};
+
+extern const char *mapgen_phase_names[MGPHASE_COUNT];
+
+class MapgenPhaseTimer;
+
 enum MapgenType {
 	MAPGEN_V5,
 	MAPGEN_V6,
@@ -134,6 +154,8 @@ struct MapgenParams {
 	virtual void writeParams(Settings *settings) const;
 
 	s32 getSpawnRangeMax();
+	// Nodes at the outer sides of the outermost chunks that can be generated
+	void getMapgenEdges(s16 *edge_min, s16 *edge_max);
 
 private:
 	void calcMapgenEdges();
@@ -170,6 +192,13 @@ class Mapgen {
 	BiomeGen *biomegen = nullptr;
 	GenerateNotifier gennotify;
 
+	// Shared with the other mapgens, see forEachSlab()
+	WorkerPool *workerpool = nullptr;
+
+	// Microseconds spent in each phase, summed up until they are reset
+	u64 phase_times[MGPHASE_COUNT] = {};
+	MapgenPhaseTimer *current_phase = nullptr;
+
 	Mapgen() = default;
 	Mapgen(int mapgenid, MapgenParams *params, EmergeManager *emerge);
 	virtual ~Mapgen() = default;
@@ -195,6 +224,14 @@ class Mapgen {
 	void propagateSunlight(v3s16 nmin, v3s16 nmax, bool propagate_shadow);
 	void spreadLight(v3s16 nmin, v3s16 nmax);
 
+	// Splits [zmin, zmax] into slabs and calls f(slab, slab_zmin, slab_zmax)
+	// for each, on the threads of the worker pool. The slab boundaries
+	// depend on the pool, so f must give the same results however the
+	// range is split up.
+	u32 getSlabCount(s16 zmin, s16 zmax) const;
+	void forEachSlab(s16 zmin, s16 zmax,
+		const std::function<void(u32, s16, s16)> &f);
+
 	virtual void makeChunk(BlockMakeData *data) {}
 	virtual int getGroundLevelAtPoint(v2s16 p) { return 0; }
 
@@ -220,6 +257,24 @@ class Mapgen {
 	inline bool isLiquidHorizontallyFlowable(u32 vi, v3s16 em);
 };
 
+/*
+	Adds the time until it goes out of scope to a phase of the mapgen.
+	Phases can be nested, the outer one is paused meanwhile. Only to be used
+	on the thread that runs makeChunk(), not within forEachSlab().
+*/
+class MapgenPhaseTimer {
+public:
+	MapgenPhaseTimer(Mapgen *mapgen, MapgenPhase phase);
+	~MapgenPhaseTimer();
+	DISABLE_CLASS_COPY(MapgenPhaseTimer);
+
+private:
+	Mapgen *m_mapgen;
+	MapgenPhase m_phase;
+	MapgenPhaseTimer *m_parent;
+	u64 m_start;
+};
+
 /*
 	MapgenBasic is a Mapgen implementation that handles basic functionality
 	the majority of conventional mapgens will probably want to use, but isn't
@@ -248,7 +248,10 @@ void MapgenCarpathian::makeChunk(BlockMakeData *data)
 
 	// Init biome generator, place biome-specific nodes, and build biomemap
 	if (flags & MG_BIOMES) {
-		biomegen->calcBiomeNoise(node_min);
+		{
+			MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+			biomegen->calcBiomeNoise(node_min);
+		}
 		generateBiomes();
 	}
 
@@ -373,22 +376,27 @@ float MapgenCarpathian::terrainLevelAtPoint(s16 x, s16 z)
 
 int MapgenCarpathian::generateTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	MapNode mn_air(CONTENT_AIR);
 	MapNode mn_stone(c_stone);
 	MapNode mn_water(c_water_source);
 
 	// Calculate noise for terrain generation
-	noise_height1->perlinMap2D(node_min.X, node_min.Z);
-	noise_height2->perlinMap2D(node_min.X, node_min.Z);
-	noise_height3->perlinMap2D(node_min.X, node_min.Z);
-	noise_height4->perlinMap2D(node_min.X, node_min.Z);
-	noise_hills_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_ridge_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_step_terrain->perlinMap2D(node_min.X, node_min.Z);
-	noise_hills->perlinMap2D(node_min.X, node_min.Z);
-	noise_ridge_mnt->perlinMap2D(node_min.X, node_min.Z);
-	noise_step_mnt->perlinMap2D(node_min.X, node_min.Z);
-	noise_mnt_var->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_height1->perlinMap2D(node_min.X, node_min.Z);
+		noise_height2->perlinMap2D(node_min.X, node_min.Z);
+		noise_height3->perlinMap2D(node_min.X, node_min.Z);
+		noise_height4->perlinMap2D(node_min.X, node_min.Z);
+		noise_hills_terrain->perlinMap2D(node_min.X, node_min.Z);
+		noise_ridge_terrain->perlinMap2D(node_min.X, node_min.Z);
+		noise_step_terrain->perlinMap2D(node_min.X, node_min.Z);
+		noise_hills->perlinMap2D(node_min.X, node_min.Z);
+		noise_ridge_mnt->perlinMap2D(node_min.X, node_min.Z);
+		noise_step_mnt->perlinMap2D(node_min.X, node_min.Z);
+		noise_mnt_var->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			NULL, workerpool);
+	}
 
 	//// Place nodes
 	const v3s16 &em = vm->m_area.getExtent();
@@ -196,7 +196,10 @@ void MapgenFlat::makeChunk(BlockMakeData *data)
 
 	// Init biome generator, place biome-specific nodes, and build biomemap
 	if (flags & MG_BIOMES) {
-		biomegen->calcBiomeNoise(node_min);
+		{
+			MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+			biomegen->calcBiomeNoise(node_min);
+		}
 		generateBiomes();
 	}
 
@@ -239,6 +242,7 @@ void MapgenFlat::makeChunk(BlockMakeData *data)
 
 s16 MapgenFlat::generateTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	MapNode n_air(CONTENT_AIR);
 	MapNode n_stone(c_stone);
 	MapNode n_water(c_water_source);
@@ -248,8 +252,10 @@ s16 MapgenFlat::generateTerrain()
 	u32 ni2d = 0;
 
 	bool use_noise = (spflags & MGFLAT_LAKES) || (spflags & MGFLAT_HILLS);
-	if (use_noise)
+	if (use_noise) {
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
 		noise_terrain->perlinMap2D(node_min.X, node_min.Z);
+	}
 
 	for (s16 z = node_min.Z; z <= node_max.Z; z++)
 	for (s16 x = node_min.X; x <= node_max.X; x++, ni2d++) {
@@ -207,7 +207,10 @@ void MapgenFractal::makeChunk(BlockMakeData *data)
 
 	// Init biome generator, place biome-specific nodes, and build biomemap
 	if (flags & MG_BIOMES) {
-		biomegen->calcBiomeNoise(node_min);
+		{
+			MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+			biomegen->calcBiomeNoise(node_min);
+		}
 		generateBiomes();
 	}
 
@@ -380,6 +383,7 @@ bool MapgenFractal::getFractalAtPoint(s16 x, s16 y, s16 z)
 
 s16 MapgenFractal::generateTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	MapNode n_air(CONTENT_AIR);
 	MapNode n_stone(c_stone);
 	MapNode n_water(c_water_source);
@@ -387,7 +391,10 @@ s16 MapgenFractal::generateTerrain()
 	s16 stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
 	u32 index2d = 0;
 
-	noise_seabed->perlinMap2D(node_min.X, node_min.Z);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_seabed->perlinMap2D(node_min.X, node_min.Z);
+	}
 
 	for (s16 z = node_min.Z; z <= node_max.Z; z++) {
 		for (s16 y = node_min.Y - 1; y <= node_max.Y + 1; y++) {
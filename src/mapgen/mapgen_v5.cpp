@@ -207,7 +207,10 @@ void MapgenV5::makeChunk(BlockMakeData *data)
 
 	// Init biome generator, place biome-specific nodes, and build biomemap
 	if (flags & MG_BIOMES) {
-		biomegen->calcBiomeNoise(node_min);
+		{
+			MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+			biomegen->calcBiomeNoise(node_min);
+		}
 		generateBiomes();
 	}
 
@@ -265,13 +268,18 @@ void MapgenV5::makeChunk(BlockMakeData *data)
 
 int MapgenV5::generateBaseTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	u32 index = 0;
 	u32 index2d = 0;
 	int stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
 
-	noise_factor->perlinMap2D(node_min.X, node_min.Z);
-	noise_height->perlinMap2D(node_min.X, node_min.Z);
-	noise_ground->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_factor->perlinMap2D(node_min.X, node_min.Z);
+		noise_height->perlinMap2D(node_min.X, node_min.Z);
+		noise_ground->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			NULL, workerpool);
+	}
 
 	for (s16 z=node_min.Z; z<=node_max.Z; z++) {
 		for (s16 y=node_min.Y - 1; y<=node_max.Y + 1; y++) {
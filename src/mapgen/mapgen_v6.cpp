@@ -561,6 +561,7 @@ void MapgenV6::makeChunk(BlockMakeData *data)
 	// Add dungeons
 	if ((flags & MG_DUNGEONS) && stone_surface_max_y >= node_min.Y &&
 			full_node_min.Y >= dungeon_ymin && full_node_max.Y <= dungeon_ymax) {
+		MapgenPhaseTimer timer(this, MGPHASE_DUNGEONS);
 		DungeonParams dp;
 
 		dp.seed             = seed;
@@ -634,6 +635,7 @@ void MapgenV6::makeChunk(BlockMakeData *data)
 
 void MapgenV6::calculateNoise()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_NOISE);
 	int x = node_min.X;
 	int z = node_min.Z;
 	int fx = full_node_min.X;
@@ -658,6 +660,7 @@ void MapgenV6::calculateNoise()
 
 int MapgenV6::generateGround()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	//TimeTaker timer1("Generating ground level");
 	MapNode n_air(CONTENT_AIR), n_water_source(c_water_source);
 	MapNode n_stone(c_stone), n_desert_stone(c_desert_stone);
@@ -703,6 +706,7 @@ int MapgenV6::generateGround()
 
 void MapgenV6::addMud()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	// 15ms @cs=8
 	//TimeTaker timer1("add mud");
 	MapNode n_dirt(c_dirt), n_gravel(c_gravel);
@@ -764,6 +768,7 @@ void MapgenV6::addMud()
 
 void MapgenV6::flowMud(s16 &mudflow_minpos, s16 &mudflow_maxpos)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	// 340ms @cs=8
 	//TimeTaker timer1("flow mud");
 
@@ -932,6 +937,7 @@ void MapgenV6::moveMud(u32 remove_index, u32 place_index,
 
 void MapgenV6::placeTreesAndJungleGrass()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_DECORATIONS);
 	//TimeTaker t("placeTrees");
 	if (node_max.Y < water_level)
 		return;
@@ -1046,6 +1052,7 @@ void MapgenV6::placeTreesAndJungleGrass()
 
 void MapgenV6::growGrass() // Add surface nodes
 {
+	MapgenPhaseTimer timer(this, MGPHASE_BIOMES);
 	MapNode n_dirt_with_grass(c_dirt_with_grass);
 	MapNode n_dirt_with_snow(c_dirt_with_snow);
 	MapNode n_snowblock(c_snowblock);
@@ -1098,6 +1105,7 @@ void MapgenV6::growGrass() // Add surface nodes
 
 void MapgenV6::generateCaves(int max_stone_y)
 {
+	MapgenPhaseTimer timer(this, MGPHASE_CAVES);
 	float cave_amount = NoisePerlin2D(np_cave, node_min.X, node_min.Y, seed);
 	int volume_nodes = (node_max.X - node_min.X + 1) *
 					   (node_max.Y - node_min.Y + 1) * MAP_BLOCKSIZE;
@@ -327,7 +327,10 @@ void MapgenV7::makeChunk(BlockMakeData *data)
 
 	// Init biome generator, place biome-specific nodes, and build biomemap
 	if (flags & MG_BIOMES) {
-		biomegen->calcBiomeNoise(node_min);
+		{
+			MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+			biomegen->calcBiomeNoise(node_min);
+		}
 		generateBiomes();
 	}
 
@@ -492,80 +495,112 @@ void MapgenV7::floatBaseExtentFromMap(s16 *float_base_min, s16 *float_base_max,
 
 int MapgenV7::generateTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	MapNode n_air(CONTENT_AIR);
 	MapNode n_stone(c_stone);
 	MapNode n_water(c_water_source);
 
 	//// Calculate noise for terrain generation
-	noise_terrain_persist->perlinMap2D(node_min.X, node_min.Z);
-	float *persistmap = noise_terrain_persist->result;
-
-	noise_terrain_base->perlinMap2D(node_min.X, node_min.Z, persistmap);
-	noise_terrain_alt->perlinMap2D(node_min.X, node_min.Z, persistmap);
-	noise_height_select->perlinMap2D(node_min.X, node_min.Z);
-
-	if ((spflags & MGV7_MOUNTAINS) || (spflags & MGV7_FLOATLANDS)) {
-		noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
-	}
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_terrain_persist->perlinMap2D(node_min.X, node_min.Z);
+		float *persistmap = noise_terrain_persist->result;
+
+		noise_terrain_base->perlinMap2D(node_min.X, node_min.Z, persistmap);
+		noise_terrain_alt->perlinMap2D(node_min.X, node_min.Z, persistmap);
+		noise_height_select->perlinMap2D(node_min.X, node_min.Z);
+
+		if ((spflags & MGV7_MOUNTAINS) || (spflags & MGV7_FLOATLANDS)) {
+			noise_mountain->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+				NULL, workerpool);
+		}
 
-	if (spflags & MGV7_MOUNTAINS) {
-		noise_mount_height->perlinMap2D(node_min.X, node_min.Z);
-	}
+		if (spflags & MGV7_MOUNTAINS) {
+			noise_mount_height->perlinMap2D(node_min.X, node_min.Z);
+		}
 
-	if (spflags & MGV7_FLOATLANDS) {
-		noise_floatland_base->perlinMap2D(node_min.X, node_min.Z);
-		noise_float_base_height->perlinMap2D(node_min.X, node_min.Z);
+		if (spflags & MGV7_FLOATLANDS) {
+			noise_floatland_base->perlinMap2D(node_min.X, node_min.Z);
+			noise_float_base_height->perlinMap2D(node_min.X, node_min.Z);
+		}
 	}
 
 	//// Place nodes
 	const v3s16 &em = vm->m_area.getExtent();
-	s16 stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
-	u32 index2d = 0;
 
-	for (s16 z = node_min.Z; z <= node_max.Z; z++)
-	for (s16 x = node_min.X; x <= node_max.X; x++, index2d++) {
-		s16 surface_y = baseTerrainLevelFromMap(index2d);
-		if (surface_y > stone_surface_max_y)
-			stone_surface_max_y = surface_y;
-
-		// Get extent of floatland base terrain
-		// '+1' to avoid a layer of stone at y = MAX_MAP_GENERATION_LIMIT
-		s16 float_base_min = MAX_MAP_GENERATION_LIMIT + 1;
-		s16 float_base_max = MAX_MAP_GENERATION_LIMIT;
-		if (spflags & MGV7_FLOATLANDS)
-			floatBaseExtentFromMap(&float_base_min, &float_base_max, index2d);
-
-		u32 vi = vm->m_area.index(x, node_min.Y - 1, z);
-		u32 index3d = (z - node_min.Z) * zstride_1u1d + (x - node_min.X);
-
-		for (s16 y = node_min.Y - 1; y <= node_max.Y + 1;
-				y++,
-				index3d += ystride,
-				VoxelArea::add_y(em, vi, 1)) {
-			if (vm->m_data[vi].getContent() != CONTENT_IGNORE)
-				continue;
-
-			if (y <= surface_y) {
-				vm->m_data[vi] = n_stone; // Base terrain
-			} else if ((spflags & MGV7_MOUNTAINS) &&
-					getMountainTerrainFromMap(index3d, index2d, y)) {
-				vm->m_data[vi] = n_stone; // Mountain terrain
-				if (y > stone_surface_max_y)
-					stone_surface_max_y = y;
-			} else if ((spflags & MGV7_FLOATLANDS) &&
-					((y >= float_base_min && y <= float_base_max) ||
-					getFloatlandMountainFromMap(index3d, index2d, y))) {
-				vm->m_data[vi] = n_stone; // Floatland terrain
-				stone_surface_max_y = node_max.Y;
-			} else if (y <= water_level) {
-				vm->m_data[vi] = n_water; // Ground level water
-			} else if ((spflags & MGV7_FLOATLANDS) &&
-					(y >= float_base_max && y <= floatland_level)) {
-				vm->m_data[vi] = n_water; // Floatland water
-			} else {
-				vm->m_data[vi] = n_air;
+	// The columns are independent, only stone_surface_max_y is shared. It
+	// is raised to the highest stone but set to node_max.Y at floatlands,
+	// so each slab notes whether it set it and the slabs are combined in
+	// order to get the same value as a single loop.
+	struct SlabResult {
+		s16 max_y;
+		bool reset;
+	};
+	u32 slabs = getSlabCount(node_min.Z, node_max.Z);
+	std::vector<SlabResult> results(slabs);
+
+	forEachSlab(node_min.Z, node_max.Z, [&] (u32 slab, s16 zmin, s16 zmax) {
+		s16 stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
+		bool reset = false;
+		u32 index2d = (zmin - node_min.Z) * csize.X;
+
+		for (s16 z = zmin; z <= zmax; z++)
+		for (s16 x = node_min.X; x <= node_max.X; x++, index2d++) {
+			s16 surface_y = baseTerrainLevelFromMap(index2d);
+			if (surface_y > stone_surface_max_y)
+				stone_surface_max_y = surface_y;
+
+			// Get extent of floatland base terrain
+			// '+1' to avoid a layer of stone at y = MAX_MAP_GENERATION_LIMIT
+			s16 float_base_min = MAX_MAP_GENERATION_LIMIT + 1;
+			s16 float_base_max = MAX_MAP_GENERATION_LIMIT;
+			if (spflags & MGV7_FLOATLANDS)
+				floatBaseExtentFromMap(&float_base_min, &float_base_max, index2d);
+
+			u32 vi = vm->m_area.index(x, node_min.Y - 1, z);
+			u32 index3d = (z - node_min.Z) * zstride_1u1d + (x - node_min.X);
+
+			for (s16 y = node_min.Y - 1; y <= node_max.Y + 1;
+					y++,
+					index3d += ystride,
+					VoxelArea::add_y(em, vi, 1)) {
+				if (vm->m_data[vi].getContent() != CONTENT_IGNORE)
+					continue;
+
+				if (y <= surface_y) {
+					vm->m_data[vi] = n_stone; // Base terrain
+				} else if ((spflags & MGV7_MOUNTAINS) &&
+						getMountainTerrainFromMap(index3d, index2d, y)) {
+					vm->m_data[vi] = n_stone; // Mountain terrain
+					if (y > stone_surface_max_y)
+						stone_surface_max_y = y;
+				} else if ((spflags & MGV7_FLOATLANDS) &&
+						((y >= float_base_min && y <= float_base_max) ||
+						getFloatlandMountainFromMap(index3d, index2d, y))) {
+					vm->m_data[vi] = n_stone; // Floatland terrain
+					stone_surface_max_y = node_max.Y;
+					reset = true;
+				} else if (y <= water_level) {
+					vm->m_data[vi] = n_water; // Ground level water
+				} else if ((spflags & MGV7_FLOATLANDS) &&
+						(y >= float_base_max && y <= floatland_level)) {
+					vm->m_data[vi] = n_water; // Floatland water
+				} else {
+					vm->m_data[vi] = n_air;
+				}
 			}
 		}
+
+		results[slab].max_y = stone_surface_max_y;
+		results[slab].reset = reset;
+	});
+
+	s16 stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
+	for (const SlabResult &result : results) {
+		if (result.reset)
+			stone_surface_max_y = result.max_y;
+		else
+			stone_surface_max_y = MYMAX(stone_surface_max_y, result.max_y);
 	}
 
 	return stone_surface_max_y;
@@ -574,12 +609,17 @@ int MapgenV7::generateTerrain()
 
 void MapgenV7::generateRidgeTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	if (node_max.Y < water_level - 16 ||
 			((spflags & MGV7_FLOATLANDS) && node_max.Y > shadow_limit))
 		return;
 
-	noise_ridge->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z);
-	noise_ridge_uwater->perlinMap2D(node_min.X, node_min.Z);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		noise_ridge->perlinMap3D(node_min.X, node_min.Y - 1, node_min.Z,
+			NULL, workerpool);
+		noise_ridge_uwater->perlinMap2D(node_min.X, node_min.Z);
+	}
 
 	MapNode n_water(c_water_source);
 	MapNode n_air(CONTENT_AIR);
@@ -218,7 +218,10 @@ void MapgenValleys::makeChunk(BlockMakeData *data)
 	// Generate biome noises. Note this must be executed strictly before
 	// generateTerrain, because generateTerrain depends on intermediate
 	// biome-related noises.
-	m_bgen->calcBiomeNoise(node_min);
+	{
+		MapgenPhaseTimer noise_timer(this, MGPHASE_NOISE);
+		m_bgen->calcBiomeNoise(node_min);
+	}
 
 	// Generate noise maps and base terrain height.
 	// Modify heat and humidity maps.
@@ -283,6 +286,7 @@ void MapgenValleys::makeChunk(BlockMakeData *data)
 
 void MapgenValleys::calculateNoise()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_NOISE);
 	int x = node_min.X;
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
@@ -293,7 +297,7 @@ void MapgenValleys::calculateNoise()
 	noise_valley_depth->perlinMap2D(x, z);
 	noise_valley_profile->perlinMap2D(x, z);
 
-	noise_inter_valley_fill->perlinMap3D(x, y, z);
+	noise_inter_valley_fill->perlinMap3D(x, y, z, NULL, workerpool);
 
 	float heat_offset = 0.0f;
 	float humidity_scale = 1.0f;
@@ -448,6 +452,7 @@ float MapgenValleys::terrainLevelAtPoint(s16 x, s16 z)
 
 int MapgenValleys::generateTerrain()
 {
+	MapgenPhaseTimer timer(this, MGPHASE_TERRAIN);
 	// Raising this reduces the rate of evaporation
 	static const float evaporation = 300.0f;
 	static const float humidity_dropoff = 4.0f;
@@ -142,9 +142,10 @@ Biome *BiomeManager::getBiomeFromNoiseOriginal(float heat, float humidity, v3s16
 		}
 	}
 
-	mysrand(pos.Y + (heat + humidity) * 0.9f);
+	// Seeded like the one in BiomeGenOriginal::calcBiomeFromNoise()
+	PcgRandom blend_rand((unsigned int)(pos.Y + (heat + humidity) * 0.9f));
 	if (biome_closest_blend && dist_min_blend <= dist_min &&
-			myrand_range(0, biome_closest_blend->vertical_blend) >=
+			blend_rand.range(0, biome_closest_blend->vertical_blend) >=
 			pos.Y - biome_closest_blend->max_pos.Y)
 		return biome_closest_blend;
 
@@ -306,11 +307,11 @@ Biome *BiomeGenOriginal::calcBiomeFromNoise(float heat, float humidity, v3s16 po
 
 	// Carefully tune pseudorandom seed variation to avoid single node dither
 	// and create larger scale blending patterns similar to horizontal biome
-	// blend.
-	mysrand(pos.Y + (heat + humidity) * 0.9f);
+	// blend. The generator is local as this runs on several threads at once.
+	PcgRandom blend_rand((unsigned int)(pos.Y + (heat + humidity) * 0.9f));
 
 	if (biome_closest_blend && dist_min_blend <= dist_min &&
-			myrand_range(0, biome_closest_blend->vertical_blend) >=
+			blend_rand.range(0, biome_closest_blend->vertical_blend) >=
 			pos.Y - biome_closest_blend->max_pos.Y)
 		return biome_closest_blend;
 
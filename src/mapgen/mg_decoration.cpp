@@ -53,6 +53,7 @@ DecorationManager::DecorationManager(IGameDef *gamedef) :
 size_t DecorationManager::placeAllDecos(Mapgen *mg, u32 blockseed,
 	v3s16 nmin, v3s16 nmax)
 {
+	MapgenPhaseTimer timer(mg, MGPHASE_DECORATIONS);
 	size_t nplaced = 0;
 
 	for (size_t i = 0; i != m_objects.size(); i++) {
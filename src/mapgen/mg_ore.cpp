@@ -47,6 +47,7 @@ OreManager::OreManager(IGameDef *gamedef) :
 
 size_t OreManager::placeAllOres(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 {
+	MapgenPhaseTimer timer(mg, MGPHASE_ORES);
 	size_t nplaced = 0;
 
 	for (size_t i = 0; i != m_objects.size(); i++) {
@@ -716,7 +716,7 @@ void MapNode::deSerialize(u8 *source, u8 version)
 }
 void MapNode::serializeBulk(std::ostream &os, int version,
 		const MapNode *nodes, u32 nodecount,
-		u8 content_width, u8 params_width, bool compressed)
+		u8 content_width, u8 params_width, bool compressed, u8 compression)
 {
 	if (!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapNode format not supported");
@@ -748,7 +748,7 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 	*/
 
 	if (compressed)
-		compressZlib(databuf, databuf_size, os);
+		compressBlockData(databuf, databuf_size, os, compression);
 	else
 		os.write((const char*) &databuf[0], databuf_size);
 
@@ -758,7 +758,7 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 // Deserialize bulk node data
 void MapNode::deSerializeBulk(std::istream &is, int version,
 		MapNode *nodes, u32 nodecount,
-		u8 content_width, u8 params_width, bool compressed)
+		u8 content_width, u8 params_width, bool compressed, u8 compression)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapNode format not supported");
@@ -774,7 +774,7 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 	if(compressed)
 	{
 		std::ostringstream os(std::ios_base::binary);
-		decompressZlib(is, os);
+		decompressBlockData(is, os, compression);
 		std::string s = os.str();
 		if(s.size() != len)
 			throw SerializationError("deSerializeBulkNodes: "
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes_bloated.h"
 #include "light.h"
+#include "serialization.h"
 #include <string>
 #include <vector>
 
@@ -296,13 +297,16 @@ struct MapNode
 	//   version = serialization version. Must be >= 22
 	//   content_width = the number of bytes of content per node
 	//   params_width = the number of bytes of params per node
-	//   compressed = true to zlib-compress output
+	//   compressed = true to compress output
+	//   compression = the BlockCompression codec to use if compressed
 	static void serializeBulk(std::ostream &os, int version,
 			const MapNode *nodes, u32 nodecount,
-			u8 content_width, u8 params_width, bool compressed);
+			u8 content_width, u8 params_width, bool compressed,
+			u8 compression = BLOCK_COMPRESSION_ZLIB);
 	static void deSerializeBulk(std::istream &is, int version,
 			MapNode *nodes, u32 nodecount,
-			u8 content_width, u8 params_width, bool compressed);
+			u8 content_width, u8 params_width, bool compressed,
+			u8 compression = BLOCK_COMPRESSION_ZLIB);
 
 private:
 	// Deprecated serialization methods
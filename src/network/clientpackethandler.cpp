@@ -80,6 +80,10 @@ void Client::handleCommand_Hello(NetworkPacket* pkt)
 	m_server_ser_ver = serialization_ver;
 	m_proto_ver = proto_ver;
 
+	// Small reliable packets may be packed together from now on
+	if (m_proto_ver >= 37)
+		m_con->EnablePeerBundling(PEER_ID_SERVER);
+
 	//TODO verify that username_legacy matches sent username, only
 	// differs in casing (make both uppercase and compare)
 	// This is only neccessary though when we actually want to add casing support
@@ -291,6 +295,37 @@ void Client::handleCommand_BlockData(NetworkPacket* pkt)
 	addUpdateMeshTaskWithEdge(p, true);
 }
 
+void Client::handleCommand_BlockNodes(NetworkPacket* pkt)
+{
+	v3s16 p;
+	u16 count;
+	*pkt >> p >> count;
+
+	// The block was deleted meanwhile, the server notices that
+	MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+	if (!block || block->isDummy())
+		return;
+
+	for (u16 j = 0; j < count; j++) {
+		u16 i;
+		MapNode n;
+		*pkt >> i >> n.param0 >> n.param1 >> n.param2;
+		if (i >= MapBlock::nodecount) {
+			errorstream << "Client: Invalid node index in TOCLIENT_BLOCK_NODES"
+					<< std::endl;
+			break;
+		}
+		block->setNodeNoCheck(MapBlock::nodeIndexToPos(i), n);
+	}
+	block->expireDayNightDiff();
+
+	if (m_localdb) {
+		ServerMap::saveBlock(block, m_localdb);
+	}
+
+	addUpdateMeshTaskWithEdge(p, true);
+}
+
 void Client::handleCommand_Inventory(NetworkPacket* pkt)
 {
 	if (pkt->getSize() < 1)
@@ -0,0 +1,278 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "congestion.h"
+#include "connection.h"
+#include "settings.h"
+#include <algorithm>
+#include <cfloat>
+
+// Queuing delay the window is adjusted to, in seconds
+#define LEDBAT_TARGET_DELAY 0.1f
+// Window change per round trip at zero or twice the target delay
+#define LEDBAT_GAIN 1.0f
+#define LEDBAT_MIN_WINDOW 16
+// Seconds covered by one entry of the base delay history
+#define LEDBAT_BASE_INTERVAL 15.0f
+// Pacing rate relative to one window per round trip
+#define LEDBAT_PACING_GAIN_SLOW_START 2.0f
+#define LEDBAT_PACING_GAIN 1.25f
+
+// The bucket holds the bytes of this many seconds, but at least a packet
+#define PACER_BURST_TIME 0.01f
+#define PACER_MIN_BURST 1500.0f
+
+namespace con
+{
+
+CongestionController *CongestionController::create(const std::string &name)
+{
+	if (name == "ledbat")
+		return new LedbatController(MIN_RELIABLE_WINDOW_SIZE);
+	if (name == "loss")
+		return new LossWindowController(
+				g_settings->getU16("max_packets_per_iteration"));
+	return nullptr;
+}
+
+/*
+	LossWindowController
+*/
+
+LossWindowController::LossWindowController(u32 initial_window):
+	m_window(initial_window)
+{
+}
+
+void LossWindowController::onAck(u32 bytes, float rtt, u32 in_flight)
+{
+	m_packets_acked++;
+	m_bytes_acked += bytes;
+}
+
+void LossWindowController::onLoss(u32 packets)
+{
+	m_packets_lost += packets;
+}
+
+void LossWindowController::step(float dtime)
+{
+	m_timer += dtime;
+	if (m_timer <= 1.0f)
+		return;
+	m_timer -= 1.0f;
+
+	unsigned int packet_loss = m_packets_lost;
+	unsigned int packets_successful = m_packets_acked;
+	bool reasonable_amount_of_data_transmitted =
+		m_bytes_acked > (unsigned int) (m_window*512/2);
+	m_packets_lost = 0;
+	m_packets_acked = 0;
+	m_bytes_acked = 0;
+
+	/* dynamic window size */
+	float successful_to_lost_ratio = 0.0f;
+
+	if (packets_successful > 0) {
+		successful_to_lost_ratio = packet_loss/packets_successful;
+	} else if (packet_loss > 0) {
+		m_window = std::max(
+				(m_window - 10),
+				MIN_RELIABLE_WINDOW_SIZE);
+		return;
+	}
+
+	if ((successful_to_lost_ratio < 0.01f) &&
+		(m_window < MAX_RELIABLE_WINDOW_SIZE)) {
+		/* don't even think about increasing if we didn't even
+		 * use major parts of our window */
+		if (reasonable_amount_of_data_transmitted)
+			m_window = std::min(
+					(m_window + 100),
+					MAX_RELIABLE_WINDOW_SIZE);
+	} else if ((successful_to_lost_ratio < 0.05f) &&
+			(m_window < MAX_RELIABLE_WINDOW_SIZE)) {
+		/* don't even think about increasing if we didn't even
+		 * use major parts of our window */
+		if (reasonable_amount_of_data_transmitted)
+			m_window = std::min(
+					(m_window + 50),
+					MAX_RELIABLE_WINDOW_SIZE);
+	} else if (successful_to_lost_ratio > 0.15f) {
+		m_window = std::max(
+				(m_window - 100),
+				MIN_RELIABLE_WINDOW_SIZE);
+	} else if (successful_to_lost_ratio > 0.1f) {
+		m_window = std::max(
+				(m_window - 50),
+				MIN_RELIABLE_WINDOW_SIZE);
+	}
+}
+
+/*
+	LedbatController
+*/
+
+LedbatController::LedbatController(u32 initial_window):
+	m_window(initial_window),
+	m_packet_size(512.0f)
+{
+	std::fill_n(m_base_history, 4, FLT_MAX);
+	std::fill_n(m_current_history, 4, FLT_MAX);
+}
+
+void LedbatController::onAck(u32 bytes, float rtt, u32 in_flight)
+{
+	m_packet_size += (bytes - m_packet_size) / 16.0f;
+
+	if (rtt >= 0.0f) {
+		m_base_history[0] = std::min(m_base_history[0], rtt);
+		m_current_history[m_current_index] = rtt;
+		m_current_index = (m_current_index + 1) % 4;
+
+		if (m_srtt < 0.0f)
+			m_srtt = rtt;
+		else
+			m_srtt += (rtt - m_srtt) / 8.0f;
+	}
+
+	// Don't grow a window that isn't used
+	bool window_limited = in_flight * 2 >= m_window;
+	float delay = getQueuingDelay();
+
+	if (m_slow_start) {
+		if (delay < LEDBAT_TARGET_DELAY * 0.75f) {
+			// Doubles the window every round trip
+			if (window_limited)
+				m_window += 1.0f;
+		} else {
+			m_slow_start = false;
+		}
+	}
+
+	if (!m_slow_start) {
+		float off_target = (LEDBAT_TARGET_DELAY - delay) / LEDBAT_TARGET_DELAY;
+		off_target = std::max(off_target, -1.0f);
+		if (off_target > 0.0f && !window_limited)
+			off_target = 0.0f;
+		m_window += LEDBAT_GAIN * off_target / m_window;
+	}
+
+	m_window = std::max(m_window, (float)LEDBAT_MIN_WINDOW);
+	m_window = std::min(m_window, (float)MAX_RELIABLE_WINDOW_SIZE);
+}
+
+void LedbatController::onLoss(u32 packets)
+{
+	if (packets == 0)
+		return;
+
+	m_slow_start = false;
+
+	// Packets lost together are one congestion event
+	if (m_srtt >= 0.0f && m_time - m_last_decrease < m_srtt)
+		return;
+
+	m_window = std::max(m_window / 2.0f, (float)LEDBAT_MIN_WINDOW);
+	m_last_decrease = m_time;
+}
+
+void LedbatController::step(float dtime)
+{
+	m_time += dtime;
+	m_base_timer += dtime;
+	if (m_base_timer < LEDBAT_BASE_INTERVAL)
+		return;
+
+	// Forget the oldest interval, so that a route change is noticed
+	m_base_timer -= LEDBAT_BASE_INTERVAL;
+	for (int i = 3; i > 0; i--)
+		m_base_history[i] = m_base_history[i - 1];
+	m_base_history[0] = FLT_MAX;
+}
+
+float LedbatController::getBaseDelay() const
+{
+	return *std::min_element(m_base_history, m_base_history + 4);
+}
+
+float LedbatController::getQueuingDelay() const
+{
+	float base = getBaseDelay();
+	if (base == FLT_MAX)
+		return 0.0f;
+
+	float current = *std::min_element(m_current_history, m_current_history + 4);
+	return current - base;
+}
+
+float LedbatController::getPacingRate() const
+{
+	if (m_srtt < 0.0f)
+		return 0.0f;
+
+	float gain = m_slow_start ?
+			LEDBAT_PACING_GAIN_SLOW_START : LEDBAT_PACING_GAIN;
+	// The rtt can be measured as 0 on fast links, timing is in milliseconds
+	return gain * m_window * m_packet_size / std::max(m_srtt, 0.001f);
+}
+
+/*
+	Pacer
+*/
+
+static float pacer_burst(float rate)
+{
+	return std::max(rate * PACER_BURST_TIME, PACER_MIN_BURST);
+}
+
+void Pacer::setRate(float rate)
+{
+	if (rate <= 0.0f)
+		m_tokens = 0.0f;
+	else if (m_rate <= 0.0f)
+		m_tokens = pacer_burst(rate);
+	else
+		m_tokens = std::min(m_tokens, pacer_burst(rate));
+	m_rate = rate;
+}
+
+void Pacer::update(float dtime)
+{
+	if (m_rate <= 0.0f)
+		return;
+
+	m_tokens = std::min(m_tokens + m_rate * dtime, pacer_burst(m_rate));
+}
+
+void Pacer::consume(u32 bytes)
+{
+	if (m_rate > 0.0f)
+		m_tokens -= bytes;
+}
+
+float Pacer::getWaitTime() const
+{
+	if (canSend())
+		return 0.0f;
+
+	return -m_tokens / m_rate;
+}
+
+}
@@ -0,0 +1,148 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irrlichttypes.h"
+#include <string>
+
+namespace con
+{
+
+/*
+	Decides how many reliable packets may be on the wire to one peer and
+	how fast they may be put there. Fed by the connection threads with the
+	acknowledgements and the resends of the peer.
+*/
+class CongestionController
+{
+public:
+	virtual ~CongestionController() = default;
+
+	// Returns nullptr for an unknown name
+	static CongestionController *create(const std::string &name);
+
+	virtual const char *getName() const = 0;
+
+	/*
+		A reliable packet of the given size was acknowledged.
+		rtt is negative if it was resent, as the time then is ambiguous.
+		in_flight is the number of packets still waiting for an ack.
+	*/
+	virtual void onAck(u32 bytes, float rtt, u32 in_flight) = 0;
+	// Reliable packets timed out and are sent again
+	virtual void onLoss(u32 packets) = 0;
+	virtual void step(float dtime) {}
+
+	// Number of reliable packets allowed to wait for an ack
+	virtual u32 getWindow() const = 0;
+	// Bytes per second to put packets on the wire with, 0 for no limit
+	virtual float getPacingRate() const = 0;
+};
+
+/*
+	The window adjustment connections always had: every second the
+	window grows if nearly nothing was lost and shrinks otherwise.
+	Doesn't pace.
+*/
+class LossWindowController : public CongestionController
+{
+public:
+	LossWindowController(u32 initial_window);
+
+	const char *getName() const { return "loss"; }
+	void onAck(u32 bytes, float rtt, u32 in_flight);
+	void onLoss(u32 packets);
+	void step(float dtime);
+	u32 getWindow() const { return m_window; }
+	float getPacingRate() const { return 0.0f; }
+
+private:
+	int m_window;
+	float m_timer = 0.0f;
+	u32 m_packets_acked = 0;
+	u32 m_packets_lost = 0;
+	u32 m_bytes_acked = 0;
+};
+
+/*
+	Delay based congestion control after LEDBAT (RFC 6817). The window
+	follows the queuing delay, the round trip time above the lowest one
+	seen recently: it grows while the delay is below a target and shrinks
+	when it is above, before the buffers of the link overflow. Losses
+	halve the window. Packets are paced to spread a window over a round
+	trip.
+*/
+class LedbatController : public CongestionController
+{
+public:
+	LedbatController(u32 initial_window);
+
+	const char *getName() const { return "ledbat"; }
+	void onAck(u32 bytes, float rtt, u32 in_flight);
+	void onLoss(u32 packets);
+	void step(float dtime);
+	u32 getWindow() const { return (u32)m_window; }
+	float getPacingRate() const;
+
+	float getQueuingDelay() const;
+
+private:
+	float getBaseDelay() const;
+
+	float m_window;
+	bool m_slow_start = true;
+	// Smoothed round trip time, negative until the first sample
+	float m_srtt = -1.0f;
+	float m_packet_size;
+	float m_time = 0.0f;
+	float m_last_decrease = 0.0f;
+
+	// Lowest round trip times of the last intervals, the newest first
+	float m_base_history[4];
+	float m_base_timer = 0.0f;
+	// Last round trip times, filtering out single outliers
+	float m_current_history[4];
+	u32 m_current_index = 0;
+};
+
+/*
+	Token bucket limiting the rate packets are put on the wire with.
+	A packet may be sent as long as there are tokens left; it can take
+	more than there are, the bucket then has to fill up again.
+*/
+class Pacer
+{
+public:
+	// Bytes per second, 0 for no limit
+	void setRate(float rate);
+	float getRate() const { return m_rate; }
+	void update(float dtime);
+
+	bool canSend() const { return m_rate <= 0.0f || m_tokens > 0.0f; }
+	void consume(u32 bytes);
+	// Seconds until canSend() is true again
+	float getWaitTime() const;
+
+private:
+	float m_rate = 0.0f;
+	float m_tokens = 0.0f;
+};
+
+}
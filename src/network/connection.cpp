@@ -56,38 +56,30 @@ std::mutex log_message_mutex;
 
 #define PING_TIMEOUT 5.0
 
-BufferedPacket makePacket(Address &address, SharedBuffer<u8> data,
+BufferedPacket makePacket(Address &address, const PacketBuffer &data,
 		u32 protocol_id, session_t sender_peer_id, u8 channel)
 {
-	u32 packet_size = data.getSize() + BASE_HEADER_SIZE;
-	BufferedPacket p(packet_size);
+	BufferedPacket p(data.prepend(BASE_HEADER_SIZE));
 	p.address = address;
 
 	writeU32(&p.data[0], protocol_id);
 	writeU16(&p.data[4], sender_peer_id);
 	writeU8(&p.data[6], channel);
 
-	memcpy(&p.data[BASE_HEADER_SIZE], *data, data.getSize());
-
 	return p;
 }
 
-SharedBuffer<u8> makeOriginalPacket(const SharedBuffer<u8> &data)
+PacketBuffer makeOriginalPacket(const PacketBuffer &data)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	PacketBuffer b = data.prepend(ORIGINAL_HEADER_SIZE);
 
 	writeU8(&(b[0]), PACKET_TYPE_ORIGINAL);
-	if (data.getSize() > 0) {
-		memcpy(&(b[header_size]), *data, data.getSize());
-	}
 	return b;
 }
 
 // Split data in chunks and add TYPE_SPLIT headers to them
-void makeSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max, u16 seqnum,
-		std::list<SharedBuffer<u8>> *chunks)
+void makeSplitPacket(const PacketBuffer &data, u32 chunksize_max, u16 seqnum,
+		std::list<PacketBuffer> *chunks)
 {
 	// Chunk packets, containing the TYPE_SPLIT header
 	u32 chunk_header_size = 7;
@@ -104,7 +96,7 @@ void makeSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max, u16 seqnum
 		u32 payload_size = end - start + 1;
 		u32 packet_size = chunk_header_size + payload_size;
 
-		SharedBuffer<u8> chunk(packet_size);
+		PacketBuffer chunk(packet_size, RELIABLE_HEADROOM);
 
 		writeU8(&chunk[0], PACKET_TYPE_SPLIT);
 		writeU16(&chunk[1], seqnum);
@@ -120,14 +112,14 @@ void makeSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max, u16 seqnum
 	}
 	while (end != data.getSize() - 1);
 
-	for (SharedBuffer<u8> &chunk : *chunks) {
+	for (PacketBuffer &chunk : *chunks) {
 		// Write chunk_count
 		writeU16(&(chunk[3]), chunk_count);
 	}
 }
 
-void makeAutoSplitPacket(SharedBuffer<u8> data, u32 chunksize_max,
-		u16 &split_seqnum, std::list<SharedBuffer<u8>> *list)
+void makeAutoSplitPacket(const PacketBuffer &data, u32 chunksize_max,
+		u16 &split_seqnum, std::list<PacketBuffer> *list)
 {
 	u32 original_header_size = 1;
 
@@ -140,16 +132,31 @@ void makeAutoSplitPacket(SharedBuffer<u8> data, u32 chunksize_max,
 	list->push_back(makeOriginalPacket(data));
 }
 
-SharedBuffer<u8> makeReliablePacket(SharedBuffer<u8> data, u16 seqnum)
+PacketBuffer makeReliablePacket(const PacketBuffer &data, u16 seqnum)
 {
-	u32 header_size = 3;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
+	PacketBuffer b = data.prepend(RELIABLE_HEADER_SIZE);
 
 	writeU8(&b[0], PACKET_TYPE_RELIABLE);
 	writeU16(&b[1], seqnum);
 
-	memcpy(&b[header_size], *data, data.getSize());
+	return b;
+}
+
+PacketBuffer makeBundlePacket(const std::vector<PacketBuffer> &originals)
+{
+	u32 packet_size = BUNDLE_HEADER_SIZE;
+	for (const PacketBuffer &original : originals)
+		packet_size += BUNDLE_ENTRY_HEADER_SIZE + original.getSize();
+	PacketBuffer b(packet_size, RELIABLE_HEADROOM);
+
+	writeU8(&b[0], PACKET_TYPE_BUNDLE);
+	u32 offset = BUNDLE_HEADER_SIZE;
+	for (const PacketBuffer &original : originals) {
+		writeU16(&b[offset], original.getSize());
+		offset += BUNDLE_ENTRY_HEADER_SIZE;
+		memcpy(&b[offset], *original, original.getSize());
+		offset += original.getSize();
+	}
 
 	return b;
 }
@@ -163,8 +170,10 @@ void ReliablePacketBuffer::print()
 	MutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
 	unsigned int index = 0;
-	for (BufferedPacket &bufferedPacket : m_list) {
-		u16 s = readU16(&(bufferedPacket.data[BASE_HEADER_SIZE+1]));
+	for (u32 i = 0; i < m_span; i++) {
+		u16 s = m_first_seqnum + i;
+		if (!findSlot(s))
+			continue;
 		LOG(dout_con<<index<< ":" << s << std::endl);
 		index++;
 	}
@@ -172,7 +181,7 @@ void ReliablePacketBuffer::print()
 bool ReliablePacketBuffer::empty()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_list_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
@@ -182,80 +191,94 @@ u32 ReliablePacketBuffer::size()
 
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	MutexAutoLock listlock(m_list_mutex);
+	return findSlot(seqnum) != nullptr;
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+ReliablePacketBuffer::Slot *ReliablePacketBuffer::findSlot(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if (s == seqnum)
-			break;
+	// Seqnums within the span map to distinct slots
+	u16 offset = seqnum - m_first_seqnum;
+	if (offset >= m_span)
+		return nullptr;
+	Slot &slot = m_ring[seqnum & (m_ring.size() - 1)];
+	return slot.packet ? &slot : nullptr;
+}
+
+void ReliablePacketBuffer::reserve(u32 span)
+{
+	sanity_check(span <= SEQNUM_MAX+1);
+	if (span <= m_ring.size())
+		return;
+
+	size_t new_size = m_ring.empty() ? 64 : m_ring.size();
+	while (new_size < span)
+		new_size *= 2;
+
+	std::vector<Slot> ring(new_size);
+	for (u32 i = 0; i < m_span; i++) {
+		u16 s = m_first_seqnum + i;
+		ring[s & (new_size - 1)] = std::move(m_ring[s & (m_ring.size() - 1)]);
 	}
-	return i;
+	m_ring = std::move(ring);
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+
+BufferedPacket ReliablePacketBuffer::takePacket(u16 seqnum)
 {
-	return m_list.end();
+	Slot *slot = findSlot(seqnum);
+	sanity_check(slot);
+
+	BufferedPacket p = *slot->packet;
+	p.time = m_clock - slot->sent_at;
+	p.totaltime = m_clock - slot->buffered_at;
+	slot->packet.reset();
+	--m_list_size;
+
+	if (m_list_size == 0) {
+		m_span = 0;
+		m_resend_heap.clear();
+		return p;
+	}
+
+	// Keep the span tight around the remaining packets
+	if (seqnum == m_first_seqnum) {
+		do {
+			++m_first_seqnum;
+			--m_span;
+		} while (!findSlot(m_first_seqnum));
+	} else if ((u16)(seqnum - m_first_seqnum) == m_span - 1) {
+		do {
+			--m_span;
+		} while (!findSlot(m_first_seqnum + m_span - 1));
+	}
+	return p;
 }
+
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_list_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_first_seqnum;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_list_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack =
-				readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
-	}
-	return p;
+	return takePacket(m_first_seqnum);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if (r == notFound()) {
+	if (!findSlot(seqnum)) {
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-
-
-	RPBSearchResult next = r;
-	++next;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
-	}
-
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return takePacket(seqnum);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
@@ -284,57 +307,21 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 		return;
 	}
 
-	++m_list_size;
-	sanity_check(m_list_size <= SEQNUM_MAX+1);	// FIXME: Handle the error?
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if (m_list.empty())
-	{
-		m_list.push_back(p);
-		m_oldest_non_answered_ack = seqnum;
-		// Done.
-		return;
-	}
-
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			++i;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-
-	if (s == seqnum) {
-		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
-			)
-		{
+	if (m_list_size == 0) {
+		reserve(1);
+		m_first_seqnum = seqnum;
+		m_span = 1;
+	} else if (Slot *slot = findSlot(seqnum)) {
+		BufferedPacket &old = *slot->packet;
+		if ((old.data.getSize() != p.data.getSize()) ||
+				(old.address != p.address)) {
 			/* if this happens your maximum transfer window may be to big */
 			fprintf(stderr,
 					"Duplicated seqnum %d non matching packet detected:\n",
 					seqnum);
 			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(),
-					i->address.serializeString().c_str());
+					readU16(&(old.data[BASE_HEADER_SIZE+1])),old.data.getSize(),
+					old.address.serializeString().c_str());
 			fprintf(stderr, "New: seqnum: %05d size: %04u, address: %s\n",
 					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(),
 					p.address.serializeString().c_str());
@@ -343,27 +330,53 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
+		return;
+	} else if (seqnum_higher(seqnum, m_first_seqnum)) {
+		u16 offset = seqnum - m_first_seqnum;
+		if (offset >= m_span) {
+			reserve(offset + 1);
+			m_span = offset + 1;
+		}
+	} else {
+		/* packet is older than all buffered ones, e.g. on wrap around */
+		u16 shift = m_first_seqnum - seqnum;
+		reserve(m_span + shift);
+		m_first_seqnum = seqnum;
+		m_span += shift;
 	}
-	else {
-		m_list.push_back(p);
+
+	Slot &slot = m_ring[seqnum & (m_ring.size() - 1)];
+	slot.packet.reset(new BufferedPacket(p));
+	slot.buffered_at = m_clock - p.totaltime;
+	slot.sent_at = m_clock - p.time;
+	++m_list_size;
+
+	pushResendEntry(slot, seqnum);
+}
+
+void ReliablePacketBuffer::pushResendEntry(const Slot &slot, u16 seqnum)
+{
+	// Buffers that are never asked for timed outs only accumulate stale
+	// entries, drop them once they outnumber the packets
+	if (m_resend_heap.size() > 2 * m_list_size + 64) {
+		m_resend_heap.clear();
+		for (u32 i = 0; i < m_span; i++) {
+			u16 s = m_first_seqnum + i;
+			if (const Slot *live = findSlot(s))
+				m_resend_heap.push_back({live->sent_at, s});
+		}
+		std::make_heap(m_resend_heap.begin(), m_resend_heap.end());
+		return;
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	m_resend_heap.push_back({slot.sent_at, seqnum});
+	std::push_heap(m_resend_heap.begin(), m_resend_heap.end());
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	for (BufferedPacket &bufferedPacket : m_list) {
-		bufferedPacket.time += dtime;
-		bufferedPacket.totaltime += dtime;
-	}
+	m_clock += dtime;
 }
 
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
@@ -371,16 +384,32 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 {
 	MutexAutoLock listlock(m_list_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for (BufferedPacket &bufferedPacket : m_list) {
-		if (bufferedPacket.time >= timeout) {
-			timed_outs.push_back(bufferedPacket);
+	std::vector<u16> resent;
+	while (!m_resend_heap.empty() && timed_outs.size() < max_packets) {
+		ResendEntry entry = m_resend_heap.front();
+		Slot *slot = findSlot(entry.seqnum);
+		bool stale = !slot || slot->sent_at != entry.sent_at;
+		if (!stale && m_clock - entry.sent_at < timeout)
+			break;
 
-			//this packet will be sent right afterwards reset timeout here
-			bufferedPacket.time = 0.0f;
-			if (timed_outs.size() >= max_packets)
-				break;
-		}
+		std::pop_heap(m_resend_heap.begin(), m_resend_heap.end());
+		m_resend_heap.pop_back();
+		if (stale)
+			continue;
+
+		BufferedPacket p = *slot->packet;
+		p.time = m_clock - slot->sent_at;
+		p.totaltime = m_clock - slot->buffered_at;
+		timed_outs.push_back(p);
+
+		//this packet will be sent right afterwards reset timeout here
+		slot->sent_at = m_clock;
+		resent.push_back(entry.seqnum);
 	}
+
+	// Pushed afterwards so a packet is not returned twice in one call
+	for (u16 seqnum : resent)
+		pushResendEntry(*findSlot(seqnum), seqnum);
 	return timed_outs;
 }
 
@@ -508,7 +537,7 @@ void ConnectionCommand::send(session_t peer_id_, u8 channelnum_, NetworkPacket *
 	type = CONNCMD_SEND;
 	peer_id = peer_id_;
 	channelnum = channelnum_;
-	data = pkt->oldForgePacket();
+	data = pkt->forgePacket();
 	reliable = reliable_;
 }
 
@@ -560,7 +589,8 @@ u16 Channel::getOutgoingSequenceNumber(bool& successful)
 			// ugly cast but this one is required in order to tell compiler we
 			// know about difference of two unsigned may be negative in general
 			// but we already made sure it won't happen in this case
-			if (((u16)(next_outgoing_seqnum - lowest_unacked_seqnumber)) > window_size) {
+			if (((u16)(next_outgoing_seqnum - lowest_unacked_seqnumber)) >
+					MAX_RELIABLE_WINDOW_SIZE) {
 				successful = false;
 				return 0;
 			}
@@ -570,7 +600,7 @@ u16 Channel::getOutgoingSequenceNumber(bool& successful)
 			// know about difference of two unsigned may be negative in general
 			// but we already made sure it won't happen in this case
 			if ((next_outgoing_seqnum + (u16)(SEQNUM_MAX - lowest_unacked_seqnumber)) >
-				window_size) {
+				MAX_RELIABLE_WINDOW_SIZE) {
 				successful = false;
 				return 0;
 			}
@@ -597,11 +627,10 @@ bool Channel::putBackSequenceNumber(u16 seqnum)
 	return false;
 }
 
-void Channel::UpdateBytesSent(unsigned int bytes, unsigned int packets)
+void Channel::UpdateBytesSent(unsigned int bytes)
 {
 	MutexAutoLock internal(m_internal_mutex);
 	current_bytes_transfered += bytes;
-	current_packet_successful += packets;
 }
 
 void Channel::UpdateBytesReceived(unsigned int bytes) {
@@ -616,87 +645,9 @@ void Channel::UpdateBytesLost(unsigned int bytes)
 }
 
 
-void Channel::UpdatePacketLossCounter(unsigned int count)
-{
-	MutexAutoLock internal(m_internal_mutex);
-	current_packet_loss += count;
-}
-
-void Channel::UpdatePacketTooLateCounter()
-{
-	MutexAutoLock internal(m_internal_mutex);
-	current_packet_too_late++;
-}
-
 void Channel::UpdateTimers(float dtime)
 {
 	bpm_counter += dtime;
-	packet_loss_counter += dtime;
-
-	if (packet_loss_counter > 1.0f) {
-		packet_loss_counter -= 1.0f;
-
-		unsigned int packet_loss = 11; /* use a neutral value for initialization */
-		unsigned int packets_successful = 0;
-		//unsigned int packet_too_late = 0;
-
-		bool reasonable_amount_of_data_transmitted = false;
-
-		{
-			MutexAutoLock internal(m_internal_mutex);
-			packet_loss = current_packet_loss;
-			//packet_too_late = current_packet_too_late;
-			packets_successful = current_packet_successful;
-
-			if (current_bytes_transfered > (unsigned int) (window_size*512/2)) {
-				reasonable_amount_of_data_transmitted = true;
-			}
-			current_packet_loss = 0;
-			current_packet_too_late = 0;
-			current_packet_successful = 0;
-		}
-
-		/* dynamic window size */
-		float successful_to_lost_ratio = 0.0f;
-		bool done = false;
-
-		if (packets_successful > 0) {
-			successful_to_lost_ratio = packet_loss/packets_successful;
-		} else if (packet_loss > 0) {
-			window_size = std::max(
-					(window_size - 10),
-					MIN_RELIABLE_WINDOW_SIZE);
-			done = true;
-		}
-
-		if (!done) {
-			if ((successful_to_lost_ratio < 0.01f) &&
-				(window_size < MAX_RELIABLE_WINDOW_SIZE)) {
-				/* don't even think about increasing if we didn't even
-				 * use major parts of our window */
-				if (reasonable_amount_of_data_transmitted)
-					window_size = std::min(
-							(window_size + 100),
-							MAX_RELIABLE_WINDOW_SIZE);
-			} else if ((successful_to_lost_ratio < 0.05f) &&
-					(window_size < MAX_RELIABLE_WINDOW_SIZE)) {
-				/* don't even think about increasing if we didn't even
-				 * use major parts of our window */
-				if (reasonable_amount_of_data_transmitted)
-					window_size = std::min(
-							(window_size + 50),
-							MAX_RELIABLE_WINDOW_SIZE);
-			} else if (successful_to_lost_ratio > 0.15f) {
-				window_size = std::max(
-						(window_size - 100),
-						MIN_RELIABLE_WINDOW_SIZE);
-			} else if (successful_to_lost_ratio > 0.1f) {
-				window_size = std::max(
-						(window_size - 50),
-						MIN_RELIABLE_WINDOW_SIZE);
-			}
-		}
-	}
 
 	if (bpm_counter > 10.0f) {
 		{
@@ -887,8 +838,21 @@ void Peer::Drop()
 UDPPeer::UDPPeer(u16 a_id, Address a_address, Connection* connection) :
 	Peer(a_address,a_id,connection)
 {
-	for (Channel &channel : channels)
-		channel.setWindowSize(g_settings->getU16("max_packets_per_iteration"));
+	std::string name = g_settings->get("congestion_control");
+	m_congestion.reset(CongestionController::create(name));
+	if (!m_congestion) {
+		warningstream << "Unknown congestion_control \"" << name
+			<< "\", using ledbat" << std::endl;
+		m_congestion.reset(CongestionController::create("ledbat"));
+	}
+}
+
+UDPPeer::~UDPPeer()
+{
+	std::string prefix = "Connection: peer " + itos(id) + " ";
+	g_profiler->remove(prefix + "window");
+	g_profiler->remove(prefix + "pacing rate [KB/s]");
+	g_profiler->remove(prefix + "packets lost");
 }
 
 bool UDPPeer::getAddress(MTProtocols type,Address& toset)
@@ -915,6 +879,89 @@ void UDPPeer::reportRTT(float rtt)
 	resend_timeout = timeout;
 }
 
+float UDPPeer::getStat(rtt_stat_type type) const
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	switch (type) {
+		case CONGESTION_WINDOW:
+			return m_congestion->getWindow();
+		case PACING_RATE:
+			return m_congestion->getPacingRate();
+		case PACKETS_LOST:
+			return m_packets_lost;
+		default:
+			return Peer::getStat(type);
+	}
+}
+
+u32 UDPPeer::getReliablesInFlight()
+{
+	u32 in_flight = 0;
+	for (Channel &channel : channels)
+		in_flight += channel.outgoing_reliables_sent.size();
+	return in_flight;
+}
+
+u32 UDPPeer::getCongestionWindow() const
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	return m_congestion->getWindow();
+}
+
+float UDPPeer::getPacingRate() const
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	return m_congestion->getPacingRate();
+}
+
+bool UDPPeer::canSendReliable()
+{
+	return m_pacer.canSend() &&
+		getReliablesInFlight() < getCongestionWindow();
+}
+
+void UDPPeer::onReliableAcked(u32 bytes, float rtt)
+{
+	u32 in_flight = getReliablesInFlight();
+	MutexAutoLock lock(m_congestion_mutex);
+	m_congestion->onAck(bytes, rtt, in_flight);
+}
+
+void UDPPeer::onReliablesLost(u32 packets)
+{
+	MutexAutoLock lock(m_congestion_mutex);
+	m_congestion->onLoss(packets);
+	m_packets_lost += packets;
+}
+
+void UDPPeer::stepCongestion(float dtime)
+{
+	float rate;
+	u32 window;
+	u32 lost;
+	{
+		MutexAutoLock lock(m_congestion_mutex);
+		m_congestion->step(dtime);
+		rate = m_congestion->getPacingRate();
+		window = m_congestion->getWindow();
+		lost = m_packets_lost - m_packets_lost_reported;
+		m_packets_lost_reported = m_packets_lost;
+	}
+
+	m_pacer.setRate(rate);
+	m_pacer.update(dtime);
+
+	m_congestion_report_timer += dtime;
+	if (m_congestion_report_timer < 1.0f && lost == 0)
+		return;
+	m_congestion_report_timer = 0.0f;
+
+	std::string prefix = "Connection: peer " + itos(id) + " ";
+	g_profiler->avg(prefix + "window", window);
+	g_profiler->avg(prefix + "pacing rate [KB/s]", rate / 1024.0f);
+	g_profiler->add(prefix + "packets lost", lost);
+}
+
 bool UDPPeer::Ping(float dtime,SharedBuffer<u8>& data)
 {
 	m_ping_timer += dtime;
@@ -938,7 +985,7 @@ void UDPPeer::PutReliableSendCommand(ConnectionCommand &c,
 	if ( channels[c.channelnum].queued_commands.empty() &&
 			/* don't queue more packets then window size */
 			(channels[c.channelnum].queued_reliables.size()
-			< (channels[c.channelnum].getWindowSize()/2))) {
+			< (getCongestionWindow()/2))) {
 		LOG(dout_con<<m_connection->getDesc()
 				<<" processing reliable command for peer id: " << c.peer_id
 				<<" data size: " << c.data.getSize() << std::endl);
@@ -967,7 +1014,26 @@ bool UDPPeer::processReliableSendCommand(
 
 	sanity_check(c.data.getSize() < MAX_RELIABLE_WINDOW_SIZE*512);
 
-	std::list<SharedBuffer<u8>> originals;
+	Channel &channel = channels[c.channelnum];
+	u32 entry_size = BUNDLE_ENTRY_HEADER_SIZE + ORIGINAL_HEADER_SIZE
+			+ c.data.getSize();
+	if (m_bundling && !c.raw && BUNDLE_HEADER_SIZE + entry_size <= chunksize_max) {
+		// Small packet, keep it until the bundle is full or gets flushed
+		// by the send thread
+		if (channel.pending_bundle_size + entry_size > chunksize_max &&
+				!flushBundle(c.channelnum))
+			return false;
+
+		channel.pending_bundle.push_back(makeOriginalPacket(c.data));
+		channel.pending_bundle_size += entry_size;
+		return true;
+	}
+
+	// Packets must not overtake the pending small ones
+	if (!flushBundle(c.channelnum))
+		return false;
+
+	std::list<PacketBuffer> originals;
 	u16 split_sequence_number = channels[c.channelnum].readNextSplitSeqNum();
 
 	if (c.raw) {
@@ -982,7 +1048,7 @@ bool UDPPeer::processReliableSendCommand(
 	std::queue<BufferedPacket> toadd;
 	volatile u16 initial_sequence_number = 0;
 
-	for (SharedBuffer<u8> &original : originals) {
+	for (PacketBuffer &original : originals) {
 		u16 seqnum = channels[c.channelnum].getOutgoingSequenceNumber(have_sequence_number);
 
 		/* oops, we don't have enough sequence numbers to send this packet */
@@ -995,7 +1061,7 @@ bool UDPPeer::processReliableSendCommand(
 			have_initial_sequence_number = true;
 		}
 
-		SharedBuffer<u8> reliable = makeReliablePacket(original, seqnum);
+		PacketBuffer reliable = makeReliablePacket(original, seqnum);
 
 		// Add base headers and make a packet
 		BufferedPacket p = con::makePacket(address, reliable,
@@ -1053,6 +1119,41 @@ bool UDPPeer::processReliableSendCommand(
 	return false;
 }
 
+bool UDPPeer::flushBundle(u8 channelnum)
+{
+	Channel &channel = channels[channelnum];
+	if (channel.pending_bundle.empty())
+		return true;
+
+	bool have_sequence_number = true;
+	u16 seqnum = channel.getOutgoingSequenceNumber(have_sequence_number);
+	if (!have_sequence_number)
+		return false;
+
+	// A single packet doesn't need the bundle header
+	PacketBuffer original = channel.pending_bundle.size() == 1 ?
+			channel.pending_bundle.front() :
+			makeBundlePacket(channel.pending_bundle);
+
+	LOG(dout_con<<m_connection->getDesc()
+			<< " bundling " << channel.pending_bundle.size()
+			<< " packets for peer_id: " << id
+			<< " channel: " << (u32)channelnum
+			<< " seqnum: " << seqnum << std::endl);
+	g_profiler->avg("Connection: packets per bundle",
+			channel.pending_bundle.size());
+
+	PacketBuffer reliable = makeReliablePacket(original, seqnum);
+	BufferedPacket p = con::makePacket(address, reliable,
+			m_connection->GetProtocolID(), m_connection->GetPeerID(),
+			channelnum);
+	channel.queued_reliables.push(p);
+
+	channel.pending_bundle.clear();
+	channel.pending_bundle_size = BUNDLE_HEADER_SIZE;
+	return true;
+}
+
 void UDPPeer::RunCommandQueues(
 							unsigned int max_packet_size,
 							unsigned int maxcommands,
@@ -1115,18 +1216,28 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 		bool ipv6, PeerHandler *peerhandler) :
 	m_udpSocket(ipv6),
 	m_protocol_id(protocol_id),
-	m_sendThread(new ConnectionSendThread(max_packet_size, timeout)),
-	m_receiveThread(new ConnectionReceiveThread(max_packet_size)),
 	m_bc_peerhandler(peerhandler)
 
 {
 	m_udpSocket.setTimeoutMs(5);
 
-	m_sendThread->setParent(this);
-	m_receiveThread->setParent(this);
+	u32 send_threads = rangelim(
+		g_settings->getU16("connection_send_threads"), 1, 64);
+	for (u32 i = 0; i < send_threads; i++) {
+		m_peer_shards.emplace_back(new PeerShard());
+		m_sendThreads.emplace_back(
+			new ConnectionSendThread(max_packet_size, timeout, i));
+		m_sendThreads.back()->setParent(this);
+	}
+
+	// Further receive threads are added when serving
+	m_receiveThreads.emplace_back(
+		new ConnectionReceiveThread(max_packet_size, &m_udpSocket));
+	m_receiveThreads.back()->setParent(this);
 
-	m_sendThread->start();
-	m_receiveThread->start();
+	for (auto &thread : m_sendThreads)
+		thread->start();
+	m_receiveThreads.back()->start();
 }
 
 
@@ -1134,21 +1245,28 @@ Connection::~Connection()
 {
 	m_shutting_down = true;
 	// request threads to stop
-	m_sendThread->stop();
-	m_receiveThread->stop();
+	for (auto &thread : m_sendThreads)
+		thread->stop();
 
 	//TODO for some unkonwn reason send/receive threads do not exit as they're
 	// supposed to be but wait on peer timeout. To speed up shutdown we reduce
 	// timeout to half a second.
-	m_sendThread->setPeerTimeout(0.5);
-
-	// wait for threads to finish
-	m_sendThread->wait();
-	m_receiveThread->wait();
+	for (auto &thread : m_sendThreads)
+		thread->setPeerTimeout(0.5);
+
+	// wait for threads to finish; the send threads first, as serving
+	// adds receive threads and the acks have to come in until then
+	for (auto &thread : m_sendThreads)
+		thread->wait();
+	for (auto &thread : m_receiveThreads)
+		thread->stop();
+	for (auto &thread : m_receiveThreads)
+		thread->wait();
 
 	// Delete peers
-	for (auto &peer : m_peers) {
-		delete peer.second;
+	for (auto &shard : m_peer_shards) {
+		for (auto &peer : shard->peers)
+			delete peer.second;
 	}
 }
 
@@ -1159,17 +1277,41 @@ void Connection::putEvent(ConnectionEvent &e)
 	m_event_queue.push_back(e);
 }
 
-void Connection::TriggerSend()
+void Connection::TriggerSend(session_t peer_id)
+{
+	m_sendThreads[getShard(peer_id)]->Trigger();
+}
+
+std::list<session_t> Connection::getPeerIDs()
 {
-	m_sendThread->Trigger();
+	std::list<session_t> peer_ids;
+	for (auto &shard : m_peer_shards) {
+		MutexAutoLock peerlock(shard->mutex);
+		peer_ids.insert(peer_ids.end(),
+			shard->peer_ids.begin(), shard->peer_ids.end());
+	}
+	return peer_ids;
+}
+
+std::list<session_t> Connection::getPeerIDs(u32 shard)
+{
+	MutexAutoLock peerlock(m_peer_shards[shard]->mutex);
+	return m_peer_shards[shard]->peer_ids;
+}
+
+u32 Connection::getPeerCount(u32 shard)
+{
+	MutexAutoLock peerlock(m_peer_shards[shard]->mutex);
+	return m_peer_shards[shard]->peers.size();
 }
 
 PeerHelper Connection::getPeerNoEx(session_t peer_id)
 {
-	MutexAutoLock peerlock(m_peers_mutex);
-	std::map<session_t, Peer *>::iterator node = m_peers.find(peer_id);
+	PeerShard &shard = *m_peer_shards[getShard(peer_id)];
+	MutexAutoLock peerlock(shard.mutex);
+	std::map<session_t, Peer *>::iterator node = shard.peers.find(peer_id);
 
-	if (node == m_peers.end()) {
+	if (node == shard.peers.end()) {
 		return PeerHelper(NULL);
 	}
 
@@ -1182,22 +1324,24 @@ PeerHelper Connection::getPeerNoEx(session_t peer_id)
 /* find peer_id for address */
 u16 Connection::lookupPeer(Address& sender)
 {
-	MutexAutoLock peerlock(m_peers_mutex);
-	std::map<u16, Peer*>::iterator j;
-	j = m_peers.begin();
-	for(; j != m_peers.end(); ++j)
-	{
-		Peer *peer = j->second;
-		if (peer->isPendingDeletion())
-			continue;
+	for (auto &shard : m_peer_shards) {
+		MutexAutoLock peerlock(shard->mutex);
+		std::map<u16, Peer*>::iterator j;
+		j = shard->peers.begin();
+		for(; j != shard->peers.end(); ++j)
+		{
+			Peer *peer = j->second;
+			if (peer->isPendingDeletion())
+				continue;
 
-		Address tocheck;
+			Address tocheck;
 
-		if ((peer->getAddress(MTP_MINETEST_RELIABLE_UDP, tocheck)) && (tocheck == sender))
-			return peer->id;
+			if ((peer->getAddress(MTP_MINETEST_RELIABLE_UDP, tocheck)) && (tocheck == sender))
+				return peer->id;
 
-		if ((peer->getAddress(MTP_UDP, tocheck)) && (tocheck == sender))
-			return peer->id;
+			if ((peer->getAddress(MTP_UDP, tocheck)) && (tocheck == sender))
+				return peer->id;
+		}
 	}
 
 	return PEER_ID_INEXISTENT;
@@ -1209,12 +1353,13 @@ bool Connection::deletePeer(session_t peer_id, bool timeout)
 
 	/* lock list as short as possible */
 	{
-		MutexAutoLock peerlock(m_peers_mutex);
-		if (m_peers.find(peer_id) == m_peers.end())
+		PeerShard &shard = *m_peer_shards[getShard(peer_id)];
+		MutexAutoLock peerlock(shard.mutex);
+		if (shard.peers.find(peer_id) == shard.peers.end())
 			return false;
-		peer = m_peers[peer_id];
-		m_peers.erase(peer_id);
-		m_peer_ids.remove(peer_id);
+		peer = shard.peers[peer_id];
+		shard.peers.erase(peer_id);
+		shard.peer_ids.remove(peer_id);
 	}
 
 	Address peer_address;
@@ -1245,9 +1390,24 @@ ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 
 void Connection::putCommand(ConnectionCommand &c)
 {
-	if (!m_shutting_down) {
-		m_command_queue.push_back(c);
-		m_sendThread->Trigger();
+	if (m_shutting_down)
+		return;
+
+	switch (c.type) {
+	case CONNCMD_SERVE:
+	case CONNCMD_CONNECT:
+		m_sendThreads[0]->putCommand(c);
+		break;
+	case CONNCMD_DISCONNECT:
+	case CONNCMD_SEND_TO_ALL:
+		// Every send thread takes care of its own peers
+		for (auto &thread : m_sendThreads)
+			thread->putCommand(c);
+		break;
+	default:
+		// All commands for a peer go through the same queue to keep
+		// their order
+		m_sendThreads[getShard(c.peer_id)]->putCommand(c);
 	}
 }
 
@@ -1267,13 +1427,10 @@ void Connection::Connect(Address address)
 
 bool Connection::Connected()
 {
-	MutexAutoLock peerlock(m_peers_mutex);
-
-	if (m_peers.size() != 1)
+	if (getPeerIDs().size() != 1)
 		return false;
 
-	std::map<session_t, Peer *>::iterator node = m_peers.find(PEER_ID_SERVER);
-	if (node == m_peers.end())
+	if (!getPeerNoEx(PEER_ID_SERVER))
 		return false;
 
 	if (m_peer_id == PEER_ID_INEXISTENT)
@@ -1395,6 +1552,9 @@ u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 {
 	// Somebody wants to make a new connection
 
+	// Receive threads may create peers at the same time
+	MutexAutoLock lock(m_create_peer_mutex);
+
 	// Get a unique peer id (2 or higher)
 	session_t peer_id_new = m_next_remote_peer_id;
 	u16 overflow =  MAX_UDP_PEERS;
@@ -1402,12 +1562,10 @@ u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 	/*
 		Find an unused peer id
 	*/
-	MutexAutoLock lock(m_peers_mutex);
 	bool out_of_ids = false;
 	for(;;) {
 		// Check if exists
-		if (m_peers.find(peer_id_new) == m_peers.end())
-
+		if (!getPeerNoEx(peer_id_new))
 			break;
 		// Check for overflow
 		if (peer_id_new == overflow) {
@@ -1426,8 +1584,12 @@ u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 	Peer *peer = 0;
 	peer = new UDPPeer(peer_id_new, sender, this);
 
-	m_peers[peer->id] = peer;
-	m_peer_ids.push_back(peer->id);
+	{
+		PeerShard &shard = *m_peer_shards[getShard(peer->id)];
+		MutexAutoLock peerlock(shard.mutex);
+		shard.peers[peer->id] = peer;
+		shard.peer_ids.push_back(peer->id);
+	}
 
 	m_next_remote_peer_id = (peer_id_new +1 ) % MAX_UDP_PEERS;
 
@@ -1471,6 +1633,13 @@ void Connection::DisconnectPeer(session_t peer_id)
 	putCommand(discon);
 }
 
+void Connection::EnablePeerBundling(session_t peer_id)
+{
+	ConnectionCommand c;
+	c.enable_bundling(peer_id);
+	putCommand(c);
+}
+
 void Connection::sendAck(session_t peer_id, u8 channelnum, u16 seqnum)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
@@ -1488,7 +1657,6 @@ void Connection::sendAck(session_t peer_id, u8 channelnum, u16 seqnum)
 
 	c.ack(peer_id, channelnum, ack);
 	putCommand(c);
-	m_sendThread->Trigger();
 }
 
 UDPPeer* Connection::createServerPeer(Address& address)
@@ -1501,9 +1669,10 @@ UDPPeer* Connection::createServerPeer(Address& address)
 	UDPPeer *peer = new UDPPeer(PEER_ID_SERVER, address, this);
 
 	{
-		MutexAutoLock lock(m_peers_mutex);
-		m_peers[peer->id] = peer;
-		m_peer_ids.push_back(peer->id);
+		PeerShard &shard = *m_peer_shards[getShard(peer->id)];
+		MutexAutoLock peerlock(shard.mutex);
+		shard.peers[peer->id] = peer;
+		shard.peer_ids.push_back(peer->id);
 	}
 
 	return peer;
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include "irrlichttypes_bloated.h"
+#include "congestion.h"
 #include "peerhandler.h"
 #include "socket.h"
 #include "constants.h"
@@ -32,6 +33,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <memory>
+#include <vector>
 
 class NetworkPacket;
 
@@ -89,12 +92,12 @@ static inline float CALC_DTIME(u64 lasttime, u64 curtime)
 struct BufferedPacket
 {
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size)
+		data(a_data, a_size, 0)
 	{}
-	BufferedPacket(u32 a_size):
-		data(a_size)
+	BufferedPacket(const PacketBuffer &a_data):
+		data(a_data)
 	{}
-	Buffer<u8> data; // Data of the packet, including headers
+	PacketBuffer data; // Data of the packet, including headers
 	float time = 0.0f; // Seconds from buffering the packet or re-sending
 	float totaltime = 0.0f; // Seconds from buffering the packet
 	u64 absolute_send_time = -1;
@@ -102,17 +105,25 @@ struct BufferedPacket
 	unsigned int resend_count = 0;
 };
 
+/*
+	The packet builders below write the headers into the free space in
+	front of the data where possible, instead of copying it.
+*/
+
 // This adds the base headers to the data and makes a packet out of it
-BufferedPacket makePacket(Address &address, SharedBuffer<u8> data,
+BufferedPacket makePacket(Address &address, const PacketBuffer &data,
 		u32 protocol_id, session_t sender_peer_id, u8 channel);
 
 // Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
 // Increments split_seqnum if a split packet is made
-void makeAutoSplitPacket(SharedBuffer<u8> data, u32 chunksize_max,
-		u16 &split_seqnum, std::list<SharedBuffer<u8>> *list);
+void makeAutoSplitPacket(const PacketBuffer &data, u32 chunksize_max,
+		u16 &split_seqnum, std::list<PacketBuffer> *list);
 
 // Add the TYPE_RELIABLE header to the data
-SharedBuffer<u8> makeReliablePacket(SharedBuffer<u8> data, u16 seqnum);
+PacketBuffer makeReliablePacket(const PacketBuffer &data, u16 seqnum);
+
+// Pack TYPE_ORIGINAL packets into a TYPE_BUNDLE packet
+PacketBuffer makeBundlePacket(const std::vector<PacketBuffer> &originals);
 
 struct IncomingSplitPacket
 {
@@ -216,20 +227,41 @@ with a buffer in the receiving and transmitting end.
 //#define TYPE_RELIABLE 3
 #define RELIABLE_HEADER_SIZE 3
 #define SEQNUM_INITIAL 65500
+/*
+BUNDLE: Several small ORIGINAL packets packed into one datagram.
+- Only sent atop of a RELIABLE packet, and only to peers which have
+  been enabled with Connection::EnablePeerBundling().
+- When processed, the contents of each entry is handed to the user
+  in order.
+	Header (1 byte):
+	[0] u8 type
+	Followed by entries of:
+	[0] u16 size
+	[2] u8[size] ORIGINAL packet
+*/
+//#define TYPE_BUNDLE 4
+#define BUNDLE_HEADER_SIZE 1
+#define BUNDLE_ENTRY_HEADER_SIZE 2
+
+// Free space for the headers in front of data sent as a reliable packet.
+// NetworkPacket::forgePacket() leaves enough of it (see PACKET_HEADROOM).
+#define RELIABLE_HEADROOM (BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE)
 
 enum PacketType: u8 {
 	PACKET_TYPE_CONTROL = 0,
 	PACKET_TYPE_ORIGINAL = 1,
 	PACKET_TYPE_SPLIT = 2,
 	PACKET_TYPE_RELIABLE = 3,
+	PACKET_TYPE_BUNDLE = 4,
 	PACKET_TYPE_MAX
 };
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
-*/
+	A buffer which stores reliable packets in a ring indexed by seqnum,
+	for fast access to the smallest one and to any given seqnum.
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+	Resend times are kept in a min-heap, so collecting the timed out
+	packets only touches the ones that actually timed out.
+*/
 
 class ReliablePacketBuffer
 {
@@ -249,17 +281,48 @@ class ReliablePacketBuffer
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
+	struct Slot
+	{
+		std::unique_ptr<BufferedPacket> packet;
+		// Values of m_clock when the packet was buffered and last sent
+		double buffered_at = 0.0;
+		double sent_at = 0.0;
+	};
 
-	std::list<BufferedPacket> m_list;
+	struct ResendEntry
+	{
+		double sent_at;
+		u16 seqnum;
+
+		// Inverted for use as a min-heap with std::push_heap
+		bool operator<(const ResendEntry &other) const
+		{
+			if (sent_at != other.sent_at)
+				return sent_at > other.sent_at;
+			return seqnum > other.seqnum;
+		}
+	};
+
+	Slot *findSlot(u16 seqnum);
+	BufferedPacket takePacket(u16 seqnum);
+	void reserve(u32 span);
+	void pushResendEntry(const Slot &slot, u16 seqnum);
+
+	// Size is a power of two, at least m_span
+	std::vector<Slot> m_ring;
+	// Seqnum of the oldest packet and number of seqnums up to the newest one
+	u16 m_first_seqnum = 0;
+	u32 m_span = 0;
 	u32 m_list_size = 0;
 
-	u16 m_oldest_non_answered_ack;
+	// Seconds passed to incrementTimeouts() so far
+	double m_clock = 0.0;
+	// May contain entries of packets which have been popped or resent since
+	std::vector<ResendEntry> m_resend_heap;
 
 	std::mutex m_list_mutex;
 };
@@ -291,11 +354,11 @@ struct OutgoingPacket
 {
 	session_t peer_id;
 	u8 channelnum;
-	SharedBuffer<u8> data;
+	PacketBuffer data;
 	bool reliable;
 	bool ack;
 
-	OutgoingPacket(session_t peer_id_, u8 channelnum_, const SharedBuffer<u8> &data_,
+	OutgoingPacket(session_t peer_id_, u8 channelnum_, const PacketBuffer &data_,
 			bool reliable_,bool ack_=false):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
@@ -315,7 +378,8 @@ enum ConnectionCommandType{
 	CONNCMD_SEND,
 	CONNCMD_SEND_TO_ALL,
 	CONCMD_ACK,
-	CONCMD_CREATE_PEER
+	CONCMD_CREATE_PEER,
+	CONNCMD_ENABLE_BUNDLING
 };
 
 struct ConnectionCommand
@@ -324,23 +388,13 @@ struct ConnectionCommand
 	Address address;
 	session_t peer_id = PEER_ID_INEXISTENT;
 	u8 channelnum = 0;
-	Buffer<u8> data;
+	// Shared with the NetworkPacket and other commands, the data must
+	// not be changed
+	PacketBuffer data;
 	bool reliable = false;
 	bool raw = false;
 
 	ConnectionCommand() = default;
-	ConnectionCommand &operator=(const ConnectionCommand &other)
-	{
-		type = other.type;
-		address = other.address;
-		peer_id = other.peer_id;
-		channelnum = other.channelnum;
-		// We must copy the buffer here to prevent race condition
-		data = SharedBuffer<u8>(*other.data, other.data.getSize());
-		reliable = other.reliable;
-		raw = other.raw;
-		return *this;
-	}
 
 	void serve(Address address_)
 	{
@@ -361,6 +415,11 @@ struct ConnectionCommand
 		type = CONNCMD_DISCONNECT_PEER;
 		peer_id = peer_id_;
 	}
+	void enable_bundling(session_t peer_id_)
+	{
+		type = CONNCMD_ENABLE_BUNDLING;
+		peer_id = peer_id_;
+	}
 
 	void send(session_t peer_id_, u8 channelnum_, NetworkPacket *pkt, bool reliable_);
 
@@ -369,7 +428,7 @@ struct ConnectionCommand
 		type = CONCMD_ACK;
 		peer_id = peer_id_;
 		channelnum = channelnum_;
-		data = data_;
+		data = PacketBuffer(*data_, data_.getSize(), BASE_HEADER_SIZE);
 		reliable = false;
 	}
 
@@ -377,7 +436,7 @@ struct ConnectionCommand
 	{
 		type = CONCMD_CREATE_PEER;
 		peer_id = peer_id_;
-		data = data_;
+		data = PacketBuffer(*data_, data_.getSize(), RELIABLE_HEADROOM);
 		channelnum = 0;
 		reliable = true;
 		raw = true;
@@ -419,14 +478,16 @@ class Channel
 	//queue commands prior splitting to packets
 	std::deque<ConnectionCommand> queued_commands;
 
+	// small TYPE_ORIGINAL packets waiting to be sent as one TYPE_BUNDLE
+	std::vector<PacketBuffer> pending_bundle;
+	u32 pending_bundle_size = BUNDLE_HEADER_SIZE;
+
 	IncomingSplitBuffer incoming_splits;
 
 	Channel() = default;
 	~Channel() = default;
 
-	void UpdatePacketLossCounter(unsigned int count);
-	void UpdatePacketTooLateCounter();
-	void UpdateBytesSent(unsigned int bytes,unsigned int packages=1);
+	void UpdateBytesSent(unsigned int bytes);
 	void UpdateBytesLost(unsigned int bytes);
 	void UpdateBytesReceived(unsigned int bytes);
 
@@ -454,23 +515,14 @@ class Channel
 	const float getAvgIncomingRateKB()
 		{ MutexAutoLock lock(m_internal_mutex); return avg_incoming_kbps; };
 
-	const unsigned int getWindowSize() const { return window_size; };
-
-	void setWindowSize(unsigned int size) { window_size = size; };
 private:
 	std::mutex m_internal_mutex;
-	int window_size = MIN_RELIABLE_WINDOW_SIZE;
 
 	u16 next_incoming_seqnum = SEQNUM_INITIAL;
 
 	u16 next_outgoing_seqnum = SEQNUM_INITIAL;
 	u16 next_outgoing_split_seqnum = SEQNUM_INITIAL;
 
-	unsigned int current_packet_loss = 0;
-	unsigned int current_packet_too_late = 0;
-	unsigned int current_packet_successful = 0;
-	float packet_loss_counter = 0.0f;
-
 	unsigned int current_bytes_transfered = 0;
 	unsigned int current_bytes_received = 0;
 	unsigned int current_bytes_lost = 0;
@@ -583,6 +635,8 @@ class Peer {
 					return m_rtt.jitter_avg;
 				case TIMEOUT_COUNTER:
 					return m_timeout_counter;
+				default:
+					break;
 			}
 			return -1;
 		}
@@ -640,7 +694,7 @@ class UDPPeer : public Peer
 	friend class Connection;
 
 	UDPPeer(u16 a_id, Address a_address, Connection* connection);
-	virtual ~UDPPeer() = default;
+	virtual ~UDPPeer();
 
 	void PutReliableSendCommand(ConnectionCommand &c,
 							unsigned int max_packet_size);
@@ -653,6 +707,8 @@ class UDPPeer : public Peer
 	SharedBuffer<u8> addSplitPacket(u8 channel, const BufferedPacket &toadd,
 		bool reliable);
 
+	float getStat(rtt_stat_type type) const;
+
 protected:
 	/*
 		Calculates avg_rtt and resend_timeout.
@@ -672,12 +728,41 @@ class UDPPeer : public Peer
 		{ MutexAutoLock lock(m_exclusive_access_mutex); resend_timeout = timeout; }
 	bool Ping(float dtime,SharedBuffer<u8>& data);
 
+	/*
+		Sends the pending small packets of a channel as one reliable
+		packet. Returns false if no sequence number was available.
+	*/
+	bool flushBundle(u8 channelnum);
+
+	// Number of reliable packets waiting for an ack on all channels
+	u32 getReliablesInFlight();
+	u32 getCongestionWindow() const;
+	// Bytes per second the pacer is set to, safe to call from any thread
+	float getPacingRate() const;
+	// Whether the window and the pacer allow sending a reliable packet
+	bool canSendReliable();
+	void onReliableAcked(u32 bytes, float rtt);
+	void onReliablesLost(u32 packets);
+	// Advances the congestion controller and the pacer, and reports them
+	// to the profiler
+	void stepCongestion(float dtime);
+
 	Channel channels[CHANNEL_COUNT];
 	bool m_pending_disconnect = false;
+	// Whether the peer understands TYPE_BUNDLE packets
+	bool m_bundling = false;
+	// Only used by the send thread
+	Pacer m_pacer;
 private:
 	// This is changed dynamically
 	float resend_timeout = 0.5;
 
+	mutable std::mutex m_congestion_mutex;
+	std::unique_ptr<CongestionController> m_congestion;
+	u32 m_packets_lost = 0;
+	u32 m_packets_lost_reported = 0;
+	float m_congestion_report_timer = 0.0f;
+
 	bool processReliableSendCommand(
 					ConnectionCommand &c,
 					unsigned int max_packet_size);
@@ -777,6 +862,12 @@ class Connection
 	const u32 GetProtocolID() const { return m_protocol_id; };
 	const std::string getDesc();
 	void DisconnectPeer(session_t peer_id);
+	// Allow packing small reliable packets to the peer, which must be
+	// able to process TYPE_BUNDLE packets
+	void EnablePeerBundling(session_t peer_id);
+	// Drops the given fraction of the sent packets, for testing
+	void SetSimulatedPacketLoss(float loss)
+		{ m_udpSocket.setSimulatedPacketLoss(loss); }
 
 protected:
 	PeerHelper getPeerNoEx(session_t peer_id);
@@ -792,30 +883,44 @@ class Connection
 
 	void PrintInfo(std::ostream &out);
 
-	std::list<session_t> getPeerIDs()
-	{
-		MutexAutoLock peerlock(m_peers_mutex);
-		return m_peer_ids;
-	}
+	std::list<session_t> getPeerIDs();
+	// Peers the send thread of the given shard takes care of
+	std::list<session_t> getPeerIDs(u32 shard);
+	u32 getPeerCount(u32 shard);
+
+	u32 getShardCount() const { return m_peer_shards.size(); }
+	u32 getShard(session_t peer_id) const
+		{ return peer_id % m_peer_shards.size(); }
 
 	UDPSocket m_udpSocket;
-	MutexedQueue<ConnectionCommand> m_command_queue;
+	// Sockets of the further receive threads, bound to the same address
+	// as m_udpSocket with SO_REUSEPORT
+	std::vector<std::unique_ptr<UDPSocket>> m_receive_sockets;
 
 	void putEvent(ConnectionEvent &e);
 
-	void TriggerSend();
+	void TriggerSend(session_t peer_id);
 private:
+	// Peers of one send thread
+	struct PeerShard
+	{
+		std::map<session_t, Peer *> peers;
+		std::list<session_t> peer_ids;
+		std::mutex mutex;
+	};
+
 	MutexedQueue<ConnectionEvent> m_event_queue;
 
 	session_t m_peer_id = 0;
 	u32 m_protocol_id;
 
-	std::map<session_t, Peer *> m_peers;
-	std::list<session_t> m_peer_ids;
-	std::mutex m_peers_mutex;
+	// Peers are assigned to the shards by their id
+	std::vector<std::unique_ptr<PeerShard>> m_peer_shards;
+	// Held while a new peer id is looked for
+	std::mutex m_create_peer_mutex;
 
-	std::unique_ptr<ConnectionSendThread> m_sendThread;
-	std::unique_ptr<ConnectionReceiveThread> m_receiveThread;
+	std::vector<std::unique_ptr<ConnectionSendThread>> m_sendThreads;
+	std::vector<std::unique_ptr<ConnectionReceiveThread>> m_receiveThreads;
 
 	std::mutex m_info_mutex;
 
@@ -53,6 +53,9 @@ std::mutex log_conthread_mutex;
 
 #define WINDOW_SIZE 5
 
+/* packets collected before they are sent with a single UDPSocket::SendBatch() */
+#define SEND_BATCH_SIZE 64
+
 static session_t readPeerId(u8 *packetdata)
 {
 	return readU16(&packetdata[4]);
@@ -67,10 +70,11 @@ static u8 readChannel(u8 *packetdata)
 /******************************************************************************/
 
 ConnectionSendThread::ConnectionSendThread(unsigned int max_packet_size,
-	float timeout) :
+	float timeout, u32 shard) :
 	Thread("ConnectionSend"),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
+	m_shard(shard),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration"))
 {
 }
@@ -86,7 +90,8 @@ void *ConnectionSendThread::run()
 	u64 lasttime = curtime;
 
 	PROFILE(std::stringstream ThreadIdentifier);
-	PROFILE(ThreadIdentifier << "ConnectionSend: [" << m_connection->getDesc() << "]");
+	PROFILE(ThreadIdentifier << "ConnectionSend: [" << m_connection->getDesc()
+		<< ";" << m_shard << "]");
 
 	/* if stop is requested don't stop immediately but try to send all        */
 	/* packets first */
@@ -96,8 +101,8 @@ void *ConnectionSendThread::run()
 
 		m_iteration_packets_avaialble = m_max_data_packets_per_iteration;
 
-		/* wait for trigger or timeout */
-		m_send_sleep_semaphore.wait(50);
+		/* wait for trigger, timeout or the pacer of a peer */
+		m_send_sleep_semaphore.wait(m_sleep_ms);
 
 		/* remove all triggers */
 		while (m_send_sleep_semaphore.wait(0)) {
@@ -111,19 +116,22 @@ void *ConnectionSendThread::run()
 		runTimeouts(dtime);
 
 		/* translate commands to packets */
-		ConnectionCommand c = m_connection->m_command_queue.pop_frontNoEx(0);
+		ConnectionCommand c = m_command_queue.pop_frontNoEx(0);
 		while (c.type != CONNCMD_NONE) {
 			if (c.reliable)
 				processReliableCommand(c);
 			else
 				processNonReliableCommand(c);
 
-			c = m_connection->m_command_queue.pop_frontNoEx(0);
+			c = m_command_queue.pop_frontNoEx(0);
 		}
 
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* put everything of this iteration on the wire */
+		flushSendBatch();
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -136,9 +144,15 @@ void ConnectionSendThread::Trigger()
 	m_send_sleep_semaphore.post();
 }
 
+void ConnectionSendThread::putCommand(const ConnectionCommand &c)
+{
+	m_command_queue.push_back(c);
+	Trigger();
+}
+
 bool ConnectionSendThread::packetsQueued()
 {
-	std::list<session_t> peerIds = m_connection->getPeerIDs();
+	std::list<session_t> peerIds = m_connection->getPeerIDs(m_shard);
 
 	if (!m_outgoing_queue.empty() && !peerIds.empty())
 		return true;
@@ -166,7 +180,7 @@ bool ConnectionSendThread::packetsQueued()
 void ConnectionSendThread::runTimeouts(float dtime)
 {
 	std::list<session_t> timeouted_peers;
-	std::list<session_t> peerIds = m_connection->getPeerIDs();
+	std::list<session_t> peerIds = m_connection->getPeerIDs(m_shard);
 
 	for (session_t &peerId : peerIds) {
 		PeerHelper peer = m_connection->getPeerNoEx(peerId);
@@ -201,6 +215,8 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			continue;
 		}
 
+		udpPeer->stepCongestion(dtime);
+
 		float resend_timeout = udpPeer->getResendTimeout();
 		bool retry_count_exceeded = false;
 		for (Channel &channel : udpPeer->channels) {
@@ -212,7 +228,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			// Increment reliable packet times
 			channel.outgoing_reliables_sent.incrementTimeouts(dtime);
 
-			unsigned int numpeers = m_connection->m_peers.size();
+			unsigned int numpeers = m_connection->getPeerCount(m_shard);
 
 			if (numpeers == 0)
 				return;
@@ -221,7 +237,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			timed_outs = channel.outgoing_reliables_sent.getTimedOuts(resend_timeout,
 				(m_max_data_packets_per_iteration / numpeers));
 
-			channel.UpdatePacketLossCounter(timed_outs.size());
+			udpPeer->onReliablesLost(timed_outs.size());
 			g_profiler->graphAdd("packets_lost", timed_outs.size());
 
 			m_iteration_packets_avaialble -= timed_outs.size();
@@ -252,6 +268,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 					<< std::endl);
 
 				rawSend(*k);
+				udpPeer->m_pacer.consume(k->data.getSize());
 
 				// do not handle rtt here as we can't decide if this packet was
 				// lost or really takes more time to transmit
@@ -273,7 +290,8 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			LOG(dout_con << m_connection->getDesc()
 				<< "Sending ping for peer_id: " << udpPeer->id << std::endl);
 			/* this may fail if there ain't a sequence number left */
-			if (!rawSendAsPacket(udpPeer->id, 0, data, true)) {
+			PacketBuffer ping(*data, data.getSize(), RELIABLE_HEADROOM);
+			if (!rawSendAsPacket(udpPeer->id, 0, ping, true)) {
 				//retrigger with reduced ping interval
 				udpPeer->Ping(4.0, data);
 			}
@@ -294,17 +312,35 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try {
-		m_connection->m_udpSocket.Send(packet.address, *packet.data,
-			packet.data.getSize());
-		LOG(dout_con << m_connection->getDesc()
-			<< " rawSend: " << packet.data.getSize()
-			<< " bytes sent" << std::endl);
-	} catch (SendFailedException &e) {
+	UDPSocket::Datagram datagram;
+	datagram.address = packet.address;
+	datagram.data = *packet.data;
+	datagram.size = packet.data.getSize();
+	m_send_batch.push_back(datagram);
+	m_send_batch_buffers.push_back(packet.data);
+
+	if (m_send_batch.size() >= SEND_BATCH_SIZE)
+		flushSendBatch();
+}
+
+void ConnectionSendThread::flushSendBatch()
+{
+	if (m_send_batch.empty())
+		return;
+
+	int count = m_send_batch.size();
+	int sent = m_connection->m_udpSocket.SendBatch(m_send_batch.data(), count);
+	LOG(dout_con << m_connection->getDesc()
+		<< " rawSend: " << sent << " of " << count << " packets sent"
+		<< std::endl);
+	if (sent < count) {
 		LOG(derr_con << m_connection->getDesc()
-			<< "Connection::rawSend(): SendFailedException: "
-			<< packet.address.serializeString() << std::endl);
+			<< "Connection::flushSendBatch(): failed to send "
+			<< (count - sent) << " of " << count << " packets" << std::endl);
 	}
+
+	m_send_batch.clear();
+	m_send_batch_buffers.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket &p, Channel *channel)
@@ -327,7 +363,7 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacket &p, Channel *chan
 }
 
 bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
-	SharedBuffer<u8> data, bool reliable)
+	const PacketBuffer &data, bool reliable)
 {
 	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 	if (!peer) {
@@ -338,7 +374,8 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 			"Trying to send raw packet reliable but no peer found!");
 		return false;
 	}
-	Channel *channel = &(dynamic_cast<UDPPeer *>(&peer)->channels[channelnum]);
+	UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(&peer);
+	Channel *channel = &udpPeer->channels[channelnum];
 
 	if (reliable) {
 		bool have_sequence_number_for_raw_packet = true;
@@ -348,7 +385,7 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 		if (!have_sequence_number_for_raw_packet)
 			return false;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
+		PacketBuffer reliable = makeReliablePacket(data, seqnum);
 		Address peer_address;
 		peer->getAddress(MTP_MINETEST_RELIABLE_UDP, peer_address);
 
@@ -358,13 +395,14 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 			channelnum);
 
 		// first check if our send window is already maxed out
-		if (channel->outgoing_reliables_sent.size()
-			< channel->getWindowSize()) {
+		if (udpPeer->getReliablesInFlight()
+			< udpPeer->getCongestionWindow()) {
 			LOG(dout_con << m_connection->getDesc()
 				<< " INFO: sending a reliable packet to peer_id " << peer_id
 				<< " channel: " << (u32)channelnum
 				<< " seqnum: " << seqnum << std::endl);
 			sendAsPacketReliable(p, channel);
+			udpPeer->m_pacer.consume(p.data.getSize());
 			return true;
 		}
 
@@ -482,6 +520,11 @@ void ConnectionSendThread::processNonReliableCommand(ConnectionCommand &c)
 				<< " UDP processing CONCMD_ACK" << std::endl);
 			sendAsPacket(c.peer_id, c.channelnum, c.data, true);
 			return;
+		case CONNCMD_ENABLE_BUNDLING:
+			LOG(dout_con << m_connection->getDesc()
+				<< " UDP processing CONNCMD_ENABLE_BUNDLING" << std::endl);
+			enableBundling(c.peer_id);
+			return;
 		case CONCMD_CREATE_PEER:
 			FATAL_ERROR("Got command that should be reliable as unreliable command");
 		default:
@@ -494,6 +537,14 @@ void ConnectionSendThread::serve(Address bind_address)
 {
 	LOG(dout_con << m_connection->getDesc()
 		<< "UDP serving at port " << bind_address.serializeString() << std::endl);
+	u32 receive_threads = rangelim(
+		g_settings->getU16("connection_receive_threads"), 1, 64);
+	if (receive_threads > 1 && !m_connection->m_udpSocket.setReusePort()) {
+		warningstream << "Can't share the server port between threads, "
+			"using one connection receive thread" << std::endl;
+		receive_threads = 1;
+	}
+
 	try {
 		m_connection->m_udpSocket.Bind(bind_address);
 		m_connection->SetPeerID(PEER_ID_SERVER);
@@ -503,6 +554,32 @@ void ConnectionSendThread::serve(Address bind_address)
 		ConnectionEvent ce;
 		ce.bindFailed();
 		m_connection->putEvent(ce);
+		return;
+	}
+
+	/*
+		Further receive threads get sockets bound to the same port; the
+		kernel then spreads the clients over them by their addresses.
+		All of them are sent from the first socket.
+	*/
+	for (u32 i = 1; i < receive_threads; i++) {
+		std::unique_ptr<UDPSocket> socket(new UDPSocket(bind_address.isIPv6()));
+		socket->setTimeoutMs(5);
+		try {
+			socket->setReusePort();
+			socket->Bind(bind_address);
+		} catch (SocketException &e) {
+			warningstream << "Failed to add connection receive thread: "
+				<< e.what() << std::endl;
+			break;
+		}
+
+		ConnectionReceiveThread *thread =
+			new ConnectionReceiveThread(m_max_packet_size, socket.get());
+		thread->setParent(m_connection);
+		m_connection->m_receive_sockets.push_back(std::move(socket));
+		m_connection->m_receiveThreads.emplace_back(thread);
+		thread->start();
 	}
 }
 
@@ -539,13 +616,13 @@ void ConnectionSendThread::disconnect()
 	LOG(dout_con << m_connection->getDesc() << " disconnecting" << std::endl);
 
 	// Create and send DISCO packet
-	SharedBuffer<u8> data(2);
+	PacketBuffer data(2, BASE_HEADER_SIZE);
 	writeU8(&data[0], PACKET_TYPE_CONTROL);
 	writeU8(&data[1], CONTROLTYPE_DISCO);
 
 
 	// Send to all
-	std::list<session_t> peerids = m_connection->getPeerIDs();
+	std::list<session_t> peerids = m_connection->getPeerIDs(m_shard);
 
 	for (session_t peerid : peerids) {
 		sendAsPacket(peerid, 0, data, false);
@@ -557,7 +634,7 @@ void ConnectionSendThread::disconnect_peer(session_t peer_id)
 	LOG(dout_con << m_connection->getDesc() << " disconnecting peer" << std::endl);
 
 	// Create and send DISCO packet
-	SharedBuffer<u8> data(2);
+	PacketBuffer data(2, BASE_HEADER_SIZE);
 	writeU8(&data[0], PACKET_TYPE_CONTROL);
 	writeU8(&data[1], CONTROLTYPE_DISCO);
 	sendAsPacket(peer_id, 0, data, false);
@@ -574,8 +651,19 @@ void ConnectionSendThread::disconnect_peer(session_t peer_id)
 	dynamic_cast<UDPPeer *>(&peer)->m_pending_disconnect = true;
 }
 
+void ConnectionSendThread::enableBundling(session_t peer_id)
+{
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	if (!peer)
+		return;
+
+	UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(&peer);
+	if (udpPeer)
+		udpPeer->m_bundling = true;
+}
+
 void ConnectionSendThread::send(session_t peer_id, u8 channelnum,
-	SharedBuffer<u8> data)
+	const PacketBuffer &data)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
 
@@ -595,13 +683,13 @@ void ConnectionSendThread::send(session_t peer_id, u8 channelnum,
 	u16 split_sequence_number = peer->getNextSplitSequenceNumber(channelnum);
 
 	u32 chunksize_max = m_max_packet_size - BASE_HEADER_SIZE;
-	std::list<SharedBuffer<u8>> originals;
+	std::list<PacketBuffer> originals;
 
 	makeAutoSplitPacket(data, chunksize_max, split_sequence_number, &originals);
 
 	peer->setNextSplitSequenceNumber(channelnum, split_sequence_number);
 
-	for (const SharedBuffer<u8> &original : originals) {
+	for (const PacketBuffer &original : originals) {
 		sendAsPacket(peer_id, channelnum, original);
 	}
 }
@@ -615,9 +703,9 @@ void ConnectionSendThread::sendReliable(ConnectionCommand &c)
 	peer->PutReliableSendCommand(c, m_max_packet_size);
 }
 
-void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
+void ConnectionSendThread::sendToAll(u8 channelnum, const PacketBuffer &data)
 {
-	std::list<session_t> peerids = m_connection->getPeerIDs();
+	std::list<session_t> peerids = m_connection->getPeerIDs(m_shard);
 
 	for (session_t peerid : peerids) {
 		send(peerid, channelnum, data);
@@ -626,7 +714,7 @@ void ConnectionSendThread::sendToAll(u8 channelnum, SharedBuffer<u8> data)
 
 void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 {
-	std::list<session_t> peerids = m_connection->getPeerIDs();
+	std::list<session_t> peerids = m_connection->getPeerIDs(m_shard);
 
 	for (session_t peerid : peerids) {
 		PeerHelper peer = m_connection->getPeerNoEx(peerid);
@@ -640,10 +728,11 @@ void ConnectionSendThread::sendToAllReliable(ConnectionCommand &c)
 
 void ConnectionSendThread::sendPackets(float dtime)
 {
-	std::list<session_t> peerIds = m_connection->getPeerIDs();
+	std::list<session_t> peerIds = m_connection->getPeerIDs(m_shard);
 	std::list<session_t> pendingDisconnect;
 	std::map<session_t, bool> pending_unreliable;
 
+	m_sleep_ms = 50;
 	for (session_t peerId : peerIds) {
 		PeerHelper peer = m_connection->getPeerNoEx(peerId);
 		//peer may have been removed
@@ -654,7 +743,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 			continue;
 		}
 		peer->m_increment_packets_remaining =
-			m_iteration_packets_avaialble / m_connection->m_peers.size();
+			m_iteration_packets_avaialble / peerIds.size();
 
 		UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(&peer);
 
@@ -708,9 +797,11 @@ void ConnectionSendThread::sendPackets(float dtime)
 				<< channel.queued_commands.size()
 				<< std::endl);
 
+			// small packets of this iteration go out together
+			udpPeer->flushBundle(i);
+
 			while (!channel.queued_reliables.empty() &&
-					channel.outgoing_reliables_sent.size()
-					< channel.getWindowSize() &&
+					udpPeer->canSendReliable() &&
 					peer->m_increment_packets_remaining > 0) {
 				BufferedPacket p = channel.queued_reliables.front();
 				channel.queued_reliables.pop();
@@ -720,8 +811,16 @@ void ConnectionSendThread::sendPackets(float dtime)
 					<< ", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE + 1])
 					<< std::endl);
 				sendAsPacketReliable(p, &channel);
+				udpPeer->m_pacer.consume(p.data.getSize());
 				peer->m_increment_packets_remaining--;
 			}
+
+			// come back as soon as the pacer lets the next packet go
+			if (!channel.queued_reliables.empty() &&
+					!udpPeer->m_pacer.canSend()) {
+				u32 wait_ms = std::ceil(udpPeer->m_pacer.getWaitTime() * 1000.0f);
+				m_sleep_ms = rangelim(wait_ms, 1, m_sleep_ms);
+			}
 		}
 	}
 
@@ -776,14 +875,16 @@ void ConnectionSendThread::sendPackets(float dtime)
 }
 
 void ConnectionSendThread::sendAsPacket(session_t peer_id, u8 channelnum,
-	SharedBuffer<u8> data, bool ack)
+	const PacketBuffer &data, bool ack)
 {
 	OutgoingPacket packet(peer_id, channelnum, data, false, ack);
 	m_outgoing_queue.push(packet);
 }
 
-ConnectionReceiveThread::ConnectionReceiveThread(unsigned int max_packet_size) :
-	Thread("ConnectionReceive")
+ConnectionReceiveThread::ConnectionReceiveThread(unsigned int max_packet_size,
+	UDPSocket *socket) :
+	Thread("ConnectionReceive"),
+	m_socket(socket)
 {
 }
 
@@ -851,6 +952,9 @@ void *ConnectionReceiveThread::run()
 				output << "OUT to Peer " << *i << " RATES (good / loss) " << std::endl;
 				output << "\tcurrent (sum): " << peer_current << "kb/s "<< peer_loss << "kb/s" << std::endl;
 				output << "\taverage (sum): " << avg_rate << "kb/s "<< avg_loss << "kb/s" << std::endl;
+				output << "\twindow: " << peer->getCongestionWindow()
+					<< " pacing: " << peer->getPacingRate() / 1024.0f << "kb/s"
+					<< std::endl;
 				output << std::setfill(' ');
 				for(u16 j=0; j<CHANNEL_COUNT; j++)
 				{
@@ -862,7 +966,6 @@ void *ConnectionReceiveThread::run()
 						<< " CUR: " << std::setw(6) << peer->channels[j].getCurrentLossRateKB() <<"kb/s"
 						<< " AVG: " << std::setw(6) << peer->channels[j].getAvgLossRateKB() <<"kb/s"
 						<< " MAX: " << std::setw(6) << peer->channels[j].getMaxLossRateKB() <<"kb/s"
-						<< " / WS: " << peer->channels[j].getWindowSize()
 						<< std::endl;
 				}
 
@@ -877,14 +980,20 @@ void *ConnectionReceiveThread::run()
 	return NULL;
 }
 
+// Number of datagrams read with one UDPSocket::ReceiveBatch()
+#define RECEIVE_BATCH_SIZE 32
+
 // Receive packets from the network and buffers and create ConnectionEvents
 void ConnectionReceiveThread::receive()
 {
 	// use IPv6 minimum allowed MTU as receive buffer size as this is
 	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
 	// infrastructure
-	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	const unsigned int packet_maxsize = 1500;
+	if (m_receive_batch.empty()) {
+		m_receive_batch.resize(RECEIVE_BATCH_SIZE);
+		m_receive_batch_data.resize(RECEIVE_BATCH_SIZE * packet_maxsize);
+	}
 
 	bool packet_queued = true;
 
@@ -893,162 +1002,196 @@ void ConnectionReceiveThread::receive()
 	/* first of all read packets from socket */
 	/* check for incoming data available */
 	while ((loop_count < 10) &&
-		(m_connection->m_udpSocket.WaitData(50))) {
+		(m_socket->WaitData(50))) {
 		loop_count++;
-		try {
-			if (packet_queued) {
-				bool data_left = true;
-				session_t peer_id;
-				SharedBuffer<u8> resultdata;
-				while (data_left) {
-					try {
-						data_left = getFromBuffers(peer_id, resultdata);
-						if (data_left) {
-							ConnectionEvent e;
-							e.dataReceived(peer_id, resultdata);
-							m_connection->putEvent(e);
-						}
-					}
-					catch (ProcessedSilentlyException &e) {
-						/* try reading again */
-					}
-				}
-				packet_queued = false;
-			}
 
-			Address sender;
-			s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata,
-				packet_maxsize);
+		// Take everything that is already there at once
+		for (unsigned int i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+			m_receive_batch[i].data = &m_receive_batch_data[i * packet_maxsize];
+			m_receive_batch[i].size = packet_maxsize;
+		}
+		int count = m_socket->ReceiveBatch(
+			m_receive_batch.data(), RECEIVE_BATCH_SIZE);
 
-			if ((received_size < BASE_HEADER_SIZE) ||
-				(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
-				LOG(derr_con << m_connection->getDesc()
-					<< "Receive(): Invalid incoming packet, "
-					<< "size: " << received_size
-					<< ", protocol: "
-					<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
-					<< std::endl);
-				continue;
-			}
+		for (int i = 0; i < count; i++)
+			receiveDatagram(m_receive_batch[i], packet_queued);
 
-			session_t peer_id = readPeerId(*packetdata);
-			u8 channelnum = readChannel(*packetdata);
+		// The batch may have filled a gap in front of buffered packets,
+		// don't wait for the next one to deliver them
+		processBufferedPackets();
+		packet_queued = false;
+	}
+}
 
-			if (channelnum > CHANNEL_COUNT - 1) {
-				LOG(derr_con << m_connection->getDesc()
-					<< "Receive(): Invalid channel " << (u32)channelnum << std::endl);
-				throw InvalidIncomingDataException("Channel doesn't exist");
+void ConnectionReceiveThread::processBufferedPackets()
+{
+	bool data_left = true;
+	session_t peer_id;
+	SharedBuffer<u8> resultdata;
+	while (data_left) {
+		try {
+			data_left = getFromBuffers(peer_id, resultdata);
+			if (data_left) {
+				ConnectionEvent e;
+				e.dataReceived(peer_id, resultdata);
+				m_connection->putEvent(e);
 			}
+		}
+		catch (ProcessedSilentlyException &e) {
+			/* try reading again */
+		}
+	}
+}
 
-			/* Try to identify peer by sender address (may happen on join) */
-			if (peer_id == PEER_ID_INEXISTENT) {
-				peer_id = m_connection->lookupPeer(sender);
-				// We do not have to remind the peer of its
-				// peer id as the CONTROLTYPE_SET_PEER_ID
-				// command was sent reliably.
-			}
+void ConnectionReceiveThread::receiveDatagram(
+	const UDPSocket::Datagram &datagram, bool &packet_queued)
+{
+	try {
+		if (packet_queued) {
+			processBufferedPackets();
+			packet_queued = false;
+		}
 
-			/* The peer was not found in our lists. Add it. */
-			if (peer_id == PEER_ID_INEXISTENT) {
-				peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
-			}
+		Address sender = datagram.address;
+		u8 *packetdata = datagram.data;
+		s32 received_size = datagram.size;
+
+		if ((received_size < BASE_HEADER_SIZE) ||
+			(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
+			LOG(derr_con << m_connection->getDesc()
+				<< "Receive(): Invalid incoming packet, "
+				<< "size: " << received_size
+				<< ", protocol: "
+				<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
+				<< std::endl);
+			return;
+		}
 
-			PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+		session_t peer_id = readPeerId(packetdata);
+		u8 channelnum = readChannel(packetdata);
 
-			if (!peer) {
-				LOG(dout_con << m_connection->getDesc()
-					<< " got packet from unknown peer_id: "
-					<< peer_id << " Ignoring." << std::endl);
-				continue;
-			}
+		if (channelnum > CHANNEL_COUNT - 1) {
+			LOG(derr_con << m_connection->getDesc()
+				<< "Receive(): Invalid channel " << (u32)channelnum << std::endl);
+			throw InvalidIncomingDataException("Channel doesn't exist");
+		}
 
-			// Validate peer address
+		/* Try to identify peer by sender address (may happen on join) */
+		if (peer_id == PEER_ID_INEXISTENT) {
+			peer_id = m_connection->lookupPeer(sender);
+			// We do not have to remind the peer of its
+			// peer id as the CONTROLTYPE_SET_PEER_ID
+			// command was sent reliably.
+		}
 
-			Address peer_address;
+		/* The peer was not found in our lists. Add it. */
+		if (peer_id == PEER_ID_INEXISTENT) {
+			peer_id = m_connection->createPeer(sender, MTP_MINETEST_RELIABLE_UDP, 0);
+		}
 
-			if (peer->getAddress(MTP_UDP, peer_address)) {
-				if (peer_address != sender) {
-					LOG(derr_con << m_connection->getDesc()
-						<< m_connection->getDesc()
-						<< " Peer " << peer_id << " sending from different address."
-						" Ignoring." << std::endl);
-					continue;
-				}
-			} else {
-
-				bool invalid_address = true;
-				if (invalid_address) {
-					LOG(derr_con << m_connection->getDesc()
-						<< m_connection->getDesc()
-						<< " Peer " << peer_id << " unknown."
-						" Ignoring." << std::endl);
-					continue;
-				}
-			}
+		PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
-			peer->ResetTimeout();
+		if (!peer) {
+			LOG(dout_con << m_connection->getDesc()
+				<< " got packet from unknown peer_id: "
+				<< peer_id << " Ignoring." << std::endl);
+			return;
+		}
 
-			Channel *channel = 0;
+		// Validate peer address
 
-			if (dynamic_cast<UDPPeer *>(&peer) != 0) {
-				channel = &(dynamic_cast<UDPPeer *>(&peer)->channels[channelnum]);
-			}
+		Address peer_address;
 
-			if (channel != 0) {
-				channel->UpdateBytesReceived(received_size);
+		if (peer->getAddress(MTP_UDP, peer_address)) {
+			if (peer_address != sender) {
+				LOG(derr_con << m_connection->getDesc()
+					<< m_connection->getDesc()
+					<< " Peer " << peer_id << " sending from different address."
+					" Ignoring." << std::endl);
+				return;
 			}
+		} else {
 
-			// Throw the received packet to channel->processPacket()
+			bool invalid_address = true;
+			if (invalid_address) {
+				LOG(derr_con << m_connection->getDesc()
+					<< m_connection->getDesc()
+					<< " Peer " << peer_id << " unknown."
+					" Ignoring." << std::endl);
+				return;
+			}
+		}
 
-			// Make a new SharedBuffer from the data without the base headers
-			SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-			memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-				strippeddata.getSize());
+		peer->ResetTimeout();
 
-			try {
-				// Process it (the result is some data with no headers made by us)
-				SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
+		Channel *channel = 0;
 
-				LOG(dout_con << m_connection->getDesc()
-					<< " ProcessPacket from peer_id: " << peer_id
-					<< ", channel: " << (u32)channelnum << ", returned "
-					<< resultdata.getSize() << " bytes" << std::endl);
+		if (dynamic_cast<UDPPeer *>(&peer) != 0) {
+			channel = &(dynamic_cast<UDPPeer *>(&peer)->channels[channelnum]);
+		}
 
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				m_connection->putEvent(e);
-			}
-			catch (ProcessedSilentlyException &e) {
-			}
-			catch (ProcessedQueued &e) {
-				packet_queued = true;
-			}
+		if (channel != 0) {
+			channel->UpdateBytesReceived(received_size);
 		}
-		catch (InvalidIncomingDataException &e) {
+
+		// Throw the received packet to channel->processPacket()
+
+		// Make a new SharedBuffer from the data without the base headers
+		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
+		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
+			strippeddata.getSize());
+
+		try {
+			// Process it (the result is some data with no headers made by us)
+			SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
+
+			LOG(dout_con << m_connection->getDesc()
+				<< " ProcessPacket from peer_id: " << peer_id
+				<< ", channel: " << (u32)channelnum << ", returned "
+				<< resultdata.getSize() << " bytes" << std::endl);
+
+			ConnectionEvent e;
+			e.dataReceived(peer_id, resultdata);
+			m_connection->putEvent(e);
 		}
 		catch (ProcessedSilentlyException &e) {
 		}
+		catch (ProcessedQueued &e) {
+			m_buffered_peers.insert(peer_id);
+			packet_queued = true;
+		}
+	}
+	catch (InvalidIncomingDataException &e) {
+	}
+	catch (ProcessedSilentlyException &e) {
 	}
 }
 
 bool ConnectionReceiveThread::getFromBuffers(session_t &peer_id, SharedBuffer<u8> &dst)
 {
-	std::list<session_t> peerids = m_connection->getPeerIDs();
-
-	for (session_t peerid : peerids) {
-		PeerHelper peer = m_connection->getPeerNoEx(peerid);
-		if (!peer)
-			continue;
-
-		if (dynamic_cast<UDPPeer *>(&peer) == 0)
+	std::set<session_t>::iterator it = m_buffered_peers.begin();
+	while (it != m_buffered_peers.end()) {
+		PeerHelper peer = m_connection->getPeerNoEx(*it);
+		UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(&peer);
+		if (!udpPeer) {
+			it = m_buffered_peers.erase(it);
 			continue;
+		}
 
-		for (Channel &channel : (dynamic_cast<UDPPeer *>(&peer))->channels) {
+		bool buffered = false;
+		for (Channel &channel : udpPeer->channels) {
 			if (checkIncomingBuffers(&channel, peer_id, dst)) {
 				return true;
 			}
+			if (!channel.incoming_reliables.empty())
+				buffered = true;
 		}
+
+		if (buffered)
+			++it;
+		else
+			it = m_buffered_peers.erase(it);
 	}
 	return false;
 }
@@ -1122,6 +1265,7 @@ const ConnectionReceiveThread::PacketTypeHandler
 	{&ConnectionReceiveThread::handlePacketType_Original},
 	{&ConnectionReceiveThread::handlePacketType_Split},
 	{&ConnectionReceiveThread::handlePacketType_Reliable},
+	{&ConnectionReceiveThread::handlePacketType_Bundle},
 };
 
 SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *channel,
@@ -1147,6 +1291,8 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *chan
 
 		try {
 			BufferedPacket p = channel->outgoing_reliables_sent.popSeqnum(seqnum);
+			UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(peer);
+			float rtt = -1.0f;
 
 			// only calculate rtt from straight sent packets
 			if (p.resend_count == 0) {
@@ -1155,7 +1301,7 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *chan
 
 				// a overflow is quite unlikely but as it'd result in major
 				// rtt miscalculation we handle it here
-				float rtt = 0.0f;
+				rtt = 0.0f;
 				if (current_time > p.absolute_send_time) {
 					rtt = (current_time - p.absolute_send_time) / 1000.0f;
 				} else if (p.totaltime > 0) {
@@ -1165,16 +1311,21 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *chan
 				// Let peer calculate stuff according to it
 				// (avg_rtt and resend_timeout)
 				if (rtt != 0.0f)
-					dynamic_cast<UDPPeer *>(peer)->reportRTT(rtt);
+					udpPeer->reportRTT(rtt);
 			}
 			// put bytes for max bandwidth calculation
-			channel->UpdateBytesSent(p.data.getSize(), 1);
-			if (channel->outgoing_reliables_sent.size() == 0)
-				m_connection->TriggerSend();
+			channel->UpdateBytesSent(p.data.getSize());
+			udpPeer->onReliableAcked(p.data.getSize(), rtt);
+
+			// wake up the send thread if the window was full or has
+			// room for more than a few packets
+			u32 in_flight = udpPeer->getReliablesInFlight();
+			u32 window = udpPeer->getCongestionWindow();
+			if (in_flight + 1 >= window || in_flight < window / 2)
+				m_connection->TriggerSend(peer->id);
 		} catch (NotFoundException &e) {
 			LOG(derr_con << m_connection->getDesc()
 				<< "WARNING: ACKed packet not in outgoing queue" << std::endl);
-			channel->UpdatePacketTooLateCounter();
 		}
 
 		throw ProcessedSilentlyException("Got an ACK");
@@ -1244,7 +1395,7 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Split(Channel *channe
 		// We have to create a packet again for buffering
 		// This isn't actually too bad an idea.
 		BufferedPacket packet = makePacket(peer_address,
-			packetdata,
+			PacketBuffer(*packetdata, packetdata.getSize(), BASE_HEADER_SIZE),
 			m_connection->GetProtocolID(),
 			peer->id,
 			channelnum);
@@ -1324,7 +1475,7 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Reliable(Channel *cha
 		// Well, we have all the ingredients, so just do it.
 		BufferedPacket packet = con::makePacket(
 			peer_address,
-			packetdata,
+			PacketBuffer(*packetdata, packetdata.getSize(), BASE_HEADER_SIZE),
 			m_connection->GetProtocolID(),
 			peer->id,
 			channelnum);
@@ -1376,4 +1527,42 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Reliable(Channel *cha
 	return processPacket(channel, payload, peer->id, channelnum, true);
 }
 
+SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Bundle(Channel *channel,
+	SharedBuffer<u8> packetdata, Peer *peer, u8 channelnum, bool reliable)
+{
+	// Only reliable delivery keeps the bundled packets in order
+	if (!reliable)
+		throw InvalidIncomingDataException("Found unreliable bundle packet");
+
+	// Check all entries before handing out any of them
+	std::vector<SharedBuffer<u8>> payloads;
+	u32 offset = BUNDLE_HEADER_SIZE;
+	while (offset < packetdata.getSize()) {
+		if (packetdata.getSize() - offset < BUNDLE_ENTRY_HEADER_SIZE)
+			throw InvalidIncomingDataException("Truncated bundle entry header");
+		u16 size = readU16(&packetdata[offset]);
+		offset += BUNDLE_ENTRY_HEADER_SIZE;
+
+		if (size <= ORIGINAL_HEADER_SIZE || size > packetdata.getSize() - offset)
+			throw InvalidIncomingDataException("Invalid bundle entry size");
+		if (readU8(&packetdata[offset]) != PACKET_TYPE_ORIGINAL)
+			throw InvalidIncomingDataException("Bundle entry is not original");
+
+		SharedBuffer<u8> payload(size - ORIGINAL_HEADER_SIZE);
+		memcpy(*payload, &packetdata[offset + ORIGINAL_HEADER_SIZE],
+			payload.getSize());
+		payloads.push_back(payload);
+		offset += size;
+	}
+
+	LOG(dout_con << m_connection->getDesc() << "RETURNING TYPE_BUNDLE: "
+		<< payloads.size() << " packets to user" << std::endl);
+	for (const SharedBuffer<u8> &payload : payloads) {
+		ConnectionEvent e;
+		e.dataReceived(peer->id, payload);
+		m_connection->putEvent(e);
+	}
+	throw ProcessedSilentlyException("Got a bundle");
+}
+
 }
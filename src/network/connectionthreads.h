@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include <cassert>
+#include <set>
 #include "threading/thread.h"
 #include "connection.h"
 
@@ -35,11 +36,17 @@ class ConnectionSendThread : public Thread
 public:
 	friend class UDPPeer;
 
-	ConnectionSendThread(unsigned int max_packet_size, float timeout);
+	/*
+		Sends to the peers of the given shard of the connection; the
+		commands for them have to be put to this thread.
+	*/
+	ConnectionSendThread(unsigned int max_packet_size, float timeout,
+			u32 shard);
 
 	void *run();
 
 	void Trigger();
+	void putCommand(const ConnectionCommand &c);
 
 	void setParent(Connection *parent)
 	{
@@ -51,8 +58,10 @@ class ConnectionSendThread : public Thread
 
 private:
 	void runTimeouts(float dtime);
+	// Queues the packet for the next flushSendBatch()
 	void rawSend(const BufferedPacket &packet);
-	bool rawSendAsPacket(session_t peer_id, u8 channelnum, SharedBuffer<u8> data,
+	void flushSendBatch();
+	bool rawSendAsPacket(session_t peer_id, u8 channelnum, const PacketBuffer &data,
 			bool reliable);
 
 	void processReliableCommand(ConnectionCommand &c);
@@ -61,14 +70,15 @@ class ConnectionSendThread : public Thread
 	void connect(Address address);
 	void disconnect();
 	void disconnect_peer(session_t peer_id);
-	void send(session_t peer_id, u8 channelnum, SharedBuffer<u8> data);
+	void enableBundling(session_t peer_id);
+	void send(session_t peer_id, u8 channelnum, const PacketBuffer &data);
 	void sendReliable(ConnectionCommand &c);
-	void sendToAll(u8 channelnum, SharedBuffer<u8> data);
+	void sendToAll(u8 channelnum, const PacketBuffer &data);
 	void sendToAllReliable(ConnectionCommand &c);
 
 	void sendPackets(float dtime);
 
-	void sendAsPacket(session_t peer_id, u8 channelnum, SharedBuffer<u8> data,
+	void sendAsPacket(session_t peer_id, u8 channelnum, const PacketBuffer &data,
 			bool ack = false);
 
 	void sendAsPacketReliable(BufferedPacket &p, Channel *channel);
@@ -78,6 +88,8 @@ class ConnectionSendThread : public Thread
 	Connection *m_connection = nullptr;
 	unsigned int m_max_packet_size;
 	float m_timeout;
+	u32 m_shard;
+	MutexedQueue<ConnectionCommand> m_command_queue;
 	std::queue<OutgoingPacket> m_outgoing_queue;
 	Semaphore m_send_sleep_semaphore;
 
@@ -85,12 +97,18 @@ class ConnectionSendThread : public Thread
 	unsigned int m_max_commands_per_iteration = 1;
 	unsigned int m_max_data_packets_per_iteration;
 	unsigned int m_max_packets_requeued = 256;
+	// Milliseconds to wait for a trigger before the next iteration
+	unsigned int m_sleep_ms = 50;
+
+	// Packets collected by rawSend(); the buffers keep the datagram data alive
+	std::vector<UDPSocket::Datagram> m_send_batch;
+	std::vector<PacketBuffer> m_send_batch_buffers;
 };
 
 class ConnectionReceiveThread : public Thread
 {
 public:
-	ConnectionReceiveThread(unsigned int max_packet_size);
+	ConnectionReceiveThread(unsigned int max_packet_size, UDPSocket *socket);
 
 	void *run();
 
@@ -102,6 +120,10 @@ class ConnectionReceiveThread : public Thread
 
 private:
 	void receive();
+	void receiveDatagram(const UDPSocket::Datagram &datagram,
+			bool &packet_queued);
+	// Puts the buffered packets that are next in order to the events
+	void processBufferedPackets();
 
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
@@ -134,6 +156,9 @@ class ConnectionReceiveThread : public Thread
 	SharedBuffer<u8> handlePacketType_Reliable(Channel *channel,
 			SharedBuffer<u8> packetdata, Peer *peer, u8 channelnum,
 			bool reliable);
+	SharedBuffer<u8> handlePacketType_Bundle(Channel *channel,
+			SharedBuffer<u8> packetdata, Peer *peer, u8 channelnum,
+			bool reliable);
 
 	struct PacketTypeHandler
 	{
@@ -145,5 +170,14 @@ class ConnectionReceiveThread : public Thread
 	static const PacketTypeHandler packetTypeRouter[PACKET_TYPE_MAX];
 
 	Connection *m_connection = nullptr;
+	UDPSocket *m_socket;
+
+	// Peers with reliable packets buffered by this thread, waiting for
+	// the ones in front of them
+	std::set<session_t> m_buffered_peers;
+
+	// Receive buffers of the datagrams of one ReceiveBatch()
+	std::vector<UDPSocket::Datagram> m_receive_batch;
+	std::vector<u8> m_receive_batch_data;
 };
 }
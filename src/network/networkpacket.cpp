@@ -24,20 +24,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "networkprotocol.h"
 
 NetworkPacket::NetworkPacket(u16 command, u32 datasize, session_t peer_id):
-m_datasize(datasize), m_command(command), m_peer_id(peer_id)
+m_data(datasize, PACKET_HEADROOM), m_datasize(datasize), m_command(command),
+m_peer_id(peer_id)
 {
-	m_data.resize(m_datasize);
 }
 
 NetworkPacket::NetworkPacket(u16 command, u32 datasize):
-m_datasize(datasize), m_command(command)
-{
-	m_data.resize(m_datasize);
-}
-
-NetworkPacket::~NetworkPacket()
+m_data(datasize, PACKET_HEADROOM), m_datasize(datasize), m_command(command)
 {
-	m_data.clear();
 }
 
 void NetworkPacket::checkReadOffset(u32 from_offset, u32 field_size)
@@ -59,11 +53,12 @@ void NetworkPacket::putRawPacket(u8 *data, u32 datasize, session_t peer_id)
 	m_datasize = datasize - 2;
 	m_peer_id = peer_id;
 
+	m_forged = PacketBuffer();
 	m_data.resize(m_datasize);
 
 	// split command and datas
 	m_command = readU16(&data[0]);
-	memcpy(m_data.data(), &data[2], m_datasize);
+	memcpy(*m_data, &data[2], m_datasize);
 }
 
 const char* NetworkPacket::getString(u32 from_offset)
@@ -75,10 +70,7 @@ const char* NetworkPacket::getString(u32 from_offset)
 
 void NetworkPacket::putRawString(const char* src, u32 len)
 {
-	if (m_read_offset + len > m_datasize) {
-		m_datasize = m_read_offset + len;
-		m_data.resize(m_datasize);
-	}
+	checkDataSize(len);
 
 	if (len == 0)
 		return;
@@ -529,6 +521,15 @@ NetworkPacket& NetworkPacket::operator<<(video::SColor src)
 	return *this;
 }
 
+PacketBuffer NetworkPacket::forgePacket()
+{
+	if (m_forged.getSize() == 0) {
+		m_forged = m_data.prepend(2);
+		writeU16(&m_forged[0], m_command);
+	}
+	return m_forged;
+}
+
 SharedBuffer<u8> NetworkPacket::oldForgePacket()
 {
 	SharedBuffer<u8> sb(m_datasize + 2);
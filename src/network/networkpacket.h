@@ -25,6 +25,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "networkprotocol.h"
 #include <SColor.h>
 
+/*
+	Free space kept in front of the packet data, enough for the command
+	and the connection headers of an unsplit reliable packet
+*/
+#define PACKET_HEADROOM 16
+
 class NetworkPacket
 {
 
@@ -33,8 +39,6 @@ class NetworkPacket
 	NetworkPacket(u16 command, u32 datasize);
 	NetworkPacket() = default;
 
-	~NetworkPacket();
-
 	void putRawPacket(u8 *data, u32 datasize, session_t peer_id);
 
 	// Getters
@@ -118,6 +122,10 @@ class NetworkPacket
 	NetworkPacket &operator>>(video::SColor &dst);
 	NetworkPacket &operator<<(video::SColor src);
 
+	// Returns the command followed by the data, sharing the packet data.
+	// Sending the same packet to many peers doesn't copy it.
+	PacketBuffer forgePacket();
+
 	// Temp, we remove SharedBuffer when migration finished
 	SharedBuffer<u8> oldForgePacket();
 
@@ -126,13 +134,18 @@ class NetworkPacket
 
 	inline void checkDataSize(u32 field_size)
 	{
+		// The forged packet keeps the old data
+		m_forged = PacketBuffer();
 		if (m_read_offset + field_size > m_datasize) {
 			m_datasize = m_read_offset + field_size;
 			m_data.resize(m_datasize);
+		} else {
+			m_data.makeUnique();
 		}
 	}
 
-	std::vector<u8> m_data;
+	PacketBuffer m_data = PacketBuffer(0, PACKET_HEADROOM);
+	PacketBuffer m_forged;
 	u32 m_datasize = 0;
 	u32 m_read_offset = 0;
 	u16 m_command = 0;
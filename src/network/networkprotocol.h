@@ -188,9 +188,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		Nodebox version 5
 		Add disconnected nodeboxes
 		Add TOCLIENT_FORMSPEC_PREPEND
+	PROTOCOL VERSION 37:
+		Add low-level TYPE_BUNDLE packets, small reliable packets may be
+			packed into one datagram
+	PROTOCOL VERSION 38:
+		Add GENERIC_CMD_UPDATE_POSITION_REFERENCE and
+			GENERIC_CMD_UPDATE_POSITION_DELTA, object positions are sent
+			quantized and relative to the last reliably sent one
+	PROTOCOL VERSION 39:
+		Add TOCLIENT_BLOCK_NODES, modified blocks the client has are sent
+			as the changed nodes
 */
 
-#define LATEST_PROTOCOL_VERSION 36
+#define LATEST_PROTOCOL_VERSION 39
 #define LATEST_PROTOCOL_VERSION_STRING TOSTRING(LATEST_PROTOCOL_VERSION)
 
 // Server's supported network protocol range
@@ -223,7 +233,7 @@ enum ToClientCommand
 		Sent after TOSERVER_INIT.
 
 		u8 deployed serialisation version
-		u16 deployed network compression mode
+		u16 deployed network compression mode (NetProtoCompressionMode)
 		u16 deployed protocol version
 		u32 supported auth methods
 		std::string username that should be used for legacy hash (for proper casing)
@@ -289,6 +299,19 @@ enum ToClientCommand
 		u32 CSMRestrictionFlags byteflag
 	 */
 
+	TOCLIENT_BLOCK_NODES = 0x2B,
+	/*
+		Changed nodes of a block the client has, sent instead of
+		TOCLIENT_BLOCKDATA. Metadata and flags are unchanged.
+		v3s16 block position
+		u16 count
+		for each:
+			u16 node index (z * 256 + y * 16 + x)
+			u16 param0
+			u8 param1
+			u8 param2
+	*/
+
 	// (oops, there is some gap here)
 
 	TOCLIENT_CHAT_MESSAGE = 0x2F,
@@ -662,7 +685,7 @@ enum ToServerCommand
 		Sent first after connected.
 
 		u8 serialisation version (=SER_FMT_VER_HIGHEST_READ)
-		u16 supported network compression modes
+		u16 supported network compression modes (NetProtoCompressionMode)
 		u16 minimum supported network protocol version
 		u16 maximum supported network protocol version
 		std::string player name
@@ -902,8 +925,15 @@ enum AccessDeniedCode {
 	SERVER_ACCESSDENIED_MAX,
 };
 
+/*
+	Flags of the MapBlock compression codecs a client supports besides
+	zlib. Only used with serialization version >= 29; the server deploys
+	at most one of them.
+*/
 enum NetProtoCompressionMode {
 	NETPROTO_COMPRESSION_NONE = 0,
+	NETPROTO_COMPRESSION_ZSTD = 0x01,
+	NETPROTO_COMPRESSION_LZ4 = 0x02,
 };
 
 const static std::string accessDeniedStrings[SERVER_ACCESSDENIED_MAX] = {
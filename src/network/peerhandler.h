@@ -31,7 +31,10 @@ typedef enum {
 	MIN_JITTER,
 	MAX_JITTER,
 	AVG_JITTER,
-	TIMEOUT_COUNTER
+	TIMEOUT_COUNTER,
+	CONGESTION_WINDOW,
+	PACING_RATE,
+	PACKETS_LOST
 } rtt_stat_type;
 
 class Peer;
@@ -257,6 +257,10 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 		}
 	}
 
+	// Small reliable packets may be packed together from now on
+	if (net_proto_version >= 37)
+		m_con->EnablePeerBundling(pkt->getPeerId());
+
 	/*
 		Answer with a TOCLIENT_HELLO
 	*/
@@ -267,7 +271,16 @@ void Server::handleCommand_Init(NetworkPacket* pkt)
 	NetworkPacket resp_pkt(TOCLIENT_HELLO, 1 + 4
 		+ legacyPlayerNameCasing.size(), pkt->getPeerId());
 
+	// Use the block compression codec with the best ratio both support
 	u16 depl_compress_mode = NETPROTO_COMPRESSION_NONE;
+	if (depl_serial_v >= 29) {
+		if ((supp_compr_modes & NETPROTO_COMPRESSION_ZSTD) &&
+				isBlockCompressionSupported(BLOCK_COMPRESSION_ZSTD))
+			depl_compress_mode = NETPROTO_COMPRESSION_ZSTD;
+		else if ((supp_compr_modes & NETPROTO_COMPRESSION_LZ4) &&
+				isBlockCompressionSupported(BLOCK_COMPRESSION_LZ4))
+			depl_compress_mode = NETPROTO_COMPRESSION_LZ4;
+	}
 	resp_pkt << depl_serial_v << depl_compress_mode << net_proto_version
 		<< auth_mechs << legacyPlayerNameCasing;
 
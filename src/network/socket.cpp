@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "debug.h"
 #include "settings.h"
 #include "log.h"
+#include "profiler.h"
 
 #ifdef _WIN32
 // Without this some of the network functions are not found on mingw
@@ -190,62 +191,190 @@ void UDPSocket::Bind(Address addr)
 	}
 }
 
-void UDPSocket::Send(const Address &destination, const void *data, int size)
+bool UDPSocket::setReusePort()
 {
-	bool dumping_packet = false; // for INTERNET_SIMULATOR
+#ifdef SO_REUSEPORT
+	int value = 1;
+	return setsockopt(m_handle, SOL_SOCKET, SO_REUSEPORT,
+			reinterpret_cast<char *>(&value), sizeof(value)) == 0;
+#else
+	return false;
+#endif
+}
 
-	if (INTERNET_SIMULATOR)
-		dumping_packet = myrand() % INTERNET_SIMULATOR_PACKET_LOSS == 0;
+// Number of datagrams per sendmmsg()/recvmmsg() call
+#define SOCKET_BATCH_SIZE 64
 
-	if (socket_enable_debug_output) {
-		// Print packet destination and size
-		dstream << (int)m_handle << " -> ";
-		destination.print(&dstream);
-		dstream << ", size=" << size;
-
-		// Print packet contents
-		dstream << ", data=";
-		for (int i = 0; i < size && i < 20; i++) {
-			if (i % 2 == 0)
-				dstream << " ";
-			unsigned int a = ((const unsigned char *)data)[i];
-			dstream << std::hex << std::setw(2) << std::setfill('0') << a;
-		}
+static void printPacket(int handle, const char *direction,
+		const Address &address, const void *data, int size, bool dumped)
+{
+	// Print packet destination or sender and size
+	dstream << handle << direction;
+	address.print(&dstream);
+	dstream << ", size=" << size;
+
+	// Print packet contents
+	dstream << ", data=";
+	for (int i = 0; i < size && i < 20; i++) {
+		if (i % 2 == 0)
+			dstream << " ";
+		unsigned int a = ((const unsigned char *)data)[i];
+		dstream << std::hex << std::setw(2) << std::setfill('0') << a;
+	}
 
-		if (size > 20)
-			dstream << "...";
+	if (size > 20)
+		dstream << "...";
 
-		if (dumping_packet)
-			dstream << " (DUMPED BY INTERNET_SIMULATOR)";
+	if (dumped)
+		dstream << " (DUMPED BY INTERNET_SIMULATOR)";
 
-		dstream << std::endl;
+	dstream << std::endl;
+}
+
+static socklen_t toSockaddr(const Address &address,
+		struct sockaddr_storage *storage)
+{
+	memset(storage, 0, sizeof(*storage));
+	if (address.getFamily() == AF_INET6) {
+		struct sockaddr_in6 *address6 = (struct sockaddr_in6 *)storage;
+		*address6 = address.getAddress6();
+		address6->sin6_port = htons(address.getPort());
+		return sizeof(struct sockaddr_in6);
 	}
 
+	struct sockaddr_in *address4 = (struct sockaddr_in *)storage;
+	*address4 = address.getAddress();
+	address4->sin_port = htons(address.getPort());
+	return sizeof(struct sockaddr_in);
+}
+
+static Address fromSockaddr(const struct sockaddr_storage &storage)
+{
+	if (storage.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *address6 =
+			(const struct sockaddr_in6 *)&storage;
+		IPv6AddressBytes bytes;
+		memcpy(bytes.bytes, address6->sin6_addr.s6_addr, 16);
+		return Address(&bytes, ntohs(address6->sin6_port));
+	}
+
+	const struct sockaddr_in *address4 = (const struct sockaddr_in *)&storage;
+	return Address(ntohl(address4->sin_addr.s_addr),
+		ntohs(address4->sin_port));
+}
+
+void UDPSocket::Send(const Address &destination, const void *data, int size)
+{
+	bool dumping_packet = false; // for INTERNET_SIMULATOR
+	float simulated_loss = m_simulated_loss;
+
+	if (INTERNET_SIMULATOR)
+		dumping_packet = myrand() % INTERNET_SIMULATOR_PACKET_LOSS == 0;
+	else if (simulated_loss > 0.0f)
+		dumping_packet = myrand_range(0, 9999) < simulated_loss * 10000;
+
+	if (socket_enable_debug_output)
+		printPacket(m_handle, " -> ", destination, data, size, dumping_packet);
+
 	if (dumping_packet) {
 		// Lol let's forget it
-		dstream << "UDPSocket::Send(): INTERNET_SIMULATOR: dumping packet."
-			<< std::endl;
+		if (INTERNET_SIMULATOR)
+			dstream << "UDPSocket::Send(): INTERNET_SIMULATOR: dumping packet."
+				<< std::endl;
 		return;
 	}
 
 	if (destination.getFamily() != m_addr_family)
 		throw SendFailedException("Address family mismatch");
 
-	int sent;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address = destination.getAddress6();
-		address.sin6_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in6));
-	} else {
-		struct sockaddr_in address = destination.getAddress();
-		address.sin_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in));
+	bool ok = sendOne(destination, data, size);
+	g_profiler->add("UDPSocket: send syscalls", 1);
+	if (!ok)
+		throw SendFailedException("Failed to send packet");
+}
+
+bool UDPSocket::sendOne(const Address &destination, const void *data, int size)
+{
+	struct sockaddr_storage address;
+	socklen_t address_len = toSockaddr(destination, &address);
+	int sent = sendto(m_handle, (const char *)data, size, 0,
+			(struct sockaddr *)&address, address_len);
+	return sent == size;
+}
+
+int UDPSocket::SendBatch(const Datagram *datagrams, int count)
+{
+	// The simulators and the debug output work per packet
+	if (INTERNET_SIMULATOR || m_simulated_loss > 0.0f ||
+			socket_enable_debug_output) {
+		int sent = 0;
+		for (int i = 0; i < count; i++) {
+			try {
+				Send(datagrams[i].address, datagrams[i].data,
+					datagrams[i].size);
+				sent++;
+			} catch (SendFailedException &e) {
+			}
+		}
+		return sent;
 	}
 
-	if (sent != size)
-		throw SendFailedException("Failed to send packet");
+	g_profiler->avg("UDPSocket: datagrams per send batch", count);
+
+	// The profiler locks a mutex, so only add to it once per batch
+	int sent = 0;
+	int syscalls = 0;
+#ifdef __linux__
+	struct mmsghdr msgs[SOCKET_BATCH_SIZE];
+	struct iovec iovecs[SOCKET_BATCH_SIZE];
+	struct sockaddr_storage addresses[SOCKET_BATCH_SIZE];
+
+	int next = 0;
+	while (next < count) {
+		int n = 0;
+		for (; n < SOCKET_BATCH_SIZE && next < count; next++) {
+			const Datagram &datagram = datagrams[next];
+			// Send() refuses these, so does the kernel
+			if (datagram.address.getFamily() != m_addr_family)
+				continue;
+			iovecs[n].iov_base = datagram.data;
+			iovecs[n].iov_len = datagram.size;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &addresses[n];
+			msgs[n].msg_hdr.msg_namelen =
+				toSockaddr(datagram.address, &addresses[n]);
+			msgs[n].msg_hdr.msg_iov = &iovecs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		int done = 0;
+		while (done < n) {
+			int ret = sendmmsg(m_handle, msgs + done, n - done, 0);
+			syscalls++;
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				// The first datagram failed; skip it and go on with the rest
+				ret = 1;
+			} else {
+				sent += ret;
+			}
+			done += ret;
+		}
+	}
+#else
+	for (int i = 0; i < count; i++) {
+		if (datagrams[i].address.getFamily() != m_addr_family)
+			continue;
+		if (sendOne(datagrams[i].address, datagrams[i].data,
+				datagrams[i].size))
+			sent++;
+		syscalls++;
+	}
+#endif
+	g_profiler->add("UDPSocket: send syscalls", syscalls);
+	return sent;
 }
 
 int UDPSocket::Receive(Address &sender, void *data, int size)
@@ -254,60 +383,78 @@ int UDPSocket::Receive(Address &sender, void *data, int size)
 	if (!WaitData(m_timeout_ms))
 		return -1;
 
-	int received;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
+	int received = receiveOne(sender, data, size);
+	if (received < 0)
+		return -1;
 
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+	if (socket_enable_debug_output)
+		printPacket(m_handle, " <- ", sender, data, received, false);
 
-		if (received < 0)
-			return -1;
+	return received;
+}
 
-		u16 address_port = ntohs(address.sin6_port);
-		IPv6AddressBytes bytes;
-		memcpy(bytes.bytes, address.sin6_addr.s6_addr, 16);
-		sender = Address(&bytes, address_port);
-	} else {
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+int UDPSocket::receiveOne(Address &sender, void *data, int size)
+{
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
 
-		socklen_t address_len = sizeof(address);
+	int received = recvfrom(m_handle, (char *)data, size, 0,
+			(struct sockaddr *)&address, &address_len);
+	g_profiler->add("UDPSocket: receive syscalls", 1);
 
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+	if (received >= 0)
+		sender = fromSockaddr(address);
+	return received;
+}
 
-		if (received < 0)
-			return -1;
+int UDPSocket::ReceiveBatch(Datagram *datagrams, int count)
+{
+	int received = 0;
+
+#ifdef __linux__
+	struct mmsghdr msgs[SOCKET_BATCH_SIZE];
+	struct iovec iovecs[SOCKET_BATCH_SIZE];
+	struct sockaddr_storage addresses[SOCKET_BATCH_SIZE];
+
+	count = MYMIN(count, SOCKET_BATCH_SIZE);
+	for (int i = 0; i < count; i++) {
+		iovecs[i].iov_base = datagrams[i].data;
+		iovecs[i].iov_len = datagrams[i].size;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &addresses[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+		msgs[i].msg_hdr.msg_iov = &iovecs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+	int ret = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, NULL);
+	g_profiler->add("UDPSocket: receive syscalls", 1);
+	if (ret < 0)
+		return 0;
 
-		sender = Address(address_ip, address_port);
+	for (; received < ret; received++) {
+		datagrams[received].address = fromSockaddr(addresses[received]);
+		datagrams[received].size = msgs[received].msg_len;
+	}
+#else
+	while (received < count && WaitData(0)) {
+		Datagram &datagram = datagrams[received];
+		int size = receiveOne(datagram.address, datagram.data, datagram.size);
+		if (size < 0)
+			break;
+		datagram.size = size;
+		received++;
 	}
+#endif
 
 	if (socket_enable_debug_output) {
-		// Print packet sender and size
-		dstream << (int)m_handle << " <- ";
-		sender.print(&dstream);
-		dstream << ", size=" << received;
-
-		// Print packet contents
-		dstream << ", data=";
-		for (int i = 0; i < received && i < 20; i++) {
-			if (i % 2 == 0)
-				dstream << " ";
-			unsigned int a = ((const unsigned char *)data)[i];
-			dstream << std::hex << std::setw(2) << std::setfill('0') << a;
-		}
-		if (received > 20)
-			dstream << "...";
-
-		dstream << std::endl;
+		for (int i = 0; i < received; i++)
+			printPacket(m_handle, " <- ", datagrams[i].address,
+				datagrams[i].data, datagrams[i].size, false);
 	}
 
+	g_profiler->avg("UDPSocket: datagrams per receive batch", received);
 	return received;
 }
 
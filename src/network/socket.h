@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <netinet/in.h>
 #endif
 
+#include <atomic>
 #include <ostream>
 #include <cstring>
 #include "address.h"
@@ -53,18 +54,48 @@ class UDPSocket
 
 	bool init(bool ipv6, bool noExceptions = false);
 
+	// One datagram of SendBatch() or ReceiveBatch()
+	struct Datagram
+	{
+		Address address;
+		u8 *data = nullptr;
+		// Size of the data; when receiving the capacity of the buffer
+		// before and the received size after the call
+		int size = 0;
+	};
+
 	// void Close();
 	// bool IsOpen();
 	void Send(const Address &destination, const void *data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address &sender, void *data, int size);
+	/*
+		Batched versions of Send() and Receive(), using sendmmsg() and
+		recvmmsg() where available to need one system call for many
+		datagrams. SendBatch() returns the number of datagrams sent.
+		ReceiveBatch() does not wait; call WaitData() first. It returns the
+		number of datagrams received into the first entries of datagrams.
+	*/
+	int SendBatch(const Datagram *datagrams, int count);
+	int ReceiveBatch(Datagram *datagrams, int count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
+	// Lets further sockets bind to the same port, which must be done
+	// before binding. Returns false if it isn't supported.
+	bool setReusePort();
+	// Drops the given fraction of the sent packets, to test lossy links
+	void setSimulatedPacketLoss(float loss) { m_simulated_loss = loss; }
 
 private:
+	// Send() and Receive() without the debug output and waiting
+	bool sendOne(const Address &destination, const void *data, int size);
+	int receiveOne(Address &sender, void *data, int size);
+
 	int m_handle;
 	int m_timeout_ms;
 	int m_addr_family;
+	// Set by other threads than the sending one
+	std::atomic<float> m_simulated_loss {0.0f};
 };
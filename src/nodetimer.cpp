@@ -21,7 +21,6 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include "serialization.h"
 #include "util/serialize.h"
-#include "constants.h" // MAP_BLOCKSIZE
 
 /*
 	NodeTimer
@@ -47,27 +46,25 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 {
 	if (map_format_version == 24) {
 		// Version 0 is a placeholder for "nothing to see here; go away."
-		if (m_timers.empty()) {
+		if (m_heap.empty()) {
 			writeU8(os, 0); // version
 			return;
 		}
 		writeU8(os, 1); // version
-		writeU16(os, m_timers.size());
+		writeU16(os, m_heap.size());
 	}
 
 	if (map_format_version >= 25) {
 		writeU8(os, 2 + 4 + 4); // length of the data for a single timer
-		writeU16(os, m_timers.size());
+		writeU16(os, m_heap.size());
 	}
 
-	for (const auto &timer : m_timers) {
-		NodeTimer t = timer.second;
+	for (const Entry &e : m_heap) {
+		const NodeTimer &t = e.timer;
 		NodeTimer nt = NodeTimer(t.timeout,
-			t.timeout - (f32)(timer.first - m_time), t.position);
-		v3s16 p = t.position;
+			t.timeout - (f32)(e.trigger_time - m_time), t.position);
 
-		u16 p16 = p.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE + p.Y * MAP_BLOCKSIZE + p.X;
-		writeU16(os, p16);
+		writeU16(os, posToIndex(t.position));
 		nt.serialize(os);
 	}
 }
@@ -113,7 +110,7 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 			continue;
 		}
 
-		if (m_iterators.find(p) != m_iterators.end()) {
+		if (getSlot(p) != 0) {
 			warningstream<<"NodeTimerList::deSerialize(): "
 					<<"already set data at position"
 					<<"("<<p.X<<","<<p.Y<<","<<p.Z<<"): Ignoring."
@@ -125,26 +122,107 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 	}
 }
 
+NodeTimerList::Entry NodeTimerList::makeEntry(const NodeTimer &timer)
+{
+	Entry e;
+	e.trigger_time = m_time + (double)(timer.timeout - timer.elapsed);
+	e.seq = m_next_seq++;
+	e.timer = timer;
+	return e;
+}
+
+void NodeTimerList::place(size_t slot, const Entry &e)
+{
+	m_heap[slot] = e;
+	m_slots[posToIndex(e.timer.position)] = slot + 1;
+}
+
+void NodeTimerList::siftUp(size_t slot)
+{
+	Entry e = m_heap[slot];
+	while (slot > 0) {
+		size_t parent = (slot - 1) / 2;
+		if (!(e < m_heap[parent]))
+			break;
+		place(slot, m_heap[parent]);
+		slot = parent;
+	}
+	place(slot, e);
+}
+
+void NodeTimerList::siftDown(size_t slot)
+{
+	Entry e = m_heap[slot];
+	size_t size = m_heap.size();
+	while (true) {
+		size_t child = 2 * slot + 1;
+		if (child >= size)
+			break;
+		if (child + 1 < size && m_heap[child + 1] < m_heap[child])
+			child++;
+		if (!(m_heap[child] < e))
+			break;
+		place(slot, m_heap[child]);
+		slot = child;
+	}
+	place(slot, e);
+}
+
+void NodeTimerList::removeAt(size_t slot)
+{
+	m_slots[posToIndex(m_heap[slot].timer.position)] = 0;
+
+	size_t last = m_heap.size() - 1;
+	if (slot != last) {
+		m_heap[slot] = m_heap[last];
+		m_heap.pop_back();
+		// The moved timer may belong either above or below its new slot
+		if (slot > 0 && m_heap[slot] < m_heap[(slot - 1) / 2])
+			siftUp(slot);
+		else
+			siftDown(slot);
+	} else {
+		m_heap.pop_back();
+	}
+}
+
+void NodeTimerList::insert(NodeTimer timer)
+{
+	if (m_slots.empty())
+		m_slots.resize(MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE, 0);
+
+	m_heap.push_back(makeEntry(timer));
+	siftUp(m_heap.size() - 1);
+}
+
+void NodeTimerList::set(const NodeTimer &timer)
+{
+	u16 slot = getSlot(timer.position);
+	if (slot == 0) {
+		insert(timer);
+		return;
+	}
+
+	// Update in place instead of removing and inserting again
+	size_t i = slot - 1;
+	double old_trigger_time = m_heap[i].trigger_time;
+	m_heap[i] = makeEntry(timer);
+	if (m_heap[i].trigger_time < old_trigger_time)
+		siftUp(i);
+	else
+		siftDown(i);
+}
+
 std::vector<NodeTimer> NodeTimerList::step(float dtime)
 {
 	std::vector<NodeTimer> elapsed_timers;
 	m_time += dtime;
-	if (m_next_trigger_time == -1. || m_time < m_next_trigger_time) {
-		return elapsed_timers;
-	}
-	std::multimap<double, NodeTimer>::iterator i = m_timers.begin();
 	// Process timers
-	for (; i != m_timers.end() && i->first <= m_time; ++i) {
-		NodeTimer t = i->second;
-		t.elapsed = t.timeout + (f32)(m_time - i->first);
+	while (!m_heap.empty() && m_heap[0].trigger_time <= m_time) {
+		NodeTimer t = m_heap[0].timer;
+		t.elapsed = t.timeout + (f32)(m_time - m_heap[0].trigger_time);
 		elapsed_timers.push_back(t);
-		m_iterators.erase(t.position);
+		removeAt(0);
 	}
-	// Delete elapsed timers
-	m_timers.erase(m_timers.begin(), i);
-	if (m_timers.empty())
-		m_next_trigger_time = -1.;
-	else
-		m_next_trigger_time = m_timers.begin()->first;
 	return elapsed_timers;
 }
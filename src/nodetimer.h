@@ -20,8 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #pragma once
 
 #include "irr_v3d.h"
+#include "constants.h" // MAP_BLOCKSIZE
 #include <iostream>
-#include <map>
 #include <vector>
 
 /*
@@ -52,6 +52,10 @@ class NodeTimer
 
 /*
 	List of timers of all the nodes of a block
+
+	The timers are kept in a binary min-heap ordered by trigger time, with
+	a per-node index of heap slots so that get, set and remove don't need
+	to search. Positions are relative to the block.
 */
 
 class NodeTimerList
@@ -64,65 +68,67 @@ class NodeTimerList
 	void deSerialize(std::istream &is, u8 map_format_version);
 
 	// Get timer
-	NodeTimer get(const v3s16 &p) {
-		std::map<v3s16, std::multimap<double, NodeTimer>::iterator>::iterator n =
-			m_iterators.find(p);
-		if (n == m_iterators.end())
+	NodeTimer get(const v3s16 &p) const {
+		u16 slot = getSlot(p);
+		if (slot == 0)
 			return NodeTimer();
-		NodeTimer t = n->second->second;
-		t.elapsed = t.timeout - (n->second->first - m_time);
+		const Entry &e = m_heap[slot - 1];
+		NodeTimer t = e.timer;
+		t.elapsed = t.timeout - (e.trigger_time - m_time);
 		return t;
 	}
 	// Deletes timer
 	void remove(v3s16 p) {
-		std::map<v3s16, std::multimap<double, NodeTimer>::iterator>::iterator n =
-			m_iterators.find(p);
-		if(n != m_iterators.end()) {
-			double removed_time = n->second->first;
-			m_timers.erase(n->second);
-			m_iterators.erase(n);
-			// Yes, this is float equality, but it is not a problem
-			// since we only test equality of floats as an ordered type
-			// and thus we never lose precision
-			if (removed_time == m_next_trigger_time) {
-				if (m_timers.empty())
-					m_next_trigger_time = -1.;
-				else
-					m_next_trigger_time = m_timers.begin()->first;
-			}
-		}
+		u16 slot = getSlot(p);
+		if (slot != 0)
+			removeAt(slot - 1);
 	}
 	// Undefined behaviour if there already is a timer
-	void insert(NodeTimer timer) {
-		v3s16 p = timer.position;
-		double trigger_time = m_time + (double)(timer.timeout - timer.elapsed);
-		std::multimap<double, NodeTimer>::iterator it =
-			m_timers.insert(std::pair<double, NodeTimer>(
-				trigger_time, timer
-			));
-		m_iterators.insert(
-			std::pair<v3s16, std::multimap<double, NodeTimer>::iterator>(p, it));
-		if (m_next_trigger_time == -1. || trigger_time < m_next_trigger_time)
-			m_next_trigger_time = trigger_time;
-	}
-	// Deletes old timer and sets a new one
-	inline void set(const NodeTimer &timer) {
-		remove(timer.position);
-		insert(timer);
-	}
+	void insert(NodeTimer timer);
+	// Replaces the old timer if there is one
+	void set(const NodeTimer &timer);
 	// Deletes all timers
 	void clear() {
-		m_timers.clear();
-		m_iterators.clear();
-		m_next_trigger_time = -1.;
+		m_heap.clear();
+		m_slots.clear();
 	}
 
+	size_t size() const { return m_heap.size(); }
+
 	// Move forward in time, returns elapsed timers
 	std::vector<NodeTimer> step(float dtime);
 
 private:
-	std::multimap<double, NodeTimer> m_timers;
-	std::map<v3s16, std::multimap<double, NodeTimer>::iterator> m_iterators;
-	double m_next_trigger_time = -1.0;
+	struct Entry {
+		double trigger_time;
+		// Keeps timers with the same trigger time in insertion order
+		u32 seq;
+		NodeTimer timer;
+
+		bool operator<(const Entry &other) const {
+			return trigger_time < other.trigger_time ||
+				(trigger_time == other.trigger_time && seq < other.seq);
+		}
+	};
+
+	static inline u16 posToIndex(const v3s16 &p) {
+		return p.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE + p.Y * MAP_BLOCKSIZE + p.X;
+	}
+
+	// Returns the heap slot + 1 of the timer at p, or 0 if there is none
+	inline u16 getSlot(const v3s16 &p) const {
+		return m_slots.empty() ? 0 : m_slots[posToIndex(p)];
+	}
+
+	Entry makeEntry(const NodeTimer &timer);
+	void place(size_t slot, const Entry &e);
+	void siftUp(size_t slot);
+	void siftDown(size_t slot);
+	void removeAt(size_t slot);
+
+	std::vector<Entry> m_heap;
+	// Heap slot + 1 for every node of the block, allocated on first use
+	std::vector<u16> m_slots;
+	u32 m_next_seq = 0;
 	double m_time = 0.0;
 };
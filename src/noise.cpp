@@ -23,11 +23,14 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <atomic>
 #include <cmath>
 #include "noise.h"
 #include <iostream>
 #include <cstring> // memset
+#include <functional>
 #include "debug.h"
+#include "threading/workerpool.h"
 #include "util/numeric.h"
 #include "util/string.h"
 #include "exceptions.h"
@@ -37,6 +40,10 @@
 #define NOISE_MAGIC_Z    52591
 #define NOISE_MAGIC_SEED 1013
 
+// 3D maps are split into more z-slabs than there are threads, so that a
+// thread that is held up delays the map less
+#define NOISE_SLABS_PER_THREAD 2
+
 typedef float (*Interp2dFxn)(
 		float v00, float v10, float v01, float v11,
 		float x, float y);
@@ -427,6 +434,360 @@ float NoisePerlin3D(NoiseParams *np, float x, float y, float z, s32 seed)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+	Kernels of the bulk noise functions
+
+	The SIMD versions do the same operations in the same order as the
+	scalar code, so the results are the same to the bit and maps don't
+	change. For this reason they don't use fused multiply-adds.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#define NOISE_HAVE_SSE2
+	#include <emmintrin.h>
+#endif
+
+// The AVX2 functions are compiled for it with function attributes and
+// only called if the CPU supports it
+#if defined(NOISE_HAVE_SSE2) && defined(__GNUC__)
+	#define NOISE_HAVE_AVX2
+	#include <immintrin.h>
+	#define NOISE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+struct NoiseKernels {
+	// out[i] = noise3d(x + i, y, z, seed)
+	void (*lattice3d)(float *out, s32 x, s32 y, s32 z, s32 seed, size_t count);
+	// Interpolates rows which are interpolated along x already, along y
+	// and then z: v10 is the row with y + 1, v01 the one with z + 1.
+	void (*interpolate3d)(float *out, const float *v00, const float *v10,
+		const float *v01, const float *v11, float ty, float tz, size_t count);
+	// result[i] += g * gradient[i]
+	void (*accumulate)(float *result, const float *gradient, float g,
+		bool absvalue, size_t count);
+	// result[i] += gmap[i] * gradient[i], gmap[i] *= persistence[i]
+	void (*accumulatePersist)(float *result, float *gmap,
+		const float *gradient, const float *persistence, bool absvalue,
+		size_t count);
+};
+
+// The remainders of the rows the SIMD kernels leave over
+static inline void interpolate3d_scalar(float *out, const float *v00,
+	const float *v10, const float *v01, const float *v11,
+	float ty, float tz, size_t i, size_t count)
+{
+	for (; i < count; i++) {
+		float u = linearInterpolation(v00[i], v10[i], ty);
+		float v = linearInterpolation(v01[i], v11[i], ty);
+		out[i] = linearInterpolation(u, v, tz);
+	}
+}
+
+static inline void accumulate_scalar(float *result, const float *gradient,
+	float g, bool absvalue, size_t i, size_t count)
+{
+	for (; i < count; i++)
+		result[i] += g * (absvalue ? std::fabs(gradient[i]) : gradient[i]);
+}
+
+static inline void accumulate_persist_scalar(float *result, float *gmap,
+	const float *gradient, const float *persistence, bool absvalue,
+	size_t i, size_t count)
+{
+	for (; i < count; i++) {
+		result[i] += gmap[i] *
+			(absvalue ? std::fabs(gradient[i]) : gradient[i]);
+		gmap[i] *= persistence[i];
+	}
+}
+
+static inline u32 noise_lattice_base(s32 y, s32 z, s32 seed)
+{
+	// Unsigned, as the sum overflows
+	return (u32)NOISE_MAGIC_Y * y + (u32)NOISE_MAGIC_Z * z
+		+ (u32)NOISE_MAGIC_SEED * seed;
+}
+
+#ifdef NOISE_HAVE_SSE2
+
+// SSE2 has no 32 bit multiplication keeping the low half
+static inline __m128i mullo_epi32_sse2(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static void lattice3d_sse2(float *out, s32 x, s32 y, s32 z, s32 seed,
+	size_t count)
+{
+	const __m128i base = _mm_set1_epi32(noise_lattice_base(y, z, seed));
+	const __m128i magic_x = _mm_set1_epi32(NOISE_MAGIC_X);
+	const __m128i mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i c1 = _mm_set1_epi32(60493);
+	const __m128i c2 = _mm_set1_epi32(19990303);
+	const __m128i c3 = _mm_set1_epi32(1376312589);
+	const __m128 scale = _mm_set1_ps(1.f / 0x40000000);
+	const __m128 one = _mm_set1_ps(1.f);
+
+	__m128i xs = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i n = _mm_and_si128(
+			_mm_add_epi32(mullo_epi32_sse2(magic_x, xs), base), mask);
+		n = _mm_xor_si128(_mm_srli_epi32(n, 13), n);
+		__m128i t = mullo_epi32_sse2(mullo_epi32_sse2(n, n), c1);
+		t = mullo_epi32_sse2(n, _mm_add_epi32(t, c2));
+		n = _mm_and_si128(_mm_add_epi32(t, c3), mask);
+		_mm_storeu_ps(out + i,
+			_mm_sub_ps(one, _mm_mul_ps(_mm_cvtepi32_ps(n), scale)));
+		xs = _mm_add_epi32(xs, _mm_set1_epi32(4));
+	}
+	for (; i < count; i++)
+		out[i] = noise3d(x + i, y, z, seed);
+}
+
+static inline __m128 lerp_sse2(__m128 v0, __m128 v1, __m128 t)
+{
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+static void interpolate3d_sse2(float *out, const float *v00, const float *v10,
+	const float *v01, const float *v11, float ty, float tz, size_t count)
+{
+	const __m128 vty = _mm_set1_ps(ty);
+	const __m128 vtz = _mm_set1_ps(tz);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 u = lerp_sse2(_mm_loadu_ps(v00 + i), _mm_loadu_ps(v10 + i), vty);
+		__m128 v = lerp_sse2(_mm_loadu_ps(v01 + i), _mm_loadu_ps(v11 + i), vty);
+		_mm_storeu_ps(out + i, lerp_sse2(u, v, vtz));
+	}
+	interpolate3d_scalar(out, v00, v10, v01, v11, ty, tz, i, count);
+}
+
+static inline __m128 gradient_sse2(const float *gradient, bool absvalue)
+{
+	__m128 v = _mm_loadu_ps(gradient);
+	return absvalue ? _mm_andnot_ps(_mm_set1_ps(-0.f), v) : v;
+}
+
+static void accumulate_sse2(float *result, const float *gradient, float g,
+	bool absvalue, size_t count)
+{
+	const __m128 vg = _mm_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 v = _mm_mul_ps(vg, gradient_sse2(gradient + i, absvalue));
+		_mm_storeu_ps(result + i, _mm_add_ps(_mm_loadu_ps(result + i), v));
+	}
+	accumulate_scalar(result, gradient, g, absvalue, i, count);
+}
+
+static void accumulate_persist_sse2(float *result, float *gmap,
+	const float *gradient, const float *persistence, bool absvalue,
+	size_t count)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 g = _mm_loadu_ps(gmap + i);
+		__m128 v = _mm_mul_ps(g, gradient_sse2(gradient + i, absvalue));
+		_mm_storeu_ps(result + i, _mm_add_ps(_mm_loadu_ps(result + i), v));
+		_mm_storeu_ps(gmap + i, _mm_mul_ps(g, _mm_loadu_ps(persistence + i)));
+	}
+	accumulate_persist_scalar(result, gmap, gradient, persistence, absvalue,
+		i, count);
+}
+
+static const NoiseKernels noise_kernels_sse2 = {
+	lattice3d_sse2,
+	interpolate3d_sse2,
+	accumulate_sse2,
+	accumulate_persist_sse2,
+};
+
+#endif
+
+#ifdef NOISE_HAVE_AVX2
+
+NOISE_TARGET_AVX2
+static void lattice3d_avx2(float *out, s32 x, s32 y, s32 z, s32 seed,
+	size_t count)
+{
+	const __m256i base = _mm256_set1_epi32(noise_lattice_base(y, z, seed));
+	const __m256i magic_x = _mm256_set1_epi32(NOISE_MAGIC_X);
+	const __m256i mask = _mm256_set1_epi32(0x7fffffff);
+	const __m256i c1 = _mm256_set1_epi32(60493);
+	const __m256i c2 = _mm256_set1_epi32(19990303);
+	const __m256i c3 = _mm256_set1_epi32(1376312589);
+	const __m256 scale = _mm256_set1_ps(1.f / 0x40000000);
+	const __m256 one = _mm256_set1_ps(1.f);
+
+	__m256i xs = _mm256_add_epi32(_mm256_set1_epi32(x),
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i n = _mm256_and_si256(
+			_mm256_add_epi32(_mm256_mullo_epi32(magic_x, xs), base), mask);
+		n = _mm256_xor_si256(_mm256_srli_epi32(n, 13), n);
+		__m256i t = _mm256_mullo_epi32(_mm256_mullo_epi32(n, n), c1);
+		t = _mm256_mullo_epi32(n, _mm256_add_epi32(t, c2));
+		n = _mm256_and_si256(_mm256_add_epi32(t, c3), mask);
+		_mm256_storeu_ps(out + i, _mm256_sub_ps(one,
+			_mm256_mul_ps(_mm256_cvtepi32_ps(n), scale)));
+		xs = _mm256_add_epi32(xs, _mm256_set1_epi32(8));
+	}
+	for (; i < count; i++)
+		out[i] = noise3d(x + i, y, z, seed);
+}
+
+NOISE_TARGET_AVX2
+static inline __m256 lerp_avx2(__m256 v0, __m256 v1, __m256 t)
+{
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+NOISE_TARGET_AVX2
+static void interpolate3d_avx2(float *out, const float *v00, const float *v10,
+	const float *v01, const float *v11, float ty, float tz, size_t count)
+{
+	const __m256 vty = _mm256_set1_ps(ty);
+	const __m256 vtz = _mm256_set1_ps(tz);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 u = lerp_avx2(_mm256_loadu_ps(v00 + i),
+			_mm256_loadu_ps(v10 + i), vty);
+		__m256 v = lerp_avx2(_mm256_loadu_ps(v01 + i),
+			_mm256_loadu_ps(v11 + i), vty);
+		_mm256_storeu_ps(out + i, lerp_avx2(u, v, vtz));
+	}
+	interpolate3d_scalar(out, v00, v10, v01, v11, ty, tz, i, count);
+}
+
+NOISE_TARGET_AVX2
+static inline __m256 gradient_avx2(const float *gradient, bool absvalue)
+{
+	__m256 v = _mm256_loadu_ps(gradient);
+	return absvalue ? _mm256_andnot_ps(_mm256_set1_ps(-0.f), v) : v;
+}
+
+NOISE_TARGET_AVX2
+static void accumulate_avx2(float *result, const float *gradient, float g,
+	bool absvalue, size_t count)
+{
+	const __m256 vg = _mm256_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 v = _mm256_mul_ps(vg, gradient_avx2(gradient + i, absvalue));
+		_mm256_storeu_ps(result + i,
+			_mm256_add_ps(_mm256_loadu_ps(result + i), v));
+	}
+	accumulate_scalar(result, gradient, g, absvalue, i, count);
+}
+
+NOISE_TARGET_AVX2
+static void accumulate_persist_avx2(float *result, float *gmap,
+	const float *gradient, const float *persistence, bool absvalue,
+	size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 g = _mm256_loadu_ps(gmap + i);
+		__m256 v = _mm256_mul_ps(g, gradient_avx2(gradient + i, absvalue));
+		_mm256_storeu_ps(result + i,
+			_mm256_add_ps(_mm256_loadu_ps(result + i), v));
+		_mm256_storeu_ps(gmap + i,
+			_mm256_mul_ps(g, _mm256_loadu_ps(persistence + i)));
+	}
+	accumulate_persist_scalar(result, gmap, gradient, persistence, absvalue,
+		i, count);
+}
+
+static const NoiseKernels noise_kernels_avx2 = {
+	lattice3d_avx2,
+	interpolate3d_avx2,
+	accumulate_avx2,
+	accumulate_persist_avx2,
+};
+
+#endif
+
+static bool noise_simd_supported(NoiseSimdLevel level)
+{
+	switch (level) {
+	case NOISE_SIMD_NONE:
+		return true;
+#ifdef NOISE_HAVE_SSE2
+	case NOISE_SIMD_SSE2:
+		return true;
+#endif
+#ifdef NOISE_HAVE_AVX2
+	case NOISE_SIMD_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+static const NoiseKernels *noise_simd_kernels(NoiseSimdLevel level)
+{
+	switch (level) {
+#ifdef NOISE_HAVE_SSE2
+	case NOISE_SIMD_SSE2:
+		return &noise_kernels_sse2;
+#endif
+#ifdef NOISE_HAVE_AVX2
+	case NOISE_SIMD_AVX2:
+		return &noise_kernels_avx2;
+#endif
+	default:
+		return nullptr;
+	}
+}
+
+static NoiseSimdLevel noise_best_simd_level()
+{
+	if (noise_simd_supported(NOISE_SIMD_AVX2))
+		return NOISE_SIMD_AVX2;
+	if (noise_simd_supported(NOISE_SIMD_SSE2))
+		return NOISE_SIMD_SSE2;
+	return NOISE_SIMD_NONE;
+}
+
+// The level can be changed while mapgen threads use the noise, so the
+// bulk functions load the kernels once and stick to them
+static std::atomic<NoiseSimdLevel> noise_simd_level(noise_best_simd_level());
+// nullptr for the scalar code
+static std::atomic<const NoiseKernels *> noise_kernels(
+	noise_simd_kernels(noise_simd_level));
+
+NoiseSimdLevel noise_get_simd_level()
+{
+	return noise_simd_level;
+}
+
+bool noise_set_simd_level(NoiseSimdLevel level)
+{
+	if (!noise_simd_supported(level))
+		return false;
+
+	noise_simd_level = level;
+	noise_kernels = noise_simd_kernels(level);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+
 Noise::Noise(NoiseParams *np_, s32 seed, u32 sx, u32 sy, u32 sz)
 {
 	memcpy(&np, np_, sizeof(np));
@@ -445,6 +806,8 @@ Noise::~Noise()
 	delete[] persist_buf;
 	delete[] noise_buf;
 	delete[] result;
+	delete[] lerp_buf;
+	delete[] lerp_index_buf;
 }
 
 
@@ -527,14 +890,37 @@ void Noise::resizeNoiseBuf(bool is3d)
 	size_t nlz = is3d ? (size_t)std::ceil(num_noise_points_z) + 3 : 1;
 
 	delete[] noise_buf;
+	delete[] lerp_buf;
+	delete[] lerp_index_buf;
+	lerp_buf = nullptr;
+	lerp_index_buf = nullptr;
+	// The planes are allocated for the slabs when they are used
+	lerp_slabs = 0;
+	lerp_plane_size = is3d ? nly * sx : 0;
 	try {
 		noise_buf = new float[nlx * nly * nlz];
+		if (is3d)
+			lerp_index_buf = new u32[sx];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
 }
 
 
+// Calls f(i) for every i in [0, count), on the pool if there is one
+static void noise_parallel_for(WorkerPool *pool, size_t count,
+	const std::function<void(size_t)> &f)
+{
+	if (pool) {
+		pool->parallelFor(count, f);
+		return;
+	}
+
+	for (size_t i = 0; i != count; i++)
+		f(i);
+}
+
+
 /*
  * NB:  This algorithm is not optimal in terms of space complexity.  The entire
  * integer lattice of noise points could be done as 2 lines instead, and for 3D,
@@ -614,42 +1000,92 @@ void Noise::gradientMap2D(
 void Noise::gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
-		s32 seed)
+		s32 seed, WorkerPool *pool)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	u32 index, i, j, k, noisex, noisey, noisez;
+	float u, v, w;
 	u32 nlx, nly, nlz;
 	s32 x0, y0, z0;
 
-	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
-
 	x0 = std::floor(x);
 	y0 = std::floor(y);
 	z0 = std::floor(z);
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
-	orig_v = v;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
 	nly = (u32)(v + sy * step_y) + 2;
 	nlz = (u32)(w + sz * step_z) + 2;
-	index = 0;
-	for (k = 0; k != nlz; k++)
-		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
+	const NoiseKernels *kernels = noise_kernels;
+	noise_parallel_for(pool, nlz, [&] (size_t k) {
+		if (kernels) {
+			for (u32 j = 0; j != nly; j++)
+				kernels->lattice3d(&noise_buf[idx(0, j, k)],
+					x0, y0 + j, z0 + k, seed, nlx);
+			return;
+		}
+		u32 index = idx(0, 0, k);
+		for (u32 j = 0; j != nly; j++)
+			for (u32 i = 0; i != nlx; i++)
 				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+	});
+
+	bool simd = kernels && lerp_plane_size;
+	u32 slabs = 1;
+	if (pool && pool->getThreadCount() > 1)
+		slabs = MYMIN(sz, pool->getThreadCount() * NOISE_SLABS_PER_THREAD);
+	if (simd) {
+		if (slabs > lerp_slabs) {
+			delete[] lerp_buf;
+			lerp_buf = new float[sx + 2 * lerp_plane_size * slabs];
+			lerp_slabs = slabs;
+		}
+		prepareLerp3D(u, step_x);
+	}
 
 	//calculate interpolations
-	index  = 0;
-	noisey = 0;
-	noisez = 0;
-	for (k = 0; k != sz; k++) {
+	noise_parallel_for(pool, slabs, [&] (size_t s) {
+		u32 k0 = sz * s / slabs;
+		u32 k1 = sz * (s + 1) / slabs;
+
+		// Step to the slab like the loop over the whole map would, so that
+		// the slabs don't change the result
+		float slab_w = w;
+		u32 noisez = 0;
+		for (u32 k = 0; k != k0; k++) {
+			slab_w += step_z;
+			if (slab_w >= 1.0) {
+				slab_w -= 1.0;
+				noisez++;
+			}
+		}
+
+		if (simd)
+			gradientSlab3DSimd(kernels, v, slab_w, noisez, step_y, step_z,
+				nlx, nly, k0, k1,
+				lerp_buf + sx + 2 * lerp_plane_size * s);
+		else
+			gradientSlab3D(u, v, slab_w, noisez, step_x, step_y, step_z,
+				nlx, nly, k0, k1);
+	});
+}
+
+
+void Noise::gradientSlab3D(float orig_u, float orig_v, float w, u32 noisez,
+		float step_x, float step_y, float step_z,
+		u32 nlx, u32 nly, u32 k0, u32 k1)
+{
+	float v000, v010, v100, v110;
+	float v001, v011, v101, v111;
+	float u, v;
+	u32 index, i, j, k, noisex, noisey;
+
+	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
+		triLinearInterpolation : triLinearInterpolationNoEase;
+
+	index = k0 * sy * sx;
+	for (k = k0; k != k1; k++) {
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
@@ -699,6 +1135,89 @@ void Noise::gradientMap3D(
 		}
 	}
 }
+
+
+/*
+ * The SIMD version interpolates along x only once for each column and lattice
+ * row: the columns of a map row share the lattice points of a cell, so the
+ * values interpolated along x can be kept in two planes, one for each z of the
+ * cell, and only the y and z interpolations are left for each point. These
+ * are done for whole rows by the SIMD kernels.
+ *
+ * prepareLerp3D finds the lattice cell and interpolation factor of each
+ * column, which are the same for all rows.
+ */
+void Noise::prepareLerp3D(float u, float step_x)
+{
+	bool eased = np.flags & NOISE_FLAG_EASED;
+	float *tx = lerp_buf;
+	u32 noisex = 0;
+
+	for (u32 i = 0; i != sx; i++) {
+		lerp_index_buf[i] = noisex;
+		tx[i] = eased ? easeCurve(u) : u;
+
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+}
+
+
+void Noise::gradientSlab3DSimd(const NoiseKernels *kernels,
+		float orig_v, float w, u32 noisez, float step_y, float step_z,
+		u32 nlx, u32 nly, u32 k0, u32 k1, float *planes)
+{
+	bool eased = np.flags & NOISE_FLAG_EASED;
+	const float *tx = lerp_buf;
+	float *plane0 = planes;
+	float *plane1 = planes + lerp_plane_size;
+
+	auto lerp_plane = [&] (float *plane, u32 lz) {
+		for (u32 ly = 0; ly != nly; ly++) {
+			const float *row = &noise_buf[idx(0, ly, lz)];
+			float *dest = &plane[ly * sx];
+			for (u32 col = 0; col != sx; col++) {
+				u32 lx = lerp_index_buf[col];
+				dest[col] = linearInterpolation(row[lx], row[lx + 1], tx[col]);
+			}
+		}
+	};
+	lerp_plane(plane0, noisez);
+	lerp_plane(plane1, noisez + 1);
+
+	float *out = &gradient_buf[k0 * sy * sx];
+	for (u32 k = k0; k != k1; k++) {
+		float tz = eased ? easeCurve(w) : w;
+		float v = orig_v;
+		u32 noisey = 0;
+		for (u32 j = 0; j != sy; j++) {
+			float ty = eased ? easeCurve(v) : v;
+			kernels->interpolate3d(out,
+				&plane0[noisey * sx], &plane0[(noisey + 1) * sx],
+				&plane1[noisey * sx], &plane1[(noisey + 1) * sx],
+				ty, tz, sx);
+			out += sx;
+
+			v += step_y;
+			if (v >= 1.0) {
+				v -= 1.0;
+				noisey++;
+			}
+		}
+
+		w += step_z;
+		if (w >= 1.0) {
+			w -= 1.0;
+			noisez++;
+			std::swap(plane0, plane1);
+			if (k + 1 != k1)
+				lerp_plane(plane1, noisez + 1);
+		}
+	}
+}
 #undef idx
 
 
@@ -724,7 +1243,7 @@ float *Noise::perlinMap2D(float x, float y, float *persistence_map)
 			f / np.spread.X, f / np.spread.Y,
 			seed + np.seed + oct);
 
-		updateResults(g, persist_buf, persistence_map, bufsize);
+		updateResults(g, persist_buf, persistence_map, 0, bufsize);
 
 		f *= np.lacunarity;
 		g *= np.persist;
@@ -739,10 +1258,12 @@ float *Noise::perlinMap2D(float x, float y, float *persistence_map)
 }
 
 
-float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
+float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map,
+	WorkerPool *pool)
 {
 	float f = 1.0, g = 1.0;
 	size_t bufsize = sx * sy * sz;
+	u32 parts = pool ? pool->getThreadCount() : 1;
 
 	x /= np.spread.X;
 	y /= np.spread.Y;
@@ -760,9 +1281,12 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 	for (size_t oct = 0; oct < np.octaves; oct++) {
 		gradientMap3D(x * f, y * f, z * f,
 			f / np.spread.X, f / np.spread.Y, f / np.spread.Z,
-			seed + np.seed + oct);
+			seed + np.seed + oct, pool);
 
-		updateResults(g, persist_buf, persistence_map, bufsize);
+		noise_parallel_for(pool, parts, [&] (size_t part) {
+			updateResults(g, persist_buf, persistence_map,
+				bufsize * part / parts, bufsize * (part + 1) / parts);
+		});
 
 		f *= np.lacunarity;
 		g *= np.persist;
@@ -778,28 +1302,41 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 
 
 void Noise::updateResults(float g, float *gmap,
-	const float *persistence_map, size_t bufsize)
+	const float *persistence_map, size_t begin, size_t end)
 {
+	const NoiseKernels *kernels = noise_kernels;
+	if (kernels) {
+		bool absvalue = np.flags & NOISE_FLAG_ABSVALUE;
+		if (persistence_map)
+			kernels->accumulatePersist(result + begin, gmap + begin,
+				gradient_buf + begin, persistence_map + begin, absvalue,
+				end - begin);
+		else
+			kernels->accumulate(result + begin, gradient_buf + begin,
+				g, absvalue, end - begin);
+		return;
+	}
+
 	// This looks very ugly, but it is 50-70% faster than having
 	// conditional statements inside the loop
 	if (np.flags & NOISE_FLAG_ABSVALUE) {
 		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
+			for (size_t i = begin; i != end; i++) {
 				result[i] += gmap[i] * std::fabs(gradient_buf[i]);
 				gmap[i] *= persistence_map[i];
 			}
 		} else {
-			for (size_t i = 0; i != bufsize; i++)
+			for (size_t i = begin; i != end; i++)
 				result[i] += g * std::fabs(gradient_buf[i]);
 		}
 	} else {
 		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
+			for (size_t i = begin; i != end; i++) {
 				result[i] += gmap[i] * gradient_buf[i];
 				gmap[i] *= persistence_map[i];
 			}
 		} else {
-			for (size_t i = 0; i != bufsize; i++)
+			for (size_t i = begin; i != end; i++)
 				result[i] += g * gradient_buf[i];
 		}
 	}
@@ -29,6 +29,9 @@
 #include "exceptions.h"
 #include "util/string.h"
 
+class WorkerPool;
+struct NoiseKernels;
+
 extern FlagDesc flagdesc_noiseparams[];
 
 // Note: this class is not polymorphic so that its high level of
@@ -127,6 +130,20 @@ struct NoiseParams {
 	}
 };
 
+/*
+	Instruction sets the bulk noise functions can use. They all give
+	exactly the same results; the best one the CPU supports is used.
+*/
+enum NoiseSimdLevel {
+	NOISE_SIMD_NONE,
+	NOISE_SIMD_SSE2,
+	NOISE_SIMD_AVX2,
+};
+
+NoiseSimdLevel noise_get_simd_level();
+// Returns false if the build or the CPU doesn't support the level
+bool noise_set_simd_level(NoiseSimdLevel level);
+
 class Noise {
 public:
 	NoiseParams np;
@@ -138,6 +155,11 @@ class Noise {
 	float *gradient_buf = nullptr;
 	float *persist_buf = nullptr;
 	float *result = nullptr;
+	// The x factors of the columns, followed by two lattice planes
+	// interpolated along x for each z-slab of the map
+	float *lerp_buf = nullptr;
+	// Lattice x index of each column of the map
+	u32 *lerp_index_buf = nullptr;
 
 	Noise(NoiseParams *np, s32 seed, u32 sx, u32 sy, u32 sz=1);
 	~Noise();
@@ -153,10 +175,13 @@ class Noise {
 	void gradientMap3D(
 		float x, float y, float z,
 		float step_x, float step_y, float step_z,
-		s32 seed);
+		s32 seed, WorkerPool *pool=NULL);
 
 	float *perlinMap2D(float x, float y, float *persistence_map=NULL);
-	float *perlinMap3D(float x, float y, float z, float *persistence_map=NULL);
+	// With a pool, the map is split into z-slabs computed by its threads.
+	// The result is the same as without.
+	float *perlinMap3D(float x, float y, float z, float *persistence_map=NULL,
+		WorkerPool *pool=NULL);
 
 	inline float *perlinMap2D_PO(float x, float xoff, float y, float yoff,
 		float *persistence_map=NULL)
@@ -180,8 +205,20 @@ class Noise {
 private:
 	void allocBuffers();
 	void resizeNoiseBuf(bool is3d);
+	void gradientSlab3D(float orig_u, float orig_v, float w, u32 noisez,
+		float step_x, float step_y, float step_z,
+		u32 nlx, u32 nly, u32 k0, u32 k1);
+	void prepareLerp3D(float u, float step_x);
+	void gradientSlab3DSimd(const NoiseKernels *kernels,
+		float orig_v, float w, u32 noisez, float step_y, float step_z,
+		u32 nlx, u32 nly, u32 k0, u32 k1, float *planes);
 	void updateResults(float g, float *gmap, const float *persistence_map,
-			size_t bufsize);
+			size_t begin, size_t end);
+
+	// Size of a plane in lerp_buf, 0 for 2D maps
+	size_t lerp_plane_size = 0;
+	// Number of slabs lerp_buf has planes for
+	u32 lerp_slabs = 0;
 
 };
 
@@ -683,6 +683,30 @@ int ModApiEnvMod::l_get_objects_inside_radius(lua_State *L)
 	return 1;
 }
 
+// get_objects_in_area(pos1, pos2)
+int ModApiEnvMod::l_get_objects_in_area(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	v3f pos1 = checkFloatPos(L, 1);
+	v3f pos2 = checkFloatPos(L, 2);
+	aabb3f box(pos1, pos2);
+	box.repair();
+	std::vector<u16> ids;
+	env->getObjectsInArea(ids, box);
+	ScriptApiBase *script = getScriptApiBase(L);
+	lua_createtable(L, ids.size(), 0);
+	u32 i = 0;
+	for (u16 id : ids) {
+		ServerActiveObject *obj = env->getActiveObject(id);
+		if (!obj->isGone()) {
+			script->objectrefGetOrCreate(L, obj);
+			lua_rawseti(L, -2, ++i);
+		}
+	}
+	return 1;
+}
+
 // set_timeofday(val)
 // val = 0...1
 int ModApiEnvMod::l_set_timeofday(lua_State *L)
@@ -826,13 +850,40 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 	std::vector<u32> individual_count;
 	individual_count.resize(filter.size());
 
+	// Use the content index to find the blocks that cannot match
+	Map &map = env->getMap();
+	bool filter_ignore = CONTAINS(filter, CONTENT_IGNORE);
+	VoxelArea block_area(getNodeBlockPos(minp), getNodeBlockPos(maxp));
+	std::vector<bool> block_can_match(block_area.getVolume(), filter_ignore);
+	for (s16 bz = block_area.MinEdge.Z; bz <= block_area.MaxEdge.Z; bz++)
+	for (s16 by = block_area.MinEdge.Y; by <= block_area.MaxEdge.Y; by++)
+	for (s16 bx = block_area.MinEdge.X; bx <= block_area.MaxEdge.X; bx++) {
+		v3s16 bp(bx, by, bz);
+		MapBlock *block = map.getBlockNoCreateNoEx(bp);
+		if (!block || block->isDummy())
+			continue;
+		MapBlockContentIndex &index = block->getContentIndex();
+		for (content_t c : filter) {
+			if (index.getCount(c) != 0) {
+				block_can_match[block_area.index(bp)] = true;
+				break;
+			}
+		}
+	}
+
 	lua_newtable(L);
 	u64 i = 0;
 	for (s16 x = minp.X; x <= maxp.X; x++)
 	for (s16 y = minp.Y; y <= maxp.Y; y++)
 	for (s16 z = minp.Z; z <= maxp.Z; z++) {
 		v3s16 p(x, y, z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
+		v3s16 bp = getNodeBlockPos(p);
+		if (!block_can_match[block_area.index(bp)]) {
+			// Continue with the first node of the next block
+			z = bp.Z * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1;
+			continue;
+		}
+		content_t c = map.getNodeNoEx(p).getContent();
 
 		std::vector<content_t>::iterator it = std::find(filter.begin(), filter.end(), c);
 		if (it != filter.end()) {
@@ -1279,6 +1330,7 @@ void ModApiEnvMod::Initialize(lua_State *L, int top)
 	API_FCT(get_node_timer);
 	API_FCT(get_player_by_name);
 	API_FCT(get_objects_inside_radius);
+	API_FCT(get_objects_in_area);
 	API_FCT(set_timeofday);
 	API_FCT(get_timeofday);
 	API_FCT(get_gametime);
@@ -107,6 +107,9 @@ class ModApiEnvMod : public ModApiBase {
 	// get_objects_inside_radius(pos, radius)
 	static int l_get_objects_inside_radius(lua_State *L);
 
+	// get_objects_in_area(pos1, pos2)
+	static int l_get_objects_in_area(lua_State *L);
+
 	// set_timeofday(val)
 	// val = 0...1
 	static int l_set_timeofday(lua_State *L);
@@ -19,11 +19,20 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "serialization.h"
 
+#include "config.h"
+#include "log.h"
 #include "util/serialize.h"
 #if defined(_WIN32) && !defined(WIN32_NO_ZLIB_WINAPI)
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#if USE_ZSTD
+	#include <zstd.h>
+	#include <zdict.h>
+#endif
+#if USE_LZ4
+	#include <lz4.h>
+#endif
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -185,6 +194,268 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
+static const char *block_compression_names[BLOCK_COMPRESSION_MAX] = {
+	"zlib",
+	"zstd",
+	"lz4",
+	"zstd_dict",
+};
+
+// Upper bound for the uncompressed size, guards against corrupted data
+static const u32 BLOCK_DATA_MAX_SIZE = 64 * 1024 * 1024;
+
+#if USE_ZSTD
+// Level 3 is the zstd default and still much faster than zlib
+static const int ZSTD_LEVEL = 3;
+
+// Contexts are expensive to create, so every thread keeps its own
+struct ZstdContexts {
+	ZstdContexts() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+	~ZstdContexts()
+	{
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+	}
+
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static thread_local ZstdContexts zstd_contexts;
+static ZSTD_CDict *zstd_cdict = nullptr;
+static ZSTD_DDict *zstd_ddict = nullptr;
+#endif
+
+bool isBlockCompressionSupported(u8 compression)
+{
+	switch (compression) {
+	case BLOCK_COMPRESSION_ZLIB:
+#if USE_ZSTD
+	case BLOCK_COMPRESSION_ZSTD:
+#endif
+#if USE_LZ4
+	case BLOCK_COMPRESSION_LZ4:
+#endif
+		return true;
+	case BLOCK_COMPRESSION_ZSTD_DICT:
+		return hasBlockCompressionDictionary();
+	default:
+		return false;
+	}
+}
+
+u8 getDefaultBlockCompression()
+{
+#if USE_ZSTD
+	return BLOCK_COMPRESSION_ZSTD;
+#elif USE_LZ4
+	return BLOCK_COMPRESSION_LZ4;
+#else
+	return BLOCK_COMPRESSION_ZLIB;
+#endif
+}
+
+const char *getBlockCompressionName(u8 compression)
+{
+	if (compression >= BLOCK_COMPRESSION_MAX)
+		return "unknown";
+	return block_compression_names[compression];
+}
+
+bool parseBlockCompressionName(const std::string &name, u8 *compression)
+{
+	for (u8 i = 0; i < BLOCK_COMPRESSION_MAX; i++) {
+		if (name == block_compression_names[i]) {
+			*compression = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	Everything except zlib is stored as
+	u32 compressed size, u32 uncompressed size, compressed data
+*/
+
+void compressBlockData(const u8 *data, size_t data_size, std::ostream &os,
+		u8 compression)
+{
+	if (compression == BLOCK_COMPRESSION_ZLIB) {
+		compressZlib(data, data_size, os);
+		return;
+	}
+
+	if (data_size > BLOCK_DATA_MAX_SIZE)
+		throw SerializationError("compressBlockData: data too large");
+
+	std::string buf;
+	size_t size = 0;
+	switch (compression) {
+#if USE_ZSTD
+	case BLOCK_COMPRESSION_ZSTD:
+	case BLOCK_COMPRESSION_ZSTD_DICT: {
+		buf.resize(ZSTD_compressBound(data_size));
+		if (compression == BLOCK_COMPRESSION_ZSTD_DICT) {
+			if (!zstd_cdict)
+				throw SerializationError("compressBlockData: no dictionary");
+			size = ZSTD_compress_usingCDict(zstd_contexts.cctx, &buf[0],
+				buf.size(), data, data_size, zstd_cdict);
+		} else {
+			size = ZSTD_compressCCtx(zstd_contexts.cctx, &buf[0],
+				buf.size(), data, data_size, ZSTD_LEVEL);
+		}
+		if (ZSTD_isError(size))
+			throw SerializationError(std::string("compressBlockData: ") +
+				ZSTD_getErrorName(size));
+		break;
+	}
+#endif
+#if USE_LZ4
+	case BLOCK_COMPRESSION_LZ4: {
+		buf.resize(LZ4_compressBound(data_size));
+		int ret = LZ4_compress_default((const char *)data, &buf[0],
+			data_size, buf.size());
+		if (ret <= 0)
+			throw SerializationError("compressBlockData: LZ4 failed");
+		size = ret;
+		break;
+	}
+#endif
+	default:
+		throw SerializationError(std::string("compressBlockData: ") +
+			getBlockCompressionName(compression) + " is not supported");
+	}
+
+	writeU32(os, size);
+	writeU32(os, data_size);
+	os.write(buf.c_str(), size);
+}
+
+void compressBlockData(const std::string &data, std::ostream &os,
+		u8 compression)
+{
+	compressBlockData((const u8 *)data.c_str(), data.size(), os, compression);
+}
+
+void decompressBlockData(std::istream &is, std::ostream &os, u8 compression)
+{
+	if (compression == BLOCK_COMPRESSION_ZLIB) {
+		decompressZlib(is, os);
+		return;
+	}
+
+	u32 compressed_size = readU32(is);
+	u32 size = readU32(is);
+	if (compressed_size > BLOCK_DATA_MAX_SIZE || size > BLOCK_DATA_MAX_SIZE)
+		throw SerializationError("decompressBlockData: invalid size");
+
+	std::string in(compressed_size, '\0');
+	is.read(&in[0], compressed_size);
+	if ((u32)is.gcount() != compressed_size)
+		throw SerializationError("decompressBlockData: not enough input data");
+
+	std::string out(size, '\0');
+	switch (compression) {
+#if USE_ZSTD
+	case BLOCK_COMPRESSION_ZSTD:
+	case BLOCK_COMPRESSION_ZSTD_DICT: {
+		size_t ret;
+		if (compression == BLOCK_COMPRESSION_ZSTD_DICT) {
+			if (!zstd_ddict)
+				throw SerializationError("decompressBlockData: no dictionary");
+			ret = ZSTD_decompress_usingDDict(zstd_contexts.dctx, &out[0],
+				size, in.c_str(), compressed_size, zstd_ddict);
+		} else {
+			ret = ZSTD_decompressDCtx(zstd_contexts.dctx, &out[0], size,
+				in.c_str(), compressed_size);
+		}
+		if (ZSTD_isError(ret))
+			throw SerializationError(std::string("decompressBlockData: ") +
+				ZSTD_getErrorName(ret));
+		if (ret != size)
+			throw SerializationError("decompressBlockData: size mismatch");
+		break;
+	}
+#endif
+#if USE_LZ4
+	case BLOCK_COMPRESSION_LZ4: {
+		int ret = LZ4_decompress_safe(in.c_str(), &out[0], compressed_size,
+			size);
+		if (ret < 0 || (u32)ret != size)
+			throw SerializationError("decompressBlockData: LZ4 failed");
+		break;
+	}
+#endif
+	default:
+		throw SerializationError(std::string("decompressBlockData: ") +
+			getBlockCompressionName(compression) + " is not supported");
+	}
+
+	os.write(out.c_str(), size);
+}
+
+bool setBlockCompressionDictionary(const std::string &dict)
+{
+#if USE_ZSTD
+	ZSTD_freeCDict(zstd_cdict);
+	ZSTD_freeDDict(zstd_ddict);
+	zstd_cdict = nullptr;
+	zstd_ddict = nullptr;
+	if (dict.empty())
+		return false;
+
+	zstd_cdict = ZSTD_createCDict(dict.c_str(), dict.size(), ZSTD_LEVEL);
+	zstd_ddict = ZSTD_createDDict(dict.c_str(), dict.size());
+	if (!zstd_cdict || !zstd_ddict) {
+		ZSTD_freeCDict(zstd_cdict);
+		ZSTD_freeDDict(zstd_ddict);
+		zstd_cdict = nullptr;
+		zstd_ddict = nullptr;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool hasBlockCompressionDictionary()
+{
+#if USE_ZSTD
+	return zstd_cdict != nullptr;
+#else
+	return false;
+#endif
+}
+
+std::string trainBlockCompressionDictionary(
+		const std::vector<std::string> &samples, size_t max_size)
+{
+#if USE_ZSTD
+	std::string buffer;
+	std::vector<size_t> sizes;
+	sizes.reserve(samples.size());
+	for (const std::string &sample : samples) {
+		buffer.append(sample);
+		sizes.push_back(sample.size());
+	}
+
+	std::string dict(max_size, '\0');
+	size_t size = ZDICT_trainFromBuffer(&dict[0], max_size, buffer.c_str(),
+		sizes.data(), sizes.size());
+	if (ZDICT_isError(size)) {
+		errorstream << "trainBlockCompressionDictionary: "
+			<< ZDICT_getErrorName(size) << std::endl;
+		return "";
+	}
+	dict.resize(size);
+	return dict;
+#else
+	return "";
+#endif
+}
+
 void compress(const SharedBuffer<u8> &data, std::ostream &os, u8 version)
 {
 	if(version >= 11)
@@ -22,6 +22,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include "exceptions.h"
 #include <iostream>
+#include <string>
+#include <vector>
 #include "util/pointer.h"
 
 /*
@@ -63,13 +65,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	26: Never written; read the same as 25
 	27: Added light spreading flags to blocks
 	28: Added "private" flag to NodeMetadata
+	29: Added the block compression codec (BlockCompression)
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST_READ 28
+#define SER_FMT_VER_HIGHEST_READ 29
 // Saved on disk version
-#define SER_FMT_VER_HIGHEST_WRITE 28
+#define SER_FMT_VER_HIGHEST_WRITE 29
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST_READ 0
 // Lowest serialization version for writing
@@ -81,6 +84,27 @@ inline bool ser_ver_supported(s32 v) {
 	return v >= SER_FMT_VER_LOWEST_READ && v <= SER_FMT_VER_HIGHEST_READ;
 }
 
+/*
+	Compression codecs of MapBlock data, stored in every block from
+	serialization version 29 on. Older versions always use zlib.
+*/
+enum BlockCompression : u8 {
+	BLOCK_COMPRESSION_ZLIB = 0,
+	BLOCK_COMPRESSION_ZSTD = 1,
+	BLOCK_COMPRESSION_LZ4 = 2,
+	// Zstandard with the dictionary of the world, never sent to clients
+	BLOCK_COMPRESSION_ZSTD_DICT = 3,
+	BLOCK_COMPRESSION_MAX
+};
+
+// Whether this build can compress and decompress with the codec
+bool isBlockCompressionSupported(u8 compression);
+// The preferred codec of this build: zstd, else LZ4, else zlib
+u8 getDefaultBlockCompression();
+const char *getBlockCompressionName(u8 compression);
+// Returns false if the name is unknown
+bool parseBlockCompressionName(const std::string &name, u8 *compression);
+
 /*
 	Misc. serialization functions
 */
@@ -89,6 +113,23 @@ void compressZlib(const u8 *data, size_t data_size, std::ostream &os, int level
 void compressZlib(const std::string &data, std::ostream &os, int level = -1);
 void decompressZlib(std::istream &is, std::ostream &os);
 
+// Block data with the given BlockCompression codec
+void compressBlockData(const u8 *data, size_t data_size, std::ostream &os,
+		u8 compression);
+void compressBlockData(const std::string &data, std::ostream &os,
+		u8 compression);
+void decompressBlockData(std::istream &is, std::ostream &os, u8 compression);
+
+/*
+	Dictionary of BLOCK_COMPRESSION_ZSTD_DICT. It has to be set before
+	blocks using it are read or written, and not changed afterwards.
+*/
+bool setBlockCompressionDictionary(const std::string &dict);
+bool hasBlockCompressionDictionary();
+// Trains a dictionary on uncompressed block data, empty on failure
+std::string trainBlockCompressionDictionary(
+		const std::vector<std::string> &samples, size_t max_size);
+
 // These choose between zlib and a self-made one according to version
 void compress(const SharedBuffer<u8> &data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
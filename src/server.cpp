@@ -667,10 +667,9 @@ void Server::AsyncRunStep(bool initial_step)
 
 			std::queue<u16> removed_objects;
 			std::queue<u16> added_objects;
-			m_env->getRemovedActiveObjects(playersao, my_radius, player_radius,
-					client->m_known_objects, removed_objects);
-			m_env->getAddedActiveObjects(playersao, my_radius, player_radius,
-					client->m_known_objects, added_objects);
+			m_env->getActiveObjectChanges(client->peer_id, playersao,
+					my_radius, player_radius, client->m_known_objects,
+					added_objects, removed_objects);
 
 			// Ignore if nothing happened
 			if (removed_objects.empty() && added_objects.empty()) {
@@ -695,6 +694,7 @@ void Server::AsyncRunStep(bool initial_step)
 
 				// Remove from known objects
 				client->m_known_objects.erase(id);
+				client->forgetPositionReference(id);
 
 				if(obj && obj->m_known_by_count > 0)
 					obj->m_known_by_count--;
@@ -730,6 +730,7 @@ void Server::AsyncRunStep(bool initial_step)
 
 				// Add to known objects
 				client->m_known_objects.insert(id);
+				client->forgetPositionReference(id);
 
 				if(obj)
 					obj->m_known_by_count++;
@@ -806,6 +807,19 @@ void Server::AsyncRunStep(bool initial_step)
 				std::vector<ActiveObjectMessage>* list = buffered_message.second;
 				// Go through every message
 				for (const ActiveObjectMessage &aom : *list) {
+					bool reliable = aom.reliable;
+					const std::string *datastring = &aom.datastring;
+					std::string compact;
+					// Newer clients get the position relative to the
+					// last one they got reliably
+					if (!reliable && client->net_proto_version >= 38 &&
+							!datastring->empty() &&
+							(*datastring)[0] == GENERIC_CMD_UPDATE_POSITION) {
+						compact = client->compactPositionUpdate(aom.id,
+								aom.datastring, &reliable);
+						datastring = &compact;
+					}
+
 					// Compose the full new data with header
 					std::string new_data;
 					// Add object id
@@ -813,9 +827,9 @@ void Server::AsyncRunStep(bool initial_step)
 					writeU16((u8*)&buf[0], aom.id);
 					new_data.append(buf, 2);
 					// Add data
-					new_data += serializeString(aom.datastring);
+					new_data += serializeString(*datastring);
 					// Add data to buffer
-					if (aom.reliable)
+					if (reliable)
 						reliable_data += new_data;
 					else
 						unreliable_data += new_data;
@@ -947,6 +961,30 @@ void Server::AsyncRunStep(bool initial_step)
 		}
 	}
 
+	/*
+		Emerge the blocks nearest to the players first
+	*/
+	{
+		float &counter = m_emerge_priority_timer;
+		counter += dtime;
+		if (counter >= 0.5) {
+			counter = 0.0;
+
+			std::unordered_map<session_t, v3s16> positions;
+			{
+				MutexAutoLock envlock(m_env_mutex);
+				for (const session_t client_id : m_clients.getClientIDs()) {
+					RemotePlayer *player = m_env->getPlayer(client_id);
+					PlayerSAO *sao = player ? player->getPlayerSAO() : nullptr;
+					if (sao)
+						positions[client_id] = getNodeBlockPos(
+							floatToInt(sao->getBasePosition(), BS));
+				}
+			}
+			m_emerge->updatePriorities(positions);
+		}
+	}
+
 	// Save map, players and auth stuff
 	{
 		float &counter = m_savemap_timer;
@@ -965,7 +1003,7 @@ void Server::AsyncRunStep(bool initial_step)
 			}
 
 			// Save changed parts of map
-			m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
+			m_env->getServerMap().saveInBackground(MOD_STATE_WRITE_NEEDED);
 
 			// Save players
 			m_env->saveLoadedPlayers();
@@ -2106,7 +2144,7 @@ void Server::sendRemoveNode(v3s16 p, std::unordered_set<u16> *far_players,
 			if (far_players)
 				far_players->emplace(client_id);
 			else
-				client->SetBlockNotSent(block_pos);
+				client->SetBlockModified(block_pos);
 			continue;
 		}
 
@@ -2145,7 +2183,7 @@ void Server::sendAddNode(v3s16 p, MapNode n, std::unordered_set<u16> *far_player
 			if (far_players)
 				far_players->emplace(client_id);
 			else
-				client->SetBlockNotSent(block_pos);
+				client->SetBlockModified(block_pos);
 			continue;
 		}
 
@@ -2157,21 +2195,33 @@ void Server::sendAddNode(v3s16 p, MapNode n, std::unordered_set<u16> *far_player
 }
 
 void Server::SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
-		u16 net_proto_version)
+		u16 net_proto_version, u8 compression)
 {
 	/*
-		Create a packet with the block in the right format
+		Create a packet with the block in the right format.
+		The serialized data is shared by all clients with the same versions.
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os);
-	std::string s = os.str();
+	std::shared_ptr<const std::string> s =
+		block->getNetworkData(ver, net_proto_version, compression);
 
-	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + s.size(), peer_id);
+	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + 2 + s->size(), peer_id);
 
 	pkt << block->getPos();
-	pkt.putRawString(s.c_str(), s.size());
+	pkt.putRawString(s->c_str(), s->size());
+	Send(&pkt);
+}
+
+void Server::SendBlockNodes(session_t peer_id, MapBlock *block,
+		const std::vector<u16> &indices)
+{
+	NetworkPacket pkt(TOCLIENT_BLOCK_NODES, 6 + 2 + indices.size() * 6, peer_id);
+
+	pkt << block->getPos() << (u16) indices.size();
+	for (u16 i : indices) {
+		const MapNode &n = block->getData()[i];
+		pkt << i << n.param0 << n.param1 << n.param2;
+	}
 	Send(&pkt);
 }
 
@@ -2232,10 +2282,28 @@ void Server::SendBlocks(float dtime)
 		if (!client)
 			continue;
 
+		// Clients which have an earlier version of the block only need
+		// the changed nodes
+		u64 version;
+		std::vector<u16> changed;
+		if (client->net_proto_version >= 39 &&
+				client->getSentBlockVersion(block_to_send.pos, &version) &&
+				block->getChangedNodes(version, changed)) {
+			client->SentBlock(block_to_send.pos, block->getNodeVersion());
+			if (changed.empty()) {
+				// Nothing the client sees has changed
+				client->GotBlock(block_to_send.pos);
+				continue;
+			}
+			SendBlockNodes(block_to_send.peer_id, block, changed);
+			total_sending++;
+			continue;
+		}
+
 		SendBlockNoLock(block_to_send.peer_id, block, client->serialization_version,
-				client->net_proto_version);
+				client->net_proto_version, client->getBlockCompression());
 
-		client->SentBlock(block_to_send.pos);
+		client->SentBlock(block_to_send.pos, block->getNodeVersion());
 		total_sending++;
 	}
 	m_clients.unlock();
@@ -2651,6 +2719,9 @@ void Server::DeleteClient(session_t peer_id, ClientDeletionReason reason)
 		// clear formspec info so the next client can't abuse the current state
 		m_formspec_state_data.erase(peer_id);
 
+		m_env->removeActiveObjectInterest(peer_id);
+		m_emerge->cancelBlockEmerges(peer_id);
+
 		RemotePlayer *player = m_env->getPlayer(peer_id);
 
 		/* Run scripts and remove from environment */
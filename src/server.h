@@ -423,7 +423,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			float far_d_nodes = 100, bool remove_metadata = true);
 
 	// Environment and Connection must be locked when called
-	void SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
+	void SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
+			u16 net_proto_version, u8 compression);
+	// Sends the nodes at the given indices of a block the client already has
+	void SendBlockNodes(session_t peer_id, MapBlock *block,
+			const std::vector<u16> &indices);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -525,6 +529,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_liquid_transform_every = 1.0f;
 	float m_masterserver_timer = 0.0f;
 	float m_emergethread_trigger_timer = 0.0f;
+	float m_emerge_priority_timer = 0.0f;
 	float m_savemap_timer = 0.0f;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
@@ -0,0 +1,235 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "activeobjectindex.h"
+#include <algorithm>
+#include <cmath>
+#include "constants.h"
+#include "util/numeric.h"
+
+static const float CELL_SIZE = MAP_BLOCKSIZE * BS;
+// Not a valid cellKey(), which only uses 63 bits
+static const u64 NO_CELL_KEY = (u64)-1;
+
+s32 ActiveObjectIndex::toCellCoord(float f)
+{
+	// Casting NaN is undefined; such an object only needs some cell
+	if (std::isnan(f))
+		return 0;
+
+	// Clamp so that absurd query radii cannot overflow the cell range;
+	// objects themselves never get further than MAX_MAP_GENERATION_LIMIT
+	const float limit = MAX_MAP_GENERATION_LIMIT / MAP_BLOCKSIZE + 1;
+	return (s32)rangelim(std::floor(f / CELL_SIZE), -limit, limit);
+}
+
+u64 ActiveObjectIndex::cellKey(s32 x, s32 y, s32 z)
+{
+	// 21 bits per axis are plenty: the world is 62000 nodes wide and a
+	// cell is 16 nodes
+	return ((u64)(x & 0x1FFFFF) << 42) |
+		((u64)(y & 0x1FFFFF) << 21) |
+		(u64)(z & 0x1FFFFF);
+}
+
+u64 ActiveObjectIndex::cellKey(const v3f &pos)
+{
+	return cellKey(toCellCoord(pos.X), toCellCoord(pos.Y), toCellCoord(pos.Z));
+}
+
+v3s16 ActiveObjectIndex::cellKeyToPos(u64 key)
+{
+	// Sign extend the 21 bit coordinates
+	auto coord = [] (u64 bits) -> s16 {
+		s32 c = bits & 0x1FFFFF;
+		return c & 0x100000 ? c - 0x200000 : c;
+	};
+	return v3s16(coord(key >> 42), coord(key >> 21), coord(key));
+}
+
+// Further away than any cell, toCellCoord() clamps to less
+const v3s16 ActiveObjectIndex::NO_CELL(S16_MIN, S16_MIN, S16_MIN);
+
+v3s16 ActiveObjectIndex::getCellPos(const v3f &pos)
+{
+	return v3s16(toCellCoord(pos.X), toCellCoord(pos.Y), toCellCoord(pos.Z));
+}
+
+void ActiveObjectIndex::setRecordCellChanges(bool record)
+{
+	m_record_cell_changes = record;
+	if (!record)
+		m_cell_changes.clear();
+}
+
+void ActiveObjectIndex::takeCellChanges(std::vector<CellChange> &changes)
+{
+	changes.clear();
+	changes.swap(m_cell_changes);
+}
+
+void ActiveObjectIndex::recordCellChange(u16 id, u64 from, u64 to)
+{
+	if (!m_record_cell_changes)
+		return;
+
+	m_cell_changes.push_back(CellChange{id,
+		from == NO_CELL_KEY ? NO_CELL : cellKeyToPos(from),
+		to == NO_CELL_KEY ? NO_CELL : cellKeyToPos(to)});
+}
+
+const std::vector<u16> *ActiveObjectIndex::getCellObjects(const v3s16 &cell) const
+{
+	auto it = m_cells.find(cellKey(cell.X, cell.Y, cell.Z));
+	return it == m_cells.end() ? nullptr : &it->second;
+}
+
+void ActiveObjectIndex::addToCell(u64 cell, u16 id)
+{
+	m_cells[cell].push_back(id);
+}
+
+void ActiveObjectIndex::removeFromCell(u64 cell, u16 id)
+{
+	auto it = m_cells.find(cell);
+	if (it == m_cells.end())
+		return;
+
+	std::vector<u16> &ids = it->second;
+	auto found = std::find(ids.begin(), ids.end(), id);
+	if (found != ids.end()) {
+		*found = ids.back();
+		ids.pop_back();
+	}
+	if (ids.empty())
+		m_cells.erase(it);
+}
+
+void ActiveObjectIndex::insert(u16 id, const v3f &pos)
+{
+	auto it = m_objects.find(id);
+	if (it != m_objects.end()) {
+		update(id, pos);
+		return;
+	}
+
+	u64 cell = cellKey(pos);
+	m_objects[id] = Entry{pos, cell};
+	addToCell(cell, id);
+	recordCellChange(id, NO_CELL_KEY, cell);
+}
+
+void ActiveObjectIndex::remove(u16 id)
+{
+	auto it = m_objects.find(id);
+	if (it == m_objects.end())
+		return;
+
+	removeFromCell(it->second.cell, id);
+	recordCellChange(id, it->second.cell, NO_CELL_KEY);
+	m_objects.erase(it);
+}
+
+void ActiveObjectIndex::update(u16 id, const v3f &pos)
+{
+	auto it = m_objects.find(id);
+	if (it == m_objects.end())
+		return;
+
+	Entry &e = it->second;
+	e.pos = pos;
+	u64 cell = cellKey(pos);
+	if (cell == e.cell)
+		return;
+
+	removeFromCell(e.cell, id);
+	addToCell(cell, id);
+	recordCellChange(id, e.cell, cell);
+	e.cell = cell;
+}
+
+void ActiveObjectIndex::clear()
+{
+	for (const auto &it : m_objects)
+		recordCellChange(it.first, it.second.cell, NO_CELL_KEY);
+	m_objects.clear();
+	m_cells.clear();
+}
+
+template <typename F>
+void ActiveObjectIndex::forEachInCells(const aabb3f &box, F f) const
+{
+	// Nothing is inside a box with a NaN edge
+	if (std::isnan(box.MinEdge.X) || std::isnan(box.MinEdge.Y) ||
+			std::isnan(box.MinEdge.Z) || std::isnan(box.MaxEdge.X) ||
+			std::isnan(box.MaxEdge.Y) || std::isnan(box.MaxEdge.Z))
+		return;
+
+	s32 x0 = toCellCoord(box.MinEdge.X), x1 = toCellCoord(box.MaxEdge.X);
+	s32 y0 = toCellCoord(box.MinEdge.Y), y1 = toCellCoord(box.MaxEdge.Y);
+	s32 z0 = toCellCoord(box.MinEdge.Z), z1 = toCellCoord(box.MaxEdge.Z);
+
+	// Huge query volumes (e.g. a mod asking for everything within 10000
+	// nodes) would visit far more empty cells than there are objects
+	u64 volume = (u64)(x1 - x0 + 1) * (u64)(y1 - y0 + 1) * (u64)(z1 - z0 + 1);
+	if (volume > m_cells.size()) {
+		for (const auto &it : m_objects)
+			f(it.first, it.second.pos);
+		return;
+	}
+
+	for (s32 x = x0; x <= x1; x++)
+	for (s32 y = y0; y <= y1; y++)
+	for (s32 z = z0; z <= z1; z++) {
+		auto cell = m_cells.find(cellKey(x, y, z));
+		if (cell == m_cells.end())
+			continue;
+		for (u16 id : cell->second)
+			f(id, m_objects.at(id).pos);
+	}
+}
+
+void ActiveObjectIndex::getObjectsInsideRadius(const v3f &pos, float radius,
+		std::vector<u16> &result) const
+{
+	// Also rejects a NaN radius
+	if (!(radius >= 0))
+		return;
+
+	size_t start = result.size();
+	aabb3f box(pos - v3f(radius, radius, radius),
+		pos + v3f(radius, radius, radius));
+	forEachInCells(box, [&] (u16 id, const v3f &p) {
+		if (p.getDistanceFrom(pos) <= radius)
+			result.push_back(id);
+	});
+	// Keep the id order that mods used to get
+	std::sort(result.begin() + start, result.end());
+}
+
+void ActiveObjectIndex::getObjectsInArea(const aabb3f &box,
+		std::vector<u16> &result) const
+{
+	size_t start = result.size();
+	forEachInCells(box, [&] (u16 id, const v3f &p) {
+		if (box.isPointInside(p))
+			result.push_back(id);
+	});
+	std::sort(result.begin() + start, result.end());
+}
@@ -0,0 +1,117 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "irr_aabb3d.h"
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Uniform grid over the positions of the server's active objects
+ *
+ * Every object is stored in exactly one cell, which has the size of one
+ * mapblock. Radius and box queries only visit the cells that
+ * overlap the query volume instead of every active object.
+ */
+class ActiveObjectIndex
+{
+public:
+	void insert(u16 id, const v3f &pos);
+	void remove(u16 id);
+	// Does nothing if the object is not in the index
+	void update(u16 id, const v3f &pos);
+	void clear();
+
+	bool contains(u16 id) const { return m_objects.find(id) != m_objects.end(); }
+	size_t size() const { return m_objects.size(); }
+
+	/**
+	 * Appends the ids of all objects whose position is within radius
+	 * of pos, sorted by id. A NaN pos or radius matches nothing.
+	 */
+	void getObjectsInsideRadius(const v3f &pos, float radius,
+			std::vector<u16> &result) const;
+
+	/**
+	 * Appends the ids of all objects whose position lies inside box,
+	 * sorted by id
+	 */
+	void getObjectsInArea(const aabb3f &box, std::vector<u16> &result) const;
+
+	/*
+		Cells are addressed by their position in cells. Objects moving
+		between cells, being inserted and being removed can be recorded,
+		see ActiveObjectInterest.
+	*/
+
+	// Cell of pos; NO_CELL in a CellChange means not in the index
+	static v3s16 getCellPos(const v3f &pos);
+	static const v3s16 NO_CELL;
+
+	struct CellChange
+	{
+		u16 id;
+		v3s16 from;
+		v3s16 to;
+	};
+
+	void setRecordCellChanges(bool record);
+	// Moves the changes recorded since the last call to changes
+	void takeCellChanges(std::vector<CellChange> &changes);
+
+	size_t getCellCount() const { return m_cells.size(); }
+	// Returns nullptr for an empty cell
+	const std::vector<u16> *getCellObjects(const v3s16 &cell) const;
+	// Calls f(cell, ids) for all cells with objects
+	template <typename F>
+	void forEachCell(F f) const
+	{
+		for (const auto &it : m_cells)
+			f(cellKeyToPos(it.first), it.second);
+	}
+
+private:
+	struct Entry
+	{
+		v3f pos;
+		u64 cell;
+	};
+
+	static s32 toCellCoord(float f);
+	static u64 cellKey(s32 x, s32 y, s32 z);
+	static u64 cellKey(const v3f &pos);
+	static v3s16 cellKeyToPos(u64 key);
+
+	void recordCellChange(u16 id, u64 from, u64 to);
+
+	void addToCell(u64 cell, u16 id);
+	void removeFromCell(u64 cell, u16 id);
+
+	// Calls f(id, pos) for every object in the cells overlapping box
+	template <typename F>
+	void forEachInCells(const aabb3f &box, F f) const;
+
+	std::unordered_map<u16, Entry> m_objects;
+	std::unordered_map<u64, std::vector<u16>> m_cells;
+
+	bool m_record_cell_changes = false;
+	std::vector<CellChange> m_cell_changes;
+};
@@ -0,0 +1,141 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "activeobjectinterest.h"
+#include <algorithm>
+#include <cmath>
+#include "constants.h"
+
+ActiveObjectInterest::ActiveObjectInterest(ActiveObjectIndex &index):
+	m_index(index)
+{
+	m_index.setRecordCellChanges(true);
+}
+
+ActiveObjectInterest::~ActiveObjectInterest()
+{
+	m_index.setRecordCellChanges(false);
+}
+
+bool ActiveObjectInterest::Client::contains(const v3s16 &cell) const
+{
+	if (!subscribed || cell == ActiveObjectIndex::NO_CELL)
+		return false;
+
+	// Cells are up to 2^16 apart, the squares would overflow s32
+	s64 dx = cell.X - center.X;
+	s64 dy = cell.Y - center.Y;
+	s64 dz = cell.Z - center.Z;
+	return (float)(dx * dx + dy * dy + dz * dz) <= radius * radius;
+}
+
+void ActiveObjectInterest::dispatchCellChanges()
+{
+	m_index.takeCellChanges(m_changes);
+	if (m_clients.empty())
+		return;
+
+	for (const ActiveObjectIndex::CellChange &change : m_changes) {
+		for (auto &it : m_clients) {
+			Client &client = it.second;
+			if (client.contains(change.from) != client.contains(change.to))
+				client.changed.push_back(change.id);
+		}
+	}
+}
+
+void ActiveObjectInterest::update(u16 peer_id, const v3f &pos, float radius,
+		std::vector<u16> &changed)
+{
+	dispatchCellChanges();
+
+	Client &client = m_clients[peer_id];
+	changed.insert(changed.end(), client.changed.begin(), client.changed.end());
+	client.changed.clear();
+
+	v3s16 center = ActiveObjectIndex::getCellPos(pos);
+	radius /= MAP_BLOCKSIZE * BS;
+	if (client.subscribed && center == client.center && radius == client.radius)
+		return;
+
+	Client old;
+	old.center = client.center;
+	old.radius = client.radius;
+	old.subscribed = client.subscribed;
+	client.center = center;
+	client.radius = radius;
+	client.subscribed = true;
+
+	// Collect the objects of the cells that entered or left the area
+	s16 r = std::ceil(std::max(radius, old.subscribed ? old.radius : 0.0f));
+	v3s16 minp = center - v3s16(r, r, r);
+	v3s16 maxp = center + v3s16(r, r, r);
+	if (old.subscribed) {
+		minp.X = std::min<s16>(minp.X, old.center.X - r);
+		minp.Y = std::min<s16>(minp.Y, old.center.Y - r);
+		minp.Z = std::min<s16>(minp.Z, old.center.Z - r);
+		maxp.X = std::max<s16>(maxp.X, old.center.X + r);
+		maxp.Y = std::max<s16>(maxp.Y, old.center.Y + r);
+		maxp.Z = std::max<s16>(maxp.Z, old.center.Z + r);
+	}
+
+	// Like ActiveObjectIndex, visit the cells with objects if these are
+	// fewer than the cells around
+	u64 volume = (u64)(maxp.X - minp.X + 1) * (u64)(maxp.Y - minp.Y + 1) *
+			(u64)(maxp.Z - minp.Z + 1);
+	if (volume > m_index.getCellCount()) {
+		m_index.forEachCell([&] (const v3s16 &cell, const std::vector<u16> &ids) {
+			if (old.contains(cell) != client.contains(cell))
+				changed.insert(changed.end(), ids.begin(), ids.end());
+		});
+		return;
+	}
+
+	v3s16 cell;
+	for (cell.X = minp.X; cell.X <= maxp.X; cell.X++)
+	for (cell.Y = minp.Y; cell.Y <= maxp.Y; cell.Y++)
+	for (cell.Z = minp.Z; cell.Z <= maxp.Z; cell.Z++) {
+		if (old.contains(cell) == client.contains(cell))
+			continue;
+		const std::vector<u16> *ids = m_index.getCellObjects(cell);
+		if (ids)
+			changed.insert(changed.end(), ids->begin(), ids->end());
+	}
+}
+
+void ActiveObjectInterest::objectChanged(u16 id, const v3f &pos)
+{
+	v3s16 cell = ActiveObjectIndex::getCellPos(pos);
+	for (auto &it : m_clients) {
+		if (it.second.contains(cell))
+			it.second.changed.push_back(id);
+	}
+}
+
+bool ActiveObjectInterest::isInArea(u16 peer_id, const v3f &pos) const
+{
+	auto it = m_clients.find(peer_id);
+	return it != m_clients.end() &&
+			it->second.contains(ActiveObjectIndex::getCellPos(pos));
+}
+
+void ActiveObjectInterest::removeClient(u16 peer_id)
+{
+	m_clients.erase(peer_id);
+}
@@ -0,0 +1,82 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include "irr_v3d.h"
+#include "activeobjectindex.h"
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Interest management for sending active objects to clients
+ *
+ * Every client subscribes to the cells of the ActiveObjectIndex around
+ * its player: those whose center is within the radius of the center of
+ * the player's cell. Objects in these cells are in the area of the
+ * client. Work is only done when the player or an object moves to
+ * another cell, not for every object and client in every step.
+ */
+class ActiveObjectInterest
+{
+public:
+	ActiveObjectInterest(ActiveObjectIndex &index);
+	~ActiveObjectInterest();
+
+	/*
+		Hands the cell changes of objects to the clients whose area they
+		enter or leave. Must be called regularly so that they don't pile
+		up; update() calls it too, as changes must be handed over before
+		the area they happened in moves.
+	*/
+	void dispatchCellChanges();
+
+	/*
+		Moves the area of a client, creating it if needed. Appends the
+		ids of the objects that may have entered or left the area since
+		the last call. They can be appended more than once.
+	*/
+	void update(u16 peer_id, const v3f &pos, float radius,
+			std::vector<u16> &changed);
+
+	// Makes the clients whose area contains pos look at the object
+	// again, for changes other than moving, like it being removed
+	void objectChanged(u16 id, const v3f &pos);
+
+	// Whether pos is in the area of the client
+	bool isInArea(u16 peer_id, const v3f &pos) const;
+
+	void removeClient(u16 peer_id);
+
+private:
+	struct Client
+	{
+		v3s16 center;
+		// In cells
+		float radius = 0.0f;
+		bool subscribed = false;
+		std::vector<u16> changed;
+
+		bool contains(const v3s16 &cell) const;
+	};
+
+	ActiveObjectIndex &m_index;
+	std::unordered_map<u16, Client> m_clients;
+	std::vector<ActiveObjectIndex::CellChange> m_changes;
+};
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "mapblock.h"
+#include "noise.h"
 #include "nodedef.h"
 #include "nodemetadata.h"
 #include "gamedef.h"
@@ -36,6 +37,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/basic_macros.h"
 #include "util/pointedthing.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/thread.h"
 #include "filesys.h"
 #include "gameparams.h"
 #include "database/database-dummy.h"
@@ -251,35 +253,33 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block, u32 stamp)
 	FATAL_ERROR_IF(!m_query_mode,
 		"attempted to query on non fully set up LBMManager");
 	v3s16 pos_of_block = block->getPosRelative();
-	v3s16 pos;
-	MapNode n;
-	content_t c;
 	lbm_lookup_map::const_iterator it = getLBMsIntroducedAfter(stamp);
 	for (; it != m_lbm_lookup.end(); ++it) {
-		// Cache previous version to speedup lookup which has a very high performance
-		// penalty on each call
-		content_t previous_c{};
-		std::vector<LoadingBlockModifierDef *> *lbm_list = nullptr;
-
-		for (pos.X = 0; pos.X < MAP_BLOCKSIZE; pos.X++)
-			for (pos.Y = 0; pos.Y < MAP_BLOCKSIZE; pos.Y++)
-				for (pos.Z = 0; pos.Z < MAP_BLOCKSIZE; pos.Z++) {
-					n = block->getNodeNoEx(pos);
-					c = n.getContent();
-
-					// If content_t are not matching perform an LBM lookup
-					if (previous_c != c) {
-						lbm_list = (std::vector<LoadingBlockModifierDef *> *)
-							it->second.lookup(c);
-						previous_c = c;
-					}
+		// Only visit the nodes of content types that have LBMs
+		std::vector<content_t> contents;
+		for (const auto &count : block->getContentIndex().getCounts())
+			contents.push_back(count.first);
+
+		for (content_t c : contents) {
+			const std::vector<LoadingBlockModifierDef *> *lbm_list =
+				it->second.lookup(c);
+			if (!lbm_list)
+				continue;
 
-					if (!lbm_list)
-						continue;
-					for (auto lbmdef : *lbm_list) {
-						lbmdef->trigger(env, pos + pos_of_block, n);
-					}
+			// Copied because the LBMs may change the nodes of the block
+			const std::vector<u16> positions = block->getContentPositions(c);
+			for (u16 i : positions) {
+				v3s16 pos = MapBlock::nodeIndexToPos(i);
+				MapNode n = block->getNodeNoEx(pos);
+				// Changed by a previous LBM
+				if (n.getContent() != c)
+					continue;
+
+				for (auto lbmdef : *lbm_list) {
+					lbmdef->trigger(env, pos + pos_of_block, n);
 				}
+			}
+		}
 	}
 }
 
@@ -391,7 +391,8 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_map(map),
 	m_script(scriptIface),
 	m_server(server),
-	m_path_world(path_world)
+	m_path_world(path_world),
+	m_active_object_interest(m_active_object_index)
 {
 	// Determine which database backend to use
 	std::string conf_path = path_world + DIR_DELIM + "world.mt";
@@ -426,6 +427,15 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 		}
 	}
 	m_auth_database = openAuthDatabase(auth_name, path_world, conf);
+
+	// If unspecified, use as many threads as emerge does but at most 4;
+	// the scan is short and mostly limited by memory bandwidth
+	s16 abm_threads = 0;
+	if (!g_settings->getS16NoEx("abm_scan_threads", abm_threads) || abm_threads < 1)
+		abm_threads = rangelim((s16)Thread::getNumberOfProcessors() - 2, 1, 4);
+	m_abm_scan_pool.reset(new WorkerPool(abm_threads, "ABMScan"));
+	infostream << "ServerEnvironment: using " << abm_threads
+		<< " threads to scan for ABMs" << std::endl;
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -814,104 +824,173 @@ class ABMHandler
 		return active_object_count;
 
 	}
-	void apply(MapBlock *block, int &blocks_scanned, int &abms_run, int &blocks_cached)
+	/*
+		ABMs are applied in three steps:
+		1. prepare() (main thread) collects everything the scan needs, so
+		   that the scan only reads node data and never touches the Map.
+		2. scan() may run on any thread. It does the content, chance and
+		   neighbor checks and records the resulting triggers.
+		3. run() (main thread) calls the ABMs for the recorded triggers in
+		   order, skipping nodes that a previous ABM changed.
+	*/
+	struct Trigger
+	{
+		ActiveABM *aabm;
+		u16 index;
+		content_t c;
+	};
+
+	struct BlockScan
+	{
+		v3s16 pos;
+		MapBlock *block;
+		// The block and its 26 neighbours, indexed by neighborIndex()
+		MapBlock *neighbors[27];
+		std::vector<std::pair<content_t, const std::vector<u16> *>> contents;
+		u32 seed;
+		std::vector<Trigger> triggers;
+	};
+
+	static inline int neighborIndex(s16 x, s16 y, s16 z)
+	{
+		return (z + 1) * 9 + (y + 1) * 3 + (x + 1);
+	}
+
+	// Returns false if there is nothing to be done for the block
+	bool prepare(MapBlock *block, BlockScan &scan, int &blocks_scanned,
+		int &blocks_cached)
 	{
 		if(m_aabms.empty() || block->isDummy())
-			return;
+			return false;
 
-		// Check the content type cache first
-		// to see whether there are any ABMs
-		// to be run at all for this block.
-		if (block->contents_cached) {
+		// Check the content index first to see whether there are any ABMs
+		// to be run at all for this block, and for which content types.
+		if (block->getContentIndex().isValid())
 			blocks_cached++;
-			bool run_abms = false;
-			for (content_t c : block->contents) {
-				if (c < m_aabms.size() && m_aabms[c]) {
-					run_abms = true;
-					break;
+		scan.contents.clear();
+		for (const auto &count : block->getContentIndex().getCounts()) {
+			content_t c = count.first;
+			if (c < m_aabms.size() && m_aabms[c])
+				scan.contents.emplace_back(c, nullptr);
+		}
+		if (scan.contents.empty())
+			return false;
+		blocks_scanned++;
+
+		// Build the position lists here, the scan must not modify the index
+		for (auto &content : scan.contents)
+			content.second = &block->getContentPositions(content.first);
+
+		ServerMap *map = &m_env->getServerMap();
+		v3s16 bp = block->getPos();
+		for (s16 z = -1; z <= 1; z++)
+		for (s16 y = -1; y <= 1; y++)
+		for (s16 x = -1; x <= 1; x++)
+			scan.neighbors[neighborIndex(x, y, z)] =
+				map->getBlockNoCreateNoEx(bp + v3s16(x, y, z));
+
+		scan.pos = bp;
+		scan.block = block;
+		scan.seed = myrand();
+		scan.triggers.clear();
+		return true;
+	}
+
+	static content_t getNeighborContent(const BlockScan &scan, v3s16 p)
+	{
+		s16 bx = p.X < 0 ? -1 : (p.X >= MAP_BLOCKSIZE ? 1 : 0);
+		s16 by = p.Y < 0 ? -1 : (p.Y >= MAP_BLOCKSIZE ? 1 : 0);
+		s16 bz = p.Z < 0 ? -1 : (p.Z >= MAP_BLOCKSIZE ? 1 : 0);
+		MapBlock *block = scan.neighbors[neighborIndex(bx, by, bz)];
+		if (!block)
+			return CONTENT_IGNORE;
+		return block->getNodeNoEx(p - v3s16(bx, by, bz) * MAP_BLOCKSIZE)
+			.getContent();
+	}
+
+	void scan(BlockScan &scan)
+	{
+		PcgRandom rand(scan.seed);
+		MapBlock *block = scan.block;
+
+		for (const auto &content : scan.contents) {
+			content_t c = content.first;
+			for (u16 i : *content.second) {
+				v3s16 p0 = MapBlock::nodeIndexToPos(i);
+				for (ActiveABM &aabm : *m_aabms[c]) {
+					if (rand.next() % aabm.chance != 0)
+						continue;
+
+					// Check neighbors
+					if (aabm.check_required_neighbors) {
+						v3s16 p1;
+						for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+						for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+						for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
+						{
+							if(p1 == p0)
+								continue;
+							content_t c;
+							if (block->isValidPosition(p1)) {
+								// if the neighbor is found on the same map block
+								// get it straight from there
+								const MapNode &n = block->getNodeUnsafe(p1);
+								c = n.getContent();
+							} else {
+								// otherwise look at the neighbouring block
+								c = getNeighborContent(scan, p1);
+							}
+							if (CONTAINS(aabm.required_neighbors, c))
+								goto neighbor_found;
+						}
+						// No required neighbor found
+						continue;
+					}
+					neighbor_found:
+
+					scan.triggers.push_back({&aabm, i, c});
 				}
 			}
-			if (!run_abms)
-				return;
-		} else {
-			// Clear any caching
-			block->contents.clear();
 		}
-		blocks_scanned++;
+	}
 
+	void run(BlockScan &scan, int &abms_run)
+	{
+		if (scan.triggers.empty())
+			return;
+
+		// An ABM of a previous block may have deleted this one
 		ServerMap *map = &m_env->getServerMap();
+		MapBlock *block = map->getBlockNoCreateNoEx(scan.pos);
+		if (!block || block->isDummy())
+			return;
 
 		u32 active_object_count_wider;
 		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
 		m_env->m_added_objects = 0;
 
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
+		for (const Trigger &trigger : scan.triggers) {
+			v3s16 p0 = MapBlock::nodeIndexToPos(trigger.index);
 			const MapNode &n = block->getNodeUnsafe(p0);
-			content_t c = n.getContent();
-			// Cache content types as we go
-			if (!block->contents_cached && !block->do_not_cache_contents) {
-				block->contents.insert(c);
-				if (block->contents.size() > 64) {
-					// Too many different nodes... don't try to cache
-					block->do_not_cache_contents = true;
-					block->contents.clear();
-				}
-			}
-
-			if (c >= m_aabms.size() || !m_aabms[c])
+			// Changed by a previous ABM
+			if (n.getContent() != trigger.c)
 				continue;
 
 			v3s16 p = p0 + block->getPosRelative();
-			for (ActiveABM &aabm : *m_aabms[c]) {
-				if (myrand() % aabm.chance != 0)
-					continue;
-
-				// Check neighbors
-				if (aabm.check_required_neighbors) {
-					v3s16 p1;
-					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
-					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
-					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
-					{
-						if(p1 == p0)
-							continue;
-						content_t c;
-						if (block->isValidPosition(p1)) {
-							// if the neighbor is found on the same map block
-							// get it straight from there
-							const MapNode &n = block->getNodeUnsafe(p1);
-							c = n.getContent();
-						} else {
-							// otherwise consult the map
-							MapNode n = map->getNodeNoEx(p1 + block->getPosRelative());
-							c = n.getContent();
-						}
-						if (CONTAINS(aabm.required_neighbors, c))
-							goto neighbor_found;
-					}
-					// No required neighbor found
-					continue;
-				}
-				neighbor_found:
-
-				abms_run++;
-				// Call all the trigger variations
-				aabm.abm->trigger(m_env, p, n);
-				aabm.abm->trigger(m_env, p, n,
-					active_object_count, active_object_count_wider);
-
-				// Count surrounding objects again if the abms added any
-				if(m_env->m_added_objects > 0) {
-					active_object_count = countObjects(block, map, active_object_count_wider);
-					m_env->m_added_objects = 0;
-				}
+			ActiveABM &aabm = *trigger.aabm;
+
+			abms_run++;
+			// Call all the trigger variations
+			aabm.abm->trigger(m_env, p, n);
+			aabm.abm->trigger(m_env, p, n,
+				active_object_count, active_object_count_wider);
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
 			}
 		}
-		block->contents_cached = !block->do_not_cache_contents;
 	}
 };
 
@@ -1050,14 +1129,13 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 void ServerEnvironment::getObjectsInsideRadius(std::vector<u16> &objects, v3f pos,
 	float radius)
 {
-	for (auto &activeObject : m_active_objects) {
-		ServerActiveObject* obj = activeObject.second;
-		u16 id = activeObject.first;
-		v3f objectpos = obj->getBasePosition();
-		if (objectpos.getDistanceFrom(pos) > radius)
-			continue;
-		objects.push_back(id);
-	}
+	m_active_object_index.getObjectsInsideRadius(pos, radius, objects);
+}
+
+void ServerEnvironment::getObjectsInArea(std::vector<u16> &objects,
+	const aabb3f &box)
+{
+	m_active_object_index.getObjectsInArea(box, objects);
 }
 
 void ServerEnvironment::clearObjects(ClearObjectsMode mode)
@@ -1095,6 +1173,7 @@ void ServerEnvironment::clearObjects(ClearObjectsMode mode)
 	// Remove references from m_active_objects
 	for (u16 i : objects_to_remove) {
 		m_active_objects.erase(i);
+		m_active_object_index.remove(i);
 	}
 
 	// Get list of loaded blocks
@@ -1350,6 +1429,8 @@ void ServerEnvironment::step(float dtime)
 			int blocks_scanned = 0;
 			int abms_run = 0;
 			int blocks_cached = 0;
+			std::vector<ABMHandler::BlockScan> scans(m_active_blocks.m_abm_list.size());
+			size_t num_scans = 0;
 			for (const v3s16 &p : m_active_blocks.m_abm_list) {
 				MapBlock *block = m_map->getBlockNoCreateNoEx(p);
 				if (!block)
@@ -1358,9 +1439,23 @@ void ServerEnvironment::step(float dtime)
 				// Set current time as timestamp
 				block->setTimestampNoChangedFlag(m_game_time);
 
-				/* Handle ActiveBlockModifiers */
-				abmhandler.apply(block, blocks_scanned, abms_run, blocks_cached);
+				if (abmhandler.prepare(block, scans[num_scans],
+						blocks_scanned, blocks_cached))
+					num_scans++;
 			}
+
+			/* Find the nodes the ActiveBlockModifiers trigger on */
+			{
+				ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg per interval", SPT_AVG);
+				m_abm_scan_pool->parallelFor(num_scans, [&] (size_t i) {
+					abmhandler.scan(scans[i]);
+				});
+			}
+
+			/* Handle ActiveBlockModifiers */
+			for (size_t i = 0; i < num_scans; i++)
+				abmhandler.run(scans[i], abms_run);
+
 			g_profiler->avg("SEnv: active blocks", m_active_blocks.m_abm_list.size());
 			g_profiler->avg("SEnv: active blocks cached", blocks_cached);
 			g_profiler->avg("SEnv: active blocks scanned for ABMs", blocks_scanned);
@@ -1401,8 +1496,12 @@ void ServerEnvironment::step(float dtime)
 
 		for (auto &ao_it : m_active_objects) {
 			ServerActiveObject* obj = ao_it.second;
-			if (obj->isGone())
+			if (obj->isGone()) {
+				// Makes the clients which know it remove it
+				m_active_object_interest.objectChanged(ao_it.first,
+						obj->getBasePosition());
 				continue;
+			}
 
 			// Step object
 			obj->step(dtime, send_recommended);
@@ -1412,6 +1511,8 @@ void ServerEnvironment::step(float dtime)
 				obj->m_messages_out.pop();
 			}
 		}
+
+		m_active_object_interest.dispatchCellChanges();
 	}
 
 	/*
@@ -1531,102 +1632,60 @@ u16 ServerEnvironment::addActiveObject(ServerActiveObject *object)
 }
 
 /*
-	Finds out what new objects have been added to
-	inside a radius around a position
+	Finds out what objects came into and went out of the range of a
+	client's player
 */
-void ServerEnvironment::getAddedActiveObjects(PlayerSAO *playersao, s16 radius,
-	s16 player_radius,
+void ServerEnvironment::getActiveObjectChanges(session_t peer_id,
+	PlayerSAO *playersao, s16 radius, s16 player_radius,
 	std::set<u16> &current_objects,
-	std::queue<u16> &added_objects)
+	std::queue<u16> &added_objects,
+	std::queue<u16> &removed_objects)
 {
 	f32 radius_f = radius * BS;
 	f32 player_radius_f = player_radius * BS;
 
 	if (player_radius_f < 0)
 		player_radius_f = 0;
+
 	/*
-		Go through the object list,
-		- discard removed/deactivated objects,
-		- discard objects that are too far away,
-		- discard objects that are found in current_objects.
-		- add remaining objects to added_objects
+		Objects are only looked at when they or the player moved to
+		another cell. Players are looked at every time, as their range
+		is exact and they may be sent regardless of distance.
 	*/
-	for (auto &ao_it : m_active_objects) {
-		u16 id = ao_it.first;
-
-		// Get object
-		ServerActiveObject *object = ao_it.second;
-		if (object == NULL)
-			continue;
-
-		if (object->isGone())
-			continue;
-
-		f32 distance_f = object->getBasePosition().
-			getDistanceFrom(playersao->getBasePosition());
-		if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
-			// Discard if too far
-			if (distance_f > player_radius_f && player_radius_f != 0)
-				continue;
-		} else if (distance_f > radius_f)
-			continue;
-
-		// Discard if already on current_objects
-		std::set<u16>::iterator n;
-		n = current_objects.find(id);
-		if(n != current_objects.end())
-			continue;
-		// Add to added_objects
-		added_objects.push(id);
+	v3f player_pos = playersao->getBasePosition();
+	std::vector<u16> changed;
+	m_active_object_interest.update(peer_id, player_pos, radius_f, changed);
+	for (RemotePlayer *player : m_players) {
+		PlayerSAO *sao = player->getPlayerSAO();
+		if (sao)
+			changed.push_back(sao->getId());
 	}
-}
-
-/*
-	Finds out what objects have been removed from
-	inside a radius around a position
-*/
-void ServerEnvironment::getRemovedActiveObjects(PlayerSAO *playersao, s16 radius,
-	s16 player_radius,
-	std::set<u16> &current_objects,
-	std::queue<u16> &removed_objects)
-{
-	f32 radius_f = radius * BS;
-	f32 player_radius_f = player_radius * BS;
+	std::sort(changed.begin(), changed.end());
+	changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
 
-	if (player_radius_f < 0)
-		player_radius_f = 0;
-	/*
-		Go through current_objects; object is removed if:
-		- object is not found in m_active_objects (this is actually an
-		  error condition; objects should be removed only after all clients
-		  have been informed about removal), or
-		- object is to be removed or deactivated, or
-		- object is too far away
-	*/
-	for (u16 id : current_objects) {
+	for (u16 id : changed) {
+		/*
+			An object is removed from the client if it is not found in
+			m_active_objects, if it is to be removed or deactivated, or
+			if it is too far away
+		*/
 		ServerActiveObject *object = getActiveObject(id);
-
-		if (object == NULL) {
-			infostream << "ServerEnvironment::getRemovedActiveObjects():"
-				<< " object in current_objects is NULL" << std::endl;
-			removed_objects.push(id);
-			continue;
+		bool in_range = false;
+		if (object && !object->isGone()) {
+			v3f pos = object->getBasePosition();
+			if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
+				in_range = player_radius_f == 0 ||
+					pos.getDistanceFrom(player_pos) <= player_radius_f;
+			} else {
+				in_range = m_active_object_interest.isInArea(peer_id, pos);
+			}
 		}
 
-		if (object->isGone()) {
+		bool known = current_objects.find(id) != current_objects.end();
+		if (in_range && !known)
+			added_objects.push(id);
+		else if (!in_range && known)
 			removed_objects.push(id);
-			continue;
-		}
-
-		f32 distance_f = object->getBasePosition().getDistanceFrom(playersao->getBasePosition());
-		if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
-			if (distance_f <= player_radius_f || player_radius_f == 0)
-				continue;
-		} else if (distance_f <= radius_f)
-			continue;
-
-		// Object is no longer visible
-		removed_objects.push(id);
 	}
 }
 
@@ -1743,6 +1802,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object->getId(), object->getBasePosition());
 
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 		<<"Added id="<<object->getId()<<"; there are now "
@@ -1856,6 +1916,7 @@ void ServerEnvironment::removeRemovedObjects()
 	// Remove references from m_active_objects
 	for (u16 i : objects_to_remove) {
 		m_active_objects.erase(i);
+		m_active_object_index.remove(i);
 	}
 }
 
@@ -2113,6 +2174,7 @@ void ServerEnvironment::deactivateFarObjects(bool _force_delete)
 	// Remove references from m_active_objects
 	for (u16 i : objects_to_remove) {
 		m_active_objects.erase(i);
+		m_active_object_index.remove(i);
 	}
 }
 
@@ -22,8 +22,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "activeobject.h"
 #include "environment.h"
 #include "mapnode.h"
+#include "server/activeobjectindex.h"
+#include "server/activeobjectinterest.h"
 #include "settings.h"
 #include "util/numeric.h"
+#include "threading/workerpool.h"
+#include <memory>
 #include <set>
 
 class IGameDef;
@@ -278,23 +282,20 @@ class ServerEnvironment : public Environment
 	//bool addActiveObjectAsStatic(ServerActiveObject *object);
 
 	/*
-		Find out what new objects have been added to
-		inside a radius around a position
+		Find out what objects came into and went out of the range of the
+		player of a client. current_objects are the objects the client
+		knows. Other objects than players are in range if they are in the
+		area of the client, see ActiveObjectInterest.
 	*/
-	void getAddedActiveObjects(PlayerSAO *playersao, s16 radius,
-		s16 player_radius,
-		std::set<u16> &current_objects,
-		std::queue<u16> &added_objects);
-
-	/*
-		Find out what new objects have been removed from
-		inside a radius around a position
-	*/
-	void getRemovedActiveObjects(PlayerSAO *playersao, s16 radius,
-		s16 player_radius,
+	void getActiveObjectChanges(session_t peer_id, PlayerSAO *playersao,
+		s16 radius, s16 player_radius,
 		std::set<u16> &current_objects,
+		std::queue<u16> &added_objects,
 		std::queue<u16> &removed_objects);
 
+	void removeActiveObjectInterest(session_t peer_id)
+	{ m_active_object_interest.removeClient(peer_id); }
+
 	/*
 		Get the next message emitted by some active object.
 		Returns a message with id=0 if no messages are available.
@@ -332,6 +333,11 @@ class ServerEnvironment : public Environment
 
 	// Find all active objects inside a radius around a point
 	void getObjectsInsideRadius(std::vector<u16> &objects, v3f pos, float radius);
+	void getObjectsInArea(std::vector<u16> &objects, const aabb3f &box);
+
+	// Keeps the spatial index in sync; called from setBasePosition()
+	void updateActiveObjectPosition(u16 id, const v3f &pos)
+	{ m_active_object_index.update(id, pos); }
 
 	// Clear objects, loading and going through every MapBlock
 	void clearObjects(ClearObjectsMode mode);
@@ -442,6 +448,10 @@ class ServerEnvironment : public Environment
 	const std::string m_path_world;
 	// Active object list
 	ServerActiveObjectMap m_active_objects;
+	// Spatial index over the positions of m_active_objects
+	ActiveObjectIndex m_active_object_index;
+	// Which objects are in the areas of the clients
+	ActiveObjectInterest m_active_object_interest;
 	// Outgoing network message buffer for active objects
 	std::queue<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -463,6 +473,8 @@ class ServerEnvironment : public Environment
 	u32 m_last_clear_objects_time = 0;
 	// Active block modifiers
 	std::vector<ABMWithState> m_abms;
+	// Finds the nodes that ABMs trigger on in parallel
+	std::unique_ptr<WorkerPool> m_abm_scan_pool;
 	LBMManager m_lbm_mgr;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval = 0.1f;
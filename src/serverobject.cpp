@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverobject.h"
 #include <fstream>
 #include "inventory.h"
+#include "serverenvironment.h"
 #include "constants.h" // BS
 #include "log.h"
 
@@ -30,6 +31,13 @@ ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 {
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	if (m_env)
+		m_env->updateActiveObjectPosition(getId(), pos);
+}
+
 ServerActiveObject* ServerActiveObject::create(ActiveObjectType type,
 		ServerEnvironment *env, u16 id, v3f pos,
 		const std::string &data)
@@ -558,6 +558,8 @@ fake_function() {
 	gettext("Time in between active block management cycles");
 	gettext("Active Block Modifier interval");
 	gettext("Length of time between ABM execution cycles");
+	gettext("ABM scan threads");
+	gettext("Number of threads used to find the nodes that ABMs act on.\nThe ABM actions themselves always run on the server thread.\nSet to 0 to choose an appropriate amount automatically.");
 	gettext("NodeTimer interval");
 	gettext("Length of time between NodeTimer execution cycles");
 	gettext("Ignore world errors");
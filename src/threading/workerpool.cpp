@@ -0,0 +1,98 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "threading/workerpool.h"
+#include "threading/thread.h"
+
+class WorkerPool::WorkerThread : public Thread
+{
+public:
+	WorkerThread(WorkerPool *pool, const std::string &name) :
+		Thread(name),
+		m_pool(pool)
+	{}
+
+	void *run()
+	{
+		while (true) {
+			m_pool->m_start.wait();
+			if (stopRequested())
+				break;
+			m_pool->work();
+			m_pool->m_done.post();
+		}
+		return nullptr;
+	}
+
+private:
+	WorkerPool *m_pool;
+};
+
+WorkerPool::WorkerPool(unsigned int num_threads, const std::string &name) :
+	m_next(0)
+{
+	for (unsigned int i = 1; i < num_threads; i++) {
+		WorkerThread *thread = new WorkerThread(this, name + std::to_string(i));
+		thread->start();
+		m_threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for (WorkerThread *thread : m_threads)
+		thread->stop();
+	m_start.post(m_threads.size());
+	for (WorkerThread *thread : m_threads) {
+		thread->wait();
+		delete thread;
+	}
+}
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)> &f)
+{
+	if (count == 0)
+		return;
+
+	// Don't wait for another thread's loop, that would leave this one idle
+	std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+	if (m_threads.empty() || count == 1 || !lock.owns_lock()) {
+		for (size_t i = 0; i < count; i++)
+			f(i);
+		return;
+	}
+
+	m_job = &f;
+	m_count = count;
+	m_next = 0;
+
+	m_start.post(m_threads.size());
+	work();
+	for (size_t i = 0; i < m_threads.size(); i++)
+		m_done.wait();
+
+	m_job = nullptr;
+}
+
+void WorkerPool::work()
+{
+	size_t i;
+	while ((i = m_next++) < m_count)
+		(*m_job)(i);
+}
@@ -0,0 +1,68 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "threading/semaphore.h"
+#include "util/basic_macros.h"
+
+/** A fixed set of threads for splitting loops over independent items.
+ *
+ * The calling thread takes part in the work, so a pool created with
+ * num_threads == 1 starts no threads at all and runs everything inline.
+ * The pool can be shared by several threads: while one of them is in
+ * parallelFor(), the loops of the others run on their own thread only.
+ */
+class WorkerPool
+{
+public:
+	WorkerPool(unsigned int num_threads, const std::string &name);
+	~WorkerPool();
+
+	DISABLE_CLASS_COPY(WorkerPool);
+
+	/*
+	 * Calls f(i) for every i in [0, count) and returns once all calls
+	 * have finished. The calls may happen on any thread in any order.
+	 * f must not use the pool itself.
+	 */
+	void parallelFor(size_t count, const std::function<void(size_t)> &f);
+
+	unsigned int getThreadCount() const { return m_threads.size() + 1; }
+
+private:
+	class WorkerThread;
+
+	void work();
+
+	std::vector<WorkerThread *> m_threads;
+	// Held by the thread the workers currently help
+	std::mutex m_mutex;
+	Semaphore m_start;
+	Semaphore m_done;
+
+	const std::function<void(size_t)> *m_job = nullptr;
+	size_t m_count = 0;
+	std::atomic<size_t> m_next;
+};
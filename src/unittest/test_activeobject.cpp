@@ -19,7 +19,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "test.h"
 
+#include <cmath>
+#include <sstream>
 #include "activeobject.h"
+#include "genericobject.h"
+#include "util/serialize.h"
 
 class TestActiveObject : public TestBase
 {
@@ -30,6 +34,7 @@ class TestActiveObject : public TestBase
 	void runTests(IGameDef *gamedef);
 
 	void testAOAttributes();
+	void testPositionUpdates();
 };
 
 static TestActiveObject g_test_instance;
@@ -37,6 +42,7 @@ static TestActiveObject g_test_instance;
 void TestActiveObject::runTests(IGameDef *gamedef)
 {
 	TEST(testAOAttributes);
+	TEST(testPositionUpdates);
 }
 
 class TestAO : public ActiveObject
@@ -58,3 +64,69 @@ void TestActiveObject::testAOAttributes()
 	ao.setId(558);
 	UASSERT(ao.getId() == 558);
 }
+
+void TestActiveObject::testPositionUpdates()
+{
+	GenericPosition pos;
+	pos.position = v3f(1000.5f, -20.25f, 33.0f);
+	pos.velocity = v3f(10.0f, 0.0f, -3.5f);
+	pos.acceleration = v3f(0.0f, -98.0f, 0.0f);
+	pos.yaw = 90.0f;
+	pos.do_interpolate = true;
+	pos.update_interval = 0.2f;
+
+	std::string data = gob_cmd_update_position(pos.position, pos.velocity,
+		pos.acceleration, pos.yaw, pos.do_interpolate, pos.is_movement_end,
+		pos.update_interval);
+	std::istringstream is(data, std::ios::binary);
+	UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION);
+	GenericPosition full = gob_read_update_position(is);
+	UASSERT(full.position == pos.position);
+	UASSERT(full.velocity == pos.velocity);
+	UASSERT(full.acceleration == pos.acceleration);
+	UASSERT(full.yaw == pos.yaw);
+
+	GenericPositionReference ref;
+	ref.number = 3;
+	ref.pos = full;
+	is.str(gob_cmd_update_position_reference(ref));
+	is.clear();
+	UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_REFERENCE);
+	GenericPositionReference ref_read = gob_read_update_position_reference(is);
+	UASSERT(ref_read.number == 3);
+	UASSERT(ref_read.pos.position == ref.pos.position);
+
+	// Small movements are sent relative to the reference
+	GenericPosition moved = full;
+	moved.position += v3f(3.3f, -1.0f, 0.1f);
+	moved.velocity = v3f(11.0f, 0.0f, -3.5f);
+	moved.yaw = 120.0f;
+	moved.is_movement_end = true;
+	std::string delta = gob_cmd_update_position_delta(ref, moved);
+	UASSERT(!delta.empty());
+	UASSERT(delta.size() < data.size() / 2);
+
+	is.str(delta);
+	is.clear();
+	UASSERT(readU8(is) == GENERIC_CMD_UPDATE_POSITION_DELTA);
+	GenericPosition decoded;
+	UASSERT(gob_read_update_position_delta(is, ref, decoded));
+	UASSERT(decoded.position.getDistanceFrom(moved.position) < 0.05f);
+	UASSERT(decoded.velocity.getDistanceFrom(moved.velocity) < 0.05f);
+	UASSERT(decoded.acceleration == ref.pos.acceleration);
+	UASSERT(std::fabs(decoded.yaw - moved.yaw) < 0.01f);
+	UASSERT(decoded.do_interpolate && decoded.is_movement_end);
+	UASSERT(std::fabs(decoded.update_interval - 0.2f) < 0.001f);
+
+	// Updates for another reference are dropped
+	GenericPositionReference other = ref;
+	other.number++;
+	is.str(delta);
+	is.clear();
+	readU8(is);
+	UASSERT(!gob_read_update_position_delta(is, other, decoded));
+
+	// Far movements need a new reference
+	moved.position.X += 2000.0f;
+	UASSERT(gob_cmd_update_position_delta(ref, moved).empty());
+}
@@ -0,0 +1,246 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include <limits>
+#include "constants.h"
+#include "server/activeobjectindex.h"
+#include "server/activeobjectinterest.h"
+
+class TestActiveObjectIndex : public TestBase
+{
+public:
+	TestActiveObjectIndex() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestActiveObjectIndex"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testRadius();
+	void testArea();
+	void testUpdate();
+	void testCellChanges();
+	void testInterest();
+	void testInterestInsertRemove();
+};
+
+static TestActiveObjectIndex g_test_instance;
+
+void TestActiveObjectIndex::runTests(IGameDef *gamedef)
+{
+	TEST(testRadius);
+	TEST(testArea);
+	TEST(testUpdate);
+	TEST(testCellChanges);
+	TEST(testInterest);
+	TEST(testInterestInsertRemove);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::vector<u16> sorted(std::vector<u16> ids)
+{
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+void TestActiveObjectIndex::testRadius()
+{
+	ActiveObjectIndex index;
+	index.insert(1, v3f(0, 0, 0));
+	index.insert(2, v3f(5 * BS, 0, 0));
+	// Other side of a cell border
+	index.insert(3, v3f(-1 * BS, 0, 0));
+	index.insert(4, v3f(100 * BS, 0, -100 * BS));
+
+	std::vector<u16> ids;
+	index.getObjectsInsideRadius(v3f(0, 0, 0), 5 * BS, ids);
+	UASSERT(ids == std::vector<u16>({1, 2, 3}));
+
+	ids.clear();
+	index.getObjectsInsideRadius(v3f(100 * BS, 0, -100 * BS), 1, ids);
+	UASSERT(ids == std::vector<u16>({4}));
+
+	// Very large radius takes the full scan path
+	ids.clear();
+	index.getObjectsInsideRadius(v3f(0, 0, 0), 1e9, ids);
+	UASSERT(ids == std::vector<u16>({1, 2, 3, 4}));
+
+	// NaN matches nothing, also not an object at a NaN position
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	index.insert(5, v3f(nan, 0, 0));
+	ids.clear();
+	index.getObjectsInsideRadius(v3f(0, 0, 0), nan, ids);
+	index.getObjectsInsideRadius(v3f(0, nan, 0), 5 * BS, ids);
+	index.getObjectsInsideRadius(v3f(nan, 0, 0), 1e9, ids);
+	UASSERT(ids.empty());
+}
+
+void TestActiveObjectIndex::testArea()
+{
+	ActiveObjectIndex index;
+	index.insert(1, v3f(0, 0, 0));
+	index.insert(2, v3f(20 * BS, 20 * BS, 20 * BS));
+	index.insert(3, v3f(40 * BS, 0, 0));
+
+	std::vector<u16> ids;
+	index.getObjectsInArea(aabb3f(v3f(-BS, -BS, -BS),
+		v3f(20 * BS, 20 * BS, 20 * BS)), ids);
+	UASSERT(ids == std::vector<u16>({1, 2}));
+
+	ids.clear();
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	index.getObjectsInArea(aabb3f(v3f(-BS, nan, -BS),
+		v3f(20 * BS, 20 * BS, 20 * BS)), ids);
+	UASSERT(ids.empty());
+}
+
+void TestActiveObjectIndex::testUpdate()
+{
+	ActiveObjectIndex index;
+	index.insert(1, v3f(0, 0, 0));
+	index.insert(2, v3f(0, 0, 0));
+
+	// Move object 1 a few cells away
+	index.update(1, v3f(64 * BS, 0, 0));
+	std::vector<u16> ids;
+	index.getObjectsInsideRadius(v3f(0, 0, 0), 10 * BS, ids);
+	UASSERT(ids == std::vector<u16>({2}));
+
+	ids.clear();
+	index.getObjectsInsideRadius(v3f(64 * BS, 0, 0), 10 * BS, ids);
+	UASSERT(ids == std::vector<u16>({1}));
+
+	// Updating unknown ids is a no-op
+	index.update(7, v3f(0, 0, 0));
+	UASSERT(!index.contains(7));
+
+	index.remove(2);
+	UASSERTEQ(size_t, index.size(), 1);
+	ids.clear();
+	index.getObjectsInsideRadius(v3f(0, 0, 0), 10 * BS, ids);
+	UASSERT(ids.empty());
+}
+
+void TestActiveObjectIndex::testCellChanges()
+{
+	ActiveObjectIndex index;
+	index.insert(1, v3f(0, 0, 0));
+	index.setRecordCellChanges(true);
+
+	// Moving inside a cell is no change
+	index.update(1, v3f(BS, BS, BS));
+	index.update(1, v3f(-20 * BS, 0, 40 * BS));
+	index.insert(2, v3f(0, 0, 0));
+	index.remove(1);
+
+	std::vector<ActiveObjectIndex::CellChange> changes;
+	index.takeCellChanges(changes);
+	UASSERTEQ(size_t, changes.size(), 3);
+	UASSERT(changes[0].id == 1);
+	UASSERT(changes[0].from == v3s16(0, 0, 0));
+	UASSERT(changes[0].to == v3s16(-2, 0, 2));
+	UASSERT(changes[1].id == 2);
+	UASSERT(changes[1].from == ActiveObjectIndex::NO_CELL);
+	UASSERT(changes[2].id == 1);
+	UASSERT(changes[2].to == ActiveObjectIndex::NO_CELL);
+
+	index.takeCellChanges(changes);
+	UASSERT(changes.empty());
+
+	const std::vector<u16> *ids = index.getCellObjects(v3s16(0, 0, 0));
+	UASSERT(ids && *ids == std::vector<u16>({2}));
+	UASSERT(!index.getCellObjects(v3s16(-2, 0, 2)));
+}
+
+void TestActiveObjectIndex::testInterest()
+{
+	const float cell = MAP_BLOCKSIZE * BS;
+	ActiveObjectIndex index;
+	ActiveObjectInterest interest(index);
+	index.insert(1, v3f(0, 0, 0));
+	index.insert(2, v3f(3 * cell, 0, 0));
+	index.insert(3, v3f(-10 * cell, 0, 0));
+
+	// A new client gets everything in its area
+	std::vector<u16> changed;
+	interest.update(1, v3f(0, 0, 0), 3 * cell, changed);
+	UASSERT(sorted(changed) == std::vector<u16>({1, 2}));
+	UASSERT(interest.isInArea(1, v3f(0, 0, 3 * cell)));
+	UASSERT(!interest.isInArea(1, v3f(2 * cell, 3 * cell, 0)));
+	UASSERT(!interest.isInArea(2, v3f(0, 0, 0)));
+
+	// Nothing to do while nothing crosses a cell border
+	changed.clear();
+	index.update(1, v3f(BS, 0, 0));
+	interest.update(1, v3f(2 * BS, 0, 0), 3 * cell, changed);
+	UASSERT(changed.empty());
+
+	// Objects entering and leaving the area
+	index.update(3, v3f(-2 * cell, 0, 0));
+	index.update(2, v3f(4 * cell, 0, 0));
+	index.update(1, v3f(cell, 0, 0));
+	interest.dispatchCellChanges();
+	interest.update(1, v3f(0, 0, 0), 3 * cell, changed);
+	UASSERT(sorted(changed) == std::vector<u16>({2, 3}));
+
+	// The client moving: object 3 leaves, 2 enters
+	changed.clear();
+	interest.update(1, v3f(2 * cell, 0, 0), 3 * cell, changed);
+	UASSERT(sorted(changed) == std::vector<u16>({2, 3}));
+
+	// Changes are handed over before the area moves
+	changed.clear();
+	index.update(2, v3f(10 * cell, 0, 0));
+	interest.update(1, v3f(-5 * cell, 0, 0), 3 * cell, changed);
+	UASSERT(std::find(changed.begin(), changed.end(), 2) != changed.end());
+
+	changed.clear();
+	interest.objectChanged(3, v3f(-2 * cell, 0, 0));
+	interest.objectChanged(2, v3f(10 * cell, 0, 0));
+	interest.update(1, v3f(-5 * cell, 0, 0), 3 * cell, changed);
+	UASSERT(changed == std::vector<u16>({3}));
+
+	interest.removeClient(1);
+	UASSERT(!interest.isInArea(1, v3f(-5 * cell, 0, 0)));
+}
+
+void TestActiveObjectIndex::testInterestInsertRemove()
+{
+	const float cell = MAP_BLOCKSIZE * BS;
+	ActiveObjectIndex index;
+	ActiveObjectInterest interest(index);
+
+	std::vector<u16> changed;
+	interest.update(1, v3f(0, 0, 0), 3 * cell, changed);
+	UASSERT(changed.empty());
+
+	// Objects appearing in and vanishing from the area are reported
+	index.insert(1, v3f(cell, 0, 0));
+	index.insert(2, v3f(20 * cell, 0, 0));
+	interest.update(1, v3f(0, 0, 0), 3 * cell, changed);
+	UASSERT(changed == std::vector<u16>({1}));
+
+	changed.clear();
+	index.remove(1);
+	index.remove(2);
+	interest.update(1, v3f(0, 0, 0), 3 * cell, changed);
+	UASSERT(changed == std::vector<u16>({1}));
+}
@@ -37,6 +37,7 @@ class TestCompression : public TestBase {
 	void testRLECompression();
 	void testZlibCompression();
 	void testZlibLargeData();
+	void testBlockCompression();
 };
 
 static TestCompression g_test_instance;
@@ -46,6 +47,7 @@ void TestCompression::runTests(IGameDef *gamedef)
 	TEST(testRLECompression);
 	TEST(testZlibCompression);
 	TEST(testZlibLargeData);
+	TEST(testBlockCompression);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -170,3 +172,42 @@ void TestCompression::testZlibLargeData()
 				i, str_decompressed[i], i, data_in[i]);
 	}
 }
+
+void TestCompression::testBlockCompression()
+{
+	std::string data_in(20000, '\0');
+	PseudoRandom pseudorandom(1234);
+	for (u32 i = 0; i < data_in.size(); i++)
+		data_in[i] = pseudorandom.range(0, 3);
+
+	UASSERT(isBlockCompressionSupported(BLOCK_COMPRESSION_ZLIB));
+	UASSERT(isBlockCompressionSupported(getDefaultBlockCompression()));
+	UASSERT(!isBlockCompressionSupported(BLOCK_COMPRESSION_MAX));
+
+	for (u8 compression = 0; compression < BLOCK_COMPRESSION_MAX; compression++) {
+		u8 parsed;
+		UASSERT(parseBlockCompressionName(
+			getBlockCompressionName(compression), &parsed));
+		UASSERTEQ(int, parsed, compression);
+
+		if (!isBlockCompressionSupported(compression))
+			continue;
+
+		// Two streams back to back, like node data and metadata in a block
+		std::ostringstream os(std::ios_base::binary);
+		compressBlockData(data_in, os, compression);
+		compressBlockData("", os, compression);
+		os << "end";
+
+		std::istringstream is(os.str(), std::ios_base::binary);
+		std::ostringstream os1(std::ios_base::binary), os2(std::ios_base::binary);
+		decompressBlockData(is, os1, compression);
+		decompressBlockData(is, os2, compression);
+		UASSERT(os1.str() == data_in);
+		UASSERT(os2.str().empty());
+
+		std::string rest;
+		is >> rest;
+		UASSERTEQ(std::string, rest, "end");
+	}
+}
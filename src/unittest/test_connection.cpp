@@ -23,7 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "porting.h"
 #include "settings.h"
 #include "util/serialize.h"
+#include "network/congestion.h"
 #include "network/connection.h"
+#include "network/networkexceptions.h"
 #include "network/networkpacket.h"
 #include "network/socket.h"
 
@@ -40,7 +42,11 @@ class TestConnection : public TestBase {
 	void runTests(IGameDef *gamedef);
 
 	void testHelpers();
+	void testReliablePacketBuffer();
+	void testSendCopies();
+	void testCongestionControl();
 	void testConnectSendReceive();
+	void testShardedConnection();
 };
 
 static TestConnection g_test_instance;
@@ -48,7 +54,11 @@ static TestConnection g_test_instance;
 void TestConnection::runTests(IGameDef *gamedef)
 {
 	TEST(testHelpers);
+	TEST(testReliablePacketBuffer);
+	TEST(testSendCopies);
+	TEST(testCongestionControl);
 	TEST(testConnectSendReceive);
+	TEST(testShardedConnection);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -84,7 +94,7 @@ void TestConnection::testHelpers()
 	u32 proto_id = 0x12345678;
 	session_t peer_id = 123;
 	u8 channel = 2;
-	SharedBuffer<u8> data1(1);
+	PacketBuffer data1(1, RELIABLE_HEADROOM);
 	data1[0] = 100;
 	Address a(127,0,0,1, 10);
 	const u16 seqnum = 34352;
@@ -107,7 +117,8 @@ void TestConnection::testHelpers()
 
 	//infostream<<"initial data1[0]="<<((u32)data1[0]&0xff)<<std::endl;
 
-	SharedBuffer<u8> p2 = con::makeReliablePacket(data1, seqnum);
+	// The headers of p1 took the free space, so this one copies the data
+	PacketBuffer p2 = con::makeReliablePacket(data1, seqnum);
 
 	/*infostream<<"p2.getSize()="<<p2.getSize()<<", data1.getSize()="
 			<<data1.getSize()<<std::endl;
@@ -119,8 +130,214 @@ void TestConnection::testHelpers()
 	UASSERT(readU8(&p2[0]) == con::PACKET_TYPE_RELIABLE);
 	UASSERT(readU16(&p2[1]) == seqnum);
 	UASSERT(readU8(&p2[3]) == data1[0]);
+	UASSERT(readU8(&p1.data[7]) == data1[0]);
+	UASSERT(data1.getSize() == 1);
+
+	std::vector<PacketBuffer> originals;
+	originals.emplace_back(2, 0);
+	originals.back()[0] = con::PACKET_TYPE_ORIGINAL;
+	originals.back()[1] = 42;
+	originals.emplace_back(1, 0);
+	originals.back()[0] = con::PACKET_TYPE_ORIGINAL;
+	PacketBuffer p3 = con::makeBundlePacket(originals);
+
+	UASSERT(p3.getSize() == 1 + (2 + 2) + (2 + 1));
+	UASSERT(readU8(&p3[0]) == con::PACKET_TYPE_BUNDLE);
+	UASSERT(readU16(&p3[1]) == 2);
+	UASSERT(readU8(&p3[3]) == con::PACKET_TYPE_ORIGINAL);
+	UASSERT(readU8(&p3[4]) == 42);
+	UASSERT(readU16(&p3[5]) == 1);
+	UASSERT(readU8(&p3[7]) == con::PACKET_TYPE_ORIGINAL);
 }
 
+static con::BufferedPacket makeReliableBufferedPacket(u16 seqnum)
+{
+	PacketBuffer data(1, RELIABLE_HEADROOM);
+	data[0] = seqnum & 0xff;
+	Address a(127,0,0,1, 10);
+	return con::makePacket(a, con::makeReliablePacket(data, seqnum),
+			0x12345678, 123, 0);
+}
+
+void TestConnection::testReliablePacketBuffer()
+{
+	con::ReliablePacketBuffer buffer;
+	u16 seqnum;
+	UASSERT(buffer.empty());
+	UASSERT(!buffer.getFirstSeqnum(seqnum));
+
+	// Insert out of order and across the seqnum wrap around
+	const u16 next_expected = 65500;
+	const u16 seqnums[] = {65510, 65535, 3, 65501, 200, 0};
+	for (u16 s : seqnums) {
+		con::BufferedPacket p = makeReliableBufferedPacket(s);
+		buffer.insert(p, next_expected);
+	}
+	// Resent packets are ignored
+	con::BufferedPacket dup = makeReliableBufferedPacket(3);
+	buffer.insert(dup, next_expected);
+	UASSERTEQ(u32, buffer.size(), 6);
+	UASSERT(buffer.containsPacket(200));
+	UASSERT(!buffer.containsPacket(4));
+
+	UASSERT(buffer.getFirstSeqnum(seqnum));
+	UASSERTEQ(u16, seqnum, 65501);
+
+	// Timeouts only return packets not sent for long enough
+	buffer.incrementTimeouts(0.5f);
+	con::BufferedPacket late = makeReliableBufferedPacket(100);
+	buffer.insert(late, next_expected);
+	buffer.incrementTimeouts(0.6f);
+	std::list<con::BufferedPacket> timed_outs = buffer.getTimedOuts(1.0f, 100);
+	UASSERTEQ(size_t, timed_outs.size(), 6);
+	for (const con::BufferedPacket &p : timed_outs)
+		UASSERT(readU16(&p.data[BASE_HEADER_SIZE + 1]) != 100);
+	UASSERTEQ(size_t, buffer.getTimedOuts(1.0f, 100).size(), 0);
+	buffer.incrementTimeouts(0.5f);
+	timed_outs = buffer.getTimedOuts(1.0f, 100);
+	UASSERTEQ(size_t, timed_outs.size(), 1);
+	UASSERTEQ(u16, readU16(&timed_outs.front().data[BASE_HEADER_SIZE + 1]), 100);
+
+	// Acks may come in any order
+	con::BufferedPacket acked = buffer.popSeqnum(200);
+	UASSERTEQ(u16, readU16(&acked.data[BASE_HEADER_SIZE + 1]), 200);
+	UASSERT(acked.totaltime > 1.5f);
+	buffer.popSeqnum(3);
+	UASSERT(!buffer.containsPacket(3));
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popSeqnum(3));
+
+	const u16 expected[] = {65501, 65510, 65535, 0, 100};
+	for (u16 s : expected) {
+		UASSERT(buffer.getFirstSeqnum(seqnum));
+		UASSERTEQ(u16, seqnum, s);
+		con::BufferedPacket p = buffer.popFirst();
+		UASSERTEQ(u16, readU16(&p.data[BASE_HEADER_SIZE + 1]), s);
+	}
+	UASSERT(buffer.empty());
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popFirst());
+}
+
+void TestConnection::testSendCopies()
+{
+	/*
+		Follow a reliable packet from NetworkPacket to wire format the way
+		ConnectionCommand::send() and UDPPeer::processReliableSendCommand()
+		do for a few peers, and check where the data is copied on the way.
+	*/
+	Address a(127,0,0,1, 10);
+	const u32 chunksize_max = 512 - BASE_HEADER_SIZE - RELIABLE_HEADER_SIZE;
+	const u32 peer_count = 4;
+	const u32 sizes[] = {100, 30000};
+
+	for (u32 size : sizes) {
+		NetworkPacket pkt(0x42, size);
+		for (u32 i = 0; i < size; i++)
+			pkt << (u8)i;
+
+		PacketBuffer forged = pkt.forgePacket();
+		UASSERTEQ(u32, forged.getSize(), size + 2);
+		UASSERTEQ(u16, readU16(&forged[0]), 0x42);
+
+		for (u32 peer = 0; peer < peer_count; peer++) {
+			std::list<PacketBuffer> originals;
+			u16 split_seqnum = 0;
+			con::makeAutoSplitPacket(forged, chunksize_max, split_seqnum,
+					&originals);
+			// The headers of an unsplit packet fit in front of its data
+			// once, the other peers get a copy
+			if (size < chunksize_max) {
+				UASSERTEQ(size_t, originals.size(), 1);
+				UASSERT((*originals.front() + ORIGINAL_HEADER_SIZE ==
+						*forged) == (peer == 0));
+			}
+
+			// Split packets are copied into their chunks, the reliable and
+			// base headers are written in front of the chunk or original
+			u16 seqnum = 65500;
+			for (const PacketBuffer &original : originals) {
+				PacketBuffer reliable = con::makeReliablePacket(original, seqnum++);
+				con::BufferedPacket p = con::makePacket(a, reliable,
+						0x12345678, peer + 2, 0);
+				UASSERT(p.data.getSize() <= 512);
+				UASSERT(readU8(&p.data[BASE_HEADER_SIZE]) ==
+						con::PACKET_TYPE_RELIABLE);
+				UASSERT(*reliable + RELIABLE_HEADER_SIZE == *original);
+				UASSERT(*p.data + BASE_HEADER_SIZE == *reliable);
+			}
+		}
+	}
+
+	// Writing to the packet doesn't change what was forged before
+	NetworkPacket pkt(0x42, 0);
+	pkt << (u8)1;
+	PacketBuffer forged = pkt.forgePacket();
+	pkt << (u8)2;
+	UASSERTEQ(u32, forged.getSize(), 3);
+	UASSERTEQ(u32, pkt.forgePacket().getSize(), 4);
+	UASSERTEQ(u8, forged[2], 1);
+}
+
+void TestConnection::testCongestionControl()
+{
+	con::CongestionController *controller =
+		con::CongestionController::create("loss");
+	UASSERT(controller);
+	UASSERT(strcmp(controller->getName(), "loss") == 0);
+	UASSERTEQ(float, controller->getPacingRate(), 0.0f);
+	delete controller;
+	UASSERT(!con::CongestionController::create("nonexistent"));
+
+	// Slow start doubles the window every round trip
+	con::LedbatController ledbat(16);
+	UASSERTEQ(float, ledbat.getPacingRate(), 0.0f);
+	for (int i = 0; i < 16; i++)
+		ledbat.onAck(512, 0.05f, 16);
+	UASSERTEQ(u32, ledbat.getWindow(), 32);
+	UASSERT(ledbat.getPacingRate() > 0.0f);
+
+	// A window that isn't used doesn't grow
+	ledbat.onAck(512, 0.05f, 1);
+	UASSERTEQ(u32, ledbat.getWindow(), 32);
+
+	// Queuing delay above the target ends the slow start and shrinks it
+	for (int i = 0; i < 200; i++)
+		ledbat.onAck(512, 0.3f, ledbat.getWindow());
+	UASSERT(std::fabs(ledbat.getQueuingDelay() - 0.25f) < 0.001f);
+	u32 window = ledbat.getWindow();
+	UASSERT(window < 32);
+
+	// Losses halve it, once per round trip
+	ledbat.step(1.0f);
+	ledbat.onLoss(3);
+	UASSERT(ledbat.getWindow() < window);
+	window = ledbat.getWindow();
+	ledbat.onLoss(1);
+	UASSERTEQ(u32, ledbat.getWindow(), window);
+
+	// Below the target delay it grows again
+	for (int i = 0; i < 500; i++)
+		ledbat.onAck(512, 0.05f, ledbat.getWindow());
+	UASSERT(ledbat.getQueuingDelay() < 0.001f);
+	UASSERT(ledbat.getWindow() > window);
+
+	// Pacing with 100 KB/s, the bucket holds 1500 bytes
+	con::Pacer pacer;
+	pacer.consume(100000);
+	UASSERT(pacer.canSend());
+	pacer.setRate(100000.0f);
+	pacer.consume(1000);
+	UASSERT(pacer.canSend());
+	pacer.consume(1000);
+	UASSERT(!pacer.canSend());
+	UASSERT(std::fabs(pacer.getWaitTime() - 0.005f) < 0.0001f);
+	pacer.update(0.01f);
+	UASSERT(pacer.canSend());
+	pacer.update(1.0f);
+	pacer.consume(1500);
+	UASSERT(!pacer.canSend());
+	pacer.setRate(0.0f);
+	UASSERT(pacer.canSend());
+}
 
 void TestConnection::testConnectSendReceive()
 {
@@ -335,9 +552,210 @@ void TestConnection::testConnectSendReceive()
 		UASSERT(peer_id == PEER_ID_SERVER);
 	}
 
+	/*
+		Send small packets, which get bundled
+	*/
+	{
+		server.EnablePeerBundling(peer_id_client);
+		const u8 count = 50;
+		for (u8 i = 0; i < count; i++) {
+			NetworkPacket pkt(0, 8);
+			pkt << i << (u32) i * 1000;
+			server.Send(peer_id_client, 0, &pkt, true);
+		}
+
+		u8 received = 0;
+		u64 timems0 = porting::getTimeMs();
+		while (received < count && porting::getTimeMs() - timems0 < 5000) {
+			try {
+				NetworkPacket pkt;
+				client.Receive(&pkt);
+				u8 i;
+				u32 value;
+				pkt >> i >> value;
+				UASSERT(pkt.getPeerId() == PEER_ID_SERVER);
+				UASSERT(i == received);
+				UASSERT(value == (u32) i * 1000);
+				received++;
+			} catch (con::NoIncomingDataException &e) {
+			}
+		}
+		UASSERT(received == count);
+	}
+
+	/*
+		Send over a lossy link, the lost packets are resent
+	*/
+	{
+		server.SetSimulatedPacketLoss(0.1f);
+		const u8 count = 40;
+		for (u8 i = 0; i < count; i++) {
+			NetworkPacket pkt(0, 2000);
+			pkt << i;
+			server.Send(peer_id_client, 0, &pkt, true);
+		}
+
+		u8 received = 0;
+		u64 timems0 = porting::getTimeMs();
+		while (received < count && porting::getTimeMs() - timems0 < 10000) {
+			try {
+				NetworkPacket pkt;
+				client.Receive(&pkt);
+				u8 i;
+				pkt >> i;
+				UASSERT(pkt.getSize() == 2000);
+				UASSERT(i == received);
+				received++;
+			} catch (con::NoIncomingDataException &e) {
+			}
+		}
+		server.SetSimulatedPacketLoss(0.0f);
+		infostream << "** Lossy link: "
+			<< server.getPeerStat(peer_id_client, con::PACKETS_LOST)
+			<< " packets lost, window "
+			<< server.getPeerStat(peer_id_client, con::CONGESTION_WINDOW)
+			<< std::endl;
+
+		UASSERT(received == count);
+		UASSERT(server.getPeerStat(peer_id_client, con::PACKETS_LOST) > 0);
+		UASSERT(server.getPeerStat(peer_id_client, con::CONGESTION_WINDOW) > 0);
+	}
+
 	// Check peer handlers
 	UASSERT(hand_client.count == 1);
 	UASSERT(hand_client.last_id == 1);
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id == 2);
 }
+
+void TestConnection::testShardedConnection()
+{
+	/*
+		Serve several clients with more than one send and receive thread
+	*/
+
+	std::string send_threads = g_settings->get("connection_send_threads");
+	std::string receive_threads = g_settings->get("connection_receive_threads");
+	g_settings->set("connection_send_threads", "3");
+	g_settings->set("connection_receive_threads", "2");
+
+	u32 proto_id = 0xad26846a;
+	const u32 client_count = 4;
+	const u16 packet_count = 20;
+
+	Handler hand_server("server");
+	Handler hand_client("client");
+
+	Address address(0, 0, 0, 0, 30002);
+	Address server_address(127, 0, 0, 1, 30002);
+	std::string bind_str = g_settings->get("bind_address");
+	try {
+		Address bind_addr(0, 0, 0, 0, 30002);
+		bind_addr.Resolve(bind_str.c_str());
+
+		if (!bind_addr.isIPv6() && bind_addr != address) {
+			address = bind_addr;
+			server_address = bind_addr;
+		}
+	} catch (ResolveError &e) {
+	}
+
+	con::Connection server(proto_id, 512, 5.0, false, &hand_server);
+	server.Serve(address);
+	sleep_ms(50);
+
+	std::vector<std::unique_ptr<con::Connection>> clients;
+	for (u32 i = 0; i < client_count; i++) {
+		clients.emplace_back(new con::Connection(proto_id, 512, 5.0, false,
+			&hand_client));
+		clients.back()->Connect(server_address);
+	}
+
+	// Wait until all clients know their peer id
+	u64 timems0 = porting::getTimeMs();
+	for (;;) {
+		bool connected = true;
+		for (auto &client : clients) {
+			try {
+				NetworkPacket pkt;
+				client->Receive(&pkt);
+			} catch (con::NoIncomingDataException &e) {
+			}
+			connected = connected && client->Connected();
+		}
+		try {
+			NetworkPacket pkt;
+			server.Receive(&pkt);
+		} catch (con::NoIncomingDataException &e) {
+		}
+		if (connected || porting::getTimeMs() - timems0 > 5000)
+			break;
+		sleep_ms(10);
+	}
+	// The threads have been made by now
+	g_settings->set("connection_send_threads", send_threads);
+	g_settings->set("connection_receive_threads", receive_threads);
+	UASSERT(hand_client.count == (s32)client_count);
+
+	for (u32 i = 0; i < client_count; i++) {
+		for (u16 j = 0; j < packet_count; j++) {
+			NetworkPacket pkt(0, 3);
+			pkt << (u8)i << j;
+			clients[i]->Send(PEER_ID_SERVER, 0, &pkt, true);
+		}
+	}
+
+	// Every client's packets come in order, whichever threads handle it
+	std::map<session_t, u16> next_packet;
+	std::map<session_t, u8> client_of_peer;
+	u32 received = 0;
+	timems0 = porting::getTimeMs();
+	while (received < client_count * packet_count &&
+			porting::getTimeMs() - timems0 < 5000) {
+		try {
+			NetworkPacket pkt;
+			server.Receive(&pkt);
+			if (pkt.getSize() < 3)
+				continue;
+			u8 client;
+			u16 j;
+			pkt >> client >> j;
+			UASSERT(j == next_packet[pkt.getPeerId()]);
+			next_packet[pkt.getPeerId()]++;
+			client_of_peer[pkt.getPeerId()] = client;
+			received++;
+		} catch (con::NoIncomingDataException &e) {
+			sleep_ms(10);
+		}
+	}
+	UASSERT(received == client_count * packet_count);
+	UASSERT(client_of_peer.size() == client_count);
+	UASSERT(hand_server.count == (s32)client_count);
+
+	// Replies reach the right clients
+	for (auto &it : client_of_peer) {
+		NetworkPacket pkt(0, 1);
+		pkt << it.second;
+		server.Send(it.first, 0, &pkt, true);
+	}
+
+	for (u32 i = 0; i < client_count; i++) {
+		bool replied = false;
+		timems0 = porting::getTimeMs();
+		while (!replied && porting::getTimeMs() - timems0 < 5000) {
+			try {
+				NetworkPacket pkt;
+				clients[i]->Receive(&pkt);
+				if (pkt.getSize() < 1)
+					continue;
+				u8 client;
+				pkt >> client;
+				UASSERT(client == i);
+				replied = true;
+			} catch (con::NoIncomingDataException &e) {
+				sleep_ms(10);
+			}
+		}
+		UASSERT(replied);
+	}
+}
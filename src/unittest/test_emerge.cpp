@@ -0,0 +1,169 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include "emerge.h"
+#include "server.h"
+
+class TestEmerge : public TestBase
+{
+public:
+	TestEmerge() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestEmerge"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testPriorityOrder(Server *server);
+	void testCancel(Server *server);
+	void testCancelRange(Server *server);
+	void testReenqueue(Server *server);
+
+	// The emerge threads aren't started, these take their place
+	bool popBlock(EmergeManager &emerge, v3s16 *pos);
+	void checkQueueEmpty(EmergeManager &emerge);
+};
+
+static TestEmerge g_test_instance;
+
+void TestEmerge::runTests(IGameDef *gamedef)
+{
+	// The emerge manager takes its managers from the server, which isn't
+	// initialized further
+	Server server("fakeworld", SubgameSpec("fakespec", "fakespec"), true,
+		Address(), true, nullptr);
+
+	TEST(testPriorityOrder, &server);
+	TEST(testCancel, &server);
+	TEST(testCancelRange, &server);
+	TEST(testReenqueue, &server);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void dummy_callback(v3s16 blockpos, EmergeAction action, void *param)
+{
+}
+
+bool TestEmerge::popBlock(EmergeManager &emerge, v3s16 *pos)
+{
+	MutexAutoLock queuelock(emerge.m_queue_mutex);
+	BlockEmergeData bedata;
+	return emerge.popBlockEmergeData(pos, &bedata);
+}
+
+void TestEmerge::checkQueueEmpty(EmergeManager &emerge)
+{
+	v3s16 pos;
+	UASSERT(!popBlock(emerge, &pos));
+	UASSERT(emerge.m_blocks_enqueued.empty());
+	for (const auto &it : emerge.m_peer_queue_count)
+		UASSERTEQ(u16, it.second, 0);
+}
+
+void TestEmerge::testPriorityOrder(Server *server)
+{
+	EmergeManager emerge(server);
+	emerge.updatePriorities({{1, v3s16(0, 0, 0)}});
+
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(5, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(1, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, -1, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(3, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 1), true, true));
+	// Already enqueued
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(1, 0, 0), true, true));
+
+	// The nearest first, in the requested order among equally near ones
+	v3s16 pos;
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(1, 0, 0));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(0, -1, 0));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(0, 0, 1));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(3, 0, 0));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(5, 0, 0));
+	checkQueueEmpty(emerge);
+
+	// The player moving reorders what is left
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(10, 0, 0), true, true));
+	emerge.updatePriorities({{1, v3s16(9, 0, 0)}});
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(10, 0, 0));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(0, 0, 0));
+	checkQueueEmpty(emerge);
+}
+
+void TestEmerge::testCancel(Server *server)
+{
+	EmergeManager emerge(server);
+
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(1, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(2, v3s16(1, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmergeEx(v3s16(2, 0, 0), 1,
+		BLOCK_EMERGE_ALLOW_GEN | BLOCK_EMERGE_FORCE_QUEUE,
+		dummy_callback, nullptr));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(3, 0, 0), true, true));
+
+	emerge.cancelBlockEmerges(1);
+
+	// Peer 2 still waits for (1, 0, 0), and the callback for (2, 0, 0)
+	v3s16 pos;
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(1, 0, 0));
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(2, 0, 0));
+	checkQueueEmpty(emerge);
+
+	// Cancelling after a rebuild of the queue
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(2, v3s16(1, 0, 0), true, true));
+	emerge.cancelBlockEmerges(1);
+	emerge.updatePriorities({{2, v3s16(0, 0, 0)}});
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(1, 0, 0));
+	checkQueueEmpty(emerge);
+}
+
+void TestEmerge::testCancelRange(Server *server)
+{
+	EmergeManager emerge(server);
+
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(10, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(2, -2, 2), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 3, 0), true, true));
+
+	// Only the blocks out of range are cancelled
+	emerge.cancelBlockEmerges(1, v3s16(0, 0, 0), 2);
+
+	v3s16 pos;
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(2, -2, 2));
+	checkQueueEmpty(emerge);
+}
+
+void TestEmerge::testReenqueue(Server *server)
+{
+	EmergeManager emerge(server);
+
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 0), true, true));
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(1, 0, 0), true, true));
+	emerge.cancelBlockEmerges(1);
+	UASSERT(emerge.enqueueBlockEmerge(1, v3s16(0, 0, 0), true, true));
+
+	// The item left over from the first request is skipped
+	v3s16 pos;
+	UASSERT(popBlock(emerge, &pos) && pos == v3s16(0, 0, 0));
+	checkQueueEmpty(emerge);
+}
@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapgen/mapgen_v5.h"
 #include "util/sha1.h"
 #include "map_settings_manager.h"
+#include "emerge.h"
+#include "mapblock.h"
 
 class TestMapSettingsManager : public TestBase {
 public:
@@ -38,6 +40,7 @@ class TestMapSettingsManager : public TestBase {
 	void testMapSettingsManager();
 	void testMapMetaSaveLoad();
 	void testMapMetaFailures();
+	void testMapgenEdges();
 };
 
 static TestMapSettingsManager g_test_instance;
@@ -47,6 +50,7 @@ void TestMapSettingsManager::runTests(IGameDef *gamedef)
 	TEST(testMapSettingsManager);
 	TEST(testMapMetaSaveLoad);
 	TEST(testMapMetaFailures);
+	TEST(testMapgenEdges);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -259,3 +263,45 @@ void TestMapSettingsManager::testMapMetaFailures()
 	MapSettingsManager mgr2(&conf, test_mapmeta_path);
 	UASSERT(!mgr2.loadMapMeta());
 }
+
+
+// Same as ServerMap::blockpos_over_mapgen_limit()
+static bool over_mapgen_limit(s16 blockpos, s16 mapgen_limit)
+{
+	s16 limit_bp = rangelim(mapgen_limit, 0, MAX_MAP_GENERATION_LIMIT) /
+		MAP_BLOCKSIZE;
+	return blockpos < -limit_bp || blockpos > limit_bp;
+}
+
+
+void TestMapSettingsManager::testMapgenEdges()
+{
+	const s16 limits[] = {MAX_MAP_GENERATION_LIMIT, 31000, 1000, 100, 50};
+	const s16 chunksizes[] = {5, 3, 2, 1};
+
+	for (s16 limit : limits)
+	for (s16 chunksize : chunksizes) {
+		MapgenParams params;
+		params.mapgen_limit = limit;
+		params.chunksize = chunksize;
+
+		s16 edge_min, edge_max;
+		params.getMapgenEdges(&edge_min, &edge_max);
+		UASSERT(edge_min <= 0 && edge_max >= 0);
+
+		// The edges are the outer nodes of the outermost chunks, including
+		// the block around a chunk that is generated along with it, which
+		// initBlockMake() still accepts. The chunks beyond are refused.
+		s16 chunk_min = EmergeManager::getContainingChunk(
+			getNodeBlockPos(v3s16(edge_min, 0, 0)), chunksize).X;
+		s16 chunk_max = EmergeManager::getContainingChunk(
+			getNodeBlockPos(v3s16(edge_max, 0, 0)), chunksize).X;
+		UASSERTEQ(s16, chunk_min * MAP_BLOCKSIZE, edge_min);
+		UASSERTEQ(s32, (chunk_max + chunksize) * MAP_BLOCKSIZE - 1, edge_max);
+
+		UASSERT(!over_mapgen_limit(chunk_min - 1, limit));
+		UASSERT(!over_mapgen_limit(chunk_max + chunksize, limit));
+		UASSERT(over_mapgen_limit(chunk_min - chunksize - 1, limit));
+		UASSERT(over_mapgen_limit(chunk_max + 2 * chunksize, limit));
+	}
+}
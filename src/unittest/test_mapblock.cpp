@@ -0,0 +1,179 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include <sstream>
+#include "gamedef.h"
+#include "mapblock.h"
+#include "nameidmapping.h"
+#include "nodedef.h"
+
+class TestMapBlock : public TestBase
+{
+public:
+	TestMapBlock() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapBlock"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testContentIndex(IGameDef *gamedef);
+	void testNodeChanges(IGameDef *gamedef);
+	void testDeferredNodeIds(IGameDef *gamedef);
+};
+
+static TestMapBlock g_test_instance;
+
+void TestMapBlock::runTests(IGameDef *gamedef)
+{
+	TEST(testContentIndex, gamedef);
+	TEST(testNodeChanges, gamedef);
+	TEST(testDeferredNodeIds, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestMapBlock::testContentIndex(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode air(CONTENT_AIR);
+	MapNode stone(t_CONTENT_STONE);
+
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		block.getData()[i] = air;
+	block.setNode(v3s16(1, 2, 3), stone);
+
+	MapBlockContentIndex &index = block.getContentIndex();
+	UASSERT(index.isValid());
+	UASSERTEQ(size_t, index.getCounts().size(), 2);
+	UASSERTEQ(u16, index.getCount(CONTENT_AIR), MapBlock::nodecount - 1);
+	UASSERTEQ(u16, index.getCount(t_CONTENT_STONE), 1);
+	UASSERTEQ(u16, index.getCount(t_CONTENT_WATER), 0);
+
+	// Position lists are kept up to date once built
+	const std::vector<u16> &stones = block.getContentPositions(t_CONTENT_STONE);
+	UASSERTEQ(size_t, stones.size(), 1);
+	UASSERT(MapBlock::nodeIndexToPos(stones[0]) == v3s16(1, 2, 3));
+
+	block.setNode(v3s16(15, 0, 0), stone);
+	block.setNodeNoCheck(v3s16(0, 15, 15), stone);
+	block.setNode(v3s16(1, 2, 3), air);
+	UASSERTEQ(u16, index.getCount(t_CONTENT_STONE), 2);
+	UASSERTEQ(u16, index.getCount(CONTENT_AIR), MapBlock::nodecount - 2);
+	UASSERTEQ(size_t, stones.size(), 2);
+	UASSERT(std::is_sorted(stones.begin(), stones.end()));
+	UASSERT(MapBlock::nodeIndexToPos(stones[0]) == v3s16(15, 0, 0));
+	UASSERT(MapBlock::nodeIndexToPos(stones[1]) == v3s16(0, 15, 15));
+
+	// Content types disappear from the index when their last node is gone
+	block.setNode(v3s16(15, 0, 0), air);
+	block.setNode(v3s16(0, 15, 15), air);
+	UASSERTEQ(size_t, index.getCounts().size(), 1);
+	UASSERT(block.getContentPositions(t_CONTENT_STONE).empty());
+	UASSERTEQ(size_t, block.getContentPositions(CONTENT_AIR).size(),
+		MapBlock::nodecount);
+
+	// Bulk changes invalidate the index
+	block.reallocate();
+	UASSERT(!index.isValid());
+	UASSERTEQ(u16, block.getContentIndex().getCount(CONTENT_IGNORE),
+		MapBlock::nodecount);
+}
+
+void TestMapBlock::testNodeChanges(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode stone(t_CONTENT_STONE);
+	std::vector<u16> changed;
+
+	u64 v0 = block.getNodeVersion();
+	UASSERT(block.getChangedNodes(v0, changed));
+	UASSERT(changed.empty());
+
+	// Changes are sorted and only listed once
+	block.setNode(v3s16(3, 0, 0), stone);
+	block.setNodeNoCheck(v3s16(1, 0, 0), stone);
+	block.setNode(v3s16(3, 0, 0), stone);
+	u64 v1 = block.getNodeVersion();
+	UASSERT(v1 > v0);
+	UASSERT(block.getChangedNodes(v0, changed));
+	UASSERTEQ(size_t, changed.size(), 2);
+	UASSERTEQ(u16, changed[0], 1);
+	UASSERTEQ(u16, changed[1], 3);
+
+	block.setNode(v3s16(0, 0, 2), stone);
+	UASSERT(block.getChangedNodes(v1, changed));
+	UASSERTEQ(size_t, changed.size(), 1);
+	UASSERTEQ(u16, changed[0], 2 * MapBlock::zstride);
+	UASSERT(!block.getChangedNodes(block.getNodeVersion() + 1, changed));
+
+	// Modifications not affecting the networked data keep the log
+	block.raiseModified(MOD_STATE_WRITE_AT_UNLOAD, MOD_REASON_SET_TIMESTAMP);
+	block.expireDayNightDiff();
+	UASSERT(block.getChangedNodes(v1, changed));
+
+	// Other modifications start a new log
+	u64 v2 = block.getNodeVersion();
+	block.raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REPORT_META_CHANGE);
+	UASSERT(!block.getChangedNodes(v2, changed));
+	UASSERT(block.getNodeVersion() > v2);
+
+	// So do too many changes
+	u64 v3 = block.getNodeVersion();
+	for (u32 i = 0; i <= MapBlock::max_node_changes; i++)
+		block.setNodeNoCheck(MapBlock::nodeIndexToPos(i), stone);
+	UASSERT(!block.getChangedNodes(v3, changed));
+	UASSERT(block.getChangedNodes(block.getNodeVersion(), changed));
+	UASSERT(changed.empty());
+
+	// A new block of the same position doesn't reuse versions
+	u64 v4 = block.getNodeVersion();
+	MapBlock block2(NULL, v3s16(0, 0, 0), gamedef);
+	UASSERT(!block2.getChangedNodes(v4, changed));
+}
+
+void TestMapBlock::testDeferredNodeIds(IGameDef *gamedef)
+{
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	MapNode stone(t_CONTENT_STONE);
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		block.getData()[i] = MapNode(CONTENT_AIR);
+	block.setNode(v3s16(1, 2, 3), stone);
+
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true);
+
+	// The stored ids are numbered in the order of appearance
+	MapBlock loaded(NULL, v3s16(0, 0, 0), gamedef);
+	NameIdMapping nimap;
+	std::istringstream is(os.str(), std::ios_base::binary);
+	loaded.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true, &nimap);
+	u32 i = 3 * MapBlock::zstride + 2 * MapBlock::ystride + 1;
+	UASSERTEQ(content_t, loaded.getData()[i].getContent(), 1);
+	UASSERTEQ(content_t, loaded.getData()[0].getContent(), 0);
+	std::string name;
+	UASSERT(nimap.getName(1, name));
+	UASSERT(name == gamedef->ndef()->get(t_CONTENT_STONE).name);
+
+	loaded.correctNodeIds(nimap);
+	UASSERTEQ(content_t, loaded.getData()[i].getContent(), t_CONTENT_STONE);
+	UASSERTEQ(content_t, loaded.getData()[0].getContent(), CONTENT_AIR);
+	UASSERTEQ(u16, loaded.getContentIndex().getCount(t_CONTENT_STONE), 1);
+}
@@ -0,0 +1,105 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <map>
+#include "mapblockindex.h"
+#include "noise.h"
+
+class TestMapBlockIndex : public TestBase
+{
+public:
+	TestMapBlockIndex() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapBlockIndex"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBasic();
+	void testRandomized();
+};
+
+static TestMapBlockIndex g_test_instance;
+
+void TestMapBlockIndex::runTests(IGameDef *gamedef)
+{
+	TEST(testBasic);
+	TEST(testRandomized);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The index never dereferences the blocks, so fake pointers are fine
+static MapBlock *fakeBlock(size_t i)
+{
+	return reinterpret_cast<MapBlock *>(i * 16);
+}
+
+void TestMapBlockIndex::testBasic()
+{
+	MapBlockIndex index;
+	UASSERT(index.get(v3s16(0, 0, 0)) == nullptr);
+
+	index.insert(v3s16(1, -2, 3), fakeBlock(1));
+	index.insert(v3s16(-2048, 2047, 0), fakeBlock(2));
+	UASSERTEQ(size_t, index.size(), 2);
+	UASSERT(index.get(v3s16(1, -2, 3)) == fakeBlock(1));
+	UASSERT(index.get(v3s16(-2048, 2047, 0)) == fakeBlock(2));
+
+	// The per-thread cache must not return removed or replaced blocks
+	index.erase(v3s16(1, -2, 3));
+	UASSERT(index.get(v3s16(1, -2, 3)) == nullptr);
+	index.insert(v3s16(-2048, 2047, 0), fakeBlock(3));
+	UASSERT(index.get(v3s16(-2048, 2047, 0)) == fakeBlock(3));
+	UASSERTEQ(size_t, index.size(), 1);
+
+	index.clear();
+	UASSERT(index.get(v3s16(-2048, 2047, 0)) == nullptr);
+	UASSERTEQ(size_t, index.size(), 0);
+}
+
+void TestMapBlockIndex::testRandomized()
+{
+	MapBlockIndex index;
+	std::map<v3s16, MapBlock *> reference;
+	PcgRandom pr(1234);
+
+	// A small volume to get plenty of collisions, growth and removals
+	for (u32 i = 0; i < 100000; i++) {
+		v3s16 p(pr.range(-20, 20), pr.range(-10, 10), pr.range(-20, 20));
+		switch (pr.range(0, 2)) {
+		case 0:
+			index.insert(p, fakeBlock(i + 1));
+			reference[p] = fakeBlock(i + 1);
+			break;
+		case 1:
+			index.erase(p);
+			reference.erase(p);
+			break;
+		default: {
+			auto it = reference.find(p);
+			MapBlock *expected = it == reference.end() ? nullptr : it->second;
+			UASSERT(index.get(p) == expected);
+		}
+		}
+	}
+	UASSERTEQ(size_t, index.size(), reference.size());
+	for (const auto &it : reference)
+		UASSERT(index.get(it.first) == it.second);
+}
@@ -0,0 +1,149 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <map>
+#include "database/database-dummy.h"
+#include "database/database-sqlite3.h"
+#include "filesys.h"
+
+class TestMapDatabase : public TestBase
+{
+public:
+	TestMapDatabase() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapDatabase"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testLoadBlocksDummy();
+	void testLoadBlocksSQLite3();
+	void testSQLite3SecondConnection();
+
+	void checkLoadBlocks(MapDatabase *db);
+};
+
+static TestMapDatabase g_test_instance;
+
+void TestMapDatabase::runTests(IGameDef *gamedef)
+{
+	TEST(testLoadBlocksDummy);
+	TEST(testLoadBlocksSQLite3);
+	TEST(testSQLite3SecondConnection);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::string block_data(v3s16 pos)
+{
+	return "block " + std::to_string(pos.X) + " " + std::to_string(pos.Y) +
+		" " + std::to_string(pos.Z);
+}
+
+void TestMapDatabase::checkLoadBlocks(MapDatabase *db)
+{
+	// A mapchunk with every other block stored, plus far away positions
+	// and a duplicate
+	std::vector<v3s16> positions;
+	std::map<v3s16, std::string> expected;
+	v3s16 p;
+	for (p.Z = -2; p.Z <= 2; p.Z++)
+	for (p.Y = -2; p.Y <= 2; p.Y++)
+	for (p.X = -2; p.X <= 2; p.X++) {
+		positions.push_back(p);
+		bool stored = (p.X + p.Y + p.Z) % 2 == 0;
+		expected[p] = stored ? block_data(p) : "";
+		if (stored)
+			UASSERT(db->saveBlock(p, block_data(p)));
+	}
+	positions.emplace_back(2000, -2000, 1000);
+	expected[positions.back()] = "";
+	positions.emplace_back(-2000, 100, 2000);
+	expected[positions.back()] = block_data(positions.back());
+	UASSERT(db->saveBlock(positions.back(), block_data(positions.back())));
+	positions.push_back(positions.front());
+
+	std::map<v3s16, u32> calls;
+	db->loadBlocks(positions, [&] (const v3s16 &pos, std::string *data) {
+		calls[pos]++;
+		UASSERT(expected.find(pos) != expected.end());
+		UASSERT(*data == expected[pos]);
+	});
+
+	// Every position is reported as often as it was requested
+	UASSERTEQ(size_t, calls.size(), expected.size());
+	for (const auto &call : calls)
+		UASSERTEQ(u32, call.second, call.first == positions.front() ? 2 : 1);
+
+	// Nothing to load
+	db->loadBlocks(std::vector<v3s16>(),
+		[&] (const v3s16 &pos, std::string *data) {
+			UASSERT(false);
+		});
+}
+
+void TestMapDatabase::testLoadBlocksDummy()
+{
+	Database_Dummy db;
+	checkLoadBlocks(&db);
+}
+
+void TestMapDatabase::testLoadBlocksSQLite3()
+{
+	std::string dir = getTestTempDirectory() + DIR_DELIM + "loadblocks";
+	UASSERT(fs::CreateAllDirs(dir));
+	{
+		MapDatabaseSQLite3 db(dir);
+		checkLoadBlocks(&db);
+	}
+	fs::RecursiveDelete(dir);
+}
+
+void TestMapDatabase::testSQLite3SecondConnection()
+{
+	// ServerMap prefetches through a second connection, which must see
+	// what the first one committed
+	std::string dir = getTestTempDirectory() + DIR_DELIM + "connections";
+	UASSERT(fs::CreateAllDirs(dir));
+	{
+		MapDatabaseSQLite3 db1(dir);
+		MapDatabaseSQLite3 db2(dir);
+		v3s16 pos(1, 2, 3);
+		std::vector<v3s16> positions = {pos};
+		std::string loaded;
+		auto callback = [&] (const v3s16 &, std::string *data) {
+			loaded = *data;
+		};
+
+		UASSERT(db1.saveBlock(pos, "first"));
+		db2.loadBlocks(positions, callback);
+		UASSERT(loaded == "first");
+
+		db1.beginSave();
+		UASSERT(db1.saveBlock(pos, "second"));
+		db1.endSave();
+		db2.loadBlocks(positions, callback);
+		UASSERT(loaded == "second");
+
+		UASSERT(db1.deleteBlock(pos));
+		db2.loadBlocks(positions, callback);
+		UASSERT(loaded.empty());
+	}
+	fs::RecursiveDelete(dir);
+}
@@ -0,0 +1,225 @@
+/*
+Minetest
+Copyright (C) 2018 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <cmath>
+#include <map>
+#include <sstream>
+#include "log.h"
+#include "nodetimer.h"
+#include "noise.h"
+#include "serialization.h"
+
+class TestNodeTimer : public TestBase
+{
+public:
+	TestNodeTimer() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestNodeTimer"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testStepOrder();
+	void testSetRemove();
+	void testSerialize();
+	void testBenchmark();
+};
+
+static TestNodeTimer g_test_instance;
+
+void TestNodeTimer::runTests(IGameDef *gamedef)
+{
+	TEST(testStepOrder);
+	TEST(testSetRemove);
+	TEST(testSerialize);
+	TEST(testBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline bool approxEqual(f32 a, f32 b)
+{
+	return std::fabs(a - b) < 0.001f;
+}
+
+void TestNodeTimer::testStepOrder()
+{
+	NodeTimerList timers;
+	timers.set(NodeTimer(3.0f, 0.0f, v3s16(1, 0, 0)));
+	timers.set(NodeTimer(1.0f, 0.0f, v3s16(2, 0, 0)));
+	timers.set(NodeTimer(2.0f, 0.5f, v3s16(3, 0, 0)));
+	timers.set(NodeTimer(1.0f, 0.0f, v3s16(4, 0, 0)));
+	UASSERTEQ(size_t, timers.size(), 4);
+
+	UASSERT(timers.step(0.5f).empty());
+
+	std::vector<NodeTimer> elapsed = timers.step(1.25f);
+	UASSERTEQ(size_t, elapsed.size(), 3);
+	// Equal trigger times come out in insertion order
+	UASSERT(elapsed[0].position == v3s16(2, 0, 0));
+	UASSERT(elapsed[1].position == v3s16(4, 0, 0));
+	UASSERT(elapsed[2].position == v3s16(3, 0, 0));
+	UASSERT(approxEqual(elapsed[0].elapsed, 1.75f));
+	UASSERT(approxEqual(elapsed[2].elapsed, 2.25f));
+
+	elapsed = timers.step(10.0f);
+	UASSERTEQ(size_t, elapsed.size(), 1);
+	UASSERT(elapsed[0].position == v3s16(1, 0, 0));
+	UASSERTEQ(size_t, timers.size(), 0);
+}
+
+void TestNodeTimer::testSetRemove()
+{
+	NodeTimerList timers;
+	v3s16 p(15, 15, 15);
+	UASSERT(timers.get(p).timeout == 0.0f);
+
+	timers.set(NodeTimer(5.0f, 1.0f, p));
+	timers.step(1.0f);
+	NodeTimer t = timers.get(p);
+	UASSERT(approxEqual(t.timeout, 5.0f));
+	UASSERT(approxEqual(t.elapsed, 2.0f));
+
+	// Replacing moves the trigger time in both directions
+	timers.set(NodeTimer(10.0f, 0.0f, v3s16(0, 0, 0)));
+	timers.set(NodeTimer(1.0f, 0.0f, p));
+	UASSERTEQ(size_t, timers.size(), 2);
+	std::vector<NodeTimer> elapsed = timers.step(1.0f);
+	UASSERTEQ(size_t, elapsed.size(), 1);
+	UASSERT(elapsed[0].position == p);
+
+	timers.set(NodeTimer(1.0f, 0.0f, p));
+	timers.set(NodeTimer(20.0f, 0.0f, p));
+	UASSERT(timers.step(11.0f).size() == 1);
+
+	timers.remove(p);
+	timers.remove(v3s16(1, 2, 3));
+	UASSERTEQ(size_t, timers.size(), 0);
+	UASSERT(timers.get(p).timeout == 0.0f);
+}
+
+void TestNodeTimer::testSerialize()
+{
+	NodeTimerList timers;
+	for (s16 i = 0; i < 16; i++)
+		timers.set(NodeTimer(1.0f + i, 0.5f, v3s16(i, 15 - i, i / 2)));
+	timers.step(0.25f);
+
+	std::ostringstream os(std::ios_base::binary);
+	timers.serialize(os, SER_FMT_VER_HIGHEST_WRITE);
+
+	NodeTimerList timers2;
+	std::istringstream is(os.str(), std::ios_base::binary);
+	timers2.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE);
+	UASSERTEQ(size_t, timers2.size(), 16);
+	for (s16 i = 0; i < 16; i++) {
+		NodeTimer t = timers2.get(v3s16(i, 15 - i, i / 2));
+		UASSERT(approxEqual(t.timeout, 1.0f + i));
+		UASSERT(approxEqual(t.elapsed, 0.75f));
+	}
+}
+
+/*
+	The previous NodeTimerList engine, kept to compare against
+*/
+class MultimapNodeTimerList
+{
+public:
+	void remove(v3s16 p)
+	{
+		auto n = m_iterators.find(p);
+		if (n != m_iterators.end()) {
+			m_timers.erase(n->second);
+			m_iterators.erase(n);
+		}
+	}
+
+	void set(const NodeTimer &timer)
+	{
+		remove(timer.position);
+		double trigger_time = m_time + (double)(timer.timeout - timer.elapsed);
+		auto it = m_timers.insert(std::make_pair(trigger_time, timer));
+		m_iterators.insert(std::make_pair(timer.position, it));
+	}
+
+	std::vector<NodeTimer> step(float dtime)
+	{
+		std::vector<NodeTimer> elapsed_timers;
+		m_time += dtime;
+		auto i = m_timers.begin();
+		for (; i != m_timers.end() && i->first <= m_time; ++i) {
+			NodeTimer t = i->second;
+			t.elapsed = t.timeout + (f32)(m_time - i->first);
+			elapsed_timers.push_back(t);
+			m_iterators.erase(t.position);
+		}
+		m_timers.erase(m_timers.begin(), i);
+		return elapsed_timers;
+	}
+
+private:
+	std::multimap<double, NodeTimer> m_timers;
+	std::map<v3s16, std::multimap<double, NodeTimer>::iterator> m_iterators;
+	double m_time = 0.0;
+};
+
+// Furnace-like load: every node has a timer, elapsed timers are restarted
+template <typename T>
+static u64 runTimerLoad(T &timers, u32 &num_elapsed)
+{
+	PcgRandom pr(42);
+	u64 t1 = porting::getTimeUs();
+	for (u16 i = 0; i < 4096; i++) {
+		v3s16 p(i % 16, (i / 16) % 16, i / 256);
+		timers.set(NodeTimer(0.5f + pr.range(0, 100) / 50.0f, 0.0f, p));
+	}
+	num_elapsed = 0;
+	for (u32 step = 0; step < 500; step++) {
+		for (const NodeTimer &t : timers.step(0.2f)) {
+			timers.set(NodeTimer(t.timeout, 0.0f, t.position));
+			num_elapsed++;
+		}
+		// Some nodes are dug or replaced
+		for (u32 j = 0; j < 20; j++) {
+			u16 i = pr.range(0, 4095);
+			v3s16 p(i % 16, (i / 16) % 16, i / 256);
+			if (j % 2)
+				timers.remove(p);
+			else
+				timers.set(NodeTimer(1.0f, 0.0f, p));
+		}
+	}
+	return porting::getTimeUs() - t1;
+}
+
+void TestNodeTimer::testBenchmark()
+{
+	NodeTimerList heap;
+	MultimapNodeTimerList multimap;
+	u32 heap_elapsed, multimap_elapsed;
+	u64 heap_us = runTimerLoad(heap, heap_elapsed);
+	u64 multimap_us = runTimerLoad(multimap, multimap_elapsed);
+
+	// Both engines must agree on what happened
+	UASSERTEQ(u32, heap_elapsed, multimap_elapsed);
+
+	rawstream << "NodeTimerList: heap " << heap_us << "us, multimap "
+		<< multimap_us << "us for " << heap_elapsed << " elapsed timers"
+		<< std::endl;
+}
@@ -20,8 +20,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include <cmath>
+#include <cstring>
 #include "exceptions.h"
 #include "noise.h"
+#include "threading/workerpool.h"
 
 class TestNoise : public TestBase {
 public:
@@ -35,6 +37,8 @@ class TestNoise : public TestBase {
 	void testNoise3dPoint();
 	void testNoise3dBulk();
 	void testNoiseInvalidParams();
+	void testNoiseSimd();
+	void testNoise3dSlabs();
 
 	static const float expected_2d_results[10 * 10];
 	static const float expected_3d_results[10 * 10 * 10];
@@ -49,6 +53,8 @@ void TestNoise::runTests(IGameDef *gamedef)
 	TEST(testNoise3dPoint);
 	TEST(testNoise3dBulk);
 	TEST(testNoiseInvalidParams);
+	TEST(testNoiseSimd);
+	TEST(testNoise3dSlabs);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -121,6 +127,81 @@ void TestNoise::testNoiseInvalidParams()
 	UASSERT(exception_thrown);
 }
 
+void TestNoise::testNoiseSimd()
+{
+	const u32 flags[] = {
+		NOISE_FLAG_DEFAULTS,
+		NOISE_FLAG_EASED,
+		NOISE_FLAG_ABSVALUE,
+		NOISE_FLAG_EASED | NOISE_FLAG_ABSVALUE,
+	};
+	const NoiseSimdLevel levels[] = {NOISE_SIMD_SSE2, NOISE_SIMD_AVX2};
+	// Not a multiple of the vector sizes, so that the remainders are used
+	const u32 sx = 37, sy = 13, sz = 11;
+	const u32 bufsize = sx * sy * sz;
+
+	NoiseSimdLevel old_level = noise_get_simd_level();
+	std::vector<float> persistence(bufsize);
+	for (u32 i = 0; i != bufsize; i++)
+		persistence[i] = 0.4f + (i % 7) * 0.05f;
+
+	for (u32 f : flags)
+	for (int persist = 0; persist != 2; persist++) {
+		NoiseParams np(20, 40, v3f(29, 17, 43), 9, 5, 0.6, 2.0, f);
+		Noise noise(&np, 1337, sx, sy, sz);
+		float *pmap = persist ? persistence.data() : NULL;
+
+		UASSERT(noise_set_simd_level(NOISE_SIMD_NONE));
+		std::vector<float> expected_3d(bufsize);
+		noise.perlinMap3D(-103.5f, 7.25f, -0.75f, pmap);
+		memcpy(expected_3d.data(), noise.result, bufsize * sizeof(float));
+		std::vector<float> expected_2d(sx * sy);
+		noise.perlinMap2D(-103.5f, 7.25f, pmap);
+		memcpy(expected_2d.data(), noise.result, sx * sy * sizeof(float));
+
+		// The SIMD versions must not change maps, not even by a bit
+		for (NoiseSimdLevel level : levels) {
+			if (!noise_set_simd_level(level))
+				continue;
+			noise.perlinMap3D(-103.5f, 7.25f, -0.75f, pmap);
+			UASSERT(memcmp(noise.result, expected_3d.data(),
+				bufsize * sizeof(float)) == 0);
+			noise.perlinMap2D(-103.5f, 7.25f, pmap);
+			UASSERT(memcmp(noise.result, expected_2d.data(),
+				sx * sy * sizeof(float)) == 0);
+		}
+	}
+
+	noise_set_simd_level(old_level);
+}
+
+void TestNoise::testNoise3dSlabs()
+{
+	const u32 sx = 37, sy = 13, sz = 23;
+	const u32 bufsize = sx * sy * sz;
+	NoiseSimdLevel old_level = noise_get_simd_level();
+	WorkerPool pool(3, "TestNoise");
+
+	for (int simd = 0; simd != 2; simd++) {
+		if (!simd)
+			noise_set_simd_level(NOISE_SIMD_NONE);
+
+		NoiseParams np(20, 40, v3f(29, 7, 43), 9, 5, 0.6, 2.0,
+			NOISE_FLAG_EASED);
+		Noise noise(&np, 1337, sx, sy, sz);
+		std::vector<float> expected(bufsize);
+		noise.perlinMap3D(-103.5f, 7.25f, -0.75f);
+		memcpy(expected.data(), noise.result, bufsize * sizeof(float));
+
+		// Splitting the map into slabs must not change it
+		noise.perlinMap3D(-103.5f, 7.25f, -0.75f, NULL, &pool);
+		UASSERT(memcmp(noise.result, expected.data(),
+			bufsize * sizeof(float)) == 0);
+
+		noise_set_simd_level(old_level);
+	}
+}
+
 const float TestNoise::expected_2d_results[10 * 10] = {
 	19.11726, 18.49626, 16.48476, 15.02135, 14.75713, 16.26008, 17.54822,
 	18.06860, 18.57016, 18.48407, 18.49649, 17.89160, 15.94162, 14.54901,
@@ -37,6 +37,7 @@ class TestSocket : public TestBase {
 
 	void testIPv4Socket();
 	void testIPv6Socket();
+	void testBatch();
 
 	static const int port = 30003;
 };
@@ -49,6 +50,8 @@ void TestSocket::runTests(IGameDef *gamedef)
 
 	if (g_settings->getBool("enable_ipv6"))
 		TEST(testIPv6Socket);
+
+	TEST(testBatch);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -149,3 +152,42 @@ void TestSocket::testIPv6Socket()
 					<< std::endl;
 	}
 }
+
+void TestSocket::testBatch()
+{
+	Address address(127, 0, 0, 1, port + 1);
+	UDPSocket socket(false);
+	socket.Bind(Address(0, 0, 0, 0, port + 1));
+
+	const int count = 10;
+	u8 senddata[count][4];
+	UDPSocket::Datagram outgoing[count];
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < 4; j++)
+			senddata[i][j] = i * 4 + j;
+		outgoing[i].address = address;
+		outgoing[i].data = senddata[i];
+		outgoing[i].size = 4;
+	}
+	UASSERTEQ(int, socket.SendBatch(outgoing, count), count);
+
+	sleep_ms(50);
+	UASSERT(socket.WaitData(50));
+
+	u8 rcvdata[count + 2][16];
+	UDPSocket::Datagram incoming[count + 2];
+	for (int i = 0; i < count + 2; i++) {
+		incoming[i].data = rcvdata[i];
+		incoming[i].size = sizeof(rcvdata[i]);
+	}
+	UASSERTEQ(int, socket.ReceiveBatch(incoming, count + 2), count);
+
+	for (int i = 0; i < count; i++) {
+		UASSERTEQ(int, incoming[i].size, 4);
+		UASSERT(memcmp(incoming[i].data, senddata[i], 4) == 0);
+		UASSERT(incoming[i].address == address);
+	}
+
+	// Nothing left, and not waiting for more
+	UASSERTEQ(int, socket.ReceiveBatch(incoming, count), 0);
+}
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <atomic>
 #include "threading/semaphore.h"
 #include "threading/thread.h"
+#include "threading/workerpool.h"
 
 
 class TestThreading : public TestBase {
@@ -33,6 +34,7 @@ class TestThreading : public TestBase {
 	void testStartStopWait();
 	void testThreadKill();
 	void testAtomicSemaphoreThread();
+	void testWorkerPoolShared();
 };
 
 static TestThreading g_test_instance;
@@ -42,6 +44,7 @@ void TestThreading::runTests(IGameDef *gamedef)
 	TEST(testStartStopWait);
 	TEST(testThreadKill);
 	TEST(testAtomicSemaphoreThread);
+	TEST(testWorkerPoolShared);
 }
 
 class SimpleTestThread : public Thread {
@@ -181,3 +184,56 @@ void TestThreading::testAtomicSemaphoreThread()
 	UASSERT(val == num_threads * 0x10000);
 }
 
+
+class PoolTestThread : public Thread {
+public:
+	PoolTestThread(WorkerPool &pool, Semaphore &trigger) :
+		Thread("PoolTest"),
+		counts(0x1000),
+		pool(pool),
+		trigger(trigger)
+	{
+	}
+
+	// How often each item was done
+	std::vector<std::atomic<u32>> counts;
+
+private:
+	void *run()
+	{
+		trigger.wait();
+		for (u32 i = 0; i < 16; ++i) {
+			pool.parallelFor(counts.size(), [this] (size_t j) {
+				++counts[j];
+			});
+		}
+		return NULL;
+	}
+
+	WorkerPool &pool;
+	Semaphore &trigger;
+};
+
+
+void TestThreading::testWorkerPoolShared()
+{
+	WorkerPool pool(3, "PoolTestWorker");
+	Semaphore trigger;
+	static const u8 num_threads = 3;
+
+	PoolTestThread *threads[num_threads];
+	for (auto &thread : threads) {
+		thread = new PoolTestThread(pool, trigger);
+		UASSERT(thread->start());
+	}
+
+	// The loops of the threads overlap, each must still do every item once
+	trigger.post(num_threads);
+
+	for (PoolTestThread *thread : threads) {
+		thread->wait();
+		for (const std::atomic<u32> &count : thread->counts)
+			UASSERT(count == 16);
+		delete thread;
+	}
+}
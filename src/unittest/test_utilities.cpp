@@ -51,6 +51,7 @@ class TestUtilities : public TestBase {
 	void testIsNumber();
 	void testIsPowerOfTwo();
 	void testMyround();
+	void testHilbertIndex();
 	void testStringJoin();
 };
 
@@ -79,6 +80,7 @@ void TestUtilities::runTests(IGameDef *gamedef)
 	TEST(testIsNumber);
 	TEST(testIsPowerOfTwo);
 	TEST(testMyround);
+	TEST(testHilbertIndex);
 	TEST(testStringJoin);
 }
 
@@ -330,6 +332,28 @@ void TestUtilities::testMyround()
 	UASSERT(myround(-6.5f) == -7);
 }
 
+void TestUtilities::testHilbertIndex()
+{
+	for (u32 bits = 1; bits <= 4; bits++) {
+		u32 size = 1 << bits;
+		std::vector<v3s16> curve(size * size * size, v3s16(-1, -1, -1));
+		for (u32 z = 0; z < size; z++)
+		for (u32 y = 0; y < size; y++)
+		for (u32 x = 0; x < size; x++) {
+			u64 i = hilbert_index_3d(x, y, z, bits);
+			UASSERT(i < curve.size());
+			UASSERT(curve[i] == v3s16(-1, -1, -1));
+			curve[i] = v3s16(x, y, z);
+		}
+
+		UASSERT(curve[0] == v3s16(0, 0, 0));
+		for (size_t i = 1; i < curve.size(); i++) {
+			v3s16 d = curve[i] - curve[i - 1];
+			UASSERT(abs(d.X) + abs(d.Y) + abs(d.Z) == 1);
+		}
+	}
+}
+
 void TestUtilities::testStringJoin()
 {
 	std::vector<std::string> input;
@@ -96,6 +96,48 @@ u64 murmur_hash_64_ua(const void *key, int len, unsigned int seed)
 	return h;
 }
 
+/*
+	John Skilling's algorithm from "Programming the Hilbert curve": the
+	coordinates are transformed in place into the "transposed" index, whose
+	bits are then interleaved.
+*/
+u64 hilbert_index_3d(u32 x, u32 y, u32 z, u32 bits)
+{
+	u32 p[3] = {x, y, z};
+	u32 top = 1U << (bits - 1);
+
+	for (u32 q = top; q > 1; q >>= 1) {
+		u32 mask = q - 1;
+		for (u32 &c : p) {
+			if (c & q) {
+				p[0] ^= mask;
+			} else {
+				u32 t = (p[0] ^ c) & mask;
+				p[0] ^= t;
+				c ^= t;
+			}
+		}
+	}
+
+	// Gray encode
+	p[1] ^= p[0];
+	p[2] ^= p[1];
+	u32 t = 0;
+	for (u32 q = top; q > 1; q >>= 1) {
+		if (p[2] & q)
+			t ^= q - 1;
+	}
+	for (u32 &c : p)
+		c ^= t;
+
+	u64 index = 0;
+	for (s32 b = bits - 1; b >= 0; b--) {
+		for (u32 c : p)
+			index = (index << 1) | ((c >> b) & 1);
+	}
+	return index;
+}
+
 /*
 	blockpos_b: position of block in block coordinates
 	camera_pos: position of camera in nodes
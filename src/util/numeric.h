@@ -229,6 +229,12 @@ inline u32 calc_parity(u32 v)
 
 u64 murmur_hash_64_ua(const void *key, int len, unsigned int seed);
 
+/*
+	Position of a point on a 3D Hilbert curve through a cube with an edge
+	length of 2^bits. Points with consecutive indices are neighbours.
+*/
+u64 hilbert_index_3d(u32 x, u32 y, u32 z, u32 bits);
+
 bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 		f32 camera_fov, f32 range, f32 *distance_ptr=NULL);
 
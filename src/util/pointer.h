@@ -21,7 +21,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes.h"
 #include "debug.h" // For assert()
+#include <atomic>
 #include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
 
 template <typename T>
 class Buffer
@@ -216,3 +220,159 @@ class SharedBuffer
 	unsigned int m_size;
 	unsigned int *refcount;
 };
+
+/*
+	Reference counted byte buffer which may be passed between threads,
+	with free space in front of the data so that headers can be prepended
+	without copying.
+
+	Only the reference count is thread safe. Write the data only while
+	holding the only reference, or write the bytes handed out by
+	prepend().
+*/
+class PacketBuffer
+{
+public:
+	PacketBuffer() = default;
+	PacketBuffer(u32 size, u32 headroom):
+		m_storage(new Storage(headroom + size, headroom)),
+		m_offset(headroom),
+		m_size(size)
+	{}
+	/*
+		Copies the data
+	*/
+	PacketBuffer(const u8 *data, u32 size, u32 headroom):
+		PacketBuffer(size, headroom)
+	{
+		if (size != 0)
+			memcpy(**this, data, size);
+	}
+	PacketBuffer(const PacketBuffer &other):
+		m_storage(other.m_storage),
+		m_offset(other.m_offset),
+		m_size(other.m_size)
+	{
+		if (m_storage)
+			m_storage->refcount.fetch_add(1, std::memory_order_relaxed);
+	}
+	PacketBuffer(PacketBuffer &&other):
+		m_storage(other.m_storage),
+		m_offset(other.m_offset),
+		m_size(other.m_size)
+	{
+		other.m_storage = nullptr;
+		other.m_offset = 0;
+		other.m_size = 0;
+	}
+	PacketBuffer &operator=(PacketBuffer other)
+	{
+		std::swap(m_storage, other.m_storage);
+		std::swap(m_offset, other.m_offset);
+		std::swap(m_size, other.m_size);
+		return *this;
+	}
+	~PacketBuffer()
+	{
+		drop();
+	}
+
+	u8 & operator[](u32 i) const
+	{
+		return m_storage->data[m_offset + i];
+	}
+	u8 * operator*() const
+	{
+		return m_storage ? m_storage->data.data() + m_offset : nullptr;
+	}
+	u32 getSize() const
+	{
+		return m_size;
+	}
+	/*
+		Whether this is the only reference. The other threads are done
+		with the data once this returns true, as they release their
+		references after their last access.
+	*/
+	bool isUnique() const
+	{
+		return !m_storage ||
+			m_storage->refcount.load(std::memory_order_acquire) == 1;
+	}
+
+	/*
+		Returns the data with size bytes more in front of it, for the
+		caller to write a header into. Uses the free space if no other
+		reference did so already, and copies the data otherwise.
+	*/
+	PacketBuffer prepend(u32 size) const
+	{
+		u32 start = m_offset;
+		if (m_storage && start >= size &&
+				m_storage->used_from.compare_exchange_strong(start,
+					m_offset - size)) {
+			PacketBuffer result(*this);
+			result.m_offset -= size;
+			result.m_size += size;
+			return result;
+		}
+
+		PacketBuffer result(m_size + size, m_offset >= size ? m_offset - size : 0);
+		if (m_size != 0)
+			memcpy(*result + size, **this, m_size);
+		return result;
+	}
+
+	/*
+		Changes the size of the data, keeping the free space in front.
+		Copies the data first if it is shared.
+	*/
+	void resize(u32 size)
+	{
+		makeUnique();
+		m_storage->data.resize(m_offset + size);
+		m_size = size;
+	}
+
+	/*
+		Copies the data if it is shared, so that it can be written
+	*/
+	void makeUnique()
+	{
+		if (!m_storage) {
+			*this = PacketBuffer(0, 0);
+		} else if (!isUnique()) {
+			*this = PacketBuffer(**this, m_size, m_offset);
+		} else {
+			// Nobody else uses the free space anymore
+			m_storage->used_from = m_offset;
+		}
+	}
+
+private:
+	struct Storage
+	{
+		Storage(u32 size, u32 used_from_):
+			data(size), used_from(used_from_)
+		{}
+
+		std::vector<u8> data;
+		// Bytes in front of this have not been handed out by prepend()
+		std::atomic<u32> used_from;
+		// Released on drop, so that the accesses of a thread happen before
+		// isUnique() of another thread sees its reference gone
+		std::atomic<u32> refcount {1};
+	};
+
+	void drop()
+	{
+		if (m_storage && m_storage->refcount.fetch_sub(1,
+				std::memory_order_acq_rel) == 1)
+			delete m_storage;
+		m_storage = nullptr;
+	}
+
+	Storage *m_storage = nullptr;
+	u32 m_offset = 0;
+	u32 m_size = 0;
+};